@@ -0,0 +1,60 @@
+/*
+ * SNFS benchmarks
+ *
+ * bench.h
+ *
+ * Timing, statistics and connection helpers shared by the benchmarks.
+ * The benchmarks are clients of a server already running (see the
+ * Makefile), except bench_fswrite, which measures the fs layer alone.
+ *
+ */
+
+#ifndef _BENCH_H_
+#define _BENCH_H_
+
+#include <snfs_api.h>
+
+#ifndef SERVER_SOCK
+#define SERVER_SOCK "/tmp/server.socket"
+#endif
+
+
+/*
+ * bench_now: the current time
+ *   returns: the time in seconds
+ */
+double bench_now();
+
+
+/*
+ * bench_cycles: the time stamp counter of the processor (0 where there
+ * is none)
+ *   returns: the number of cycles
+ */
+unsigned long long bench_cycles();
+
+
+/*
+ * bench_percentile: the 'p'-th percentile of 'n' samples (sorts them)
+ * - samples: the samples [in/out]
+ * - p: the percentile, from 0 to 100
+ *   returns: the percentile
+ */
+double bench_percentile(double* samples, int n, double p);
+
+
+/*
+ * bench_connect: creates a context of the API on a new client socket
+ * - flags: context flags (see snfs_init)
+ *   returns: the context or NULL if error
+ */
+snfs_ctx_t* bench_connect(int flags);
+
+
+/*
+ * bench_mb: the throughput of 'bytes' transferred in 'secs' seconds
+ *   returns: the throughput in MB/s
+ */
+double bench_mb(double bytes, double secs);
+
+#endif
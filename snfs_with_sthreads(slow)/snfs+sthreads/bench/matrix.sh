@@ -0,0 +1,34 @@
+#!/bin/sh
+#
+# Block size matrix: formats a new storage with each block size, runs
+# bench_blocks and bench_fswrite on it and prints one row per size.
+#
+# usage: matrix.sh [disk delay] (run from the bench directory, after make)
+#
+
+SERVER=../snfs_server/server
+SIZES="512 1024 4096 16384 65536"
+DELAY=${1:-1}
+
+# a new storage is formatted for each size
+unset SNFS_IMAGE
+
+echo "small files (1 KB) per second, largest file (10 blocks, a call per block) MB/s"
+printf "%8s %10s %10s %10s %10s %10s\n" "block" "create" "read" "remove" "write MB/s" "read MB/s"
+for bs in $SIZES; do
+	SNFS_BLOCK_SIZE=$bs $SERVER $DELAY > /dev/null 2>&1 &
+	pid=$!
+	sleep 1
+	./bench_blocks $bs
+	kill $pid
+	wait $pid 2> /dev/null
+done
+
+echo
+echo "fs_write bytes per cycle (8 blocks aligned / unaligned, 100 bytes)"
+printf "%8s %10s %10s %10s\n" "block" "aligned" "unaligned" "small"
+for bs in $SIZES; do
+	./bench_fswrite $bs | awk -v bs=$bs '
+		$1 == "aligned" { a = $3 } $1 == "unaligned" { u = $3 } $1 == "small" { s = $3 }
+		END { printf "%8s %10s %10s %10s\n", bs, a, u, s }'
+done
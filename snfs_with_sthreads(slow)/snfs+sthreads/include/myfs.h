@@ -10,11 +10,22 @@
 #ifndef _MYFS_H_
 #define _MYFS_H_
 
+#include <sys/uio.h>
+#include <sthread.h>
+
+// page of the client cache of an open file (see myfs.c)
+struct _file_page;
+
 struct _file_desc {
-	int fileId;
-	unsigned size;
+	int fileId;		// file handle in the server
+	unsigned size;		// includes the data not yet written back
+	unsigned ssize;		// size last confirmed by the server
 	int read_offset;
 	int write_offset;
+	struct _file_page* pages;	// cached pages (NULL until first used)
+	unsigned next_read;	// offset where a sequential read continues
+	unsigned tick;		// use counter for the replacement of pages
+	sthread_mutex_t lock;	// NULL if the library is used by a single thread
 };
 typedef struct _file_desc* fd_t;
 
@@ -33,41 +44,124 @@ int my_init_lib();
 
 
 /*
- * my_open: open the file 'nome'
+ * my_init_lib_threads: internal initialization for a library used by
+ * several sthreads at once (sthread_init must have been called); calls
+ * on the same file descriptor are serialized
+ */
+int my_init_lib_threads();
+
+
+/*
+ * my_open: open the file 'nome'; the data other clients write to the
+ * file is seen once they close it and the file is opened again
  * - nome: absolute path of the file to open (e.g. "/f1" refers to
  *   file 'f1' in the root directory)
  * - flags: open flags
- *   returns: the internal file id of the opened file of -1 if error
+ *   returns: the descriptor of the opened file (a file opened twice gets
+ *   two descriptors, with their own offsets) or -1 if error
  */
 int my_open(char* nome, int flags);
 
 
 /*
- * my_read: read data from file
- * - fileId: the file id of the opened file
+ * my_read: read data from file (through the cache of the open file)
+ * - fd: the descriptor of the opened file
  * - buffer: where to put the read data [out]
  * - numBytes: maximum number of bytes to read
  *   returns: the number of bytes read, 0 if end of file reached or -1 if error
  */
-int my_read(int fileId, char* buffer, unsigned numBytes);
+int my_read(int fd, char* buffer, unsigned numBytes);
 
 
 /*
- * my_write: write data to file
- * - fileId: the file id of the opened file
+ * my_write: write data to file; the data is kept in the cache of the
+ * open file and written back when enough of it accumulates or when the
+ * file is closed (errors in the write back are reported by my_close)
+ * - fd: the descriptor of the opened file
  * - buffer: buffer with the data to write
  * - numBytes: number of bytes to write
  *   returns: the number of bytes written or -1 if error
  */
-int my_write(int fileId, char* buffer, unsigned numBytes);
+int my_write(int fd, char* buffer, unsigned numBytes);
+
+
+/*
+ * my_pread/my_pwrite: read/write like my_read/my_write but at 'offset',
+ * without using or changing the offsets of the descriptor
+ */
+int my_pread(int fd, char* buffer, unsigned numBytes, unsigned offset);
+
+int my_pwrite(int fd, char* buffer, unsigned numBytes, unsigned offset);
+
+
+/*
+ * my_readv/my_writev: read/write like my_read/my_write, into/from the
+ * 'iovcnt' buffers of 'iov' in turn; the whole range is handled at
+ * once (e.g. the pages it misses are read together)
+ */
+int my_readv(int fd, const struct iovec* iov, int iovcnt);
+
+int my_writev(int fd, const struct iovec* iov, int iovcnt);
+
+
+/*
+ * my_preadv/my_pwritev: vectored my_pread/my_pwrite
+ */
+int my_preadv(int fd, const struct iovec* iov, int iovcnt, unsigned offset);
+
+int my_pwritev(int fd, const struct iovec* iov, int iovcnt, unsigned offset);
+
+
+// my_lseek whence values finding data and holes (as in Linux)
+#ifndef SEEK_DATA
+#define SEEK_DATA 3
+#define SEEK_HOLE 4
+#endif
+
+/*
+ * my_lseek: move the read and the write offsets of a descriptor; a
+ *   write beyond the end of the file leaves a hole (read as zeros,
+ *   taking no space on the server) before its data
+ * - fd: the descriptor of the opened file
+ * - offset: the new offset relative to 'whence'
+ * - whence: SEEK_SET (start of the file), SEEK_CUR (read offset),
+ *   SEEK_END (end of the file), SEEK_DATA/SEEK_HOLE (the first offset
+ *   from 'offset' on with data/in a hole; the end of the file is a
+ *   hole)
+ *   returns: the new offset or -1 if error (also if 'offset' is not
+ *   below the size of the file or there is no data after it)
+ */
+int my_lseek(int fd, int offset, int whence);
+
+
+/*
+ * my_ftruncate: change the size of an opened file; a larger size ends
+ *   the file in a hole, a smaller one frees the space past it
+ * - fd: the descriptor of the opened file
+ * - size: the new size
+ *   returns: 0 if successful or -1 if error
+ */
+int my_ftruncate(int fd, unsigned size);
+
+
+/*
+ * my_fallocate: reserve the space of a range of an opened file, so
+ *   writing it later needs no allocation (e.g. before an upload of a
+ *   known size); the file grows to the end of the range if needed
+ * - fd: the descriptor of the opened file
+ * - offset: start of the range
+ * - len: number of bytes of the range
+ *   returns: 0 if successful or -1 if error (e.g. no space)
+ */
+int my_fallocate(int fd, unsigned offset, unsigned len);
 
 
 /*
- * my_close: close a previously opened file
- * - fileId: the file id of the file to close
+ * my_close: close a previously opened file, writing back its data
+ * - fd: the descriptor of the file to close
  *   returns: 0 if successful or -1 if error
  */
-int my_close(int fileId);
+int my_close(int fd);
 
 
 /*
@@ -18,17 +18,55 @@
 // the file handle of the root directory is '1'
 #define ROOT_FHANDLE 1
 
-// status of service invocation
+// status of service invocation; STAT_BUSY: the server was overloaded
+// (the synchronous calls are retried a few times before returning it,
+// the asynchronous ones return it at once)
 typedef enum {STAT_OK = 0, STAT_BUSY = 1,STAT_ERROR = -1} snfs_call_status_t;
 
 
+// maximum number of calls in flight
+#define SNFS_MAX_CALLS 32
+
+// number of messages a single snfs_read/snfs_write keeps in flight
+#define SNFS_PIPELINE_DEPTH 8
+
+// a call in flight (see the asynchronous calls below)
+typedef struct snfs_call_ snfs_call_t;
+
+// a client context: a socket connected to a server, its calls in flight
+// and its caches; every call below takes the context it is made in as
+// its first argument ('ctx')
+typedef struct snfs_ctx_ snfs_ctx_t;
+
+// context flags:
+// - SNFS_CTX_THREADS: the context is used by several sthreads at once
+//   (sthread_init must have been called); they share its socket, one
+//   of the waiting threads receives the responses of all of them
+enum snfs_ctx_flags { SNFS_CTX_THREADS = 1 };
+
+// completion callback of an asynchronous call: gets its status, the
+// number of bytes read (read) or the file size (write), and 'arg'
+typedef void (*snfs_callback_t)(snfs_call_status_t status, unsigned result,
+   void* arg);
+
+
 /*
- * snfs_init: internal initialization of the API (e.g. socket).
+ * snfs_init: creates a context of the API (e.g. socket); threads may
+ * share a context or use one each (each has its own socket)
  * - local_addr - client socket address
  * - remote_addr - server socket address
- *   returns: -1/0 if (un)suceeds
+ * - flags - context flags
+ *   returns: the context or NULL if error
  */
-int snfs_init(char* local_addr, char* remote_addr);
+snfs_ctx_t* snfs_init(char* local_addr, char* remote_addr, int flags);
+
+
+/*
+ * snfs_max_transfer: gets the amount of data transferred in a single
+ * read/write message, negotiated with the server in snfs_init
+ *   returns: the transfer size in bytes
+ */
+unsigned snfs_max_transfer(snfs_ctx_t* ctx);
 
 
 /*
@@ -39,22 +77,24 @@ int snfs_init(char* local_addr, char* remote_addr);
  * - outsize - maximum size of buffer outmsg
  *   returns: status
  */
-snfs_call_status_t snfs_ping(char* inmsg, int insize, char* outmsg, 
+snfs_call_status_t snfs_ping(snfs_ctx_t* ctx, char* inmsg, int insize, char* outmsg, 
    int outsize);
 
 
 /*
- * lookup: obtains file handle of file 'name'
+ * lookup: obtains file handle of file 'name'; results are cached while
+ * the lease the server grants on them lasts
  * - name - pathname of the file
  * - file - the file handle [out]
  * - fsize - the file size [out]
  *   returns: status
  */
-snfs_call_status_t snfs_lookup(char* pathname, snfs_fhandle_t* file, unsigned* fsize);
+snfs_call_status_t snfs_lookup(snfs_ctx_t* ctx, char* pathname, snfs_fhandle_t* file, unsigned* fsize);
 
 
 /*
- * read: read 'count' bytes from file 'fhandle' starting at 'offset'
+ * read: read 'count' bytes from file 'fhandle' starting at 'offset';
+ * reads larger than the transfer size take several messages
  * - fhandle: handle of the file to read
  * - offset: start reading position
  * - count: maximum number of bytes to read
@@ -62,12 +102,13 @@ snfs_call_status_t snfs_lookup(char* pathname, snfs_fhandle_t* file, unsigned* f
  * - nread: number of bytes read [out]
  *   returns: status
  */
-snfs_call_status_t snfs_read(snfs_fhandle_t fhandle, unsigned offset,
+snfs_call_status_t snfs_read(snfs_ctx_t* ctx, snfs_fhandle_t fhandle, unsigned offset,
    unsigned count, char* buffer, int* nread);
 
 
 /*
- * write: write 'count' bytes to file 'fhandle' starting at 'offset'
+ * write: write 'count' bytes to file 'fhandle' starting at 'offset';
+ * writes larger than the transfer size take several messages
  * - fhandle: handle of the file to write
  * - offset: starting position
  * - count: number of bytes to write
@@ -75,10 +116,100 @@ snfs_call_status_t snfs_read(snfs_fhandle_t fhandle, unsigned offset,
  * - fsize: size of file after the write [out]
  *   returns: status
  */
-snfs_call_status_t snfs_write(snfs_fhandle_t fhandle, unsigned offset, 
+snfs_call_status_t snfs_write(snfs_ctx_t* ctx, snfs_fhandle_t fhandle, unsigned offset, 
    unsigned count, char* buffer, unsigned int* fsize);
 
 
+/*
+ * seek: finds the first offset of file 'fhandle' from 'offset' on
+ * holding data (SNFS_SEEK_DATA) or in a hole (SNFS_SEEK_HOLE)
+ * - fhandle: handle of the file
+ * - offset: where to start looking (below the size of the file)
+ * - whence: SNFS_SEEK_DATA or SNFS_SEEK_HOLE
+ * - pos: the offset found [out]
+ *   returns: status (STAT_ERROR if there is no data after 'offset')
+ */
+snfs_call_status_t snfs_seek(snfs_ctx_t* ctx, snfs_fhandle_t fhandle, unsigned offset,
+   snfs_seek_whence_t whence, unsigned* pos);
+
+
+/*
+ * truncate: changes the size of file 'fhandle' to 'size'
+ * - fsize: size of file after the call [out]
+ *   returns: status
+ */
+snfs_call_status_t snfs_truncate(snfs_ctx_t* ctx, snfs_fhandle_t fhandle, unsigned size,
+   unsigned* fsize);
+
+
+/*
+ * fallocate: reserves the blocks of 'count' bytes of file 'fhandle'
+ * starting at 'offset' (the file grows to the end of the range)
+ * - fsize: size of file after the call [out]
+ *   returns: status
+ */
+snfs_call_status_t snfs_fallocate(snfs_ctx_t* ctx, snfs_fhandle_t fhandle, unsigned offset,
+   unsigned count, unsigned* fsize);
+
+
+/*
+ * Asynchronous calls
+ *
+ * Start a call and return without waiting for the response. Up to
+ * SNFS_MAX_CALLS calls may be in flight in a context (starting one more
+ * first waits for a call to complete) and responses arrive in any
+ * order. A call is completed either by snfs_wait or, if it has a
+ * callback, by running the callback while the library receives
+ * responses (in snfs_wait, snfs_poll or any synchronous call, possibly
+ * in another thread of the context); its handle must not be used once
+ * the callback runs. The synchronous calls are built on these.
+ */
+
+/*
+ * read_async: starts the read of up to snfs_max_transfer() bytes
+ * - fhandle, offset, count: as in snfs_read
+ * - buffer: where to put data (must stay valid until the call completes)
+ * - callback: completion callback or NULL to use snfs_wait
+ * - arg: argument of the callback
+ *   returns: the call or NULL if error
+ */
+snfs_call_t* snfs_read_async(snfs_ctx_t* ctx, snfs_fhandle_t fhandle, unsigned offset,
+   unsigned count, char* buffer, snfs_callback_t callback, void* arg);
+
+
+/*
+ * write_async: starts the write of up to snfs_max_transfer() bytes
+ * (the data is sent before it returns); a write beyond the end of the
+ * file leaves a hole before its data, so the writes growing the file
+ * may complete in any order
+ * - fhandle, offset, count, buffer: as in snfs_write
+ * - callback: completion callback or NULL to use snfs_wait
+ * - arg: argument of the callback
+ *   returns: the call or NULL if error
+ */
+snfs_call_t* snfs_write_async(snfs_ctx_t* ctx, snfs_fhandle_t fhandle, unsigned offset,
+   unsigned count, char* buffer, snfs_callback_t callback, void* arg);
+
+
+/*
+ * wait: waits for a call without callback to complete and frees it
+ * - call: the call
+ * - result: number of bytes read (read) or file size (write) [out]
+ *   returns: status of the call
+ */
+snfs_call_status_t snfs_wait(snfs_call_t* call, unsigned* result);
+
+
+/*
+ * poll: completes the calls whose responses have arrived, running their
+ * callbacks
+ * - block: if not 0, waits for at least one response (when some call
+ *   is in flight)
+ *   returns: the number of calls completed or -1 if error
+ */
+int snfs_poll(snfs_ctx_t* ctx, int block);
+
+
 /*
  * create: create file 'name' in directory 'dir'
  * - dir - file handle of the directory
@@ -86,7 +217,7 @@ snfs_call_status_t snfs_write(snfs_fhandle_t fhandle, unsigned offset,
  * - file - the file handle of the created file [out]
  *   returns: status
  */
-snfs_call_status_t snfs_create(snfs_fhandle_t dir, char* name, 
+snfs_call_status_t snfs_create(snfs_ctx_t* ctx, snfs_fhandle_t dir, char* name, 
    snfs_fhandle_t* file);
 
 
@@ -97,7 +228,7 @@ snfs_call_status_t snfs_create(snfs_fhandle_t dir, char* name,
  * - file - the file handle of the created subdirectory [out]
  *   returns: status
  */
-snfs_call_status_t snfs_mkdir(snfs_fhandle_t dir, char* name, 
+snfs_call_status_t snfs_mkdir(snfs_ctx_t* ctx, snfs_fhandle_t dir, char* name, 
    snfs_fhandle_t* file);
 
 
@@ -109,7 +240,7 @@ snfs_call_status_t snfs_mkdir(snfs_fhandle_t dir, char* name,
  * - count - the number of entries read [out]
  *   returns: status
  */
-snfs_call_status_t snfs_readdir(snfs_fhandle_t dir, unsigned cmax, 
+snfs_call_status_t snfs_readdir(snfs_ctx_t* ctx, snfs_fhandle_t dir, unsigned cmax, 
    snfs_dir_entry_t* list, unsigned* count);
 
 /*
@@ -119,7 +250,7 @@ snfs_call_status_t snfs_readdir(snfs_fhandle_t dir, unsigned cmax,
  * - file - the file handle of the deleted file [out]
  *   returns: status
  */
-snfs_call_status_t snfs_remove(snfs_fhandle_t dir, char* name, snfs_fhandle_t* file);
+snfs_call_status_t snfs_remove(snfs_ctx_t* ctx, snfs_fhandle_t dir, char* name, snfs_fhandle_t* file);
 
    
 /*
@@ -132,7 +263,7 @@ snfs_call_status_t snfs_remove(snfs_fhandle_t dir, char* name, snfs_fhandle_t* f
  * - file - the file handle of the destination file [out]
  *   returns: status
  */
-snfs_call_status_t snfs_copy(snfs_fhandle_t src_dir, char* src_name, 
+snfs_call_status_t snfs_copy(snfs_ctx_t* ctx, snfs_fhandle_t src_dir, char* src_name, 
    snfs_fhandle_t dst_dir, char* dst_name, snfs_fhandle_t* file);
 
 /*
@@ -145,34 +276,51 @@ snfs_call_status_t snfs_copy(snfs_fhandle_t src_dir, char* src_name,
  * - fsize - size of file after the write [out]
  *   returns: status
  */
-snfs_call_status_t snfs_append(snfs_fhandle_t dir1, char* name1, snfs_fhandle_t dir2, char* name2, unsigned int* fsize);
+snfs_call_status_t snfs_append(snfs_ctx_t* ctx, snfs_fhandle_t dir1, char* name1, snfs_fhandle_t dir2, char* name2, unsigned int* fsize);
+
+/*
+ * compound: runs a sequence of operations in a single round trip (see
+ * the compound request in snfs_proto.h for the rules)
+ * - ops: the operations and their count
+ * - results: the result of each operation [out]
+ *   returns: status of the last operation run
+ */
+snfs_call_status_t snfs_compound(snfs_ctx_t* ctx, snfs_msg_req_compound_t* ops,
+   snfs_compound_res_t* results);
 
 /*
  * defragmentation: operates the file system block defragmentation 
  *   returns: status
  */
-snfs_call_status_t snfs_defrag();
+snfs_call_status_t snfs_defrag(snfs_ctx_t* ctx);
 
 /*
  * diskusage: dumps the file system busy blocks along with the
  * name of the files that are using them. This dumping operation takes place on the server side.
  *   returns: status
  */
-snfs_call_status_t snfs_diskusage();
+snfs_call_status_t snfs_diskusage(snfs_ctx_t* ctx);
 
 /*
  * dumpcache: dumps the cache of blocks content. This dumping operation takes place on the server side.
  *   returns: status
  */
-snfs_call_status_t snfs_dumpcache();
+snfs_call_status_t snfs_dumpcache(snfs_ctx_t* ctx);
+
 
 
+/*
+ * snfs_lookup_cache_dump: dumps the statistics of the lookup cache
+ * (hits are the round trips saved)
+ */
+void snfs_lookup_cache_dump(snfs_ctx_t* ctx);
+
 
 /*
- * snfs_finish: internal finalization of the SNFS API
+ * snfs_finish: internal finalization of a context of the SNFS API
  */
 
-void snfs_finish();
+void snfs_finish(snfs_ctx_t* ctx);
 
 
 #endif
@@ -0,0 +1,645 @@
+/*
+ * SNFS Compact Wire Encoding
+ *
+ * snfs_codec.h
+ *
+ * Compact, variable-length encoding of the SNFS messages, used by the
+ * SNFS library and the SNFS server once both agree on it (see the
+ * 'negotiate' service in snfs_proto.h). The functions are defined in
+ * this header because both sides are built independently.
+ *
+ * Message layout:
+ *   - byte 0: SNFS_WIRE_MARK | version; a message in the fixed-size
+ *     format starts with the 'type' integer (always below 0x80), so
+ *     the server tells both formats apart by this byte
+ *   - byte 1: the message type
+ *   - the serial number of the request (varint)
+ *   - responses only: the status (signed varint)
+ *   - the fields of the body, in declaration order: integers as
+ *     varints (handles as signed varints) and strings prefixed with
+ *     their length; response bodies are only present if the status
+ *     is RES_OK (or if the response is the one of a compound request)
+ *
+ * The operations of a compound request (and their results) are encoded
+ * as nested messages, each preceded by its length (and, in requests,
+ * by its condition byte).
+ *
+ * The data of a write request and of a read response is not encoded:
+ * it follows the header, which is padded (a byte with the number of
+ * padding bytes precedes them) to a multiple of SNFS_WIRE_ALIGN bytes,
+ * or to exactly SNFS_WIRE_READ_HDR bytes for a read response, so the
+ * client knows where the data starts before it receives it. The data
+ * is left in place by the decoder, so it is never copied.
+ */
+
+#ifndef _SNFS_CODEC_H_
+#define _SNFS_CODEC_H_
+
+#include <string.h>
+#include <snfs_proto.h>
+
+
+// version of the compact encoding implemented in this file
+#define SNFS_WIRE_VERSION 2
+
+// first byte mark of a compactly encoded message
+#define SNFS_WIRE_MARK 0x80
+
+// true if 'buf' holds a compactly encoded message
+#define SNFS_WIRE_IS_COMPACT(buf) ((((unsigned char*)(buf))[0] & SNFS_WIRE_MARK) != 0)
+
+// true if the compactly encoded message in 'buf' is of SNFS_WIRE_VERSION
+#define SNFS_WIRE_VERSION_OK(buf) \
+   (((unsigned char*)(buf))[0] == (SNFS_WIRE_MARK | SNFS_WIRE_VERSION))
+
+// alignment of the data following a write request/read response header
+#define SNFS_WIRE_ALIGN 8
+
+// size of the header of a read response (the serial number takes at
+// most 5 bytes and the read data is never above 2^21 bytes, so its
+// length takes at most 3 bytes)
+#define SNFS_WIRE_READ_HDR 16
+
+#if SNFS_MAX_TRANSFER >= (1 << 21)
+#error "SNFS_MAX_TRANSFER does not fit in a read response header"
+#endif
+
+// maximum size of an encoded message without write/read data
+#define SNFS_WIRE_MAX_SMALL 2048
+
+
+/*
+ * Encoding primitives: each 'put' function appends to 'p' and returns
+ * the number of bytes written; each 'get' function consumes from '*p'
+ * (never beyond 'end') and returns 0, or -1 if the message is malformed
+ */
+
+static inline int snfs_wire_put_uint(char* p, unsigned v)
+{
+   int n = 0;
+   while (v >= 0x80) {
+      p[n++] = (char)(v | 0x80);
+      v >>= 7;
+   }
+   p[n++] = (char)v;
+   return n;
+}
+
+
+static inline int snfs_wire_put_int(char* p, int v)
+{
+   // zigzag: small negative values (e.g. -1) also take one byte
+   return snfs_wire_put_uint(p, ((unsigned)v << 1) ^ (unsigned)(v >> 31));
+}
+
+
+static inline int snfs_wire_put_str(char* p, const char* s, int max)
+{
+   int len = 0;
+   while (len < max && s[len] != '\0') {
+      len++;
+   }
+   int n = snfs_wire_put_uint(p, len);
+   memcpy(p + n, s, len);
+   return n + len;
+}
+
+
+static inline int snfs_wire_put_pad(char* p, int hdrlen, int align)
+{
+   // the number of padding bytes precedes them
+   int pad = (align - (hdrlen + 1) % align) % align;
+   p[0] = (char)pad;
+   memset(p + 1, 0, pad);
+   return pad + 1;
+}
+
+
+static inline int snfs_wire_get_uint(char** p, char* end, unsigned* v)
+{
+   unsigned val = 0;
+   for (int shift = 0; shift < 35; shift += 7) {
+      if (*p >= end) {
+         return -1;
+      }
+      unsigned char b = (unsigned char)*(*p)++;
+      val |= (unsigned)(b & 0x7f) << shift;
+      if (!(b & 0x80)) {
+         *v = val;
+         return 0;
+      }
+   }
+   return -1;
+}
+
+
+static inline int snfs_wire_get_int(char** p, char* end, int* v)
+{
+   unsigned u;
+   if (snfs_wire_get_uint(p, end, &u) < 0) {
+      return -1;
+   }
+   *v = (int)(u >> 1) ^ -(int)(u & 1);
+   return 0;
+}
+
+
+static inline int snfs_wire_get_str(char** p, char* end, char* s, int size)
+{
+   unsigned len;
+   if (snfs_wire_get_uint(p, end, &len) < 0 || len >= size || len > end - *p) {
+      return -1;
+   }
+   memcpy(s, *p, len);
+   s[len] = '\0';
+   *p += len;
+   return 0;
+}
+
+
+static inline int snfs_wire_get_pad(char** p, char* end)
+{
+   if (*p >= end) {
+      return -1;
+   }
+   unsigned pad = (unsigned char)*(*p)++;
+   if (pad >= SNFS_WIRE_READ_HDR || pad > end - *p) {
+      return -1;
+   }
+   *p += pad;
+   return 0;
+}
+
+
+/*
+ * snfs_decode_serial: gets the serial number of an encoded message
+ * - buf, len: the first bytes of the message (at least its header)
+ * - serial: the serial number [out]
+ *   returns: 0 or -1 if the message is malformed
+ */
+static inline int snfs_decode_serial(char* buf, int len,
+   snfs_req_serial_num_t* serial)
+{
+   char* p = buf + 2;
+   if (len < 2) {
+      return -1;
+   }
+   return snfs_wire_get_uint(&p, buf + len, serial);
+}
+
+
+/*
+ * snfs_encode_req: encodes a request, except the data of a write
+ * - req: the request (in the fixed-size format)
+ * - out: output buffer of at least SNFS_WIRE_MAX_SMALL bytes
+ *   returns: the size of the encoded request (header of a write)
+ */
+static inline int snfs_encode_req(snfs_msg_req_t* req, char* out)
+{
+   char* p = out;
+   *p++ = (char)(SNFS_WIRE_MARK | SNFS_WIRE_VERSION);
+   *p++ = (char)req->type;
+   p += snfs_wire_put_uint(p, req->serial);
+
+   switch (req->type) {
+      case REQ_PING:
+         p += snfs_wire_put_str(p, req->body.ping.msg, sizeof(req->body.ping.msg));
+         break;
+      case REQ_LOOKUP:
+         p += snfs_wire_put_str(p, req->body.lookup.pname, MAX_PATH_NAME_SIZE);
+         break;
+      case REQ_READ:
+         p += snfs_wire_put_int(p, req->body.read.fhandle);
+         p += snfs_wire_put_uint(p, req->body.read.offset);
+         p += snfs_wire_put_uint(p, req->body.read.count);
+         break;
+      case REQ_WRITE:
+         p += snfs_wire_put_int(p, req->body.write.fhandle);
+         p += snfs_wire_put_uint(p, req->body.write.offset);
+         p += snfs_wire_put_uint(p, req->body.write.count);
+         p += snfs_wire_put_pad(p, p - out, SNFS_WIRE_ALIGN);
+         break;
+      case REQ_SEEK:
+         p += snfs_wire_put_int(p, req->body.seek.fhandle);
+         p += snfs_wire_put_uint(p, req->body.seek.offset);
+         *p++ = (char)req->body.seek.whence;
+         break;
+      case REQ_TRUNCATE:
+         p += snfs_wire_put_int(p, req->body.truncate.fhandle);
+         p += snfs_wire_put_uint(p, req->body.truncate.size);
+         break;
+      case REQ_FALLOCATE:
+         p += snfs_wire_put_int(p, req->body.fallocate.fhandle);
+         p += snfs_wire_put_uint(p, req->body.fallocate.offset);
+         p += snfs_wire_put_uint(p, req->body.fallocate.count);
+         break;
+      case REQ_CREATE:
+         p += snfs_wire_put_int(p, req->body.create.dir);
+         p += snfs_wire_put_str(p, req->body.create.name, MAX_FILE_NAME_SIZE);
+         break;
+      case REQ_MKDIR:
+         p += snfs_wire_put_int(p, req->body.mkdir.dir);
+         p += snfs_wire_put_str(p, req->body.mkdir.file, MAX_FILE_NAME_SIZE);
+         break;
+      case REQ_READDIR:
+         p += snfs_wire_put_int(p, req->body.readdir.dir);
+         p += snfs_wire_put_uint(p, req->body.readdir.cmax);
+         break;
+      case REQ_REMOVE:
+         p += snfs_wire_put_int(p, req->body.remove.dir);
+         p += snfs_wire_put_str(p, req->body.remove.name, MAX_FILE_NAME_SIZE);
+         break;
+      case REQ_COPY:
+         p += snfs_wire_put_int(p, req->body.copy.src_dir);
+         p += snfs_wire_put_int(p, req->body.copy.dst_dir);
+         p += snfs_wire_put_str(p, req->body.copy.src_name, MAX_FILE_NAME_SIZE);
+         p += snfs_wire_put_str(p, req->body.copy.dst_name, MAX_FILE_NAME_SIZE);
+         break;
+      case REQ_APPEND:
+         p += snfs_wire_put_int(p, req->body.append.dir1);
+         p += snfs_wire_put_int(p, req->body.append.dir2);
+         p += snfs_wire_put_str(p, req->body.append.name1, MAX_FILE_NAME_SIZE);
+         p += snfs_wire_put_str(p, req->body.append.name2, MAX_FILE_NAME_SIZE);
+         break;
+      case REQ_NEGOTIATE:
+         p += snfs_wire_put_uint(p, req->body.negotiate.max_transfer);
+         p += snfs_wire_put_uint(p, req->body.negotiate.wire_version);
+         break;
+      case REQ_COMPOUND:
+         p += snfs_wire_put_uint(p, req->body.compound.count);
+         for (int i = 0; i < req->body.compound.count && i < SNFS_COMPOUND_MAX_OPS; i++) {
+            snfs_compound_op_t* op = &req->body.compound.ops[i];
+            snfs_msg_req_t sub;
+            char nested[SNFS_WIRE_MAX_SMALL];
+            memset(&sub, 0, sizeof(sub));
+            sub.type = op->type;
+            memcpy(&sub.body, &op->args, sizeof(op->args));
+            int n = (op->type == REQ_COMPOUND) ? 0 : snfs_encode_req(&sub, nested);
+            *p++ = (char)op->cond;
+            p += snfs_wire_put_uint(p, n);
+            memcpy(p, nested, n);
+            p += n;
+         }
+         break;
+      default:
+         // the remaining requests have no body
+         break;
+   }
+   return p - out;
+}
+
+
+/*
+ * snfs_decode_req: decodes a request into the fixed-size format
+ * - buf, len: the encoded request
+ * - req: the decoded request [out]
+ * - data: where the data of a write starts, inside 'buf' [out]
+ *   returns: the size of the request in the fixed-size format, or -1
+ *   if the request is malformed or of another version of the encoding
+ */
+static inline int snfs_decode_req(char* buf, int len, snfs_msg_req_t* req,
+   char** data)
+{
+   char* p = buf + 2;
+   char* end = buf + len;
+   int err = 0;
+
+   if (len < 2 || !SNFS_WIRE_VERSION_OK(buf)) {
+      return -1;
+   }
+   memset(req, 0, sizeof(*req));
+   req->type = (snfs_msg_type_t)(unsigned char)buf[1];
+   *data = NULL;
+   err |= snfs_wire_get_uint(&p, end, &req->serial);
+
+   switch (req->type) {
+      case REQ_PING:
+         err |= snfs_wire_get_str(&p, end, req->body.ping.msg, sizeof(req->body.ping.msg));
+         break;
+      case REQ_LOOKUP:
+         err |= snfs_wire_get_str(&p, end, req->body.lookup.pname, MAX_PATH_NAME_SIZE);
+         break;
+      case REQ_READ:
+         err |= snfs_wire_get_int(&p, end, &req->body.read.fhandle);
+         err |= snfs_wire_get_uint(&p, end, &req->body.read.offset);
+         err |= snfs_wire_get_uint(&p, end, &req->body.read.count);
+         break;
+      case REQ_WRITE:
+         err |= snfs_wire_get_int(&p, end, &req->body.write.fhandle);
+         err |= snfs_wire_get_uint(&p, end, &req->body.write.offset);
+         err |= snfs_wire_get_uint(&p, end, &req->body.write.count);
+         err |= snfs_wire_get_pad(&p, end);
+         if (err || (p - buf) % SNFS_WIRE_ALIGN || req->body.write.count != end - p) {
+            return -1;
+         }
+         *data = p;
+         return SNFS_WRITE_REQ_SIZE(req->body.write.count);
+      case REQ_SEEK:
+         err |= snfs_wire_get_int(&p, end, &req->body.seek.fhandle);
+         err |= snfs_wire_get_uint(&p, end, &req->body.seek.offset);
+         if (p >= end) {
+            return -1;
+         }
+         req->body.seek.whence = (snfs_seek_whence_t)*p++;
+         break;
+      case REQ_TRUNCATE:
+         err |= snfs_wire_get_int(&p, end, &req->body.truncate.fhandle);
+         err |= snfs_wire_get_uint(&p, end, &req->body.truncate.size);
+         break;
+      case REQ_FALLOCATE:
+         err |= snfs_wire_get_int(&p, end, &req->body.fallocate.fhandle);
+         err |= snfs_wire_get_uint(&p, end, &req->body.fallocate.offset);
+         err |= snfs_wire_get_uint(&p, end, &req->body.fallocate.count);
+         break;
+      case REQ_CREATE:
+         err |= snfs_wire_get_int(&p, end, &req->body.create.dir);
+         err |= snfs_wire_get_str(&p, end, req->body.create.name, MAX_FILE_NAME_SIZE);
+         break;
+      case REQ_MKDIR:
+         err |= snfs_wire_get_int(&p, end, &req->body.mkdir.dir);
+         err |= snfs_wire_get_str(&p, end, req->body.mkdir.file, MAX_FILE_NAME_SIZE);
+         break;
+      case REQ_READDIR:
+         err |= snfs_wire_get_int(&p, end, &req->body.readdir.dir);
+         err |= snfs_wire_get_uint(&p, end, &req->body.readdir.cmax);
+         break;
+      case REQ_REMOVE:
+         err |= snfs_wire_get_int(&p, end, &req->body.remove.dir);
+         err |= snfs_wire_get_str(&p, end, req->body.remove.name, MAX_FILE_NAME_SIZE);
+         break;
+      case REQ_COPY:
+         err |= snfs_wire_get_int(&p, end, &req->body.copy.src_dir);
+         err |= snfs_wire_get_int(&p, end, &req->body.copy.dst_dir);
+         err |= snfs_wire_get_str(&p, end, req->body.copy.src_name, MAX_FILE_NAME_SIZE);
+         err |= snfs_wire_get_str(&p, end, req->body.copy.dst_name, MAX_FILE_NAME_SIZE);
+         break;
+      case REQ_APPEND:
+         err |= snfs_wire_get_int(&p, end, &req->body.append.dir1);
+         err |= snfs_wire_get_int(&p, end, &req->body.append.dir2);
+         err |= snfs_wire_get_str(&p, end, req->body.append.name1, MAX_FILE_NAME_SIZE);
+         err |= snfs_wire_get_str(&p, end, req->body.append.name2, MAX_FILE_NAME_SIZE);
+         break;
+      case REQ_NEGOTIATE:
+         err |= snfs_wire_get_uint(&p, end, &req->body.negotiate.max_transfer);
+         err |= snfs_wire_get_uint(&p, end, &req->body.negotiate.wire_version);
+         break;
+      case REQ_COMPOUND:
+         err |= snfs_wire_get_uint(&p, end, &req->body.compound.count);
+         if (err || req->body.compound.count > SNFS_COMPOUND_MAX_OPS) {
+            return -1;
+         }
+         for (int i = 0; i < req->body.compound.count; i++) {
+            snfs_compound_op_t* op = &req->body.compound.ops[i];
+            snfs_msg_req_t sub;
+            char* subdata;
+            unsigned n;
+            if (p >= end) {
+               return -1;
+            }
+            op->cond = (snfs_compound_cond_t)*p++;
+            if (snfs_wire_get_uint(&p, end, &n) < 0 || n > end - p ||
+               snfs_decode_req(p, n, &sub, &subdata) < 0 ||
+               subdata != NULL || sub.type == REQ_COMPOUND) {
+               return -1;
+            }
+            op->type = sub.type;
+            memcpy(&op->args, &sub.body, sizeof(op->args));
+            p += n;
+         }
+         break;
+      default:
+         break;
+   }
+   return (err || p != end) ? -1 : (int)sizeof(*req);
+}
+
+
+/*
+ * snfs_encode_res: encodes a response, except the data of a read
+ * - res: the response (in the fixed-size format)
+ * - out: output buffer of at least SNFS_WIRE_MAX_SMALL bytes
+ *   returns: the size of the encoded response (header of a read)
+ */
+static inline int snfs_encode_res(snfs_msg_res_t* res, char* out)
+{
+   char* p = out;
+   *p++ = (char)(SNFS_WIRE_MARK | SNFS_WIRE_VERSION);
+   *p++ = (char)res->type;
+   p += snfs_wire_put_uint(p, res->serial);
+   p += snfs_wire_put_int(p, res->status);
+
+   // the results of a compound request are sent even if one failed
+   if (res->status != RES_OK && res->type != REQ_COMPOUND) {
+      return p - out;
+   }
+
+   switch (res->type) {
+      case REQ_PING:
+         p += snfs_wire_put_str(p, res->body.ping.msg, sizeof(res->body.ping.msg));
+         break;
+      case REQ_LOOKUP:
+         p += snfs_wire_put_int(p, res->body.lookup.file);
+         p += snfs_wire_put_uint(p, res->body.lookup.fsize);
+         *p++ = (char)res->body.lookup.ftype;
+         p += snfs_wire_put_uint(p, res->body.lookup.lease);
+         break;
+      case REQ_READ:
+         p += snfs_wire_put_uint(p, res->body.read.nread);
+         p += snfs_wire_put_pad(p, p - out, SNFS_WIRE_READ_HDR);
+         break;
+      case REQ_WRITE:
+         p += snfs_wire_put_uint(p, res->body.write.fsize);
+         break;
+      case REQ_SEEK:
+         p += snfs_wire_put_uint(p, res->body.seek.offset);
+         break;
+      case REQ_TRUNCATE:
+         p += snfs_wire_put_uint(p, res->body.truncate.fsize);
+         break;
+      case REQ_FALLOCATE:
+         p += snfs_wire_put_uint(p, res->body.fallocate.fsize);
+         break;
+      case REQ_CREATE:
+         p += snfs_wire_put_int(p, res->body.create.file);
+         break;
+      case REQ_MKDIR:
+         p += snfs_wire_put_int(p, res->body.mkdir.newdirid);
+         break;
+      case REQ_READDIR:
+         p += snfs_wire_put_uint(p, res->body.readdir.count);
+         for (int i = 0; i < res->body.readdir.count; i++) {
+            snfs_dir_entry_t* entry = &res->body.readdir.list[i];
+            *p++ = (char)entry->type;
+            p += snfs_wire_put_str(p, entry->name, MAX_FILE_NAME_SIZE);
+         }
+         break;
+      case REQ_REMOVE:
+         p += snfs_wire_put_int(p, res->body.remove.file);
+         break;
+      case REQ_COPY:
+         p += snfs_wire_put_int(p, res->body.copy.file);
+         break;
+      case REQ_APPEND:
+         p += snfs_wire_put_uint(p, res->body.append.fsize);
+         break;
+      case REQ_NEGOTIATE:
+         p += snfs_wire_put_uint(p, res->body.negotiate.max_transfer);
+         p += snfs_wire_put_uint(p, res->body.negotiate.wire_version);
+         break;
+      case REQ_INVALIDATE:
+         p += snfs_wire_put_int(p, res->body.invalidate.file);
+         break;
+      case REQ_COMPOUND:
+         p += snfs_wire_put_uint(p, res->body.compound.count);
+         for (int i = 0; i < res->body.compound.count && i < SNFS_COMPOUND_MAX_OPS; i++) {
+            snfs_compound_res_t* r = &res->body.compound.res[i];
+            snfs_msg_res_t sub;
+            char nested[SNFS_WIRE_MAX_SMALL];
+            memset(&sub, 0, sizeof(sub));
+            sub.type = r->type;
+            sub.status = r->status;
+            memcpy(&sub.body, &r->body, sizeof(r->body));
+            int n = (r->type == REQ_COMPOUND) ? 0 : snfs_encode_res(&sub, nested);
+            p += snfs_wire_put_uint(p, n);
+            memcpy(p, nested, n);
+            p += n;
+         }
+         break;
+      default:
+         break;
+   }
+   return p - out;
+}
+
+
+/*
+ * snfs_decode_res: decodes a response into the fixed-size format
+ * - buf, len: the encoded response
+ * - res: the decoded response [out]
+ * - data: where the data of a read starts, inside 'buf' [out]
+ *   returns: 0 or -1 if the response is malformed or of another version
+ *   of the encoding
+ * Only the header of a read response is accessed, so its data may have
+ * been received elsewhere ('len' still counts it).
+ */
+static inline int snfs_decode_res(char* buf, int len, snfs_msg_res_t* res,
+   char** data)
+{
+   char* p = buf + 2;
+   char* end = buf + len;
+   int err = 0;
+
+   if (len < 3 || !SNFS_WIRE_VERSION_OK(buf)) {
+      return -1;
+   }
+   memset(res, 0, sizeof(*res));
+   res->type = (snfs_msg_type_t)(unsigned char)buf[1];
+   *data = NULL;
+   int status;
+   err |= snfs_wire_get_uint(&p, end, &res->serial);
+   err |= snfs_wire_get_int(&p, end, &status);
+   res->status = (snfs_msg_res_status_t)status;
+
+   if (err || (res->status != RES_OK && res->type != REQ_COMPOUND)) {
+      return (err || p != end) ? -1 : 0;
+   }
+
+   switch (res->type) {
+      case REQ_PING:
+         err |= snfs_wire_get_str(&p, end, res->body.ping.msg, sizeof(res->body.ping.msg));
+         break;
+      case REQ_LOOKUP:
+         err |= snfs_wire_get_int(&p, end, &res->body.lookup.file);
+         err |= snfs_wire_get_uint(&p, end, &res->body.lookup.fsize);
+         if (p >= end) {
+            return -1;
+         }
+         res->body.lookup.ftype = (snfs_dir_entry_type_t)*p++;
+         err |= snfs_wire_get_uint(&p, end, &res->body.lookup.lease);
+         break;
+      case REQ_READ:
+         err |= snfs_wire_get_uint(&p, end, &res->body.read.nread);
+         err |= snfs_wire_get_pad(&p, end);
+         if (err || p - buf != SNFS_WIRE_READ_HDR || res->body.read.nread != end - p) {
+            return -1;
+         }
+         *data = p;
+         return 0;
+      case REQ_WRITE:
+         err |= snfs_wire_get_uint(&p, end, &res->body.write.fsize);
+         break;
+      case REQ_SEEK:
+         err |= snfs_wire_get_uint(&p, end, &res->body.seek.offset);
+         break;
+      case REQ_TRUNCATE:
+         err |= snfs_wire_get_uint(&p, end, &res->body.truncate.fsize);
+         break;
+      case REQ_FALLOCATE:
+         err |= snfs_wire_get_uint(&p, end, &res->body.fallocate.fsize);
+         break;
+      case REQ_CREATE:
+         err |= snfs_wire_get_int(&p, end, &res->body.create.file);
+         break;
+      case REQ_MKDIR:
+         err |= snfs_wire_get_int(&p, end, &res->body.mkdir.newdirid);
+         break;
+      case REQ_READDIR:
+         err |= snfs_wire_get_uint(&p, end, &res->body.readdir.count);
+         if (err || res->body.readdir.count > MAX_READDIR_ENTRIES) {
+            return -1;
+         }
+         for (int i = 0; i < res->body.readdir.count && !err; i++) {
+            snfs_dir_entry_t* entry = &res->body.readdir.list[i];
+            if (p >= end) {
+               return -1;
+            }
+            entry->type = (snfs_dir_entry_type_t)*p++;
+            err |= snfs_wire_get_str(&p, end, entry->name, MAX_FILE_NAME_SIZE);
+            entry->len = strlen(entry->name);
+         }
+         break;
+      case REQ_REMOVE:
+         err |= snfs_wire_get_int(&p, end, &res->body.remove.file);
+         break;
+      case REQ_COPY:
+         err |= snfs_wire_get_int(&p, end, &res->body.copy.file);
+         break;
+      case REQ_APPEND:
+         err |= snfs_wire_get_uint(&p, end, &res->body.append.fsize);
+         break;
+      case REQ_NEGOTIATE:
+         err |= snfs_wire_get_uint(&p, end, &res->body.negotiate.max_transfer);
+         err |= snfs_wire_get_uint(&p, end, &res->body.negotiate.wire_version);
+         break;
+      case REQ_INVALIDATE:
+         err |= snfs_wire_get_int(&p, end, &res->body.invalidate.file);
+         break;
+      case REQ_COMPOUND:
+         err |= snfs_wire_get_uint(&p, end, &res->body.compound.count);
+         if (err || res->body.compound.count > SNFS_COMPOUND_MAX_OPS) {
+            return -1;
+         }
+         for (int i = 0; i < res->body.compound.count; i++) {
+            snfs_compound_res_t* r = &res->body.compound.res[i];
+            snfs_msg_res_t sub;
+            char* subdata;
+            unsigned n;
+            if (snfs_wire_get_uint(&p, end, &n) < 0 || n > end - p ||
+               snfs_decode_res(p, n, &sub, &subdata) < 0 ||
+               subdata != NULL || sub.type == REQ_COMPOUND) {
+               return -1;
+            }
+            r->type = sub.type;
+            r->status = sub.status;
+            memcpy(&r->body, &sub.body, sizeof(r->body));
+            p += n;
+         }
+         break;
+      default:
+         break;
+   }
+   return (err || p != end) ? -1 : 0;
+}
+
+
+#endif
@@ -0,0 +1,130 @@
+/*
+ * fdtable.c
+ *
+ * Implementation of the open file descriptor table
+ * 
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "myfs.h"
+#include "fdtable.h"
+
+
+/* links slots [from, to) to the front of the free list, lowest first */
+static void fdtable_link_free(fdtable_t *table, unsigned from, unsigned to)
+{
+	for (unsigned i = to; i > from; i--) {
+		table->slots[i-1] = NULL;
+		table->next_free[i-1] = table->first_free;
+		table->first_free = (int)(i-1);
+	}
+}
+
+
+static int fdtable_grow(fdtable_t *table)
+{
+	unsigned size = table->size * 2;
+	if (size > table->max) {
+		size = table->max;
+	}
+	if (size <= table->size) {
+		return -1;
+	}
+
+	fd_t *slots = (fd_t*) realloc(table->slots, size * sizeof(fd_t));
+	if (slots == NULL) {
+		return -1;
+	}
+	table->slots = slots;
+	int *next_free = (int*) realloc(table->next_free, size * sizeof(int));
+	if (next_free == NULL) {
+		return -1;
+	}
+	table->next_free = next_free;
+
+	fdtable_link_free(table, table->size, size);
+	table->size = size;
+	return 0;
+}
+
+
+fdtable_t* fdtable_create(unsigned initial, unsigned max)
+{
+	if (initial == 0 || initial > max) {
+		return NULL;
+	}
+
+	fdtable_t *table = (fdtable_t*) malloc(sizeof(fdtable_t));
+	table->slots = (fd_t*) malloc(initial * sizeof(fd_t));
+	table->next_free = (int*) malloc(initial * sizeof(int));
+	if (table->slots == NULL || table->next_free == NULL) {
+		free(table->slots);
+		free(table->next_free);
+		free(table);
+		return NULL;
+	}
+	table->first_free = -1;
+	table->size = initial;
+	table->max = max;
+	table->count = 0;
+	fdtable_link_free(table, 0, initial);
+	return table;
+}
+
+
+int fdtable_destroy(fdtable_t *table)
+{
+	if (table == NULL) {
+		return 0;
+	}
+	if (table->count > 0) {
+		return -1;
+	}
+	free(table->slots);
+	free(table->next_free);
+	free(table);
+	return 0;
+}
+
+
+int fdtable_alloc(fdtable_t *table, fd_t fd)
+{
+	if (table == NULL || fd == NULL) {
+		return -1;
+	}
+	if (table->first_free < 0 && fdtable_grow(table) < 0) {
+		return -1;
+	}
+
+	int num = table->first_free;
+	table->first_free = table->next_free[num];
+	table->slots[num] = fd;
+	table->count++;
+	return num;
+}
+
+
+fd_t fdtable_get(fdtable_t *table, int num)
+{
+	if (table == NULL || num < 0 || (unsigned)num >= table->size) {
+		return NULL;
+	}
+	return table->slots[num];
+}
+
+
+fd_t fdtable_release(fdtable_t *table, int num)
+{
+	fd_t fd = fdtable_get(table, num);
+	if (fd == NULL) {
+		return NULL;
+	}
+
+	table->slots[num] = NULL;
+	table->next_free[num] = table->first_free;
+	table->first_free = num;
+	table->count--;
+	return fd;
+}
@@ -0,0 +1,47 @@
+/*
+ * fdtable.h
+ *
+ * Definition and declarations of the open file descriptor table
+ * 
+ */
+
+#ifndef _FDTABLE_H_
+#define _FDTABLE_H_
+
+#include "myfs.h"
+
+/* fdtable_t - descriptors indexed by their number; the free slots are
+ * linked through 'next_free' so allocating and releasing are O(1) */
+typedef struct {
+  fd_t *slots;
+  int *next_free;
+  int first_free;   /* first free slot or -1 if the table is full */
+  unsigned size;    /* number of slots */
+  unsigned max;     /* maximum number of slots */
+  unsigned count;   /* number of slots in use */
+} fdtable_t;
+
+
+/* fdtable_create - allocates a table with 'initial' slots that may grow
+ * up to 'max' slots */
+fdtable_t* fdtable_create(unsigned initial, unsigned max);
+
+
+/* fdtable_destroy - frees all memory used by the table if it is empty */
+int fdtable_destroy(fdtable_t *table);
+
+
+/* fdtable_alloc - stores 'fd' in a free slot, growing the table if needed;
+ * returns the slot number or -1 if the table is at its maximum size */
+int fdtable_alloc(fdtable_t *table, fd_t fd);
+
+
+/* fdtable_get - returns the descriptor in slot 'num' or NULL if free */
+fd_t fdtable_get(fdtable_t *table, int num);
+
+
+/* fdtable_release - frees slot 'num' and returns the descriptor it had
+ * (NULL if it was free) */
+fd_t fdtable_release(fdtable_t *table, int num);
+
+#endif
@@ -14,33 +14,71 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <sthread.h>
 #include "fs.h"
 
+char *strtok_r(char *str, const char *delim, char **saveptr);
+int usleep(unsigned int usec);
+
 
 #define dprintf if(1) printf
 
 //CACHE STRUTURE
 static cache_node* cache;
 
-//#define BLOCK_SIZE 512
+// protects the cache entries (innermost lock, see fs_t); a write to a
+// pinned entry, and any use of an entry being loaded or written back,
+// waits in it (the disk is accessed without the lock)
+static sthread_mon_t cache_lock;
+
+// number of pins held by reads sent from the cache (at most CACHE_PIN_MAX)
+static int cache_pinned;
+
+// data of the cache entries (CACHE_SIZE blocks) and log2 of the block size
+static char* cache_data;
+static unsigned cache_bshift;
 
 /*
  * Inode
  * - inode size = 64 bytes
  * - num of direct block refs = 10 blocks
+ * - files of up to INODE_INLINE_SZ bytes keep their data in the inode,
+ *   in the space of the block refs and of reserved[0-2] (INODE_INLINE
+ *   flag); they are moved to blocks when they grow larger
  */
 
 #define INODE_NUM_BLKS 10
 
-#define EXT_INODE_NUM_BLKS (BLOCK_SIZE / sizeof(unsigned int))
+#define EXT_INODE_NUM_BLKS(fs) (BLOCK_SIZE(fs) / sizeof(unsigned int))
 
 typedef struct fs_inode {
    fs_itype_t type;
    unsigned int size;
-   unsigned int blocks[INODE_NUM_BLKS];
-   unsigned int reserved[4]; // reserved[0] -> extending table block number
+   unsigned int blocks[INODE_NUM_BLKS]; // 0 -> a hole (read as zeros)
+   unsigned int reserved[3]; // reserved[0] -> extending table block number
+   unsigned int flags;
 } fs_inode_t;
 
+// the data is in the inode (files only)
+#define INODE_INLINE 0x1
+
+// some blocks of the file are not allocated yet (see fsi_delay_alloc)
+#define INODE_DELAYED 0x2
+
+// the blocks of the file may still be shared with a copy (see copy_inode)
+#define INODE_SHARED 0x4
+
+// number of a block not allocated yet
+#define DELAYED_BLK 0x80000000u
+
+#define BLK_IS_DELAYED(blk) ((blk) & DELAYED_BLK)
+
+#define INODE_INLINE_SZ ((INODE_NUM_BLKS + 3) * sizeof(unsigned int))
+
+#define INODE_IS_INLINE(inode) ((inode)->flags & INODE_INLINE)
+
+#define INODE_DATA(inode) ((char*)(inode)->blocks)
+
 typedef unsigned int fs_inode_ext_t;
 
 
@@ -50,7 +88,11 @@ typedef unsigned int fs_inode_ext_t;
  * - filename max size - 14 bytes (13 chars + '\0') defined in fs.h
  */
 
-#define DIR_PAGE_ENTRIES (BLOCK_SIZE / sizeof(fs_dentry_t))
+#define DIR_PAGE_ENTRIES(fs) (BLOCK_SIZE(fs) / sizeof(fs_dentry_t))
+
+// a directory has at most INODE_NUM_BLKS pages (320 entries with 512-byte
+// blocks, 40960 with 64 KB blocks); creating more entries fails
+#define DIR_MAX_ENTRIES(fs) (INODE_NUM_BLKS * DIR_PAGE_ENTRIES(fs))
 
 typedef struct dentry {
    char name[FS_MAX_FNAME_SZ];
@@ -60,26 +102,138 @@ typedef struct dentry {
 
 /*
  * File syste structure
- * - inode table size = 64 entries (8 blocks)
+ * - the block size and the sizes of the bitmaps and of the inode table
+ *   are chosen when the file system is formatted and recorded in the
+ *   superblock
  * 
  * Internal organization 
- *   - block 0        - free block bitmap
- *   - block 1        - free inode bitmap
- *   - block 2-9      - inode table (8 blocks)
- *   - block 10-(N-1) - data blocks, where N is the number of blocks
+ *   - block 0                  - superblock
+ *   - blocks bbmap_start...    - free block bitmap (bbmap_blks blocks)
+ *   - blocks ibmap_start...    - free inode bitmap (ibmap_blks blocks)
+ *   - blocks itab_start...     - inode table (itab_blks blocks)
+ *   - blocks data_start-(N-1)  - data blocks, where N is the number of blocks
+ */
+
+#define FS_MAGIC 0x534e4653
+
+// number of inodes in a block of the inode table
+#define ITAB_BLOCK_INODES(fs) (BLOCK_SIZE(fs) / sizeof(fs_inode_t))
+
+// largest number of inodes (limited by the inode ids in the directory entries)
+#define ITAB_MAX_INODES ((1 << (8 * sizeof(inodeid_t))) - 1)
+
+// superblock (block 0): the format parameters and summary counters
+typedef struct {
+   unsigned magic;
+   unsigned block_size;
+   unsigned num_blocks;
+   unsigned num_inodes;
+   unsigned bbmap_start, bbmap_blks;
+   unsigned ibmap_start, ibmap_blks;
+   unsigned itab_start, itab_blks;
+   unsigned data_start;
+   unsigned free_blocks;   // summary counters (exact only if 'clean')
+   unsigned free_inodes;
+   unsigned clean;         // 1 if the file system was unmounted
+} fs_super_t;
+
+
+/*
+ * Concurrency control
+ *
+ * Several server threads run file system operations at the same time.
+ * The following locks are used, and must always be acquired in this
+ * order to avoid deadlocks:
+ *
+ *   1. tree_lock: shared by every operation; taken exclusively by the
+ *      operations that walk or rearrange whole subtrees (copy, remove
+ *      of a directory, defrag, diskusage) and when a write must break
+ *      the block sharing left by a copy
+ *   2. inode locks: shared to read an inode and the blocks it owns,
+ *      exclusive to modify them; when an operation needs two inodes
+ *      they are locked in ascending inode number
+ *   3. inode_bmap_lock, then the block bitmap region locks in
+ *      ascending region number
+ *   4. meta_lock: serializes the storage of the metadata blocks
+ *   5. load_lock: serializes the loading of bitmap and inode table blocks
+ *   6. delay_lock: protects the count of delayed blocks
+ *   7. the cache lock (see the cache section)
  */
 
-#define ITAB_NUM_BLKS 8
+// number of independently locked regions of the block bitmap
+#define BMAP_REGIONS 8
+
+// region of the block bitmap containing block 'num'
+#define BMAP_REGION(fs,num) ((num) / (fs)->region_sz)
+
+typedef struct {
+   sthread_mon_t mon;
+   int readers;   // number of active readers
+   int writer;    // 1 if held exclusively
+   int wwait;     // number of waiting writers (they have priority)
+} fs_rwlock_t;
 
-#define ITAB_SIZE (ITAB_NUM_BLKS*BLOCK_SIZE / sizeof(fs_inode_t))
+typedef enum {FS_SHARED = 0, FS_EXCL = 1} fs_lock_mode_t;
+
+/*
+ * A block of the inode table loaded in memory, with the locks of its
+ * inodes. Blocks are loaded (through the cache) the first time one of
+ * their inodes is used and are kept until the file system is formatted.
+ * The inodes and the locks follow the structure (ITAB_BLOCK_INODES(fs) each).
+ */
+typedef struct {
+   fs_inode_t* inodes;
+   fs_rwlock_t* locks;
+   int dirty;              // must be stored with the metadata
+} fs_itab_block_t;
+
+/*
+ * A bitmap kept in memory; its blocks are loaded the first time they
+ * are used and only the blocks modified are stored
+ */
+typedef struct {
+   char* bits;
+   char* loaded;           // per block: 1 if loaded
+   char* dirty;            // per block: 1 if modified since stored
+   unsigned start;         // first block on disk
+   unsigned blks;          // number of blocks
+   unsigned shift;         // log2 of the number of bits in a block
+} fs_bmap_t;
 
 struct fs_ {
    blocks_t* blocks;
-   char inode_bmap [BLOCK_SIZE];
-   char blk_bmap [BLOCK_SIZE];
-   fs_inode_t inode_tab [ITAB_SIZE];
+   unsigned bsize;         // block size (a power of two)
+   unsigned bshift;        // log2 of the block size
+   fs_super_t sb;
+   fs_bmap_t inode_bmap;
+   fs_bmap_t blk_bmap;
+   fs_itab_block_t** itab; // loaded inode table blocks (NULL if not loaded)
+   int itab_dirty_all;     // every loaded block must be stored
+   fs_rwlock_t tree_lock;
+   sthread_mutex_t inode_bmap_lock;
+   sthread_mutex_t blk_bmap_lock [BMAP_REGIONS];
+   unsigned region_sz;     // blocks per bitmap region
+   sthread_mutex_t meta_lock;
+   sthread_mutex_t load_lock;
+   sthread_mutex_t delay_lock;
+   unsigned delayed;       // blocks written but not allocated yet
+   unsigned delay_next;    // to number the delayed blocks
 };
 
+/*
+ * Block geometry: offsets are split in block number and offset within
+ * the block with shifts, since the block size is a power of two
+ */
+
+#define BLOCK_SIZE(fs) ((fs)->bsize)
+
+#define BLOCK_NUM(fs,pos) ((pos) >> (fs)->bshift)
+
+#define BLOCK_OFF(fs,pos) ((pos) & ((fs)->bsize - 1))
+
+// number of blocks needed for 'pos' bytes
+#define OFFSET_TO_BLOCKS(fs,pos) (((pos) + (fs)->bsize - 1) >> (fs)->bshift)
+
 #define NOT_FS_INITIALIZER  1
                                
 /*
@@ -87,38 +241,230 @@ struct fs_ {
  */
                                 
                                 
-static void fsi_load_fsdata(fs_t* fs)
+static void fsi_rwlock_init(fs_rwlock_t* lock);
+static int fsi_inode_trylock(fs_t* fs, inodeid_t id);
+static void fsi_inode_unlock(fs_t* fs, inodeid_t id);
+
+
+static void fsi_bmap_alloc(fs_t* fs, fs_bmap_t* bm, unsigned start,
+   unsigned blks)
 {
-   blocks_t* bks = fs->blocks;
-   
-   // load free block bitmap from block 0
-   block_read(bks,0,fs->blk_bmap);
+   bm->bits = (char*) calloc(blks, BLOCK_SIZE(fs));
+   bm->loaded = (char*) calloc(blks, 1);
+   bm->dirty = (char*) calloc(blks, 1);
+   bm->start = start;
+   bm->blks = blks;
+   bm->shift = fs->bshift + 3;
+}
 
-   // load free inode bitmap from block 1
-   block_read(bks,1,fs->inode_bmap);
-   
-   // load inode table from blocks 2-9
-   for (int i = 0; i < ITAB_NUM_BLKS; i++) {
-      block_read(bks,i+2,&((char*)fs->inode_tab)[i*BLOCK_SIZE]);
+
+static void fsi_bmap_free(fs_bmap_t* bm)
+{
+   free(bm->bits);
+   free(bm->loaded);
+   free(bm->dirty);
+   memset(bm,0,sizeof(*bm));
+}
+
+
+/*
+ * fsi_alloc_fsdata: allocates the bitmaps and the (empty) table of
+ * loaded inode table blocks for the layout in the superblock; nothing
+ * is loaded yet
+ */
+static void fsi_alloc_fsdata(fs_t* fs)
+{
+   fsi_bmap_alloc(fs,&fs->blk_bmap,fs->sb.bbmap_start,fs->sb.bbmap_blks);
+   fsi_bmap_alloc(fs,&fs->inode_bmap,fs->sb.ibmap_start,fs->sb.ibmap_blks);
+   fs->itab = (fs_itab_block_t**) calloc(fs->sb.itab_blks, sizeof(fs_itab_block_t*));
+   fs->itab_dirty_all = 0;
+}
+
+
+static void fsi_free_fsdata(fs_t* fs)
+{
+   if (fs->itab != NULL) {
+      for (int i = 0; i < fs->sb.itab_blks; i++) {
+         free(fs->itab[i]);
+      }
+   }
+   free(fs->itab);
+   fs->itab = NULL;
+   fsi_bmap_free(&fs->blk_bmap);
+   fsi_bmap_free(&fs->inode_bmap);
+}
+
+
+/*
+ * fsi_bmap_load: loads a block of a bitmap (if another thread has not
+ * loaded it meanwhile)
+ */
+static void fsi_bmap_load(fs_t* fs, fs_bmap_t* bm, unsigned iblock)
+{
+   sthread_mutex_lock(fs->load_lock);
+   if (!bm->loaded[iblock]) {
+      block_read(fs->blocks,bm->start+iblock,&bm->bits[iblock*BLOCK_SIZE(fs)]);
+      // the block is complete before other threads can see it
+      __sync_synchronize();
+      bm->loaded[iblock] = 1;
+   }
+   sthread_mutex_unlock(fs->load_lock);
+}
+
+
+/*
+ * fsi_bmap: gets the bits of a bitmap, with the block holding bit
+ * 'num' loaded
+ */
+static inline char* fsi_bmap(fs_t* fs, fs_bmap_t* bm, unsigned num)
+{
+   unsigned iblock = num >> bm->shift;
+   if (!bm->loaded[iblock]) {
+      fsi_bmap_load(fs,bm,iblock);
+   }
+   return bm->bits;
+}
+
+// the inode and block bitmaps, ready to access bit 'num'
+#define IBMAP(fs,num) fsi_bmap((fs),&(fs)->inode_bmap,(num))
+#define BBMAP(fs,num) fsi_bmap((fs),&(fs)->blk_bmap,(num))
+
+// marks the bitmap block holding bit 'num' as modified
+#define BMAP_DIRTY(bm,num) ((bm).dirty[(num) >> (bm).shift] = 1)
+
+
+static void fsi_store_super(fs_t* fs)
+{
+   char* block = (char*) calloc(1, BLOCK_SIZE(fs));
+   memcpy(block,&fs->sb,sizeof(fs->sb));
+   block_write(fs->blocks,0,block);
+   free(block);
+}
+
+
+/*
+ * fsi_read_super: reads the superblock from block 0 of the storage
+ * - sb: the superblock (zeroed if the storage is not formatted) [out]
+ *   returns: 0 if successful, -1 if the storage is not formatted
+ */
+static int fsi_read_super(blocks_t* bks, fs_super_t* sb)
+{
+   char* block = (char*) malloc(block_size(bks));
+   block_read(bks,0,block);
+   memcpy(sb,block,sizeof(*sb));
+   free(block);
+   if (sb->magic != FS_MAGIC || sb->block_size != block_size(bks) ||
+      sb->num_blocks != block_num_blocks(bks)) {
+      // not formatted (or by another version)
+      memset(sb,0,sizeof(*sb));
+      return -1;
+   }
+   return 0;
+}
+
+
+/*
+ * fsi_load_fsdata: mounts the file system in the storage, reading
+ * only the superblock
+ *   returns: 0 if successful, -1 if the storage is not formatted
+ */
+static int fsi_load_fsdata(fs_t* fs)
+{
+   if (fsi_read_super(fs->blocks,&fs->sb) < 0) {
+      return -1;
    }
+
+   // the bitmaps and the inode table are loaded a block at a time,
+   // when they are used
+   fsi_alloc_fsdata(fs);
+   return 0;
 #define NOT_FS_INITIALIZER  1  //file system is already initialized, subsequent block acess will be delayed using a sleep function.
 }
 
 
+static void fsi_store_bmap(fs_t* fs, fs_bmap_t* bm)
+{
+   for (int i = 0; i < bm->blks; i++) {
+      if (bm->dirty[i]) {
+         bm->dirty[i] = 0;
+         block_write(fs->blocks,bm->start+i,&bm->bits[i*BLOCK_SIZE(fs)]);
+      }
+   }
+}
+
+
 static void fsi_store_fsdata(fs_t* fs)
 {
-   blocks_t* bks = fs->blocks;
- 
-   // store free block bitmap to block 0
-   block_write(bks,0,fs->blk_bmap);
+   sthread_mutex_lock(fs->meta_lock);
 
-   // store free inode bitmap to block 1
-   block_write(bks,1,fs->inode_bmap);
+   // store the bitmap blocks modified; the flags are cleared first so
+   // a change made meanwhile is stored later
+   fsi_store_bmap(fs,&fs->blk_bmap);
+   fsi_store_bmap(fs,&fs->inode_bmap);
    
-   // store inode table to blocks 2-9
-   for (int i = 0; i < ITAB_NUM_BLKS; i++) {
-      block_write(bks,i+2,&((char*)fs->inode_tab)[i*BLOCK_SIZE]);
+   // store the inode table blocks modified (through the cache)
+   int all = fs->itab_dirty_all;
+   fs->itab_dirty_all = 0;
+   for (int i = 0; i < fs->sb.itab_blks; i++) {
+      fs_itab_block_t* blk = fs->itab[i];
+      if (blk != NULL && (all || blk->dirty)) {
+         blk->dirty = 0;
+         writeIn_cache(fs,fs->sb.itab_start+i,(char*)blk->inodes);
+      }
+   }
+
+   sthread_mutex_unlock(fs->meta_lock);
+}
+
+
+/*
+ * fsi_itab_load: loads a block of the inode table (if another thread
+ * has not loaded it meanwhile)
+ */
+static fs_itab_block_t* fsi_itab_load(fs_t* fs, unsigned iblock)
+{
+   sthread_mutex_lock(fs->load_lock);
+   fs_itab_block_t* blk = fs->itab[iblock];
+   if (blk == NULL) {
+      // the structure, the locks and the inodes in a single allocation
+      unsigned n = ITAB_BLOCK_INODES(fs);
+      blk = (fs_itab_block_t*) malloc(sizeof(fs_itab_block_t) +
+         n * sizeof(fs_rwlock_t) + BLOCK_SIZE(fs));
+      blk->locks = (fs_rwlock_t*) (blk + 1);
+      blk->inodes = (fs_inode_t*) (blk->locks + n);
+      readFrom_cache(fs,fs->sb.itab_start+iblock,(char*)blk->inodes);
+      for (int i = 0; i < n; i++) {
+         fsi_rwlock_init(&blk->locks[i]);
+      }
+      blk->dirty = 0;
+      // the block is complete before other threads can see it
+      __sync_synchronize();
+      fs->itab[iblock] = blk;
+   }
+   sthread_mutex_unlock(fs->load_lock);
+   return blk;
+}
+
+
+/*
+ * fsi_itab_block: gets the (loaded) inode table block of an inode
+ */
+static inline fs_itab_block_t* fsi_itab_block(fs_t* fs, inodeid_t id)
+{
+   fs_itab_block_t* blk = fs->itab[id / ITAB_BLOCK_INODES(fs)];
+   if (blk == NULL) {
+      blk = fsi_itab_load(fs, id / ITAB_BLOCK_INODES(fs));
    }
+   return blk;
+}
+
+
+/*
+ * fsi_inode: gets an inode, loading its inode table block if needed
+ */
+static inline fs_inode_t* fsi_inode(fs_t* fs, inodeid_t id)
+{
+   return &fsi_itab_block(fs,id)->inodes[id % ITAB_BLOCK_INODES(fs)];
 }
 
 
@@ -133,10 +479,10 @@ static void fsi_store_fsdata(fs_t* fs)
 #define BMAP_ISSET(bmap,num) ((bmap)[(num)/8]&(0x1<<((num)%8)))
 
 
-static int fsi_bmap_find_free(char* bmap, int size, unsigned* free)
+static int fsi_bmap_find_free(fs_t* fs, fs_bmap_t* bm, int size, unsigned* free)
 {
    for (int i = 0; i < size; i++) {
-      if (!BMAP_ISSET(bmap,i)) {
+      if (!BMAP_ISSET(fsi_bmap(fs,bm,i),i)) {
          *free = i;
          return 1;
       }
@@ -144,372 +490,1717 @@ static int fsi_bmap_find_free(char* bmap, int size, unsigned* free)
    return 0;
 }
 
-static void fsi_dump_bmap(char* bmap,int size)
-{	
-	int i;
-	for(i=0;i<size;++i){
-		if(BMAP_ISSET(bmap,i))
-			printf("1.");
-		else
-			printf("0.");
-		if(i>0 && (i+1)%32==0)
-			printf("\n");
-	}
-}
-
 /*
- * Other internal file system macros and functions
+ * fsi_bcount_take: takes 'n' blocks from the count of free blocks; the
+ *   blocks taken are then allocated in the bitmap (maybe later, see
+ *   fsi_delay_alloc), which always has them free
+ *   returns: 1 if there were 'n' free blocks, 0 otherwise
  */
+static int fsi_bcount_take(fs_t* fs, unsigned n)
+{
+   unsigned free;
+   do {
+      free = fs->sb.free_blocks;
+      if (free < n) {
+         return 0;
+      }
+   } while (!__sync_bool_compare_and_swap(&fs->sb.free_blocks,free,free-n));
+   return 1;
+}
 
-#define MIN(a,b) ((a)<=(b)?(a):(b))
-                                
-#define MAX(a,b) ((a)>=(b)?(a):(b))
-                                
-#define OFFSET_TO_BLOCKS(pos) ((pos)/BLOCK_SIZE+(((pos)%BLOCK_SIZE>0)?1:0))
 
-                                
-static void fsi_inode_init(fs_inode_t* inode, fs_itype_t type)
+/*
+ * fsi_balloc: allocates a free block, scanning the block bitmap one
+ * region at a time so that only that region is locked
+ *   returns: 1 if a block was allocated, 0 otherwise
+ */
+static int fsi_balloc(fs_t* fs, unsigned* blk)
 {
-   int i;
-   
-   inode->type = type;
-   inode->size = 0;
-   for (i = 0; i < INODE_NUM_BLKS; i++) {
-      inode->blocks[i] = 0;
+   unsigned num_blocks = block_num_blocks(fs->blocks);
+   if (!fsi_bcount_take(fs,1)) {
+      return 0;
    }
-   
-   for (i = 0; i < 4; i++) {
-	   inode->reserved[i] = 0;
+   for (int r = 0; r < BMAP_REGIONS; r++) {
+      unsigned first = r * fs->region_sz;
+      unsigned last = first + fs->region_sz;
+      if (last > num_blocks) {
+         last = num_blocks;
+      }
+      sthread_mutex_lock(fs->blk_bmap_lock[r]);
+      for (unsigned i = first; i < last; i++) {
+         if (!BMAP_ISSET(BBMAP(fs,i),i)) {
+            BMAP_SET(fs->blk_bmap.bits,i);
+            BMAP_DIRTY(fs->blk_bmap,i);
+            sthread_mutex_unlock(fs->blk_bmap_lock[r]);
+            *blk = i;
+            return 1;
+         }
+      }
+      sthread_mutex_unlock(fs->blk_bmap_lock[r]);
    }
+   __sync_fetch_and_add(&fs->sb.free_blocks,1);
+   return 0;
 }
 
 
-static int fsi_dir_search(fs_t* fs, inodeid_t dir, char* file, 
-   inodeid_t* fileid)
+// finds 'n' free blocks in a row between 'from' and 'to'
+static int fsi_bmap_find_run(fs_t* fs, unsigned from, unsigned to, int n,
+   unsigned* start)
 {
-   fs_dentry_t page[DIR_PAGE_ENTRIES];
-   fs_inode_t* idir = &fs->inode_tab[dir];
-   int num = idir->size / sizeof(fs_dentry_t);
-   int iblock = 0;
-
-   while (num > 0) {
-      readFrom_cache(fs,idir->blocks[iblock++],(char*)page);
-      for (int i = 0; i < DIR_PAGE_ENTRIES && num > 0; i++, num--) {
-         if (strcmp(page[i].name,file) == 0) {
-            *fileid = page[i].inodeid;
-            return 0;
-         }
+   int len = 0;
+   for (unsigned i = from; i < to; i++) {
+      if (BMAP_ISSET(BBMAP(fs,i),i)) {
+         len = 0;
+      } else if (++len == n) {
+         *start = i + 1 - n;
+         return 1;
       }
    }
-   return -1;
+   return 0;
 }
 
 
 /*
- * File system interface functions
+ * fsi_balloc_extent: allocates the blocks 'first' to 'first'+'n'-1 of
+ *   a file, in a row after the closest allocated block before them if
+ *   possible (an extent); the blocks must have been taken with
+ *   fsi_bcount_take
  */
+static void fsi_balloc_extent(fs_t* fs, fs_inode_t* inode, int first, int n)
+{
+   unsigned num_blocks = fs->sb.num_blocks;
+   unsigned goal = fs->sb.data_start;
+   unsigned start;
+
+   // holes and delayed blocks have no place to follow
+   for (int i = first - 1; i >= 0; i--) {
+      if (inode->blocks[i] != 0 && !BLK_IS_DELAYED(inode->blocks[i])) {
+         goal = inode->blocks[i] + 1;
+         break;
+      }
+   }
 
+   // the extent may span several regions, all of them are locked
+   for (int r = 0; r < BMAP_REGIONS; r++) {
+      sthread_mutex_lock(fs->blk_bmap_lock[r]);
+   }
+   if (fsi_bmap_find_run(fs,goal,num_blocks,n,&start) ||
+      fsi_bmap_find_run(fs,fs->sb.data_start,num_blocks,n,&start)) {
+      for (int i = 0; i < n; i++) {
+         inode->blocks[first+i] = start + i;
+      }
+   } else {
+      // the free space is fragmented, take the free blocks one by one
+      unsigned blk = fs->sb.data_start;
+      for (int i = 0; i < n; i++, blk++) {
+         while (BMAP_ISSET(BBMAP(fs,blk),blk)) {
+            blk++;
+         }
+         inode->blocks[first+i] = blk;
+      }
+   }
+   for (int i = 0; i < n; i++) {
+      BMAP_SET(fs->blk_bmap.bits,inode->blocks[first+i]);
+      BMAP_DIRTY(fs->blk_bmap,inode->blocks[first+i]);
+   }
+   for (int r = BMAP_REGIONS - 1; r >= 0; r--) {
+      sthread_mutex_unlock(fs->blk_bmap_lock[r]);
+   }
+}
 
-void io_delay_on(int disk_delay);
 
-fs_t* fs_new(unsigned num_blocks, int disk_delay)
+/*
+ * fsi_bfree: releases a block in the block bitmap
+ */
+static void fsi_bfree(fs_t* fs, unsigned blk)
 {
-   fs_t* fs = (fs_t*) malloc(sizeof(fs_t));
-   fs->blocks = block_new(num_blocks,BLOCK_SIZE);
-   fsi_load_fsdata(fs);
-   io_delay_on(disk_delay);
-   return fs;
+   sthread_mutex_t lock = fs->blk_bmap_lock[BMAP_REGION(fs,blk)];
+   sthread_mutex_lock(lock);
+   BMAP_CLR(BBMAP(fs,blk),blk);
+   BMAP_DIRTY(fs->blk_bmap,blk);
+   sthread_mutex_unlock(lock);
+   __sync_fetch_and_add(&fs->sb.free_blocks,1);
 }
 
 
-int fs_format(fs_t* fs)
+/*
+ * fsi_bfree_blocks: releases 'n' blocks in the block bitmap at once
+ *   (the extents of a truncated file)
+ */
+static void fsi_bfree_blocks(fs_t* fs, unsigned* blks, int n)
 {
-   if (fs == NULL) {
-      printf("[fs] argument is null.\n");
-      return -1;
+   if (n == 0) {
+      return;
    }
-
-   // erase all blocks
-   char null_block[BLOCK_SIZE];
-   memset(null_block,0,sizeof(null_block));
-   for (int i = 0; i < block_num_blocks(fs->blocks); i++) {
-      block_write(fs->blocks,i,null_block);
-      BMAP_CLR(fs->blk_bmap,i);
+   for (int r = 0; r < BMAP_REGIONS; r++) {
+      sthread_mutex_lock(fs->blk_bmap_lock[r]);
    }
-
-	for(int i=0;i<ITAB_SIZE;++i)
-		BMAP_CLR(fs->inode_bmap,i);
-	
-	
-   // reserve file system meta data blocks
-   BMAP_SET(fs->blk_bmap,0);
-   BMAP_SET(fs->blk_bmap,1);
-   for (int i = 0; i < ITAB_NUM_BLKS; i++) {
-      BMAP_SET(fs->blk_bmap,i+2);
+   for (int i = 0; i < n; i++) {
+      BMAP_CLR(BBMAP(fs,blks[i]),blks[i]);
+      BMAP_DIRTY(fs->blk_bmap,blks[i]);
    }
-
-   // reserve inodes 0 (will never be used) and 1 (the root)
-   BMAP_SET(fs->inode_bmap,0);
-   BMAP_SET(fs->inode_bmap,1);
-   fsi_inode_init(&fs->inode_tab[1],FS_DIR);
-	
-   // save the file system metadata
-   fsi_store_fsdata(fs);
-   cache = fs_new_cache(fs);
-   return 0;
+   for (int r = BMAP_REGIONS - 1; r >= 0; r--) {
+      sthread_mutex_unlock(fs->blk_bmap_lock[r]);
+   }
+   __sync_fetch_and_add(&fs->sb.free_blocks,n);
 }
 
 
-int fs_get_attrs(fs_t* fs, inodeid_t file, fs_file_attrs_t* attrs)
+/*
+ * Delayed allocation
+ *
+ * The blocks added to a file by a write are not allocated at once:
+ * they are counted as taken and get a temporary number (with
+ * DELAYED_BLK set), under which their data is kept in the cache (the
+ * cache never writes back or replaces these blocks). They are allocated
+ * together, as extents following the file's previous blocks, when:
+ * - the writer needs more delayed blocks than are available (at most
+ *   DELAY_MAX in the file system, a part of the cache); its own
+ *   delayed blocks are allocated first, then those of the files not
+ *   in use (see fsi_delay_reclaim)
+ * - the write-back thread of the cache runs, for the files not in use
+ * - a whole subtree is walked or rearranged (copy, defrag, diskusage)
+ *   or the file system is unmounted (see fsi_delay_alloc_all)
+ * Files built by many small appends then get contiguous blocks.
+ */
+
+// the n-th delayed block number (never -1, a free cache entry)
+#define DELAYED_NUM(n) (DELAYED_BLK | ((n) & 0x3fffffff))
+
+#define DELAY_MAX (CACHE_SIZE/4)
+
+
+/*
+ * fsi_delay_alloc: allocates the delayed blocks of a file (locked
+ *   exclusively, or the tree is)
+ */
+static void fsi_delay_alloc(fs_t* fs, fs_inode_t* inode)
 {
-   if (fs == NULL || file >= ITAB_SIZE || attrs == NULL) {
-      dprintf("[fs_get_attrs] malformed arguments.\n");
-      return -1;
+   if (!(inode->flags & INODE_DELAYED)) {
+      return;
    }
 
-   if (!BMAP_ISSET(fs->inode_bmap,file)) {
-      dprintf("[fs_get_attrs] inode is not being used.\n");
-      return -1;
-   }
+   // an extent for each run of delayed blocks (holes may split them)
+   int total = 0;
+   unsigned delayed[INODE_NUM_BLKS];
+   for (int first = 0; first < INODE_NUM_BLKS; ) {
+      int n = 0;
+      while (first + n < INODE_NUM_BLKS && BLK_IS_DELAYED(inode->blocks[first+n])) {
+         delayed[n] = inode->blocks[first+n];
+         n++;
+      }
+      if (n == 0) {
+         first++;
+         continue;
+      }
 
-   fs_inode_t* inode = &fs->inode_tab[file];
-   attrs->inodeid = file;
-   attrs->type = inode->type;
-   attrs->size = inode->size;
-   switch (inode->type) {
-      case FS_DIR:
-         attrs->num_entries = inode->size / sizeof(fs_dentry_t);
-         break;
-      case FS_FILE:
-         attrs->num_entries = -1;
-         break;
-      default:
-         dprintf("[fs_get_attrs] fatal error - invalid inode.\n");
-         exit(-1);
+      // the data in the cache moves to the blocks allocated
+      fsi_balloc_extent(fs,inode,first,n);
+      for (int i = 0; i < n; i++) {
+         cache_rename(delayed[i],inode->blocks[first+i]);
+      }
+      first += n;
+      total += n;
    }
-   return 0;
+   inode->flags &= ~INODE_DELAYED;
+
+   sthread_mutex_lock(fs->delay_lock);
+   fs->delayed -= total;
+   sthread_mutex_unlock(fs->delay_lock);
 }
 
 
-int fs_lookup(fs_t* fs, char* file, inodeid_t* fileid)
+/*
+ * fsi_delay_alloc_all: allocates the delayed blocks of every file (the
+ *   tree is locked exclusively)
+ */
+static void fsi_delay_alloc_all(fs_t* fs)
 {
+   unsigned n = ITAB_BLOCK_INODES(fs);
+   for (int i = 0; i < fs->sb.itab_blks; i++) {
+      fs_itab_block_t* blk = fs->itab[i];
+      for (int j = 0; blk != NULL && j < n; j++) {
+         if (blk->inodes[j].flags & INODE_DELAYED) {
+            fsi_delay_alloc(fs,&blk->inodes[j]);
+            blk->dirty = 1;
+         }
+      }
+   }
+}
 
-char *token;
-char line[MAX_PATH_NAME_SIZE]; 
-char *search = "/";
-int i=0;
-int dir=0;
-   if (fs==NULL || file==NULL ) {
-      dprintf("[fs_lookup] malformed arguments.\n");
+
+/*
+ * fsi_delay_reclaim: allocates the delayed blocks of the files not in
+ *   use (their inodes are not locked), giving their part of the budget
+ *   back (the tree is locked)
+ */
+static void fsi_delay_reclaim(fs_t* fs)
+{
+   unsigned n = ITAB_BLOCK_INODES(fs);
+   for (int i = 0; i < fs->sb.itab_blks && fs->delayed > 0; i++) {
+      fs_itab_block_t* blk = fs->itab[i];
+      for (int j = 0; blk != NULL && j < n; j++) {
+         // the flag is checked again by fsi_delay_alloc, under the lock
+         if ((blk->inodes[j].flags & INODE_DELAYED) && fsi_inode_trylock(fs,i*n+j)) {
+            fsi_delay_alloc(fs,&blk->inodes[j]);
+            fsi_inode_unlock(fs,i*n+j);
+         }
+      }
+   }
+}
+
+
+/*
+ * fsi_delay_take: takes 'n' delayed blocks for a file; if there are not
+ *   enough, the file's delayed blocks are allocated first, then those of
+ *   the files not in use
+ *   returns: 1 if the blocks were taken, 0 otherwise (they should be
+ *   allocated at once)
+ */
+static int fsi_delay_take(fs_t* fs, fs_inode_t* inode, unsigned n)
+{
+   if (n > DELAY_MAX) {
+      return 0;
+   }
+   for (int retry = 0; retry < 3; retry++) {
+      sthread_mutex_lock(fs->delay_lock);
+      int full = fs->delayed + n > DELAY_MAX;
+      int taken = !full && fsi_bcount_take(fs,n);
+      if (taken) {
+         fs->delayed += n;
+      }
+      sthread_mutex_unlock(fs->delay_lock);
+      if (taken || !full) {
+         return taken;
+      }
+      if (inode->flags & INODE_DELAYED) {
+         fsi_delay_alloc(fs,inode);
+      } else {
+         fsi_delay_reclaim(fs);
+      }
+   }
+   return 0;
+}
+
+
+/*
+ * fsi_delay_drop: discards the delayed blocks of a file being removed
+ */
+static void fsi_delay_drop(fs_t* fs, fs_inode_t* inode)
+{
+   if (!(inode->flags & INODE_DELAYED)) {
+      return;
+   }
+   int n = 0;
+   for (int i = 0; i < INODE_NUM_BLKS; i++) {
+      if (BLK_IS_DELAYED(inode->blocks[i])) {
+         cache_clean(inode->blocks[i]);
+         inode->blocks[i] = 0;
+         n++;
+      }
+   }
+   inode->flags &= ~INODE_DELAYED;
+
+   sthread_mutex_lock(fs->delay_lock);
+   fs->delayed -= n;
+   sthread_mutex_unlock(fs->delay_lock);
+   __sync_fetch_and_add(&fs->sb.free_blocks,n);
+}
+
+
+/*
+ * fsi_ialloc: allocates a free inode
+ *   returns: 1 if an inode was allocated, 0 otherwise
+ */
+static int fsi_ialloc(fs_t* fs, unsigned* inode)
+{
+   sthread_mutex_lock(fs->inode_bmap_lock);
+   int found = fs->sb.free_inodes > 0 &&
+      fsi_bmap_find_free(fs,&fs->inode_bmap,fs->sb.num_inodes,inode);
+   if (found) {
+      BMAP_SET(fs->inode_bmap.bits,*inode);
+      BMAP_DIRTY(fs->inode_bmap,*inode);
+      fs->sb.free_inodes--;
+   }
+   sthread_mutex_unlock(fs->inode_bmap_lock);
+   if (found) {
+      // the new inode is initialized by the caller
+      fsi_itab_block(fs,*inode)->dirty = 1;
+   }
+   return found;
+}
+
+
+/*
+ * fsi_ifree: releases an inode in the inode bitmap
+ */
+static void fsi_ifree(fs_t* fs, unsigned inode)
+{
+   sthread_mutex_lock(fs->inode_bmap_lock);
+   BMAP_CLR(IBMAP(fs,inode),inode);
+   BMAP_DIRTY(fs->inode_bmap,inode);
+   fs->sb.free_inodes++;
+   sthread_mutex_unlock(fs->inode_bmap_lock);
+}
+
+
+static void fsi_dump_bmap(char* bmap,int size)
+{	
+	int i;
+	for(i=0;i<size;++i){
+		if(BMAP_ISSET(bmap,i))
+			printf("1.");
+		else
+			printf("0.");
+		if(i>0 && (i+1)%32==0)
+			printf("\n");
+	}
+}
+
+/*
+ * Reader-writer locks (built on sthread monitors)
+ */
+
+static void fsi_rwlock_init(fs_rwlock_t* lock)
+{
+   lock->mon = sthread_monitor_init();
+   lock->readers = 0;
+   lock->writer = 0;
+   lock->wwait = 0;
+}
+
+
+static void fsi_rwlock_lock(fs_rwlock_t* lock, fs_lock_mode_t mode)
+{
+   sthread_monitor_enter(lock->mon);
+   if (mode == FS_EXCL) {
+      lock->wwait++;
+      while (lock->writer || lock->readers > 0) {
+         sthread_monitor_wait(lock->mon);
+      }
+      lock->wwait--;
+      lock->writer = 1;
+   } else {
+      while (lock->writer || lock->wwait > 0) {
+         sthread_monitor_wait(lock->mon);
+      }
+      lock->readers++;
+   }
+   sthread_monitor_exit(lock->mon);
+}
+
+
+/*
+ * fsi_rwlock_trylock: locks exclusively if the lock is free
+ *   returns: 1 if locked, 0 otherwise
+ */
+static int fsi_rwlock_trylock(fs_rwlock_t* lock)
+{
+   sthread_monitor_enter(lock->mon);
+   int locked = !lock->writer && lock->readers == 0;
+   if (locked) {
+      lock->writer = 1;
+   }
+   sthread_monitor_exit(lock->mon);
+   return locked;
+}
+
+
+static void fsi_rwlock_unlock(fs_rwlock_t* lock)
+{
+   sthread_monitor_enter(lock->mon);
+   if (lock->writer) {
+      lock->writer = 0;
+   } else {
+      lock->readers--;
+   }
+   sthread_monitor_signalall(lock->mon);
+   sthread_monitor_exit(lock->mon);
+}
+
+
+/*
+ * The inode table blocks modified are found through the locks: an
+ * inode is only modified while it is locked exclusively (or the whole
+ * tree is), so its block is marked when the lock is taken and released
+ */
+
+static void fsi_tree_lock(fs_t* fs, fs_lock_mode_t mode)
+{
+   fsi_rwlock_lock(&fs->tree_lock,mode);
+   if (mode == FS_EXCL) {
+      fs->itab_dirty_all = 1;
+   }
+}
+
+
+static void fsi_tree_unlock(fs_t* fs)
+{
+   if (fs->tree_lock.writer) {
+      fs->itab_dirty_all = 1;
+   }
+   fsi_rwlock_unlock(&fs->tree_lock);
+}
+
+
+static void fsi_inode_lock(fs_t* fs, inodeid_t id, fs_lock_mode_t mode)
+{
+   fs_itab_block_t* blk = fsi_itab_block(fs,id);
+   fsi_rwlock_lock(&blk->locks[id % ITAB_BLOCK_INODES(fs)],mode);
+   if (mode == FS_EXCL) {
+      blk->dirty = 1;
+   }
+}
+
+
+/*
+ * fsi_inode_trylock: locks an inode exclusively if it is not in use
+ * (it may be called out of the lock order)
+ *   returns: 1 if locked, 0 otherwise
+ */
+static int fsi_inode_trylock(fs_t* fs, inodeid_t id)
+{
+   fs_itab_block_t* blk = fsi_itab_block(fs,id);
+   if (!fsi_rwlock_trylock(&blk->locks[id % ITAB_BLOCK_INODES(fs)])) {
+      return 0;
+   }
+   blk->dirty = 1;
+   return 1;
+}
+
+
+static void fsi_inode_unlock(fs_t* fs, inodeid_t id)
+{
+   fs_itab_block_t* blk = fsi_itab_block(fs,id);
+   fs_rwlock_t* lock = &blk->locks[id % ITAB_BLOCK_INODES(fs)];
+   if (lock->writer) {
+      blk->dirty = 1;
+   }
+   fsi_rwlock_unlock(lock);
+}
+
+
+/*
+ * fsi_inode_lock2: locks two inodes in ascending inode number; if both
+ * are the same inode it is locked once, exclusively if any mode is
+ */
+static void fsi_inode_lock2(fs_t* fs, inodeid_t a, fs_lock_mode_t amode,
+   inodeid_t b, fs_lock_mode_t bmode)
+{
+   if (a == b) {
+      fsi_inode_lock(fs,a,(amode == FS_EXCL || bmode == FS_EXCL) ? FS_EXCL : FS_SHARED);
+   } else if (a < b) {
+      fsi_inode_lock(fs,a,amode);
+      fsi_inode_lock(fs,b,bmode);
+   } else {
+      fsi_inode_lock(fs,b,bmode);
+      fsi_inode_lock(fs,a,amode);
+   }
+}
+
+
+static void fsi_inode_unlock2(fs_t* fs, inodeid_t a, inodeid_t b)
+{
+   fsi_inode_unlock(fs,a);
+   if (a != b) {
+      fsi_inode_unlock(fs,b);
+   }
+}
+
+
+/*
+ * Other internal file system macros and functions
+ */
+
+#define MIN(a,b) ((a)<=(b)?(a):(b))
+                                
+#define MAX(a,b) ((a)>=(b)?(a):(b))
+                                
+                                
+static void fsi_inode_init(fs_inode_t* inode, fs_itype_t type)
+{
+   int i;
+   
+   inode->type = type;
+   inode->size = 0;
+   for (i = 0; i < INODE_NUM_BLKS; i++) {
+      inode->blocks[i] = 0;
+   }
+   
+   for (i = 0; i < 3; i++) {
+	   inode->reserved[i] = 0;
+   }
+
+   // new files start with their (empty) data in the inode
+   inode->flags = (type == FS_FILE) ? INODE_INLINE : 0;
+}
+
+
+/*
+ * fsi_dir_lookup: searches a directory for an entry by name
+ *   - pos: if not NULL, receives the index of the entry in the directory
+ *   returns: 0 if the entry was found, -1 otherwise
+ */
+static int fsi_dir_lookup(fs_t* fs, inodeid_t dir, char* file, 
+   inodeid_t* fileid, int* pos)
+{
+   fs_inode_t* idir = fsi_inode(fs,dir);
+   int num = idir->size / sizeof(fs_dentry_t);
+   int iblock = 0;
+   int index = 0;
+
+   while (num > 0) {
+      fs_dentry_t* page = (fs_dentry_t*)cache_get(fs,idir->blocks[iblock++],CACHE_READ);
+      for (int i = 0; i < DIR_PAGE_ENTRIES(fs) && num > 0; i++, num--, index++) {
+         if (strcmp(page[i].name,file) == 0) {
+            *fileid = page[i].inodeid;
+            if (pos != NULL) {
+               *pos = index;
+            }
+            cache_put((char*)page,0);
+            return 0;
+         }
+      }
+      cache_put((char*)page,0);
+   }
+   return -1;
+}
+
+
+static int fsi_dir_search(fs_t* fs, inodeid_t dir, char* file, 
+   inodeid_t* fileid)
+{
+   return fsi_dir_lookup(fs,dir,file,fileid,NULL);
+}
+
+
+/*
+ * fsi_dir_entries: reads the entries of a directory, a page at a time
+ *   - num: receives the number of entries
+ *   returns: the entries (freed by the caller), NULL if there are none
+ */
+static fs_dentry_t* fsi_dir_entries(fs_t* fs, inodeid_t dir, int* num)
+{
+   fs_inode_t* idir = fsi_inode(fs,dir);
+   *num = idir->size / sizeof(fs_dentry_t);
+   if (*num == 0) {
+      return NULL;
+   }
+   fs_dentry_t* entries = (fs_dentry_t*) malloc(*num * sizeof(fs_dentry_t));
+   for (int i = 0, iblock = 0; i < *num; iblock++) {
+      int n = MIN(*num - i, DIR_PAGE_ENTRIES(fs));
+      char* page = cache_get(fs,idir->blocks[iblock],CACHE_READ);
+      memcpy(&entries[i],page,n * sizeof(fs_dentry_t));
+      cache_put(page,0);
+      i += n;
+   }
+   return entries;
+}
+
+
+/*
+ * File system interface functions
+ */
+
+
+void io_delay_on(int disk_delay);
+
+/*
+ * fsi_block_shift: log2 of a block size
+ *   returns: the log2 or -1 if the block size is not supported
+ */
+static int fsi_block_shift(unsigned block_size)
+{
+   int shift = 0;
+   while ((1u << shift) < block_size && (1u << shift) < FS_MAX_BLOCK_SIZE) {
+      shift++;
+   }
+   if ((1u << shift) != block_size || block_size < FS_MIN_BLOCK_SIZE) {
+      return -1;
+   }
+   return shift;
+}
+
+
+static fs_t* fsi_new(blocks_t* blocks)
+{
+   fs_t* fs = (fs_t*) malloc(sizeof(fs_t));
+   unsigned num_blocks = block_num_blocks(blocks);
+   fs->blocks = blocks;
+   fs->bsize = block_size(blocks);
+   fs->bshift = fsi_block_shift(fs->bsize);
+
+   fsi_rwlock_init(&fs->tree_lock);
+   fs->inode_bmap_lock = sthread_mutex_init();
+   fs->region_sz = (num_blocks + BMAP_REGIONS - 1) / BMAP_REGIONS;
+   for (int r = 0; r < BMAP_REGIONS; r++) {
+      fs->blk_bmap_lock[r] = sthread_mutex_init();
+   }
+   fs->meta_lock = sthread_mutex_init();
+   fs->load_lock = sthread_mutex_init();
+   fs->delay_lock = sthread_mutex_init();
+   fs->delayed = 0;
+   fs->delay_next = 0;
+   fs->itab = NULL;
+   memset(&fs->blk_bmap,0,sizeof(fs->blk_bmap));
+   memset(&fs->inode_bmap,0,sizeof(fs->inode_bmap));
+
+   // the inode table is read through the cache
+   cache = fs_new_cache(fs);
+   return fs;
+}
+
+
+fs_t* fs_new(unsigned num_blocks, unsigned block_size, int disk_delay)
+{
+   if (fsi_block_shift(block_size) < 0) {
+      printf("[fs] block size %u is not supported.\n", block_size);
+      return NULL;
+   }
+   fs_t* fs = fsi_new(block_new(num_blocks,block_size));
+   fsi_load_fsdata(fs);
+   io_delay_on(disk_delay);
+   return fs;
+}
+
+
+// number of bits set in the bitmap (loading all of its blocks)
+static unsigned fsi_bmap_count(fs_t* fs, fs_bmap_t* bm, unsigned size)
+{
+   unsigned count = 0;
+   for (unsigned i = 0; i < size; i++) {
+      if (BMAP_ISSET(fsi_bmap(fs,bm,i),i)) {
+         count++;
+      }
+   }
+   return count;
+}
+
+
+fs_t* fs_load(char* file, int disk_delay)
+{
+   blocks_t* blocks = block_load(file);
+   if (blocks == NULL) {
+      return NULL;
+   }
+   if (fsi_block_shift(block_size(blocks)) < 0) {
+      printf("[fs] the image '%s' has an unsupported block size.\n", file);
+      block_free(blocks);
+      return NULL;
+   }
+   // checked before the file system (and its cache) is set up
+   fs_super_t sb;
+   if (fsi_read_super(blocks,&sb) < 0) {
+      printf("[fs] the image '%s' is not formatted.\n", file);
+      block_free(blocks);
+      return NULL;
+   }
+   fs_t* fs = fsi_new(blocks);
+   fsi_load_fsdata(fs);
+
+   if (!fs->sb.clean) {
+      // the counters were not stored, count the bitmaps
+      printf("[fs] the image '%s' was not unmounted, checking it.\n", file);
+      fs->sb.free_blocks = fs->sb.num_blocks -
+         fsi_bmap_count(fs,&fs->blk_bmap,fs->sb.num_blocks);
+      fs->sb.free_inodes = fs->sb.num_inodes -
+         fsi_bmap_count(fs,&fs->inode_bmap,fs->sb.num_inodes);
+   }
+
+   // until it is unmounted, the counters on disk are not exact
+   fs->sb.clean = 0;
+   fsi_store_super(fs);
+   io_delay_on(disk_delay);
+   return fs;
+}
+
+
+int fs_unmount(fs_t* fs, char* file)
+{
+   if (fs == NULL) {
+      printf("[fs] argument is null.\n");
+      return -1;
+   }
+
+   // wait for the operations running, no other one starts
+   fsi_tree_lock(fs,FS_EXCL);
+   fsi_delay_alloc_all(fs);
+   fsi_store_fsdata(fs);
+   cache_flush(fs);
+   fs->sb.clean = 1;
+   fsi_store_super(fs);
+   if (file != NULL && block_store(fs->blocks,file) < 0) {
+      printf("[fs] error storing the image '%s'.\n", file);
       return -1;
    }
+   return 0;
+}
+
+
+// number of blocks needed for 'bits' bits
+#define BITS_TO_BLOCKS(fs,bits) (((bits) + 8*BLOCK_SIZE(fs) - 1) / (8*BLOCK_SIZE(fs)))
+
+int fs_format(fs_t* fs, unsigned num_inodes)
+{
+   if (fs == NULL) {
+      printf("[fs] argument is null.\n");
+      return -1;
+   }
+
+   // the inode table is made of whole blocks
+   unsigned num_blocks = block_num_blocks(fs->blocks);
+   num_inodes = MIN(MAX(num_inodes, 2), ITAB_MAX_INODES);
+   unsigned itab_blks = (num_inodes + ITAB_BLOCK_INODES(fs) - 1) / ITAB_BLOCK_INODES(fs);
+   fs_super_t sb;
+   memset(&sb,0,sizeof(sb));
+   sb.magic = FS_MAGIC;
+   sb.block_size = BLOCK_SIZE(fs);
+   sb.num_blocks = num_blocks;
+   sb.num_inodes = MIN(itab_blks * ITAB_BLOCK_INODES(fs), ITAB_MAX_INODES);
+   sb.bbmap_start = 1;
+   sb.bbmap_blks = BITS_TO_BLOCKS(fs,num_blocks);
+   sb.ibmap_start = sb.bbmap_start + sb.bbmap_blks;
+   sb.ibmap_blks = BITS_TO_BLOCKS(fs,sb.num_inodes);
+   sb.itab_start = sb.ibmap_start + sb.ibmap_blks;
+   sb.itab_blks = itab_blks;
+   sb.data_start = sb.itab_start + sb.itab_blks;
+   sb.free_blocks = num_blocks - sb.data_start;
+   sb.free_inodes = sb.num_inodes - 2;
+   if (sb.data_start >= num_blocks) {
+      printf("[fs] too many inodes for the storage.\n");
+      return -1;
+   }
+
+   // forget the cached blocks (and the delayed ones) and the metadata
+   // in memory
+   cache_flush(fs);
+   fs->delayed = 0;
+   fsi_free_fsdata(fs);
+   fs->sb = sb;
+   fsi_alloc_fsdata(fs);
+
+   // erase all blocks
+   char* null_block = (char*) calloc(1, BLOCK_SIZE(fs));
+   for (int i = 0; i < num_blocks; i++) {
+      block_write(fs->blocks,i,null_block);
+   }
+   free(null_block);
+
+   // write the superblock
+   fsi_store_super(fs);
+
+   // the bitmaps are empty, there is nothing to load
+   memset(fs->blk_bmap.loaded,1,fs->blk_bmap.blks);
+   memset(fs->inode_bmap.loaded,1,fs->inode_bmap.blks);
+	
+   // reserve file system meta data blocks
+   for (int i = 0; i < sb.data_start; i++) {
+      BMAP_SET(fs->blk_bmap.bits,i);
+      BMAP_DIRTY(fs->blk_bmap,i);
+   }
+
+   // reserve inodes 0 (will never be used) and 1 (the root)
+   BMAP_SET(fs->inode_bmap.bits,0);
+   BMAP_SET(fs->inode_bmap.bits,1);
+   BMAP_DIRTY(fs->inode_bmap,0);
+   fsi_inode_init(fsi_inode(fs,1),FS_DIR);
+   fsi_itab_block(fs,1)->dirty = 1;
+	
+   // save the file system metadata
+   fsi_store_fsdata(fs);
+   return 0;
+}
+
+
+static int fsi_get_attrs(fs_t* fs, inodeid_t file, fs_file_attrs_t* attrs)
+{
+   if (fs == NULL || file >= fs->sb.num_inodes || attrs == NULL) {
+      dprintf("[fs_get_attrs] malformed arguments.\n");
+      return -1;
+   }
+
+   if (!BMAP_ISSET(IBMAP(fs,file),file)) {
+      dprintf("[fs_get_attrs] inode is not being used.\n");
+      return -1;
+   }
+
+   fs_inode_t* inode = fsi_inode(fs,file);
+   attrs->inodeid = file;
+   attrs->type = inode->type;
+   attrs->size = inode->size;
+   switch (inode->type) {
+      case FS_DIR:
+         attrs->num_entries = inode->size / sizeof(fs_dentry_t);
+         break;
+      case FS_FILE:
+         attrs->num_entries = -1;
+         break;
+      default:
+         dprintf("[fs_get_attrs] fatal error - invalid inode.\n");
+         exit(-1);
+   }
+   return 0;
+}
+
+
+int fs_get_attrs(fs_t* fs, inodeid_t file, fs_file_attrs_t* attrs)
+{
+   if (fs == NULL || file >= fs->sb.num_inodes) {
+      dprintf("[fs_get_attrs] malformed arguments.\n");
+      return -1;
+   }
+
+   fsi_tree_lock(fs,FS_SHARED);
+   fsi_inode_lock(fs,file,FS_SHARED);
+   int res = fsi_get_attrs(fs,file,attrs);
+   fsi_inode_unlock(fs,file);
+   fsi_tree_unlock(fs);
+   return res;
+}
+
+
+int fs_lookup(fs_t* fs, char* file, inodeid_t* fileid)
+{
+
+char *token, *save;
+char line[MAX_PATH_NAME_SIZE]; 
+char *search = "/";
+int i=0;
+int dir=0;
+   if (fs==NULL || file==NULL ) {
+      dprintf("[fs_lookup] malformed arguments.\n");
+      return -1;
+   }
+
+
+    if(file[0] != '/') {
+        dprintf("[fs_lookup] malformed pathname.\n");
+        return -1;
+    }
+
+    strcpy(line,file);
+    token = strtok_r(line, search, &save);
+    
+   // each directory is only locked while it is searched
+   fsi_tree_lock(fs,FS_SHARED);
+   while(token != NULL) {
+     i++;
+     if(i==1) dir=1;  //Root directory
+     
+     fsi_inode_lock(fs,dir,FS_SHARED);
+     if (!BMAP_ISSET(IBMAP(fs,dir),dir)) {
+	      dprintf("[fs_lookup] inode is not being used.\n");
+	      fsi_inode_unlock(fs,dir);
+	      fsi_tree_unlock(fs);
+	      return -1;
+     }
+     fs_inode_t* idir = fsi_inode(fs,dir);
+     if (idir->type != FS_DIR) {
+        dprintf("[fs_lookup] inode is not a directory.\n");
+        fsi_inode_unlock(fs,dir);
+        fsi_tree_unlock(fs);
+        return -1;
+     }
+     inodeid_t fid;
+     if (fsi_dir_search(fs,dir,token,&fid) < 0) {
+        dprintf("[fs_lookup] file does not exist.\n");
+        fsi_inode_unlock(fs,dir);
+        fsi_tree_unlock(fs);
+        return 0;
+     }
+     fsi_inode_unlock(fs,dir);
+     *fileid = fid;
+     dir=fid;
+     token = strtok_r(NULL, search, &save);
+   }
+   fsi_tree_unlock(fs);
+
+   return 1;
+}
+
+
+static int fsi_read(fs_t* fs, inodeid_t file, unsigned offset, unsigned count, 
+   char* buffer, int* nread)
+{
+	if (fs==NULL || file >= fs->sb.num_inodes || buffer==NULL || nread==NULL) {
+		dprintf("[fs_read] malformed arguments.\n");
+		return -1;
+	}
+
+	if (!BMAP_ISSET(IBMAP(fs,file),file)) {
+		dprintf("[fs_read] inode is not being used.\n");
+		return -1;
+	}
+
+	fs_inode_t* ifile = fsi_inode(fs,file);
+	if (ifile->type != FS_FILE) {
+		dprintf("[fs_read] inode is not a file.\n");
+		return -1;
+	}
+
+	if (offset >= ifile->size) {
+		*nread = 0;
+		return 0;
+	}
+
+	// small files are read from the inode
+	if (INODE_IS_INLINE(ifile)) {
+		*nread = MIN(count,ifile->size-offset);
+		memcpy(buffer,&INODE_DATA(ifile)[offset],*nread);
+		return 0;
+	}
+	
+   	// read the specified range
+	int pos = 0;
+	int iblock = BLOCK_NUM(fs,offset);
+	int blks_used = OFFSET_TO_BLOCKS(fs,ifile->size);
+	int max = MIN(count,ifile->size-offset);
+	int tbl_pos;
+	unsigned int *blk;
+   
+	while (pos < max && iblock < blks_used) {
+		if(iblock < INODE_NUM_BLKS) {
+			blk = ifile->blocks;
+			tbl_pos = iblock;
+		}
+		
+		int start = ((pos == 0)?BLOCK_OFF(fs,offset):0);
+		int num = MIN(BLOCK_SIZE(fs) - start, max - pos);
+		if (blk[tbl_pos] == 0) {
+			// a hole has no block to read
+			memset(&buffer[pos],0,num);
+		} else {
+			char* block = cache_get(fs, blk[tbl_pos], CACHE_READ);
+			memcpy(&buffer[pos],&block[start],num);
+			cache_put(block, 0);
+		}
+
+		pos += num;
+		iblock++;
+	}
+	*nread = pos;
+	return 0;
+}
+
+
+int fs_read(fs_t* fs, inodeid_t file, unsigned offset, unsigned count, 
+   char* buffer, int* nread)
+{
+	if (fs == NULL || file >= fs->sb.num_inodes) {
+		dprintf("[fs_read] malformed arguments.\n");
+		return -1;
+	}
+
+	fsi_tree_lock(fs,FS_SHARED);
+	fsi_inode_lock(fs,file,FS_SHARED);
+	int res = fsi_read(fs,file,offset,count,buffer,nread);
+	fsi_inode_unlock(fs,file);
+	fsi_tree_unlock(fs);
+	return res;
+}
+
+// the data of the holes of the files read with fs_read_pinned
+static char zero_block[FS_MAX_BLOCK_SIZE];
+
+static int fsi_read_pinned(fs_t* fs, inodeid_t file, unsigned offset,
+   unsigned count, char* buffer, fs_pinned_t* pieces, int maxpieces,
+   int* npieces, int* nread)
+{
+	if (fs==NULL || file >= fs->sb.num_inodes || buffer==NULL || pieces==NULL ||
+	   maxpieces < 2 || npieces==NULL || nread==NULL) {
+		dprintf("[fs_read] malformed arguments.\n");
+		return -1;
+	}
+
+	if (!BMAP_ISSET(IBMAP(fs,file),file)) {
+		dprintf("[fs_read] inode is not being used.\n");
+		return -1;
+	}
+
+	fs_inode_t* ifile = fsi_inode(fs,file);
+	if (ifile->type != FS_FILE) {
+		dprintf("[fs_read] inode is not a file.\n");
+		return -1;
+	}
+
+	*npieces = 0;
+	*nread = 0;
+	if (offset >= ifile->size) {
+		return 0;
+	}
+
+	// the data of small files is in the inode, not in cache blocks
+	if (INODE_IS_INLINE(ifile)) {
+		return -1;
+	}
+
+	// the blocks holding the range (the last piece is kept for the
+	// data copied into the buffer)
+	int max = MIN(count,ifile->size-offset);
+	int first = BLOCK_NUM(fs,offset);
+	int last = MIN(OFFSET_TO_BLOCKS(fs,offset+max),INODE_NUM_BLKS);
+	int num = MIN(last - first, maxpieces - 1);
+	// only the blocks that are not holes are pinned, as many as the
+	// pins left allow
+	int blocks[INODE_NUM_BLKS], entries[INODE_NUM_BLKS];
+	int nblocks = 0;
+	for (int i = 0; i < num; i++) {
+		if (ifile->blocks[first+i] != 0) {
+			blocks[nblocks++] = ifile->blocks[first+i];
+		}
+	}
+	int npinned = cache_pin(fs,blocks,nblocks,entries);
+	if (nblocks > 0 && npinned == 0) {
+		return -1;
+	}
+
+	int pos = 0, n = 0;
+	for (int i = 0, k = 0; i < num; i++) {
+		int start = ((pos == 0)?BLOCK_OFF(fs,offset):0);
+		if (ifile->blocks[first+i] == 0) {
+			pieces[n].entry = -1;
+			pieces[n].data = zero_block + start;
+		} else if (k < npinned) {
+			pieces[n].entry = entries[k];
+			pieces[n].data = cache_pinned_block(entries[k++]) + start;
+		} else {
+			break;
+		}
+		pieces[n].len = MIN(BLOCK_SIZE(fs) - start, max - pos);
+		pos += pieces[n++].len;
+	}
+
+	// the rest of the range is copied
+	if (pos < max) {
+		int ncopied;
+		if (fsi_read(fs,file,offset+pos,max-pos,buffer+pos,&ncopied) < 0) {
+			fs_unpin(fs,pieces,n);
+			return -1;
+		}
+		pieces[n].entry = -1;
+		pieces[n].data = buffer+pos;
+		pieces[n].len = ncopied;
+		pos += pieces[n++].len;
+	}
+	*npieces = n;
+	*nread = pos;
+	return 0;
+}
+
+
+int fs_read_pinned(fs_t* fs, inodeid_t file, unsigned offset, unsigned count,
+   char* buffer, fs_pinned_t* pieces, int maxpieces, int* npieces, int* nread)
+{
+	if (fs == NULL || file >= fs->sb.num_inodes) {
+		dprintf("[fs_read] malformed arguments.\n");
+		return -1;
+	}
+
+	fsi_tree_lock(fs,FS_SHARED);
+	fsi_inode_lock(fs,file,FS_SHARED);
+	int res = fsi_read_pinned(fs,file,offset,count,buffer,pieces,maxpieces,
+	   npieces,nread);
+	fsi_inode_unlock(fs,file);
+	fsi_tree_unlock(fs);
+	return res;
+}
+
+
+void fs_unpin(fs_t* fs, fs_pinned_t* pieces, int npieces)
+{
+	int entries[INODE_NUM_BLKS];
+	while (npieces > 0) {
+		int num = MIN(npieces,INODE_NUM_BLKS);
+		int npinned = 0;
+		for (int i = 0; i < num; i++) {
+			// the pieces of holes are not pinned
+			if (pieces[i].entry >= 0) {
+				entries[npinned++] = pieces[i].entry;
+			}
+		}
+		cache_unpin(entries,npinned);
+		pieces += num;
+		npieces -= num;
+	}
+}
+
+
+static int fsi_seek(fs_t* fs, inodeid_t file, unsigned offset, fs_seek_t what,
+   unsigned* pos)
+{
+	if (fs==NULL || file >= fs->sb.num_inodes || pos==NULL) {
+		dprintf("[fs_seek] malformed arguments.\n");
+		return -1;
+	}
+
+	if (!BMAP_ISSET(IBMAP(fs,file),file)) {
+		dprintf("[fs_seek] inode is not being used.\n");
+		return -1;
+	}
+
+	fs_inode_t* ifile = fsi_inode(fs,file);
+	if (ifile->type != FS_FILE || offset >= ifile->size) {
+		dprintf("[fs_seek] no data or hole past the end of the file.\n");
+		return -1;
+	}
+
+	// the data of small files has no holes
+	if (INODE_IS_INLINE(ifile)) {
+		*pos = (what == FS_SEEK_DATA) ? offset : ifile->size;
+		return 0;
+	}
+
+	int blks_used = OFFSET_TO_BLOCKS(fs,ifile->size);
+	for (int i = BLOCK_NUM(fs,offset); i < blks_used; i++) {
+		if ((ifile->blocks[i] != 0) == (what == FS_SEEK_DATA)) {
+			*pos = MAX(offset,(unsigned)i << fs->bshift);
+			return 0;
+		}
+	}
+
+	// the end of the file is a hole too
+	if (what == FS_SEEK_HOLE) {
+		*pos = ifile->size;
+		return 0;
+	}
+	return -1;
+}
+
+
+int fs_seek(fs_t* fs, inodeid_t file, unsigned offset, fs_seek_t what,
+   unsigned* pos)
+{
+	if (fs == NULL || file >= fs->sb.num_inodes) {
+		dprintf("[fs_seek] malformed arguments.\n");
+		return -1;
+	}
+
+	fsi_tree_lock(fs,FS_SHARED);
+	fsi_inode_lock(fs,file,FS_SHARED);
+	int res = fsi_seek(fs,file,offset,what,pos);
+	fsi_inode_unlock(fs,file);
+	fsi_tree_unlock(fs);
+	return res;
+}
+
+
+int inode_search(fs_t* fs,inodeid_t file, inodeid_t* inodeid);
+
+int copy_inode_write(fs_t* fs, inodeid_t dest, inodeid_t file);
+
+
+/*
+ * fsi_is_shared: checks if a file shares its blocks with a copy; only
+ *   the files marked by copy_inode are searched, and the mark is
+ *   dropped when no copy is left
+ * - other: receives the inode of a copy
+ *   returns: 1 if the blocks are shared, 0 otherwise
+ */
+static int fsi_is_shared(fs_t* fs, inodeid_t file, inodeid_t* other)
+{
+	fs_inode_t* ifile = fsi_inode(fs,file);
+	if (!(ifile->flags & INODE_SHARED)) {
+		return 0;
+	}
+	if (inode_search(fs,file,other)) {
+		return 1;
+	}
+	ifile->flags &= ~INODE_SHARED;
+	return 0;
+}
+
+
+/*
+ * fsi_unshare: gives a file its own copy of the blocks it shares
+ *   returns: 0 if successful, -1 if there are not enough free blocks
+ */
+static int fsi_unshare(fs_t* fs, inodeid_t file)
+{
+	inodeid_t aux;
+	if (fsi_is_shared(fs,file,&aux) && copy_inode_write(fs,file,aux)) {
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * fsi_write_blocks: writes data to the blocks of a file (not inline),
+ * allocating the blocks needed (those of the holes written, which
+ * may be beyond the end of the file)
+ *   returns: 0 if successful, -1 otherwise (nothing is written)
+ */
+static int fsi_write_blocks(fs_t* fs, fs_inode_t* ifile, unsigned offset,
+   unsigned count, char* buffer)
+{
+	if (offset + count < offset || offset + count > INODE_NUM_BLKS * BLOCK_SIZE(fs)) {
+		dprintf("[fs_write] no free block entries in inode.\n");
+		return -1;
+	}
+
+	int first = BLOCK_NUM(fs,offset);
+	int last = OFFSET_TO_BLOCKS(fs,offset+count);
+
+	// the holes in the range get new blocks
+	int fresh[INODE_NUM_BLKS];
+	int blks_req = 0;
+	for (int i = first; i < last; i++) {
+		fresh[i] = (ifile->blocks[i] == 0);
+		blks_req += fresh[i];
+	}
+
+	dprintf("[fs_write] count=%d, offset=%d, fsize=%d, breq=%d\n",
+		count,offset,ifile->size,blks_req);
+	
+	if (blks_req > 0) {
+		if (fsi_delay_take(fs,ifile,blks_req)) {
+			// the blocks are allocated later (see fsi_delay_alloc)
+			for (int i = first; i < last; i++) {
+				if (fresh[i]) {
+					ifile->blocks[i] = DELAYED_NUM(__sync_fetch_and_add(&fs->delay_next,1));
+				}
+			}
+			ifile->flags |= INODE_DELAYED;
+		} else if (fsi_bcount_take(fs,blks_req)) {
+			// an extent for each hole
+			for (int i = first; i < last; ) {
+				int n = 0;
+				while (i + n < last && fresh[i+n]) {
+					n++;
+				}
+				if (n > 0) {
+					fsi_balloc_extent(fs,ifile,i,n);
+					dprintf("[fs_write] blocks %d-%d allocated.\n", ifile->blocks[i],
+						ifile->blocks[i+n-1]);
+				}
+				i += MAX(n,1);
+			}
+		} else {
+			dprintf("[fs_write] there are no free blocks.\n");
+			return -1;
+		}
+	}
+   
+	char* block;
+	unsigned num = 0;
+
+	for (int i = first; i < last; i++) {
+		int start = ((num == 0)?BLOCK_OFF(fs,offset):0);
+		int len = MIN(BLOCK_SIZE(fs) - start, count - num);
+		if (fresh[i]) {
+			// a new block has no contents to keep
+			block = cache_get(fs, ifile->blocks[i], CACHE_OVERWRITE);
+			memset(block, 0, start);
+			memset(&block[start+len], 0, BLOCK_SIZE(fs) - start - len);
+		} else {
+			// a block written whole is not read first
+			block = cache_get(fs, ifile->blocks[i],
+				(len == BLOCK_SIZE(fs)) ? CACHE_OVERWRITE : CACHE_WRITE);
+		}
+		memcpy(&block[start], &buffer[num], len);
+		cache_put(block, 1);
+		num += len;
+	}
+
+	if (num != count) {
+		printf("[fs_write] severe error: num=%d != count=%d!\n", num, count);
+		exit(-1);
+	}
+
+	ifile->size = MAX(offset + count, ifile->size);
+	return 0;
+}
+
+
+/*
+ * fsi_uninline: moves the data of a small file from its inode to a block
+ *   returns: 0 if successful, -1 otherwise (the file is left inline)
+ */
+static int fsi_uninline(fs_t* fs, fs_inode_t* ifile)
+{
+	char inline_data[INODE_INLINE_SZ];
+	unsigned inline_size = ifile->size;
+	memcpy(inline_data,INODE_DATA(ifile),inline_size);
+
+	memset(INODE_DATA(ifile),0,INODE_INLINE_SZ);
+	ifile->flags &= ~INODE_INLINE;
+	ifile->size = 0;
+	if (inline_size > 0 &&
+	   fsi_write_blocks(fs,ifile,0,inline_size,inline_data) < 0) {
+		memcpy(INODE_DATA(ifile),inline_data,inline_size);
+		ifile->flags |= INODE_INLINE;
+		ifile->size = inline_size;
+		return -1;
+	}
+	return 0;
+}
+
+
+static int fsi_write(fs_t* fs, inodeid_t file, unsigned offset, unsigned count,
+   char* buffer)
+{
+	if (fs == NULL || file >= fs->sb.num_inodes || buffer == NULL) {
+		dprintf("[fs_write] malformed arguments.\n");
+		return -1;
+	}
+
+	if (!BMAP_ISSET(IBMAP(fs,file),file)) {
+		dprintf("[fs_write] inode is not being used.\n");
+		return -1;
+	}
+
+	fs_inode_t* ifile = fsi_inode(fs,file);
+	if (ifile->type != FS_FILE) {
+		dprintf("[fs_write] inode is not a file.\n");
+		return -1;
+	}
+	
+	// nothing to write, the file does not grow either
+	if (count == 0) {
+		return 0;
+	}
+
+	if (fsi_unshare(fs,file) < 0) {
+		dprintf("[fs_write] blocks could not be unshared.\n");
+		return -1;
+	}
+
+	// a write beyond the end of the file leaves a hole before the data
+	if (INODE_IS_INLINE(ifile) && offset + count <= INODE_INLINE_SZ &&
+	   offset + count > offset) {
+		// the file is still small, its data stays in the inode
+		if (offset > ifile->size) {
+			memset(&INODE_DATA(ifile)[ifile->size],0,offset - ifile->size);
+		}
+		memcpy(&INODE_DATA(ifile)[offset],buffer,count);
+		ifile->size = MAX(offset + count, ifile->size);
+	} else {
+		// the file outgrows the inode
+		if (INODE_IS_INLINE(ifile) && fsi_uninline(fs,ifile) < 0) {
+			return -1;
+		}
+		if (fsi_write_blocks(fs,ifile,offset,count,buffer) < 0) {
+			// the data that left the inode is kept, the contents do
+			// not change
+			fsi_store_fsdata(fs);
+			return -1;
+		}
+	}
+
+   	// update the inode in disk
+	fsi_store_fsdata(fs);
+
+	dprintf("[fs_write] written %d bytes, file size %d.\n", count, ifile->size);
+	return 0;
+}
+
+
+/*
+ * fsi_lock_for_write: locks a file to be written; if the file still
+ * shares its blocks with a copy, breaking the sharing changes both
+ * inodes, so the whole tree is locked instead and the sharing is
+ * broken here (a failure is reported by the write itself)
+ *   returns: the mode in which the tree lock is held
+ */
+static fs_lock_mode_t fsi_lock_for_write(fs_t* fs, inodeid_t file)
+{
+	inodeid_t aux;
+
+	fsi_tree_lock(fs,FS_SHARED);
+	fsi_inode_lock(fs,file,FS_EXCL);
+	if (!fsi_is_shared(fs,file,&aux)) {
+		return FS_SHARED;
+	}
+	fsi_inode_unlock(fs,file);
+	fsi_tree_unlock(fs);
+	fsi_tree_lock(fs,FS_EXCL);
+	fsi_unshare(fs,file);
+	return FS_EXCL;
+}
+
+
+static void fsi_unlock_for_write(fs_t* fs, inodeid_t file, fs_lock_mode_t mode)
+{
+	if (mode == FS_SHARED) {
+		fsi_inode_unlock(fs,file);
+	}
+	fsi_tree_unlock(fs);
+}
+
+
+int fs_write(fs_t* fs, inodeid_t file, unsigned offset, unsigned count,
+   char* buffer)
+{
+	if (fs == NULL || file >= fs->sb.num_inodes) {
+		dprintf("[fs_write] malformed arguments.\n");
+		return -1;
+	}
 
+	fs_lock_mode_t mode = fsi_lock_for_write(fs,file);
+	int res = fsi_write(fs,file,offset,count,buffer);
+	fsi_unlock_for_write(fs,file,mode);
+	return res;
+}
 
-    if(file[0] != '/') {
-        dprintf("[fs_lookup] malformed pathname.\n");
-        return -1;
-    }
 
-    strcpy(line,file);
-    token = strtok(line, search);
-    
-   while(token != NULL) {
-     i++;
-     if(i==1) dir=1;  //Root directory
-     
-     if (!BMAP_ISSET(fs->inode_bmap,dir)) {
-	      dprintf("[fs_lookup] inode is not being used.\n");
-	      return -1;
-     }
-     fs_inode_t* idir = &fs->inode_tab[dir];
-     if (idir->type != FS_DIR) {
-        dprintf("[fs_lookup] inode is not a directory.\n");
-        return -1;
-     }
-     inodeid_t fid;
-     if (fsi_dir_search(fs,dir,token,&fid) < 0) {
-        dprintf("[fs_lookup] file does not exist.\n");
-        return 0;
-     }
-     *fileid = fid;
-     dir=fid;
-     token = strtok(NULL, search);
-   }
+/*
+ * fsi_shrink: frees the blocks of a file (not inline) past 'size', which
+ * is below the file size
+ */
+static void fsi_shrink(fs_t* fs, fs_inode_t* ifile, unsigned size)
+{
+	unsigned blks[INODE_NUM_BLKS];
+	int n = 0, ndelayed = 0;
+
+	// the blocks past the new end are released together
+	for (int i = OFFSET_TO_BLOCKS(fs,size); i < INODE_NUM_BLKS; i++) {
+		unsigned blk = ifile->blocks[i];
+		if (blk == 0) {
+			continue;
+		}
+		cache_clean(blk);
+		if (BLK_IS_DELAYED(blk)) {
+			ndelayed++;
+		} else {
+			blks[n++] = blk;
+		}
+		ifile->blocks[i] = 0;
+	}
+	fsi_bfree_blocks(fs,blks,n);
+
+	if (ndelayed > 0) {
+		sthread_mutex_lock(fs->delay_lock);
+		fs->delayed -= ndelayed;
+		sthread_mutex_unlock(fs->delay_lock);
+		__sync_fetch_and_add(&fs->sb.free_blocks,ndelayed);
+		int left = 0;
+		for (int i = 0; i < INODE_NUM_BLKS; i++) {
+			left |= BLK_IS_DELAYED(ifile->blocks[i]);
+		}
+		if (!left) {
+			ifile->flags &= ~INODE_DELAYED;
+		}
+	}
 
-   return 1;
+	// the rest of the last block is read as zeros if the file grows
+	unsigned last = ifile->blocks[BLOCK_NUM(fs,size)];
+	if (BLOCK_OFF(fs,size) != 0 && last != 0) {
+		char* block = cache_get(fs, last, CACHE_WRITE);
+		memset(&block[BLOCK_OFF(fs,size)], 0, BLOCK_SIZE(fs) - BLOCK_OFF(fs,size));
+		cache_put(block, 1);
+	}
 }
 
 
-int fs_read(fs_t* fs, inodeid_t file, unsigned offset, unsigned count, 
-   char* buffer, int* nread)
+static int fsi_truncate(fs_t* fs, inodeid_t file, unsigned size)
 {
-	if (fs==NULL || file >= ITAB_SIZE || buffer==NULL || nread==NULL) {
-		dprintf("[fs_read] malformed arguments.\n");
+	if (fs == NULL || file >= fs->sb.num_inodes) {
+		dprintf("[fs_truncate] malformed arguments.\n");
 		return -1;
 	}
 
-	if (!BMAP_ISSET(fs->inode_bmap,file)) {
-		dprintf("[fs_read] inode is not being used.\n");
+	if (!BMAP_ISSET(IBMAP(fs,file),file)) {
+		dprintf("[fs_truncate] inode is not being used.\n");
 		return -1;
 	}
 
-	fs_inode_t* ifile = &fs->inode_tab[file];
-	if (ifile->type != FS_FILE) {
-		dprintf("[fs_read] inode is not a file.\n");
+	fs_inode_t* ifile = fsi_inode(fs,file);
+	if (ifile->type != FS_FILE || size > INODE_NUM_BLKS * BLOCK_SIZE(fs)) {
+		dprintf("[fs_truncate] inode is not a file or the size is too large.\n");
 		return -1;
 	}
 
-	if (offset >= ifile->size) {
-		*nread = 0;
-		return 0;
+	if (fsi_unshare(fs,file) < 0) {
+		dprintf("[fs_truncate] blocks could not be unshared.\n");
+		return -1;
 	}
-	
-   	// read the specified range
-	int pos = 0;
-	int iblock = offset/BLOCK_SIZE;
-	int blks_used = OFFSET_TO_BLOCKS(ifile->size);
-	int max = MIN(count,ifile->size-offset);
-	int tbl_pos;
-	unsigned int *blk;
-	char block[BLOCK_SIZE];
-   
-	while (pos < max && iblock < blks_used) {
-		if(iblock < INODE_NUM_BLKS) {
-			blk = ifile->blocks;
-			tbl_pos = iblock;
-		}
-		
-		readFrom_cache(fs, blk[tbl_pos], block);
-		int start = ((pos == 0)?(offset % BLOCK_SIZE):0);
-		int num = MIN(BLOCK_SIZE - start, max - pos);
-		memcpy(&buffer[pos],&block[start],num);
 
-		pos += num;
-		iblock++;
+	if (!INODE_IS_INLINE(ifile) && size <= INODE_INLINE_SZ) {
+		// the file is small again, its data goes back to the inode
+		char inline_data[INODE_INLINE_SZ];
+		int nread;
+		fsi_read(fs,file,0,size,inline_data,&nread);
+		fsi_shrink(fs,ifile,0);
+		memset(INODE_DATA(ifile),0,INODE_INLINE_SZ);
+		memcpy(INODE_DATA(ifile),inline_data,nread);
+		ifile->flags |= INODE_INLINE;
+		ifile->size = nread;
+	} else if (INODE_IS_INLINE(ifile) && size > INODE_INLINE_SZ &&
+	   fsi_uninline(fs,ifile) < 0) {
+		return -1;
 	}
-	*nread = pos;
+
+	if (INODE_IS_INLINE(ifile)) {
+		// the bytes past the end of the file are kept as zeros
+		if (size < ifile->size) {
+			memset(&INODE_DATA(ifile)[size],0,ifile->size - size);
+		} else {
+			memset(&INODE_DATA(ifile)[ifile->size],0,size - ifile->size);
+		}
+	} else if (size < ifile->size) {
+		fsi_shrink(fs,ifile,size);
+	}
+	// a file that grows ends in a hole
+	ifile->size = size;
+
+	fsi_store_fsdata(fs);
 	return 0;
 }
 
-int inode_search(fs_t* fs,inodeid_t file, inodeid_t* inodeid);
-
-int copy_inode_write(fs_t* fs, inodeid_t dest, inodeid_t file);
 
-int fs_write(fs_t* fs, inodeid_t file, unsigned offset, unsigned count,
-   char* buffer)
+int fs_truncate(fs_t* fs, inodeid_t file, unsigned size)
 {
-	if (fs == NULL || file >= ITAB_SIZE || buffer == NULL) {
-		dprintf("[fs_write] malformed arguments.\n");
+	if (fs == NULL || file >= fs->sb.num_inodes) {
+		dprintf("[fs_truncate] malformed arguments.\n");
 		return -1;
 	}
 
-	if (!BMAP_ISSET(fs->inode_bmap,file)) {
-		dprintf("[fs_write] inode is not being used.\n");
+	fs_lock_mode_t mode = fsi_lock_for_write(fs,file);
+	int res = fsi_truncate(fs,file,size);
+	fsi_unlock_for_write(fs,file,mode);
+	return res;
+}
+
+
+static int fsi_fallocate(fs_t* fs, inodeid_t file, unsigned offset,
+   unsigned count)
+{
+	if (fs == NULL || file >= fs->sb.num_inodes || count == 0) {
+		dprintf("[fs_fallocate] malformed arguments.\n");
 		return -1;
 	}
 
-	fs_inode_t* ifile = &fs->inode_tab[file];
-	if (ifile->type != FS_FILE) {
-		dprintf("[fs_write] inode is not a file.\n");
+	if (!BMAP_ISSET(IBMAP(fs,file),file)) {
+		dprintf("[fs_fallocate] inode is not being used.\n");
 		return -1;
 	}
-	
-	inodeid_t aux;
-	if(inode_search(fs,file, &aux)){
-		if(copy_inode_write(fs, file , aux))
-			dprintf("[fs_write] inode is not a file.\n");
-	}
 
-	if (offset > ifile->size) {
-		offset = ifile->size;
+	fs_inode_t* ifile = fsi_inode(fs,file);
+	unsigned end = offset + count;
+	if (ifile->type != FS_FILE || end < offset ||
+	   end > INODE_NUM_BLKS * BLOCK_SIZE(fs)) {
+		dprintf("[fs_fallocate] inode is not a file or the range is too large.\n");
+		return -1;
 	}
 
-	unsigned *blk;
-
-	int blks_used = OFFSET_TO_BLOCKS(ifile->size);
-	int blks_req = MAX(OFFSET_TO_BLOCKS(offset+count),blks_used)-blks_used;
+	if (fsi_unshare(fs,file) < 0) {
+		dprintf("[fs_fallocate] blocks could not be unshared.\n");
+		return -1;
+	}
 
-	dprintf("[fs_write] count=%d, offset=%d, fsize=%d, bused=%d, breq=%d\n",
-		count,offset,ifile->size,blks_used,blks_req);
-	
-	if (blks_req > 0) {
-		if(blks_req > INODE_NUM_BLKS-blks_used) {
-			dprintf("[fs_write] no free block entries in inode.\n");
+	if (INODE_IS_INLINE(ifile) && end <= INODE_INLINE_SZ) {
+		// the inode has room for the range already
+		if (end > ifile->size) {
+			memset(&INODE_DATA(ifile)[ifile->size],0,end - ifile->size);
+		}
+	} else {
+		if (INODE_IS_INLINE(ifile) && fsi_uninline(fs,ifile) < 0) {
 			return -1;
 		}
 
-		dprintf("[fs_write] required %d blocks, used %d\n", blks_req, blks_used);
-
-      		// check and reserve if there are free blocks
-		for (int i = blks_used; i < blks_used + blks_req; i++) {
-
-			if(i < INODE_NUM_BLKS)
-				blk = &ifile->blocks[i];
-	 
-			if (!fsi_bmap_find_free(fs->blk_bmap,block_num_blocks(fs->blocks),blk)) { // ITAB_SIZE
-				dprintf("[fs_write] there are no free blocks.\n");
-				return -1;
+		// the holes in the range are reserved, as extents
+		int first = BLOCK_NUM(fs,offset);
+		int last = OFFSET_TO_BLOCKS(fs,end);
+		int blks_req = 0;
+		for (int i = first; i < last; i++) {
+			blks_req += (ifile->blocks[i] == 0);
+		}
+		if (blks_req > 0 && !fsi_bcount_take(fs,blks_req)) {
+			// the data that left the inode is kept
+			dprintf("[fs_fallocate] there are no free blocks.\n");
+			fsi_store_fsdata(fs);
+			return -1;
+		}
+		for (int i = first; i < last; ) {
+			int n = 0;
+			while (i + n < last && ifile->blocks[i+n] == 0) {
+				n++;
+			}
+			if (n == 0) {
+				i++;
+				continue;
 			}
-			BMAP_SET(fs->blk_bmap, *blk);
-			dprintf("[fs_write] block %d allocated.\n", *blk);
+			fsi_balloc_extent(fs,ifile,i,n);
+			// the blocks read as zeros, as the holes did
+			for (int k = i; k < i + n; k++) {
+				cache_clean(ifile->blocks[k]);
+				block_write(fs->blocks,ifile->blocks[k],zero_block);
+			}
+			i += n;
 		}
 	}
-   
-	char block[BLOCK_SIZE];
-	int num = 0, pos;
-	int iblock = offset/BLOCK_SIZE;
+	ifile->size = MAX(end, ifile->size);
 
-   	// write within the existent blocks
-	while (num < count && iblock < blks_used) {
-		if(iblock < INODE_NUM_BLKS) {
-			blk = ifile->blocks;
-			pos = iblock;
-		}
-		readFrom_cache(fs, blk[pos], block);
+	fsi_store_fsdata(fs);
+	return 0;
+}
 
-		int start = ((num == 0)?(offset % BLOCK_SIZE):0);
-		for (int i = start; i < BLOCK_SIZE && num < count; i++, num++) {
-			block[i] = buffer[num];
-		}
-		writeIn_cache(fs, blk[pos], block);
-		iblock++;
+
+int fs_fallocate(fs_t* fs, inodeid_t file, unsigned offset, unsigned count)
+{
+	if (fs == NULL || file >= fs->sb.num_inodes) {
+		dprintf("[fs_fallocate] malformed arguments.\n");
+		return -1;
 	}
 
-	dprintf("[fs_write] written %d bytes within.\n", num);
+	fs_lock_mode_t mode = fsi_lock_for_write(fs,file);
+	int res = fsi_fallocate(fs,file,offset,count);
+	fsi_unlock_for_write(fs,file,mode);
+	return res;
+}
 
-  	// write within the allocated blocks
-	while (num < count && iblock < blks_used + blks_req) {
-		if(iblock < INODE_NUM_BLKS) {
-			blk = ifile->blocks;
-			pos = iblock;
-		}
-      
-		for (int i = 0; i < BLOCK_SIZE && num < count; i++, num++) {
-			block[i] = buffer[num];
-		}
-		
-		writeIn_cache(fs, blk[pos], block);
-		iblock++;
-	}
 
-	if (num != count) {
-		printf("[fs_write] severe error: num=%d != count=%d!\n", num, count);
-		exit(-1);
-	}
+/*
+ * fsi_dir_add: adds an entry for a new (empty) inode to a directory; the
+ *   caller checks the name and stores the metadata
+ *   returns: 0 if successful, -1 if there are no free inodes or blocks
+ */
+static int fsi_dir_add(fs_t* fs, inodeid_t dir, char* name, fs_itype_t type,
+   inodeid_t* id)
+{
+   fs_inode_t* idir = fsi_inode(fs,dir);
 
-	ifile->size = MAX(offset + count, ifile->size);
+   if (idir->size / sizeof(fs_dentry_t) >= DIR_MAX_ENTRIES(fs)) {
+      dprintf("[fsi_dir_add] directory is full.\n");
+      return -1;
+   }
 
-   	// update the inode in disk
-	fsi_store_fsdata(fs);
+   // reserve a free inode
+   unsigned finode;
+   if (!fsi_ialloc(fs,&finode)) {
+      dprintf("[fsi_dir_add] there are no free inodes.\n");
+      return -1;
+   }
 
-	dprintf("[fs_write] written %d bytes, file size %d.\n", count, ifile->size);
-	return 0;
+   // add a new block to the directory if necessary
+   if (BLOCK_OFF(fs,idir->size) == 0) {
+      unsigned fblock;
+      if (!fsi_balloc(fs,&fblock)) {
+         dprintf("[fsi_dir_add] no free blocks to augment directory.\n");
+         fsi_ifree(fs,finode);
+         return -1;
+      }
+      idir->blocks[BLOCK_NUM(fs,idir->size)] = fblock;
+   }
+
+   // add the entry to the directory
+   char* page = cache_get(fs, idir->blocks[BLOCK_NUM(fs,idir->size)], CACHE_WRITE);
+   fs_dentry_t* entry = (fs_dentry_t*)&page[BLOCK_OFF(fs,idir->size)];
+   strcpy(entry->name,name);
+   entry->inodeid = finode;
+   cache_put(page, 1);
+   idir->size += sizeof(fs_dentry_t);
+
+   // init the new inode
+   fsi_inode_init(fsi_inode(fs,finode),type);
+
+   *id = finode;
+   return 0;
 }
 
 
-int fs_create(fs_t* fs, inodeid_t dir, char* file, inodeid_t* fileid)
+static int fsi_create(fs_t* fs, inodeid_t dir, char* file, inodeid_t* fileid)
 {
-   if (fs == NULL || dir >= ITAB_SIZE || file == NULL || fileid == NULL) {
+   if (fs == NULL || dir >= fs->sb.num_inodes || file == NULL || fileid == NULL) {
       printf("[fs_create] malformed arguments.\n");
       return -1;
    }
@@ -519,12 +2210,12 @@ int fs_create(fs_t* fs, inodeid_t dir, char* file, inodeid_t* fileid)
       return -1;
    }
 
-   if (!BMAP_ISSET(fs->inode_bmap,dir)) {
+   if (!BMAP_ISSET(IBMAP(fs,dir),dir)) {
       dprintf("[fs_create] inode is not being used.\n");
       return -1;
    }
 
-   fs_inode_t* idir = &fs->inode_tab[dir];
+   fs_inode_t* idir = fsi_inode(fs,dir);
    if (idir->type != FS_DIR) {
       dprintf("[fs_create] inode is not a directory.\n");
       return -1;
@@ -535,48 +2226,36 @@ int fs_create(fs_t* fs, inodeid_t dir, char* file, inodeid_t* fileid)
       return -1;
    }
    
-   // check if there are free inodes
-   unsigned finode;
-   if (!fsi_bmap_find_free(fs->inode_bmap,ITAB_SIZE,&finode)) {
-      dprintf("[fs_create] there are no free inodes.\n");
+   if (fsi_dir_add(fs,dir,file,FS_FILE,fileid)) {
       return -1;
    }
 
-   // add a new block to the directory if necessary
-   if (idir->size % BLOCK_SIZE == 0) {
-      unsigned fblock;
-      if (!fsi_bmap_find_free(fs->blk_bmap,block_num_blocks(fs->blocks),&fblock)) {
-         dprintf("[fs_create] no free blocks to augment directory.\n");
-         return -1;
-      }
-      BMAP_SET(fs->blk_bmap,fblock);
-      idir->blocks[idir->size / BLOCK_SIZE] = fblock;
-   }
-
-   // add the entry to the directory
-   fs_dentry_t page[DIR_PAGE_ENTRIES];
-   readFrom_cache(fs, idir->blocks[idir->size/BLOCK_SIZE],(char*)page);
-   fs_dentry_t* entry = &page[idir->size % BLOCK_SIZE / sizeof(fs_dentry_t)];
-   strcpy(entry->name,file);
-   entry->inodeid = finode;
-   writeIn_cache(fs, idir->blocks[idir->size/BLOCK_SIZE],(char*)page);
-   idir->size += sizeof(fs_dentry_t);
-
-   // reserve and init the new file inode
-   BMAP_SET(fs->inode_bmap,finode);
-   fsi_inode_init(&fs->inode_tab[finode],FS_FILE);
-
    // save the file system metadata
    fsi_store_fsdata(fs);
-
-   *fileid = finode;
    return 0;
 }
 
 
-int fs_mkdir(fs_t* fs, inodeid_t dir, char* newdir, inodeid_t* newdirid)
+int fs_create(fs_t* fs, inodeid_t dir, char* file, inodeid_t* fileid)
+{
+   if (fs == NULL || dir >= fs->sb.num_inodes) {
+      printf("[fs_create] malformed arguments.\n");
+      return -1;
+   }
+
+   // the new inode is not reachable until its entry is added to 'dir'
+   fsi_tree_lock(fs,FS_SHARED);
+   fsi_inode_lock(fs,dir,FS_EXCL);
+   int res = fsi_create(fs,dir,file,fileid);
+   fsi_inode_unlock(fs,dir);
+   fsi_tree_unlock(fs);
+   return res;
+}
+
+
+static int fsi_mkdir(fs_t* fs, inodeid_t dir, char* newdir, inodeid_t* newdirid)
 {
-	if (fs==NULL || dir>=ITAB_SIZE || newdir==NULL || newdirid==NULL) {
+	if (fs==NULL || dir>=fs->sb.num_inodes || newdir==NULL || newdirid==NULL) {
 		printf("[fs_mkdir] malformed arguments.\n");
 		return -1;
 	}
@@ -586,12 +2265,12 @@ int fs_mkdir(fs_t* fs, inodeid_t dir, char* newdir, inodeid_t* newdirid)
 		return -1;
 	}
 
-	if (!BMAP_ISSET(fs->inode_bmap,dir)) {
+	if (!BMAP_ISSET(IBMAP(fs,dir),dir)) {
 		dprintf("[fs_mkdir] inode is not being used.\n");
 		return -1;
 	}
 
-	fs_inode_t* idir = &fs->inode_tab[dir];
+	fs_inode_t* idir = fsi_inode(fs,dir);
 	if (idir->type != FS_DIR) {
 		dprintf("[fs_mkdir] inode is not a directory.\n");
 		return -1;
@@ -602,239 +2281,481 @@ int fs_mkdir(fs_t* fs, inodeid_t dir, char* newdir, inodeid_t* newdirid)
 		return -1;
 	}
    
-   	// check if there are free inodes
-	unsigned finode;
-	if (!fsi_bmap_find_free(fs->inode_bmap,ITAB_SIZE,&finode)) {
-		dprintf("[fs_mkdir] there are no free inodes.\n");
+	if (fsi_dir_add(fs,dir,newdir,FS_DIR,newdirid)) {
 		return -1;
 	}
 
-   	// add a new block to the directory if necessary
-	if (idir->size % BLOCK_SIZE == 0) {
-		unsigned fblock;
-		if (!fsi_bmap_find_free(fs->blk_bmap,block_num_blocks(fs->blocks),&fblock)) {
-			dprintf("[fs_mkdir] no free blocks to augment directory.\n");
-			return -1;
-		}
-		BMAP_SET(fs->blk_bmap,fblock);
-		idir->blocks[idir->size / BLOCK_SIZE] = fblock;
+   	// save the file system metadata
+	fsi_store_fsdata(fs);
+	return 0;
+}
+
+
+int fs_mkdir(fs_t* fs, inodeid_t dir, char* newdir, inodeid_t* newdirid)
+{
+	if (fs == NULL || dir >= fs->sb.num_inodes) {
+		printf("[fs_mkdir] malformed arguments.\n");
+		return -1;
 	}
 
-   	// add the entry to the directory
-	fs_dentry_t page[DIR_PAGE_ENTRIES];
-	readFrom_cache(fs, idir->blocks[idir->size/BLOCK_SIZE],(char*)page);
-	fs_dentry_t* entry = &page[idir->size % BLOCK_SIZE / sizeof(fs_dentry_t)];
-	strcpy(entry->name,newdir);
-	entry->inodeid = finode;
-	writeIn_cache(fs, idir->blocks[idir->size/BLOCK_SIZE],(char*)page);
-	idir->size += sizeof(fs_dentry_t);
+	fsi_tree_lock(fs,FS_SHARED);
+	fsi_inode_lock(fs,dir,FS_EXCL);
+	int res = fsi_mkdir(fs,dir,newdir,newdirid);
+	fsi_inode_unlock(fs,dir);
+	fsi_tree_unlock(fs);
+	return res;
+}
 
-   	// reserve and init the new file inode
-	BMAP_SET(fs->inode_bmap,finode);
-	fsi_inode_init(&fs->inode_tab[finode],FS_DIR);
 
-   	// save the file system metadata
-	fsi_store_fsdata(fs);
+static int fsi_readdir(fs_t* fs, inodeid_t dir, fs_file_name_t* entries, int maxentries,
+   int* numentries)
+{
+   if (fs == NULL || dir >= fs->sb.num_inodes || entries == NULL ||
+      numentries == NULL || maxentries < 0) {
+      dprintf("[fs_readdir] malformed arguments.\n");
+      return -1;
+   }
 
-	*newdirid = finode;
-	return 0;
+   if (!BMAP_ISSET(IBMAP(fs,dir),dir)) {
+      dprintf("[fs_readdir] inode is not being used.\n");
+      return -1;
+   }
+
+   fs_inode_t* idir = fsi_inode(fs,dir);
+   if (idir->type != FS_DIR) {
+      dprintf("[fs_readdir] inode is not a directory.\n");
+      return -1;
+   }
+
+   // fill in the entries with the directory content
+   int num = MIN(idir->size / sizeof(fs_dentry_t), maxentries);
+   int iblock = 0, ientry = 0;
+   inodeid_t* ids = (inodeid_t*) malloc(DIR_PAGE_ENTRIES(fs) * sizeof(inodeid_t));
+
+   while (num > 0) {
+      // the types are read after the page is released, since loading
+      // an inode may need another cache block
+      int first = ientry;
+      fs_dentry_t* page = (fs_dentry_t*)cache_get(fs, idir->blocks[iblock++], CACHE_READ);
+      for (int i = 0; i < DIR_PAGE_ENTRIES(fs) && num > 0; i++, num--) {
+         strcpy(entries[ientry].name, page[i].name);
+         ids[ientry - first] = page[i].inodeid;
+         ientry++;
+      }
+      cache_put((char*)page, 0);
+      for (int i = first; i < ientry; i++) {
+         entries[i].type = fsi_inode(fs,ids[i - first])->type;
+      }
+   }
+   free(ids);
+   *numentries = ientry;
+   return 0;
 }
 
 
 int fs_readdir(fs_t* fs, inodeid_t dir, fs_file_name_t* entries, int maxentries,
    int* numentries)
 {
-   if (fs == NULL || dir >= ITAB_SIZE || entries == NULL ||
-      numentries == NULL || maxentries < 0) {
+   if (fs == NULL || dir >= fs->sb.num_inodes) {
       dprintf("[fs_readdir] malformed arguments.\n");
       return -1;
    }
 
-   if (!BMAP_ISSET(fs->inode_bmap,dir)) {
-      dprintf("[fs_readdir] inode is not being used.\n");
-      return -1;
-   }
+   // the entries' inodes cannot change type while 'dir' is locked
+   fsi_tree_lock(fs,FS_SHARED);
+   fsi_inode_lock(fs,dir,FS_SHARED);
+   int res = fsi_readdir(fs,dir,entries,maxentries,numentries);
+   fsi_inode_unlock(fs,dir);
+   fsi_tree_unlock(fs);
+   return res;
+}
+
+
+void fs_dump(fs_t* fs)
+{
+   printf("Free block bitmap:\n");
+   fsi_dump_bmap(BBMAP(fs,0),BLOCK_SIZE(fs));
+   printf("\n");
+   
+   printf("Free inode table bitmap:\n");
+   fsi_dump_bmap(IBMAP(fs,0),BLOCK_SIZE(fs));
+   printf("\n");
+}
+
+int fsi_dir_search_file(fs_t* fs,inodeid_t dir,int i,inodeid_t* fileid);
+
+int inode_search(fs_t* fs,inodeid_t file, inodeid_t* inodeid);
+
+
+/*
+ * Subtree walks
+ *
+ * Copying or removing a directory walks its subtree. The directories
+ * still to visit are kept in a work list and a pool of up to
+ * FS_TREE_WORKERS threads visits them in parallel: a visit reads the
+ * entries of a directory at once, handles its files and adds its
+ * subdirectories to the list. The walks run with the tree locked
+ * exclusively, and a visit only changes the directory it was given (or
+ * the one receiving its copies), so no inode locks are taken; the
+ * metadata is stored once, by the caller, when the walk ends. A remove
+ * counts the files sharing each block before it starts (see
+ * fsi_share_count), so the files are released in parallel too.
+ */
+
+#ifndef FS_TREE_WORKERS
+// maximum number of threads visiting the directories of a subtree
+#define FS_TREE_WORKERS 4
+#endif
+
+typedef struct fs_tree_ fs_tree_t;
+
+// a directory to visit and, in a copy, the directory receiving its entries
+typedef struct {
+   inodeid_t dir;
+   inodeid_t dest;
+} fs_tree_item_t;
+
+typedef int (*fs_tree_visit_t)(fs_tree_t* tree, fs_tree_item_t* item);
+
+struct fs_tree_ {
+   fs_t* fs;
+   fs_tree_visit_t visit;
+   sthread_mon_t mon;         // protects the work list (and see below)
+   fs_tree_item_t* items;     // directories still to visit
+   int count, size;
+   int busy;                  // number of visits in progress
+   int error;                 // a visit failed: the walk stops
+   int budget;                // (copy) number of entries left to copy
+   int* shares;               // (remove) see fsi_share_count
+};
+
+
+/*
+ * fsi_tree_push: adds a directory to the work list of a walk
+ */
+static void fsi_tree_push(fs_tree_t* tree, inodeid_t dir, inodeid_t dest)
+{
+   sthread_monitor_enter(tree->mon);
+   if (tree->count == tree->size) {
+      tree->size = MAX(2 * tree->size, 16);
+      tree->items = (fs_tree_item_t*) realloc(tree->items,
+         tree->size * sizeof(fs_tree_item_t));
+   }
+   tree->items[tree->count].dir = dir;
+   tree->items[tree->count].dest = dest;
+   tree->count++;
+   sthread_monitor_signal(tree->mon);
+   sthread_monitor_exit(tree->mon);
+}
+
+
+/*
+ * fsi_tree_worker: visits directories of the work list until it is
+ * empty and no visit in progress can add more
+ */
+static void* fsi_tree_worker(void* arg)
+{
+   fs_tree_t* tree = (fs_tree_t*) arg;
+   fs_tree_item_t item;
+
+   sthread_monitor_enter(tree->mon);
+   while (1) {
+      while (tree->count == 0 && tree->busy > 0 && !tree->error) {
+         sthread_monitor_wait(tree->mon);
+      }
+      if (tree->count == 0 || tree->error) {
+         break;
+      }
+      // the last directory added first, so the list stays short
+      item = tree->items[--tree->count];
+      tree->busy++;
+      sthread_monitor_exit(tree->mon);
+
+      int res = tree->visit(tree,&item);
 
-   fs_inode_t* idir = &fs->inode_tab[dir];
-   if (idir->type != FS_DIR) {
-      dprintf("[fs_readdir] inode is not a directory.\n");
-      return -1;
+      sthread_monitor_enter(tree->mon);
+      tree->busy--;
+      if (res) {
+         tree->error = 1;
+      }
+      sthread_monitor_signalall(tree->mon);
    }
+   sthread_monitor_exit(tree->mon);
+   return NULL;
+}
 
-   // fill in the entries with the directory content
-   fs_dentry_t page[DIR_PAGE_ENTRIES];
-   int num = MIN(idir->size / sizeof(fs_dentry_t), maxentries);
-   int iblock = 0, ientry = 0;
 
-   while (num > 0) {
-   	  readFrom_cache(fs, idir->blocks[iblock++],(char*)page);
-      for (int i = 0; i < DIR_PAGE_ENTRIES && num > 0; i++, num--) {
-         strcpy(entries[ientry].name, page[i].name);
-         entries[ientry].type = fs->inode_tab[page[i].inodeid].type;
-         ientry++;
+/*
+ * fsi_tree_walk: visits the directory 'dir' and its subdirectories
+ * - dest: (copy) the directory receiving the entries of 'dir'
+ * - budget: (copy) the number of entries that may be copied
+ * - shares: (remove) the files holding each block (see fsi_share_count)
+ *   returns: 0 if successful, -1 if a visit failed
+ */
+static int fsi_tree_walk(fs_t* fs, fs_tree_visit_t visit, inodeid_t dir,
+   inodeid_t dest, int budget, int* shares)
+{
+   fs_tree_t tree;
+   sthread_t workers[FS_TREE_WORKERS];
+   int n;
+
+   tree.fs = fs;
+   tree.visit = visit;
+   tree.mon = sthread_monitor_init();
+   tree.items = NULL;
+   tree.count = tree.size = 0;
+   tree.busy = 0;
+   tree.error = 0;
+   tree.budget = budget;
+   tree.shares = shares;
+
+   // the first directory is visited at once: the workers are only
+   // started when it has subdirectories
+   fs_tree_item_t first = {dir, dest};
+   tree.error = (visit(&tree,&first) != 0);
+   for (n = 0; n < FS_TREE_WORKERS - 1 && tree.count > 0 && !tree.error; n++) {
+      workers[n] = sthread_create(fsi_tree_worker,(void*)&tree,1);
+      if (workers[n] == NULL) {
+         break;
       }
    }
-   *numentries = ientry;
-   return 0;
+   // the calling thread works too (alone if no worker could be started)
+   fsi_tree_worker(&tree);
+   for (int i = 0; i < n; i++) {
+      sthread_join(workers[i],NULL);
+   }
+
+   sthread_monitor_free(tree.mon);
+   free(tree.items);
+   return tree.error ? -1 : 0;
 }
 
 
-void fs_dump(fs_t* fs)
+/*
+ * fsi_share_key: the block by which the copies sharing the blocks of a
+ *   file are found (copies share every block, the first one that is not
+ *   a hole is enough), or 0 if the file has none
+ */
+static unsigned fsi_share_key(fs_inode_t* inode)
 {
-   printf("Free block bitmap:\n");
-   fsi_dump_bmap(fs->blk_bmap,BLOCK_SIZE);
-   printf("\n");
-   
-   printf("Free inode table bitmap:\n");
-   fsi_dump_bmap(fs->inode_bmap,BLOCK_SIZE);
-   printf("\n");
+	if(inode->type != FS_FILE || INODE_IS_INLINE(inode))
+		return 0;
+	// delayed blocks belong to the file alone
+	for(int k = 0; k < INODE_NUM_BLKS; k++){
+		if(inode->blocks[k] != 0 && !BLK_IS_DELAYED(inode->blocks[k]))
+			return inode->blocks[k];
+	}
+	return 0;
 }
 
-int fs_remove_aux(fs_t* fs, inodeid_t file);
-
-int fsi_dir_search_file(fs_t* fs,inodeid_t dir,int i,inodeid_t* fileid);
 
-void swap_entry(fs_t* fs,inodeid_t mother, inodeid_t file){
-	fs_inode_t* imother = &fs->inode_tab[mother];
-	int num = imother->size/ sizeof(fs_dentry_t);
-	int i, j, k;
-	int file_be, file_b, last_be, last_b;
-	fs_dentry_t page1[DIR_PAGE_ENTRIES];
-	fs_dentry_t page2[DIR_PAGE_ENTRIES];
-	if(num > 32){
-		last_b=1;
-		last_be= (num%32)-1;
+/*
+ * fsi_share_count: counts the files of each share key (see
+ *   fsi_share_key), so that the files of a subtree can be released in
+ *   any order: the last one holding a key releases the blocks
+ *   returns: the counts, indexed by block number (freed by the caller)
+ */
+static int* fsi_share_count(fs_t* fs)
+{
+	int* shares = (int*) calloc(fs->sb.num_blocks, sizeof(int));
+	for(inodeid_t i = 1; i < fs->sb.num_inodes; i++){
+		if(BMAP_ISSET(IBMAP(fs,i),i)){
+			unsigned key = fsi_share_key(fsi_inode(fs,i));
+			if(key != 0)
+				shares[key]++;
+		}
 	}
-	else{
-		last_b=0;
-		last_be= num-1;
-	}
-	for(i=0, j=0; imother->blocks[i]!=0 && i<2;i++){
-		readFrom_cache(fs,imother->blocks[i],(char*)page1);
-		for(k=0; k<DIR_PAGE_ENTRIES && j < num; j++, k++){
-			if( page1[k].inodeid == file){
-				file_b=i;
-				file_be=k;
-				break;
-			}
+	return shares;
+}
+
+
+/*
+ * fsi_release_inode: releases a removed inode and its blocks, unless a
+ *   copy still shares them (the caller stores the metadata)
+ * - shares: the counts of fsi_share_count, or NULL to search the copies
+ */
+static void fsi_release_inode(fs_t* fs, inodeid_t file, int* shares)
+{
+	fs_inode_t* ifile = fsi_inode(fs,file);
+	unsigned blks[INODE_NUM_BLKS];
+	int n = 0;
+	inodeid_t aux;
+
+	// only the blocks of files are shared (copies get new directories)
+	unsigned key = fsi_share_key(ifile);
+	int last;
+	if(key == 0)
+		last = 1;
+	else if(shares != NULL)
+		last = (__sync_sub_and_fetch(&shares[key],1) == 0);
+	else
+		last = !fsi_is_shared(fs,file,&aux);
+
+	fsi_delay_drop(fs, ifile);
+	if(!INODE_IS_INLINE(ifile) && last){
+		for(int i = 0; i < INODE_NUM_BLKS; i++){
+			if(ifile->blocks[i] == 0)
+				continue;
+			cache_clean(ifile->blocks[i]);
+			blks[n++] = ifile->blocks[i];
 		}
 	}
-	readFrom_cache( fs,imother->blocks[0],(char*)page1);
-	readFrom_cache(fs,imother->blocks[1],(char*)page2);
-	unsigned temp_inode;
-	char temp_name[FS_MAX_FNAME_SZ];
-	if(file_b==1 && last_b==1){
-		temp_inode=page2[file_be].inodeid;
-		strcpy(temp_name,page2[file_be].name);
-		page2[file_be].inodeid = page2[last_be].inodeid;
-		strcpy(page2[file_be].name,page2[last_be].name);
-		page2[last_be].inodeid = temp_inode;
-		strcpy(page2[last_be].name,temp_name);
-	}
-	if(file_b==1 && last_b==0){
-		temp_inode=page2[file_be].inodeid;
-		strcpy(temp_name,page2[file_be].name);
-		page2[file_be].inodeid = page1[last_be].inodeid;
-		strcpy(page2[file_be].name,page1[last_be].name);
-		page1[last_be].inodeid = temp_inode;
-		strcpy(page1[last_be].name,temp_name);
-	}
-	if(file_b==0 && last_b==1){
-		temp_inode=page1[file_be].inodeid;
-		strcpy(temp_name,page1[file_be].name);
-		page1[file_be].inodeid = page2[last_be].inodeid;
-		strcpy(page1[file_be].name,page2[last_be].name);
-		page2[last_be].inodeid = temp_inode;
-		strcpy(page2[last_be].name,temp_name);
-	}
-	if(file_b==0 && last_b==0){
-		temp_inode=page1[file_be].inodeid;
-		strcpy(temp_name,page1[file_be].name);
-		page1[file_be].inodeid = page1[last_be].inodeid;
-		strcpy(page1[file_be].name,page1[last_be].name);
-		page1[last_be].inodeid = temp_inode;
-		strcpy(page1[last_be].name,temp_name);
-	}
-	writeIn_cache(fs, imother->blocks[0],(char*)page1);
-	writeIn_cache(fs, imother->blocks[1],(char*)page2);
-}
-
-int fs_remove(fs_t* fs, inodeid_t dir,char* name, inodeid_t* fileid)
-{
-	if (fs == NULL || dir >= ITAB_SIZE) {
-		dprintf("[fs_remove] malformed arguments.\n");
-		return -1;
+
+	fsi_inode_init(ifile, FS_FILE);
+	fsi_ifree(fs,file);
+	fsi_bfree_blocks(fs,blks,n);
+}
+
+
+/*
+ * fsi_remove_visit: releases the files of a directory being removed and
+ *   the directory itself; its subdirectories are left to the walk
+ */
+static int fsi_remove_visit(fs_tree_t* tree, fs_tree_item_t* item)
+{
+	fs_t* fs = tree->fs;
+	int num;
+	fs_dentry_t* entries = fsi_dir_entries(fs,item->dir,&num);
+
+	for(int i = 0; i < num; i++){
+		inodeid_t id = entries[i].inodeid;
+		if(fsi_inode(fs,id)->type == FS_DIR){
+			fsi_tree_push(tree,id,0);
+		} else {
+			fsi_release_inode(fs,id,tree->shares);
+		}
 	}
+	free(entries);
 
-	if (!BMAP_ISSET(fs->inode_bmap,dir)) {
-		dprintf("[fs_remove] inode is not being used.\n");
-		return -1;
+	fsi_release_inode(fs,item->dir,tree->shares);
+	return 0;
+}
+
+/*
+ * fsi_dir_remove_entry: removes the entry at index pos of a directory
+ *   the last entry is moved into the hole, so only the pages holding
+ *   both entries are touched, and the last page is released when empty;
+ *   works for directories of any size up to DIR_MAX_ENTRIES
+ */
+static void fsi_dir_remove_entry(fs_t* fs, inodeid_t dir, int pos)
+{
+	fs_inode_t* idir = fsi_inode(fs,dir);
+	int last = idir->size / sizeof(fs_dentry_t) - 1;
+	int per_page = DIR_PAGE_ENTRIES(fs);
+
+	if (pos < 0 || pos > last || last >= DIR_MAX_ENTRIES(fs)) {
+		dprintf("[fsi_dir_remove_entry] entry out of the directory.\n");
+		return;
+	}
+	if (pos != last) {
+		fs_dentry_t entry;
+		fs_dentry_t* page = (fs_dentry_t*)cache_get(fs,idir->blocks[last/per_page],CACHE_READ);
+		memcpy(&entry,&page[last%per_page],sizeof(fs_dentry_t));
+		cache_put((char*)page,0);
+		page = (fs_dentry_t*)cache_get(fs,idir->blocks[pos/per_page],CACHE_WRITE);
+		memcpy(&page[pos%per_page],&entry,sizeof(fs_dentry_t));
+		cache_put((char*)page,1);
 	}
-	inodeid_t file;
-	if(fsi_dir_search(fs, dir, name, &file)){
-		return -1;
+	idir->size -= sizeof(fs_dentry_t);
+	// the last block of the directory is released when it is empty
+	if (BLOCK_OFF(fs,idir->size) == 0) {
+		unsigned blk = BLOCK_NUM(fs,idir->size);
+		cache_clean(idir->blocks[blk]);
+		fsi_bfree(fs,idir->blocks[blk]);
+		idir->blocks[blk] = 0;
 	}
+}
 
-	
-	swap_entry(fs, dir, file);
-	
-	
-	if(fs_remove_aux(fs, file)){
-		return -1;
+static int fsi_remove(fs_t* fs, inodeid_t dir, inodeid_t file, int pos,
+	inodeid_t* fileid, fs_itype_t* type)
+{
+	*type = fsi_inode(fs,file)->type;
+	if(*type == FS_DIR){
+		int* shares = fsi_share_count(fs);
+		fsi_tree_walk(fs, fsi_remove_visit, file, 0, 0, shares);
+		free(shares);
+	} else {
+		fsi_release_inode(fs, file, NULL);
 	}
-	fs_inode_t*  idir= &fs->inode_tab[dir];
-	idir->size -= sizeof(fs_dentry_t);
+	fsi_dir_remove_entry(fs, dir, pos);
 	fsi_store_fsdata(fs);
 	*fileid= file;
 	return 0;
 }
 
-int fs_remove_aux(fs_t* fs, inodeid_t file)
+
+int fs_remove(fs_t* fs, inodeid_t dir,char* name, inodeid_t* fileid,
+	fs_itype_t* type)
 {
-	fs_inode_t* ifile = &fs->inode_tab[file];
-	if (ifile->type == FS_DIR){
-		inodeid_t inodeId;
-		int num = ifile->size / sizeof(fs_dentry_t);
- 		for(int i=0;i<num;++i){
- 			if(fsi_dir_search_file(fs,file,i,&inodeId))
- 				return -1;
- 			if(fs_remove_aux(fs, inodeId))
- 				return -1;
- 		}
+	if (fs == NULL || dir >= fs->sb.num_inodes) {
+		dprintf("[fs_remove] malformed arguments.\n");
+		return -1;
 	}
-	inodeid_t aux;
 
-	if(!inode_search(fs,file, &aux)){
-		//erase blocks and update block bmap
-		char null_block[BLOCK_SIZE];
-		memset(null_block,0,sizeof(null_block));
-		for(int i = 0; ifile->blocks[i] != 0; i++){ 
- 		   	block_write(fs->blocks,ifile->blocks[i],null_block);
-	    	BMAP_CLR(fs->blk_bmap, ifile->blocks[i]);
-	    	cache_clean(ifile->blocks[i]);
-	  }
-  }
-  
-	//update inode bmapnode� may be used uninitialized in this fu
-	BMAP_CLR(fs->inode_bmap,file);
-	fsi_inode_init(ifile, FS_FILE);
-    
-    
-  // save the file system metadata
-	fsi_store_fsdata(fs);
-	return 0;
+	inodeid_t file, check;
+	int pos;
+	fsi_tree_lock(fs,FS_SHARED);
+	fsi_inode_lock(fs,dir,FS_EXCL);
+	while (1) {
+		if (!BMAP_ISSET(IBMAP(fs,dir),dir)) {
+			dprintf("[fs_remove] inode is not being used.\n");
+			fsi_inode_unlock(fs,dir);
+			fsi_tree_unlock(fs);
+			return -1;
+		}
+		if(fsi_dir_lookup(fs, dir, name, &file, &pos)){
+			fsi_inode_unlock(fs,dir);
+			fsi_tree_unlock(fs);
+			return -1;
+		}
+
+		if (fsi_inode(fs,file)->type == FS_DIR) {
+			// removing a subtree locks the whole tree
+			fsi_inode_unlock(fs,dir);
+			fsi_tree_unlock(fs);
+			fsi_tree_lock(fs,FS_EXCL);
+			int res = -1;
+			if (BMAP_ISSET(IBMAP(fs,dir),dir) &&
+				!fsi_dir_lookup(fs, dir, name, &file, &pos)) {
+				res = fsi_remove(fs, dir, file, pos, fileid, type);
+			}
+			fsi_tree_unlock(fs);
+			return res;
+		}
+
+		if (file > dir) {
+			fsi_inode_lock(fs,file,FS_EXCL);
+			break;
+		}
+
+		// keep the ascending order: release the directory and retry
+		// once both inodes are locked, the entry may have changed
+		fsi_inode_unlock(fs,dir);
+		fsi_inode_lock2(fs,dir,FS_EXCL,file,FS_EXCL);
+		if (BMAP_ISSET(IBMAP(fs,dir),dir) &&
+			!fsi_dir_lookup(fs, dir, name, &check, &pos) && check == file &&
+			fsi_inode(fs,file)->type == FS_FILE) {
+			break;
+		}
+		fsi_inode_unlock(fs,file);
+	}
+
+	int res = fsi_remove(fs, dir, file, pos, fileid, type);
+	fsi_inode_unlock2(fs,dir,file);
+	fsi_tree_unlock(fs);
+	return res;
 }
 
 int fsi_dir_get_path_name(fs_t* fs,inodeid_t dirId,inodeid_t fileId,char* name);
 
 int fsi_get_path_name(fs_t* fs,inodeid_t fileId,char* name)
 {
-	if(fs==NULL || fileId>=ITAB_SIZE){
+	if(fs==NULL || fileId>=fs->sb.num_inodes){
 		dprintf("[fsi_dir_get_file_name] malformed arguments.\n");
 		return -1;
 	}
 	
-	if(!BMAP_ISSET(fs->inode_bmap,fileId)){
+	if(!BMAP_ISSET(IBMAP(fs,fileId),fileId)){
 		dprintf("[fs_dir_get_file_name] inode is not being used.\n");
 		return -1;
 	}
@@ -852,17 +2773,17 @@ int fsi_get_path_name(fs_t* fs,inodeid_t fileId,char* name)
 
 int fsi_dir_get_path_name(fs_t* fs,inodeid_t dirId,inodeid_t fileId,char* name)
 {	
-	if(fs==NULL || dirId>=ITAB_SIZE || fileId>=ITAB_SIZE){
+	if(fs==NULL || dirId>=fs->sb.num_inodes || fileId>=fs->sb.num_inodes){
 		dprintf("[fsi_dir_get_path_name] malformed arguments.\n");
 		return -1;
 	}
   
-	if(!BMAP_ISSET(fs->inode_bmap,dirId) || !BMAP_ISSET(fs->inode_bmap,fileId)){
+	if(!BMAP_ISSET(IBMAP(fs,dirId),dirId) || !BMAP_ISSET(IBMAP(fs,fileId),fileId)){
 		dprintf("[fsi_dir_get_path_name] inode is not being used.\n");
 		return -1;
 	}
   
-	fs_inode_t* dirInode=&fs->inode_tab[dirId];
+	fs_inode_t* dirInode=fsi_inode(fs,dirId);
   
 	if(dirInode->type!=FS_DIR){
 		dprintf("[fsi_dir_get_path_name] inode is not a directory.\n");
@@ -879,18 +2800,19 @@ int fsi_dir_get_path_name(fs_t* fs,inodeid_t dirId,inodeid_t fileId,char* name)
   
 	//check directory entries
 	int num_entries=dirInode->size/sizeof(fs_dentry_t);
-	fs_dentry_t page[DIR_PAGE_ENTRIES];
+	fs_dentry_t* page = (fs_dentry_t*) malloc(BLOCK_SIZE(fs));
 	for(int i=0;dirInode->blocks[i]!=0;i++){
 		readFrom_cache(fs,dirInode->blocks[i],(char*)page);
-		for(int j=0;j<DIR_PAGE_ENTRIES && num_entries>0;++j){
+		for(int j=0;j<DIR_PAGE_ENTRIES(fs) && num_entries>0;++j){
 			--num_entries;
 			fs_dentry_t* entry=&page[j];
 			if(entry->inodeid==fileId){
 				strcat(name,"/");
 				strcat(name,entry->name);
+				free(page);
 				return 0;
 			}
-			if(fs->inode_tab[entry->inodeid].type==FS_DIR){
+			if(fsi_inode(fs,entry->inodeid)->type==FS_DIR){
 				int nameSize=strlen(tempName);
 				int tempSize=strlen(entry->name);
 				strcat(tempName,"/");
@@ -898,6 +2820,7 @@ int fsi_dir_get_path_name(fs_t* fs,inodeid_t dirId,inodeid_t fileId,char* name)
 				char* tempPtr=&tempName[nameSize];
 				if(fsi_dir_get_path_name(fs,entry->inodeid,fileId,tempName)==0){
 					strcat(name,tempName);
+					free(page);
 					return 0;
 				}
 				else
@@ -906,28 +2829,24 @@ int fsi_dir_get_path_name(fs_t* fs,inodeid_t dirId,inodeid_t fileId,char* name)
 		}
 	}
   
+  free(page);
   return -1;
 }
 
 int fsi_num_blocks_used(fs_t* fs)
 {
-	int blocks=0;
-	for(int i=0;i<block_num_blocks(fs->blocks);++i){
-		if(BMAP_ISSET(fs->blk_bmap,i))
-			++blocks;
-	}
-	return blocks;
+	return fs->sb.num_blocks-fs->sb.free_blocks;
 }
 
 
 int fsi_dir_search_file(fs_t* fs,inodeid_t dir,int i,inodeid_t* fileid)
 {
-   fs_dentry_t page[DIR_PAGE_ENTRIES];
-   fs_inode_t* idir = &fs->inode_tab[dir];
+   fs_inode_t* idir = fsi_inode(fs,dir);
    
-   readFrom_cache(fs,idir->blocks[i/DIR_PAGE_ENTRIES],(char*)page);
-   if((i/DIR_PAGE_ENTRIES) <DIR_PAGE_ENTRIES){
-      *fileid=page[i%DIR_PAGE_ENTRIES].inodeid;
+   if(i >= 0 && i < idir->size / sizeof(fs_dentry_t) && i < DIR_MAX_ENTRIES(fs)){
+      fs_dentry_t* page = (fs_dentry_t*)cache_get(fs,idir->blocks[i/DIR_PAGE_ENTRIES(fs)],CACHE_READ);
+      *fileid=page[i%DIR_PAGE_ENTRIES(fs)].inodeid;
+      cache_put((char*)page,0);
       return 0;
    }
    
@@ -936,13 +2855,21 @@ int fsi_dir_search_file(fs_t* fs,inodeid_t dir,int i,inodeid_t* fileid)
 
 int inode_search(fs_t* fs,inodeid_t file, inodeid_t* inodeid)
 {
-	fs_inode_t* ifile = &fs->inode_tab[file];
+	fs_inode_t* ifile = fsi_inode(fs,file);
 	int i=0;
-	for(i=1; i<ITAB_SIZE; i++){
+	// inline files have no blocks to share
+	if(INODE_IS_INLINE(ifile))
+		return 0;
+	// a copy shares every block, the first one is enough (not a hole)
+	int k=0;
+	while(k<INODE_NUM_BLKS && ifile->blocks[k]==0)
+		k++;
+	if(k==INODE_NUM_BLKS)
+		return 0;
+	for(i=1; i<fs->sb.num_inodes; i++){
 		if(i!=file){
-			if(BMAP_ISSET(fs->inode_bmap,i)){
-				if(ifile->blocks[0] == fs->inode_tab[i].blocks[0] && ifile->blocks[0]!=0){
-					printf("blocos partilhados ficheiros:%d & %d\n",file,i);
+			if(BMAP_ISSET(IBMAP(fs,i),i) && !INODE_IS_INLINE(fsi_inode(fs,i))){
+				if(ifile->blocks[k] == fsi_inode(fs,i)->blocks[k]){
 					*inodeid=i;
 					return 1;
 				}
@@ -952,30 +2879,8 @@ int inode_search(fs_t* fs,inodeid_t file, inodeid_t* inodeid)
 	return 0;
 }
 
-int get_name(fs_t* fs, inodeid_t mother,inodeid_t file, char* name){
-	
-	fs_dentry_t page[DIR_PAGE_ENTRIES];
-	fs_inode_t* imot = &fs->inode_tab[mother];
-   	if (imot->type != FS_DIR) {
-		dprintf("[fs_copy] error mother isn't a directory\n");
-		return -1;
-	}
-	int num = imot->size / sizeof(fs_dentry_t);
-	int i, j, k;
-	for(i=0, j=0; imot->blocks[i]!=0 && i<2;i++){
-		readFrom_cache(fs,imot->blocks[i],(char*)page);
-		for(k=0; k<DIR_PAGE_ENTRIES && j < num; j++, k++){
-			if( file == page[k].inodeid){
-				strcpy(name,page[k].name);
-				return 0;
-			}
-		}
-	}
-	return -1;
-}
-
 int countcopies(fs_t* fs, inodeid_t file){
-		fs_inode_t* ifile = &fs->inode_tab[file];
+		fs_inode_t* ifile = fsi_inode(fs,file);
 	int count=0;
 	if (ifile->type == FS_FILE){
    	return 1;
@@ -995,24 +2900,34 @@ int countcopies(fs_t* fs, inodeid_t file){
 
 int copy_inode_write(fs_t* fs, inodeid_t dest, inodeid_t file)
 {	
-	fs_inode_t* ifile = &fs->inode_tab[file];
-	fs_inode_t* idest = &fs->inode_tab[dest];
-	int i;
-	for( i = 0; ifile->blocks[i] != 0; i++);
-	unsigned temp=0;
-	for(int j=0; i>0; i--, j++){
-			if (!fsi_bmap_find_free(fs->blk_bmap,block_num_blocks(fs->blocks),&temp)) { // ITAB_SIZE
-				dprintf("[fs_write] there are no free blocks.\n");
-				return -1;
-			}
-			BMAP_SET(fs->blk_bmap, temp);
-			dprintf("[fs_write] block %d allocated.\n", temp);
-			idest->blocks[j]=temp;
-			
-		char block_aux[BLOCK_SIZE];	
+	fs_inode_t* ifile = fsi_inode(fs,file);
+	fs_inode_t* idest = fsi_inode(fs,dest);
+	// every block is allocated before the inode changes, so that it is
+	// left as it was if there are not enough
+	unsigned blocks[INODE_NUM_BLKS];
+	int n = 0;
+	for(int j=0; j<INODE_NUM_BLKS; j++){
+		// the holes stay holes, and delayed blocks are not shared
+		if(ifile->blocks[j] == 0 || BLK_IS_DELAYED(ifile->blocks[j]))
+			continue;
+		if (!fsi_balloc(fs,&blocks[n])) {
+			dprintf("[fs_write] there are no free blocks.\n");
+			fsi_bfree_blocks(fs,blocks,n);
+			return -1;
+		}
+		n++;
+	}
+
+	char* block_aux = (char*) malloc(BLOCK_SIZE(fs));
+	for(int j=0, k=0; j<INODE_NUM_BLKS; j++){
+		if(ifile->blocks[j] == 0 || BLK_IS_DELAYED(ifile->blocks[j]))
+			continue;
 		readFrom_cache(fs, ifile->blocks[j], block_aux);
-		writeIn_cache(fs, idest->blocks[j], block_aux);
- 	}
+		writeIn_cache(fs, blocks[k], block_aux);
+		idest->blocks[j]=blocks[k++];
+	}
+	free(block_aux);
+	idest->flags &= ~INODE_SHARED;
  	 	
   	// save the file system metadata
 	fsi_store_fsdata(fs);
@@ -1021,10 +2936,17 @@ int copy_inode_write(fs_t* fs, inodeid_t dest, inodeid_t file)
 
 void copy_inode(fs_t* fs, inodeid_t dest, inodeid_t file)
 {
-	fs_inode_t* ifile = &fs->inode_tab[file];
-	fs_inode_t* idest = &fs->inode_tab[dest];
+	fs_inode_t* ifile = fsi_inode(fs,file);
+	fs_inode_t* idest = fsi_inode(fs,dest);
 	int i;
-	for( i = 0; ifile->blocks[i] != 0; i++)
+	if(INODE_IS_INLINE(ifile)){
+		// the data itself is copied, there is nothing to share
+		*idest=*ifile;
+		return;
+	}
+	ifile->flags |= INODE_SHARED;
+	idest->flags=ifile->flags;
+	for( i = 0; i < INODE_NUM_BLKS; i++)
 		idest->blocks[i]=ifile->blocks[i];
 	idest->size=ifile->size;
 }
@@ -1033,53 +2955,102 @@ int descendsFrom(fs_t* fs,inodeid_t des,inodeid_t parent,inodeid_t* initParent)
 {
 	if(parent==des && parent!=(*initParent))
 		return 1;
-	fs_inode_t* parentInode=&fs->inode_tab[parent];
+	fs_inode_t* parentInode=fsi_inode(fs,parent);
 	int numEntries=parentInode->size/sizeof(fs_dentry_t);
-	int numPages=parentInode->size/(sizeof(fs_dentry_t)*32)+1;
+	int numPages=OFFSET_TO_BLOCKS(fs,parentInode->size);
+	fs_dentry_t* page = (fs_dentry_t*) malloc(BLOCK_SIZE(fs));
 	for(int i=0;i<numPages;++i){
-		fs_dentry_t page[DIR_PAGE_ENTRIES];
 		readFrom_cache(fs,parentInode->blocks[i],(char*)page);
-		for(int j=0;j<numEntries;++j){
+		for(int j=0;j<numEntries && j<DIR_PAGE_ENTRIES(fs);++j){
 			fs_dentry_t* entry=&page[j];
-			fs_inode_t* temp=&fs->inode_tab[entry->inodeid];
+			fs_inode_t* temp=fsi_inode(fs,entry->inodeid);
 			if(temp->type==FS_DIR){
-				if(descendsFrom(fs,des,entry->inodeid,initParent))
+				if(descendsFrom(fs,des,entry->inodeid,initParent)){
+					free(page);
 					return 1;
+				}
 			}
 		}
-	numEntries-=32;
+	numEntries-=DIR_PAGE_ENTRIES(fs);
 	}
+	free(page);
 	return 0;
 }
 
-int fs_copy_first(fs_t* fs, inodeid_t file, inodeid_t dest, inodeid_t mother, int* count);
+/*
+ * fsi_copy_visit: copies the entries of a directory into the directory
+ *   receiving them; the files share their blocks with the originals and
+ *   the new subdirectories are filled by the walk
+ */
+static int fsi_copy_visit(fs_tree_t* tree, fs_tree_item_t* item)
+{
+	fs_t* fs = tree->fs;
+	int num, res = 0;
+	fs_dentry_t* entries = fsi_dir_entries(fs,item->dir,&num);
+
+	for(int i = 0; i < num && res == 0; i++){
+		// the copy stops at the entries the subtree had when it started
+		if(__sync_fetch_and_sub(&tree->budget,1) <= 0)
+			break;
+		inodeid_t src = entries[i].inodeid, new;
+		fs_itype_t type = fsi_inode(fs,src)->type;
+		if(fsi_dir_search(fs, item->dest, entries[i].name, &new) == 0 ||
+			fsi_dir_add(fs, item->dest, entries[i].name, type, &new)){
+			dprintf("[fs_copy] error creating %s.\n", entries[i].name);
+			res = -1;
+		} else if(type == FS_DIR){
+			fsi_tree_push(tree,src,new);
+		} else {
+			copy_inode(fs, new, src);
+		}
+	}
+	free(entries);
+	return res;
+}
 
-int fs_copy_aux(fs_t* fs, inodeid_t file, inodeid_t dest, inodeid_t mother, int* count);
 
-int fs_copy(fs_t* fs, inodeid_t file, char * file_name, inodeid_t dest, char* dest_name, inodeid_t* fileid)
+/*
+ * fsi_copy_into: copies a file over another, or the subtree of a
+ *   directory into another directory
+ * - count: number of entries of the subtree
+ */
+static int fsi_copy_into(fs_t* fs, inodeid_t file, inodeid_t dest, int count)
+{
+	int res = 0;
+	if (fsi_inode(fs,file)->type == FS_FILE){
+		copy_inode(fs, dest, file);
+	} else {
+		res = fsi_tree_walk(fs, fsi_copy_visit, file, dest, count, NULL);
+	}
+	// save the file system metadata
+	fsi_store_fsdata(fs);
+	return res;
+}
+
+static int fsi_copy(fs_t* fs, inodeid_t file, char * file_name, inodeid_t dest, char* dest_name, inodeid_t* fileid)
 {
-	if (fs == NULL || file >= ITAB_SIZE || dest >= ITAB_SIZE) {
+	if (fs == NULL || file >= fs->sb.num_inodes || dest >= fs->sb.num_inodes) {
 		dprintf("[fs_copy] malformed arguments.\n");
 		return -1;
 	}
 	
-	if (!BMAP_ISSET(fs->inode_bmap,file)) {
+	if (!BMAP_ISSET(IBMAP(fs,file),file)) {
 		dprintf("[fs_copy] file/dir inode is not being used.\n");
 		return -1;
 	}
 	
-	if (!BMAP_ISSET(fs->inode_bmap, dest )) {
+	if (!BMAP_ISSET(IBMAP(fs,dest),dest)) {
 		dprintf("[fs_copy] destination inode is not being used.\n");
 		return -1;
 	}
 	
-	fs_inode_t* idest = &fs->inode_tab[dest];
+	fs_inode_t* idest = fsi_inode(fs,dest);
 	if (idest->type != FS_DIR) {
 		dprintf("[fs_copy] inode1 is not a directory.\n");
 		return -1;
 	}
 	
-	fs_inode_t* ifile = &fs->inode_tab[file];
+	fs_inode_t* ifile = fsi_inode(fs,file);
 	if (ifile->type != FS_DIR) {
 		dprintf("[fs_copy] inode2 is not a directory.\n");
 		return -1;
@@ -1096,7 +3067,7 @@ int fs_copy(fs_t* fs, inodeid_t file, char * file_name, inodeid_t dest, char* de
 		return -1;
 	}
 	
-	fs_inode_t* isrc = &fs->inode_tab[src];
+	fs_inode_t* isrc = fsi_inode(fs,src);
 	inodeid_t temp=file;
 	if(isrc->type==FS_DIR && descendsFrom(fs,dest,file,&temp)){
 		dprintf("[fs_copy] you cant copy a directory into one of its subdirectories\n");
@@ -1106,173 +3077,154 @@ int fs_copy(fs_t* fs, inodeid_t file, char * file_name, inodeid_t dest, char* de
 	int count = countcopies(fs, src);
 	inodeid_t dst;
 	if(!fsi_dir_search(fs, dest, dest_name, &dst)){
-		fs_inode_t* idst = &fs->inode_tab[dst];
+		fs_inode_t* idst = fsi_inode(fs,dst);
 		if(isrc->type != idst->type){
    		dprintf("[fs_copy] the files are not of the same type\n");
 			return -1;
 		}
 		*fileid= dst;
 		count--;
-		return fs_copy_first(fs, src, dst, dest, &count);
+		return fsi_copy_into(fs, src, dst, count);
 	}
 	inodeid_t new;
 	if(isrc->type == FS_DIR){
-		if(fs_mkdir(fs, dest, dest_name, &new)){
+		if(fsi_mkdir(fs, dest, dest_name, &new)){
 		  dprintf("[fs_copy] 1 error creating new directory.\n");
   		return -1;
 		}
 	} else {
-		if(fs_create(fs, dest, dest_name, &new)){
+		if(fsi_create(fs, dest, dest_name, &new)){
 		  dprintf("[fs_copy] 2 error creating new file.\n");
   		  return -1;
 		}
 	}
 	count--;
 	*fileid= new;
-	return fs_copy_first(fs, src, new, src, &count);
+	return fsi_copy_into(fs, src, new, count);
 }
 
-int fs_copy_first(fs_t* fs, inodeid_t file, inodeid_t dest, inodeid_t mother, int* count)
-{
-	fs_inode_t* ifile = &fs->inode_tab[file];
-	if (ifile->type == FS_FILE){
-   		copy_inode(fs, dest, file);
-	}else {
-		inodeid_t inodeId;
-		int num = ifile->size / sizeof(fs_dentry_t);
- 		for(int i=0;i<num;++i){
- 			if(fsi_dir_search_file(fs,file,i,&inodeId))
- 				return -1;
- 			if(fs_copy_aux(fs, inodeId, dest, mother, count))
- 				return -1;
- 		}
-	}
-	// save the file system metadata
- 	fsi_store_fsdata(fs);
-	return 0;
-}
 
-int fs_copy_aux(fs_t* fs, inodeid_t file, inodeid_t dest, inodeid_t mother,int* count )
+int fs_copy(fs_t* fs, inodeid_t file, char * file_name, inodeid_t dest, char* dest_name, inodeid_t* fileid)
 {
-	fs_inode_t* ifile = &fs->inode_tab[file];
-	if(*count >=0){
-		if (ifile->type == FS_FILE){
-			char dest_name[FS_MAX_FNAME_SZ];
-			inodeid_t new;
-			if(get_name(fs, mother,  file, dest_name)){
-				dprintf("[fs_copy] 8 error getting directory name.\n");
-					return -1;
-				}
-			if(fs_create(fs, dest, dest_name, &new)){
-				dprintf("[fs_copy] 4 error creating new directory.\n");
-				return -1;
-			}
-		 	copy_inode(fs, new, file);
-		 	(*count)--;
-		 	fsi_store_fsdata(fs);
-		}
-		else {
-			inodeid_t new;
-			inodeid_t inodeId;
-			char dest_name[FS_MAX_FNAME_SZ];
-			if(get_name(fs, mother,  file, dest_name)){
-				dprintf("[fs_copy] 8 error getting directory name.\n");
-					return -1;
-				}
-			if(fs_mkdir(fs, dest, dest_name, &new)){
-				dprintf("[fs_copy] 4 error creating new directory.\n");
-				return -1;
-			}
-			int num = ifile->size / sizeof(fs_dentry_t);
-	 		for(int i=0;i<num;i++){
-	 			if(fsi_dir_search_file(fs,file,i, &inodeId))
-	 				return -1;
-	 			(*count)--;
-	 			if(fs_copy_aux(fs, inodeId, new, file, count))
-	 				return -1;
-	 		}
-		}
-	}
-	return 0;
+	// copies share blocks with their source and may span whole subtrees
+	fsi_tree_lock(fs,FS_EXCL);
+	fsi_delay_alloc_all(fs);
+	int res = fsi_copy(fs,file,file_name,dest,dest_name,fileid);
+	fsi_tree_unlock(fs);
+	return res;
 }
- 
-int fs_append(fs_t* fs, inodeid_t dest, char * dest_name, inodeid_t file, char* file_name)
+
+int fs_append(fs_t* fs, inodeid_t dest, char * dest_name, inodeid_t file, char* file_name,
+	inodeid_t* fileid)
 {
-	if (fs == NULL || file >= ITAB_SIZE || dest >= ITAB_SIZE) {
+	if (fs == NULL || file >= fs->sb.num_inodes || dest >= fs->sb.num_inodes) {
 		dprintf("[fs_append] malformed arguments.\n");
 		return -1;
 	}
 	
-	if (!BMAP_ISSET(fs->inode_bmap,file)) {
+	// resolve both names with the directories locked in shared mode
+	fsi_tree_lock(fs,FS_SHARED);
+	fsi_inode_lock2(fs,dest,FS_SHARED,file,FS_SHARED);
+
+	if (!BMAP_ISSET(IBMAP(fs,file),file)) {
 		dprintf("[fs_append] file/dir inode is not being used.\n");
-		return -1;
+		goto fail_dirs;
 	}
 	
-	if (!BMAP_ISSET(fs->inode_bmap, dest )) {
+	if (!BMAP_ISSET(IBMAP(fs,dest),dest)) {
 		dprintf("[fs_append] destination inode is not being used.\n");
-		return -1;
+		goto fail_dirs;
 	}
 	
-	fs_inode_t* idest = &fs->inode_tab[dest];
+	fs_inode_t* idest = fsi_inode(fs,dest);
 	if (idest->type != FS_DIR) {
 		dprintf("[fs_append] inode1 is not a directory.\n");
-		return -1;
+		goto fail_dirs;
 	}
 	
-	fs_inode_t* ifile = &fs->inode_tab[file];
+	fs_inode_t* ifile = fsi_inode(fs,file);
 	if (ifile->type != FS_DIR) {
 		dprintf("[fs_append] inode2 is not a directory.\n");
-		return -1;
+		goto fail_dirs;
 	}
 	
 	inodeid_t src;
 	if(fsi_dir_search(fs, file, file_name, &src)){
    	dprintf("[fs_append] theres no file with that name\n");
-		return -1;
+		goto fail_dirs;
 	}
 	
 	inodeid_t dst;
 	if(fsi_dir_search(fs, dest, dest_name, &dst)){
    	dprintf("[fs_append] theres no file with that name\n");
-		return -1;
+		goto fail_dirs;
 	}
-	
-	idest = &fs->inode_tab[dst];
-	if (idest->type != FS_FILE) {
+	fsi_inode_unlock2(fs,dest,file);
+
+	// then lock the source (shared) and the destination (exclusive);
+	// a destination sharing blocks with a copy needs the whole tree
+	inodeid_t aux;
+	fs_lock_mode_t mode = FS_SHARED;
+	fsi_inode_lock2(fs,src,FS_SHARED,dst,FS_EXCL);
+	if (fsi_is_shared(fs,dst,&aux)) {
+		fsi_inode_unlock2(fs,src,dst);
+		fsi_tree_unlock(fs);
+		fsi_tree_lock(fs,FS_EXCL);
+		mode = FS_EXCL;
+	}
+
+	int res = -1;
+	idest = fsi_inode(fs,dst);
+	ifile = fsi_inode(fs,src);
+	if (!BMAP_ISSET(IBMAP(fs,dst),dst) || idest->type != FS_FILE) {
 		dprintf("[fs_append] inode1 is not a file.\n");
-		return -1;
-	}
-	
-	ifile = &fs->inode_tab[src];
-	if (ifile->type != FS_FILE) {
+	} else if (!BMAP_ISSET(IBMAP(fs,src),src) || ifile->type != FS_FILE) {
 		dprintf("[fs_append] inode2 is not a file.\n");
-		return -1;
+	} else {
+		unsigned offset = idest->size;
+		unsigned size = ifile->size;
+		int test=0;
+		// up to INODE_NUM_BLKS blocks: too large for a thread stack
+		char* buffer = (char*) malloc(size > 0 ? size : 1);
+		if (buffer == NULL) {
+			dprintf("[fs_append] out of memory.\n");
+		} else if(!fsi_read(fs, src, 0, size, buffer,&test) &&
+			!fsi_write(fs, dst, offset, test, buffer)) {
+			*fileid = dst;
+			res = 0;
+		}
+		free(buffer);
 	}
-	
-	unsigned offset = idest->size;
-	unsigned size = ifile->size;
-	int test=0;
-	char buffer[size];
-	if(fs_read(fs, src, 0, size, buffer,&test))
- 		return -1;
- 	if(fs_write(fs, dst, offset, test, buffer))
- 		return -1;
- 	return 0;
+
+	if (mode == FS_SHARED) {
+		fsi_inode_unlock2(fs,src,dst);
+	}
+	fsi_tree_unlock(fs);
+ 	return res;
+
+fail_dirs:
+	fsi_inode_unlock2(fs,dest,file);
+	fsi_tree_unlock(fs);
+	return -1;
 }
 
-int fs_diskusage(fs_t* fs)
+static int fsi_diskusage(fs_t* fs)
 {
+	fsi_delay_alloc_all(fs);
 	printf("===== Dump: FileSystem Blocks =======================\n");
-	int num_blocks=fsi_num_blocks_used(fs)-10;
-	for(int i=0,j=10;i<num_blocks;++i,++j){
-		while(!BMAP_ISSET(fs->blk_bmap,j))
+	int first=fs->sb.data_start;
+	int num_blocks=fsi_num_blocks_used(fs)-first;
+	for(int i=0,j=first;i<num_blocks;++i,++j){
+		while(!BMAP_ISSET(BBMAP(fs,j),j))
 			++j;
-		if(j>num_blocks+10)
+		if(j>num_blocks+first)
 			return 0;	
 		dprintf("blk_id: %d\n",j);
-		for(int k=1,n=0;k<ITAB_SIZE;++k){
+		for(int k=1,n=0;k<fs->sb.num_inodes;++k){
+			if(!BMAP_ISSET(IBMAP(fs,k),k) || INODE_IS_INLINE(fsi_inode(fs,k)))
+				continue;
 			for(int l=0;l<INODE_NUM_BLKS;++l){
-				if(fs->inode_tab[k].blocks[l]==j){
+				if(fsi_inode(fs,k)->blocks[l]==j){
 					char pathname[MAX_PATH_NAME_SIZE];
 					if(fsi_get_path_name(fs,k,pathname)==0){
 						printf("file_name%d: %s\n",n++,pathname);
@@ -1288,10 +3240,23 @@ int fs_diskusage(fs_t* fs)
 	return 0;
 }
 
+
+int fs_diskusage(fs_t* fs)
+{
+	fsi_tree_lock(fs,FS_EXCL);
+	int res = fsi_diskusage(fs);
+	fsi_tree_unlock(fs);
+	return res;
+}
+
 int getOwner(fs_t* fs,int block_number){
-	for(int i=1;i<ITAB_SIZE;++i){
-		fs_inode_t* inode=&fs->inode_tab[i];
-		for(int j=0;inode->blocks[j]!=0;++j){
+	for(int i=1;i<fs->sb.num_inodes;++i){
+		if(!BMAP_ISSET(IBMAP(fs,i),i))
+			continue;
+		fs_inode_t* inode=fsi_inode(fs,i);
+		if(INODE_IS_INLINE(inode))
+			continue;
+		for(int j=0;j<INODE_NUM_BLKS;++j){
 			if(inode->blocks[j]==block_number)
 				return i;
 		}
@@ -1301,14 +3266,14 @@ int getOwner(fs_t* fs,int block_number){
 
 void swap(fs_t* fs,inodeid_t s_owner,int src,int dst){
 	int d_owner=getOwner(fs,dst);
+	char* buffer0 = (char*) malloc(BLOCK_SIZE(fs));
+	char* buffer1 = (char*) malloc(BLOCK_SIZE(fs));
 	if(d_owner==s_owner){
-		char buffer0[BLOCK_SIZE];
-		char buffer1[BLOCK_SIZE];
 		block_read(fs->blocks,src,buffer0);
 		block_read(fs->blocks,dst,buffer1);
 		block_write(fs->blocks,dst,buffer0);
 		block_write(fs->blocks,src,buffer1);
-		fs_inode_t* ownerInode=&fs->inode_tab[s_owner];
+		fs_inode_t* ownerInode=fsi_inode(fs,s_owner);
 		int i,j;
 		for(i=0;ownerInode->blocks[i]!=src;++i);
 		for(j=0;ownerInode->blocks[j]!=dst;++j);
@@ -1317,28 +3282,28 @@ void swap(fs_t* fs,inodeid_t s_owner,int src,int dst){
 	}
 	else{
 		if(d_owner==-1){
-			char buffer[BLOCK_SIZE];
-			block_read(fs->blocks,src,buffer);
-			block_write(fs->blocks,dst,buffer);
-			fs_inode_t* ownerInode=&fs->inode_tab[s_owner];
+			block_read(fs->blocks,src,buffer0);
+			block_write(fs->blocks,dst,buffer0);
+			fs_inode_t* ownerInode=fsi_inode(fs,s_owner);
 			int i;
 			for(i=0;ownerInode->blocks[i]!=src;++i);
 			ownerInode->blocks[i]=dst;
-			BMAP_CLR(fs->blk_bmap,src);
-			BMAP_SET(fs->blk_bmap,dst);
-			char null_block[BLOCK_SIZE];
-			memset(null_block,0,sizeof(null_block));
-			block_write(fs->blocks,src,null_block);
+			fsi_bfree(fs,src);
+			sthread_mutex_lock(fs->blk_bmap_lock[BMAP_REGION(fs,dst)]);
+			BMAP_SET(BBMAP(fs,dst),dst);
+			BMAP_DIRTY(fs->blk_bmap,dst);
+			__sync_fetch_and_sub(&fs->sb.free_blocks,1);
+			sthread_mutex_unlock(fs->blk_bmap_lock[BMAP_REGION(fs,dst)]);
+			memset(buffer1,0,BLOCK_SIZE(fs));
+			block_write(fs->blocks,src,buffer1);
 		}
 		else{
-			char buffer0[BLOCK_SIZE];
-			char buffer1[BLOCK_SIZE];
 			block_read(fs->blocks,src,buffer0);
 			block_read(fs->blocks,dst,buffer1);
 			block_write(fs->blocks,dst,buffer0);
 			block_write(fs->blocks,src,buffer1);
-			fs_inode_t* sInode=&fs->inode_tab[s_owner];
-			fs_inode_t* dInode=&fs->inode_tab[s_owner];
+			fs_inode_t* sInode=fsi_inode(fs,s_owner);
+			fs_inode_t* dInode=fsi_inode(fs,d_owner);
 			int i,j;
 			for(i=0;sInode->blocks[i]!=src;++i);
 			for(j=0;dInode->blocks[j]!=dst;++j);
@@ -1346,24 +3311,29 @@ void swap(fs_t* fs,inodeid_t s_owner,int src,int dst){
 			dInode->blocks[j]=src;
 		}
 	}
+	free(buffer0);
+	free(buffer1);
 			
 	fsi_store_fsdata(fs);
 }
 
-#define MAX_NUM_BLKS ITAB_SIZE-1*INODE_NUM_BLKS
+#define MAX_NUM_BLKS block_num_blocks(fs->blocks)
 
-int fs_defrag(fs_t* fs)
+static int fsi_defrag(fs_t* fs)
 {
+	fsi_delay_alloc_all(fs);
 	cache_flush(fs);
 	
-	int j=10;
-	for(int i=10;i<MAX_NUM_BLKS;){
-		if(BMAP_ISSET(fs->blk_bmap,i)){
+	int j=fs->sb.data_start;
+	for(int i=fs->sb.data_start;i<MAX_NUM_BLKS;){
+		if(BMAP_ISSET(BBMAP(fs,i),i)){
 			int owner=getOwner(fs,i);
 			if(owner==-1)
 				return -1;
-			fs_inode_t* ownerInode=&fs->inode_tab[owner];
-			for(int k=0;ownerInode->blocks[k]!=0;++k){
+			fs_inode_t* ownerInode=fsi_inode(fs,owner);
+			for(int k=0;k<INODE_NUM_BLKS;++k){
+				if(ownerInode->blocks[k]==0)
+					continue;
 				if(ownerInode->blocks[k]!=j)
 					swap(fs,owner,ownerInode->blocks[k],j);
 				++j;
@@ -1376,6 +3346,16 @@ int fs_defrag(fs_t* fs)
 	return 0;
 }
 
+
+int fs_defrag(fs_t* fs)
+{
+	// blocks are moved between files, nothing else may run
+	fsi_tree_lock(fs,FS_EXCL);
+	int res = fsi_defrag(fs);
+	fsi_tree_unlock(fs);
+	return res;
+}
+
 /***************************************************************************************************
 *
 *
@@ -1390,14 +3370,22 @@ int fs_defrag(fs_t* fs)
 
 cache_node* fs_new_cache(fs_t* fs){
 	cache_node* cache=(cache_node*)malloc(sizeof(cache_node)*CACHE_SIZE);
+	// the blocks of the entries are contiguous, so that cache_put finds
+	// the entry of a block with a shift
+	cache_bshift=fs->bshift;
+	cache_data=(char*)calloc(CACHE_SIZE,BLOCK_SIZE(fs));
 	for(int i=0;i<CACHE_SIZE;++i){
 		cache[i].V=0;
 		cache[i].R=0;
 		cache[i].M=0;
 		cache[i].counter=0;
 		cache[i].block_number=-1;
-		memset(cache[i].block,0,sizeof(cache[i].block));
+		cache[i].pin=0;
+		cache[i].busy=0;
+		cache[i].old_number=-1;
+		cache[i].block=&cache_data[i<<cache_bshift];
 	}
+	cache_lock = sthread_monitor_init();
 	if (sthread_create(thread_cache_function, (void*)fs, 1) == NULL) {
     printf("sthread_create failed\n");
     exit(1);
@@ -1407,7 +3395,7 @@ cache_node* fs_new_cache(fs_t* fs){
 
 void printBlock(char* block)
 {
-	for(int i=0;i<BLOCK_SIZE;++i){
+	for(int i=0;i<FS_MIN_BLOCK_SIZE;++i){
 		if(BMAP_ISSET(block,i))
 			printf("1.");
 		else
@@ -1419,6 +3407,7 @@ void printBlock(char* block)
 
 int fs_dumpcache()
 {
+	sthread_monitor_enter(cache_lock);
 	dprintf("===== Dump: Cache of Blocks Entries =======================\n");
 	for(int i=0;i<CACHE_SIZE;++i){
 		printf("Entry: %d\n",i);
@@ -1430,100 +3419,200 @@ int fs_dumpcache()
 		}
 		printf("************************************************************\n");
 	}
+	sthread_monitor_exit(cache_lock);
 	return 0;
 }
 
-void fs_write_back(fs_t* fs,int block_number);
+// the entry cannot be replaced: it is pinned, holds a delayed block or
+// is being loaded or written back
+#define CACHE_HELD(i) (cache[i].pin>0 || cache[i].busy || (cache[i].V && BLK_IS_DELAYED(cache[i].block_number)))
 
-void cache_excg(fs_t* fs,int block_number)
+// loads a block in a free or replaceable entry (only reads it from disk
+// if 'load'), returns the entry or -1 if every entry is held; the old
+// block is written back and the new one read without the cache lock,
+// the entry is busy (and waited for by cache_find's callers) meanwhile
+int cache_excg(fs_t* fs,int block_number,int load)
 {
-	for(int i=0;i<CACHE_SIZE;++i){
-		if(cache[i].V==0){
-			block_read(fs->blocks,block_number,cache[i].block);
-			cache[i].R=1;
-			cache[i].V=1;
-			cache[i].block_number=block_number;
-			return;
-		}
+	int victim=-1;
+	// pinned entries and delayed blocks are never replaced
+	for(int i=0;i<CACHE_SIZE && victim<0;++i){
+		if(cache[i].V==0 && cache[i].pin==0 && !cache[i].busy)
+			victim=i;
 	}
-	for(int i=0;i<CACHE_SIZE;++i){
-		if(cache[i].R==0 && cache[i].M==0){
-			fs_write_back(fs,i);
-			block_read(fs->blocks,block_number,cache[i].block);
-			cache[i].R=1;
-			cache[i].block_number=block_number;
-			return;
-		}
+	for(int i=0;i<CACHE_SIZE && victim<0;++i){
+		if(cache[i].R==0 && cache[i].M==0 && !CACHE_HELD(i))
+			victim=i;
 	}
-	for(int i=0;i<CACHE_SIZE;++i){
-		if(cache[i].R==0){
-			fs_write_back(fs,i);
-			block_read(fs->blocks,block_number,cache[i].block);
-			cache[i].R=1;
-			cache[i].block_number=block_number;
-			return;
-		}
+	for(int i=0;i<CACHE_SIZE && victim<0;++i){
+		if(cache[i].R==0 && !CACHE_HELD(i))
+			victim=i;
 	}
-	for(int i=0;i<CACHE_SIZE;++i){
-		if(cache[i].M==0){
-			fs_write_back(fs,i);
-			block_read(fs->blocks,block_number,cache[i].block);
-			cache[i].R=1;
-			cache[i].block_number=block_number;
-			return;
-		}
+	for(int i=0;i<CACHE_SIZE && victim<0;++i){
+		if(cache[i].M==0 && !CACHE_HELD(i))
+			victim=i;
 	}
-	fs_write_back(fs,0);
-	block_read(fs->blocks,block_number,cache[0].block);
-	cache[0].R=1;
-	cache[0].block_number=block_number;
+	for(int i=0;i<CACHE_SIZE && victim<0;++i){
+		if(!CACHE_HELD(i))
+			victim=i;
+	}
+	if(victim<0)
+		return -1;
+	// a free entry (or a released block) is not written back
+	cache_node* node=&cache[victim];
+	int old=(node->V && node->M)?node->block_number:-1;
+	node->busy=1;
+	node->old_number=old;
+	node->block_number=block_number;
+	node->V=1;
+	node->R=1;
+	node->M=0;
+	if(old>=0 || load){
+		sthread_monitor_exit(cache_lock);
+		if(old>=0)
+			block_write(fs->blocks,old,node->block);
+		if(load)
+			block_read(fs->blocks,block_number,node->block);
+		sthread_monitor_enter(cache_lock);
+	}
+	node->busy=0;
+	node->old_number=-1;
+	sthread_monitor_signalall(cache_lock);
+	return victim;
 }
 
-int cache_read(int block_number,char* block_read)
+// index of the cache entry of a block (or of the entry writing it back)
+// or -1
+static int cache_find(int block_number)
 {
 	for(int i=0;i<CACHE_SIZE;++i){
-		if(cache[i].block_number==block_number){
-			memcpy(block_read,cache[i].block,BLOCK_SIZE);
-			return 1;
-		}
+		if(cache[i].block_number==block_number ||
+		   (cache[i].busy && cache[i].old_number==block_number))
+			return i;
 	}
-	return 0;
+	return -1;
 }
 
-int cache_write(int block_number,char* block)
+// waits (in the cache lock) until no entry is loading or writing back
+// the block
+static void cache_wait_io(int block_number)
 {
-	for(int i=0;i<CACHE_SIZE;++i){
-		if(cache[i].block_number==block_number){
-			memcpy(cache[i].block,block,BLOCK_SIZE);
-			cache[i].R=1;
-			cache[i].M=1;
-			return 1;
-		}
-	}
-	return 0;
+	int i;
+	while((i=cache_find(block_number))>=0 && cache[i].busy)
+		sthread_monitor_wait(cache_lock);
+}
+
+char* cache_get(fs_t* fs, int block_number, cache_mode_t mode)
+{
+	sthread_monitor_enter(cache_lock);
+	int i;
+	while(1){
+		i=cache_find(block_number);
+		// a block being read (e.g. sent from the cache) is not written
+		if(i>=0 && !cache[i].busy && (mode==CACHE_READ || cache[i].pin==0))
+			break;
+		if(i<0 && (i=cache_excg(fs, block_number, mode!=CACHE_OVERWRITE))>=0)
+			break;
+		sthread_monitor_wait(cache_lock);
+	}
+	cache[i].V=1;
+	cache[i].R=1;
+	cache[i].pin++;
+	sthread_monitor_exit(cache_lock);
+	return cache[i].block;
+}
+
+void cache_put(char* block, int dirty)
+{
+	cache_node* node=&cache[(block-cache_data)>>cache_bshift];
+	sthread_monitor_enter(cache_lock);
+	if(dirty)
+		node->M=1;
+	if(--node->pin==0)
+		sthread_monitor_signalall(cache_lock);
+	sthread_monitor_exit(cache_lock);
 }
 
 void writeIn_cache(fs_t* fs, int block_number,char* block){
-	if(!cache_write( block_number , block)){
-		cache_excg(fs, block_number);
-		if(!cache_write( block_number, block))
-			dprintf("[cache_write] error writing from cache");
-    }
+	char* data=cache_get(fs, block_number, CACHE_OVERWRITE);
+	memcpy(data,block,1<<cache_bshift);
+	cache_put(data,1);
 }
 
 void readFrom_cache(fs_t* fs, int block_number,char* block){
-	if(!cache_read( block_number , block)){
-		cache_excg(fs, block_number);
-		if(!cache_read( block_number, block))
-			dprintf("[cache_read] error reading from cache");
-    }
+	char* data=cache_get(fs, block_number, CACHE_READ);
+	memcpy(block,data,1<<cache_bshift);
+	cache_put(data,0);
+}
+
+int cache_pin(fs_t* fs, int* block_numbers, int count, int* entries)
+{
+	sthread_monitor_enter(cache_lock);
+	int n;
+	// stops at the first block that cannot be pinned (no pins left
+	// or every entry is in use)
+	for(n=0;n<count && cache_pinned<CACHE_PIN_MAX;++n){
+		// the pin is counted before the block is loaded (without the lock)
+		cache_pinned++;
+		int i;
+		cache_wait_io(block_numbers[n]);
+		if((i=cache_find(block_numbers[n]))<0 &&
+		   (i=cache_excg(fs, block_numbers[n], 1))<0){
+			cache_pinned--;
+			break;
+		}
+		cache[i].V=1;
+		cache[i].R=1;
+		cache[i].pin++;
+		entries[n]=i;
+	}
+	sthread_monitor_exit(cache_lock);
+	return n;
+}
+
+char* cache_pinned_block(int entry)
+{
+	return cache[entry].block;
+}
+
+void cache_unpin(int* entries, int count)
+{
+	sthread_monitor_enter(cache_lock);
+	for(int n=0;n<count;++n)
+		cache[entries[n]].pin--;
+	cache_pinned-=count;
+	sthread_monitor_signalall(cache_lock);
+	sthread_monitor_exit(cache_lock);
+}
+
+void cache_rename(int block_number, int new_number)
+{
+	sthread_monitor_enter(cache_lock);
+	// an old copy of the new block may still be on its way to disk
+	cache_wait_io(new_number);
+	for(int i=0;i<CACHE_SIZE;++i){
+		// an old copy of the new block (released before) is forgotten
+		if(cache[i].block_number==new_number){
+			cache[i].V=0;
+			cache[i].block_number=-1;
+		}
+	}
+	int i=cache_find(block_number);
+	if(i>=0){
+		cache[i].block_number=new_number;
+		cache[i].M=1;
+	}
+	sthread_monitor_exit(cache_lock);
 }
 
 void cache_clean(int block_number){
+	sthread_monitor_enter(cache_lock);
+	// the block may be written directly once released
+	cache_wait_io(block_number);
 	for(int i=0;i<CACHE_SIZE;++i){
 		if(cache[i].block_number==block_number)
 			cache[i].V=0;
 	}
+	sthread_monitor_exit(cache_lock);
 }
 
 void not_rec_used(int block_number)
@@ -1533,32 +3622,75 @@ void not_rec_used(int block_number)
 
 void fs_write_back(fs_t* fs,int block_number)
 {
+	// delayed blocks (and free entries) have no place on disk
+	if(BLK_IS_DELAYED(cache[block_number].block_number))
+		return;
 	block_write(fs->blocks,cache[block_number].block_number,cache[block_number].block);
 	cache[block_number].M=0;
 }
 
+// writes a dirty entry back without the cache lock (the entry is busy
+// meanwhile); entries in use are left for later
+static void cache_write_back(fs_t* fs,int i)
+{
+	cache_node* node=&cache[i];
+	if(!node->V || !node->M || node->pin>0 || node->busy ||
+	   BLK_IS_DELAYED(node->block_number))
+		return;
+	node->busy=1;
+	node->M=0;
+	sthread_monitor_exit(cache_lock);
+	block_write(fs->blocks,node->block_number,node->block);
+	sthread_monitor_enter(cache_lock);
+	node->busy=0;
+	sthread_monitor_signalall(cache_lock);
+}
+
 void cache_flush(fs_t*fs){
+	sthread_monitor_enter(cache_lock);
 	for(int i=0; i<CACHE_SIZE; i++){
+		while(cache[i].busy)
+			sthread_monitor_wait(cache_lock);
+		if(cache[i].block_number==-1)
+			continue;
 		fs_write_back(fs,i);
+		// the blocks may be moved on disk (defrag), forget them
 		cache[i].V=0;
+		cache[i].block_number=-1;
 	}
+	sthread_monitor_exit(cache_lock);
 }
 
 
+// interval between two runs of the cache thread (microseconds)
+#define CACHE_TICK_US 100000
+
 void * thread_cache_function(void* ptr)
 {
 	while(1){
 		fs_t* fs=(fs_t*) ptr;
-		sleep(1000);
+#ifdef USE_PTHREADS
+		// sthread_sleep with pthreads only waits whole seconds
+		usleep(CACHE_TICK_US);
+#else
+		sthread_sleep(CACHE_TICK_US);
+#endif
+		// the delayed blocks of the files not in use get their place on
+		// disk, so that they are written back (and can be replaced)
+		fsi_tree_lock(fs,FS_SHARED);
+		fsi_delay_reclaim(fs);
+		fsi_tree_unlock(fs);
+		sthread_monitor_enter(cache_lock);
 		for(int i=0;i<CACHE_SIZE;++i){
 			(cache[i].counter)++;
 			if(cache[i].counter%4==0)
 				not_rec_used(i);
 			if(cache[i].counter%10==0)
-				fs_write_back(fs,i);
+				cache_write_back(fs,i);
 			if(cache[i].counter==20)
 				cache[i].counter=0;
 		}
+		sthread_monitor_exit(cache_lock);
 	}
 	return 0;
 }
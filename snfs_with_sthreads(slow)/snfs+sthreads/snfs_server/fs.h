@@ -24,7 +24,10 @@
 // maximum size of a file name used in messages
 #define MAX_PATH_NAME_SIZE 200
 
-#define BLOCK_SIZE 512
+// block sizes supported (powers of two); the size is chosen when the
+// storage is created and recorded in the superblock
+#define FS_MIN_BLOCK_SIZE 512
+#define FS_MAX_BLOCK_SIZE (64*1024)
 
 // type of the inode: directory or file
 typedef enum {FS_DIR = 1, FS_FILE = 2} fs_itype_t;
@@ -55,19 +58,47 @@ typedef struct fs_ fs_t;
 
 
 /*
- * fs_new: allocates storage - blocks - and memory for the fs structure
+ * fs_new: allocates storage - blocks - and memory for the fs structure;
+ *   the metadata of a formatted storage is loaded (the inode table is
+ *   loaded later, a block at a time)
  * - num_blocks - number of blocks
- *   returns: the fs structure
+ * - block_size - size of the blocks, a power of two between
+ *   FS_MIN_BLOCK_SIZE and FS_MAX_BLOCK_SIZE
+ *   returns: the fs structure or NULL if the block size is not supported
  */
-fs_t* fs_new(unsigned num_blocks, int disk_delay);
+fs_t* fs_new(unsigned num_blocks, unsigned block_size, int disk_delay);
+
+
+/*
+ * fs_load: mounts the file system stored in an image file (see
+ *   block_store); only the superblock is read, the rest of the metadata
+ *   is loaded a block at a time when it is used (all of the bitmaps are
+ *   read if the file system was not unmounted)
+ * - file: the name of the image file
+ *   returns: the fs structure or NULL if the image cannot be mounted
+ */
+fs_t* fs_load(char* file, int disk_delay);
+
+
+/*
+ * fs_unmount: waits for the operations running, writes all the data
+ *   and metadata to the storage and marks the file system as cleanly
+ *   unmounted; no other operation may be started
+ * - file: the name of the image file where to store the storage (or NULL)
+ *   returns: 0 if successful, -1 otherwise
+ */
+int fs_unmount(fs_t* fs, char* file);
 
 
 /*
  * fs_format: formats the file system
  * - fs: reference to file system
+ * - num_inodes: number of inodes (files and directories) of the file
+ *   system, rounded up to fill the inode table blocks (at most 65535,
+ *   the largest inode id)
  *   returns: 0 if successful, -1 otherwise
  */
-int fs_format(fs_t* fs);
+int fs_format(fs_t* fs, unsigned num_inodes);
 
 
 /*
@@ -104,26 +135,105 @@ int fs_read(fs_t* fs, inodeid_t file, unsigned offset, unsigned count,
    char* buffer, int* nread);
 
 
+// a piece of file data held in a pinned cache block
+typedef struct {
+	char* data;		// the data (inside the cache block)
+	unsigned len;		// number of bytes
+	int entry;		// the pinned cache entry (-1 if not pinned)
+} fs_pinned_t;
+
+
+/*
+ * fs_read_pinned: like fs_read, but pins the cache blocks holding the
+ *   data instead of copying it; the data stays valid (writes to these
+ *   blocks wait) until the pieces are released with fs_unpin. When
+ *   not every block can be pinned, the data that follows the pinned
+ *   blocks is copied into the buffer (at its position in the range)
+ *   and returned as the last piece
+ * - buffer: where the data that is not pinned is copied
+ * - pieces: the pieces of data, in file order [out]
+ * - maxpieces: maximum number of pieces (at least 2)
+ * - npieces: number of pieces [out]
+ * - nread: number of bytes effectively read [out]
+ *   returns: 0 if successful, -1 otherwise (e.g. no block could be
+ *   pinned, or the file is small and its data is kept in the inode;
+ *   the caller should use fs_read instead)
+ */
+int fs_read_pinned(fs_t* fs, inodeid_t file, unsigned offset, unsigned count,
+   char* buffer, fs_pinned_t* pieces, int maxpieces, int* npieces, int* nread);
+
+
+/*
+ * fs_unpin: releases the pieces returned by fs_read_pinned
+ */
+void fs_unpin(fs_t* fs, fs_pinned_t* pieces, int npieces);
+
+
+// what fs_seek looks for
+typedef enum {FS_SEEK_DATA = 0, FS_SEEK_HOLE = 1} fs_seek_t;
+
+
+/*
+ * fs_seek: finds the data or the holes of a file; holes are the blocks
+ *   never written (read as zeros, they take no space) and the end of
+ *   the file
+ * - offset: where to start looking, below the size of the file
+ * - what: FS_SEEK_DATA or FS_SEEK_HOLE
+ * - pos: the first offset from 'offset' on with data/in a hole [out]
+ *   returns: 0 if successful, -1 otherwise (e.g. no data after 'offset')
+ */
+int fs_seek(fs_t* fs, inodeid_t file, unsigned offset, fs_seek_t what,
+   unsigned* pos);
+
+
 /*
  * fs_write: write data to file
  * - fs: reference to file system
  * - file: node id of the file
- * - offset: starting position for writing
+ * - offset: starting position for writing (beyond the end of the file,
+ *   the data is preceded by a hole)
  * - count: number of bytes to write
  * - buffer: the data to write
- *   returns: 0 if successful, -1 otherwise (the write operation is atomic)
+ *   returns: 0 if successful, -1 otherwise (the write operation is atomic);
+ *   the blocks added to the file are allocated later, together
  */
 int fs_write(fs_t* fs, inodeid_t file, unsigned offset, unsigned count,
    char* buffer);
 
 
+/*
+ * fs_truncate: changes the size of a file; the blocks past a smaller
+ *   size are freed together, a larger size ends the file in a hole
+ * - fs: reference to file system
+ * - file: node id of the file
+ * - size: the new size
+ *   returns: 0 if successful, -1 otherwise
+ */
+int fs_truncate(fs_t* fs, inodeid_t file, unsigned size);
+
+
+/*
+ * fs_fallocate: reserves the blocks of a range of a file, as extents,
+ *   so writing it later allocates nothing; the range reads as zeros
+ *   where it was not written and the file grows to its end if needed
+ * - fs: reference to file system
+ * - file: node id of the file
+ * - offset: start of the range
+ * - count: number of bytes of the range (above 0)
+ *   returns: 0 if successful, -1 otherwise (e.g. no free blocks; no
+ *   block is reserved then)
+ */
+int fs_fallocate(fs_t* fs, inodeid_t file, unsigned offset, unsigned count);
+
+
 /*
  * fs_create: create a file in a specified directory
  * - fs: reference to file system
  * - dir: the directory where to create the file
  * - file: the name of the file
  * - fileid: the inode id of the file [out]
- *   returns: 0 if successful, -1 otherwise
+ *   returns: 0 if successful, -1 otherwise (also when 'dir' is full: a directory
+ *     holds at most 10 blocks of 16-byte entries)
  */
 int fs_create(fs_t* fs, inodeid_t dir, char* file, inodeid_t* fileid);
 
@@ -134,7 +244,8 @@ int fs_create(fs_t* fs, inodeid_t dir, char* file, inodeid_t* fileid);
  * - dir: the directory where to create the file
  * - newdir: the name of the new subdirectory
  * - newdirid: the inode id of the subdirectory [out]
- *   returns: 0 if successful, -1 otherwise
+ *   returns: 0 if successful, -1 otherwise (also when 'dir' is full: a directory
+ *     holds at most 10 blocks of 16-byte entries)
  */
 int fs_mkdir(fs_t* fs, inodeid_t dir, char* newdir, inodeid_t* newdirid);
 
@@ -158,9 +269,12 @@ void fs_dump(fs_t* fs);
 
 /*
  * fs_remove: remove a file from the file system
+ * - fileid: the inode id of the file removed [out]
+ * - type: the type of the file removed [out]
  *   returns: 0 if successful, -1 otherwise
  */
-int fs_remove(fs_t* fs, inodeid_t dir,char* name, inodeid_t* fileid);
+int fs_remove(fs_t* fs, inodeid_t dir,char* name, inodeid_t* fileid,
+   fs_itype_t* type);
 
 /*
  * fs_copy: copies a file or directory from the file system to another directory
@@ -170,9 +284,11 @@ int fs_copy(fs_t* fs, inodeid_t file, char * file_name, inodeid_t dest, char* de
 
 /*
  * fs_append: appends a file to the end of another file
+ * - fileid: the inode id of the file that grew [out]
  *   returns: 0 if successful, -1 otherwise
  */
-int fs_append(fs_t* fs, inodeid_t dest, char * dest_name, inodeid_t file, char* file_name);
+int fs_append(fs_t* fs, inodeid_t dest, char * dest_name, inodeid_t file, char* file_name,
+   inodeid_t* fileid);
 
 int fs_diskusage(fs_t* fs);
 
@@ -186,7 +302,10 @@ int fs_defrag(fs_t* fs);
 *
 \*********************************************************************/
 
-#define CACHE_SIZE 8
+#define CACHE_SIZE 32
+
+// maximum number of pins held by reads sent from the cache (see cache_pin)
+#define CACHE_PIN_MAX (CACHE_SIZE/2)
 
 typedef struct cache_node{
 	short int V;
@@ -194,7 +313,10 @@ typedef struct cache_node{
 	short int M;
 	int block_number;
 	int counter;
-	char block[BLOCK_SIZE];
+	int pin;	// number of threads using the block (not replaced if > 0)
+	int busy;	// being loaded or written back (without the cache lock)
+	int old_number;	// block being written back by a busy entry, or -1
+	char* block;	// the data (block size of the file system)
 } cache_node;
 
 //static cache_node* cache;
@@ -205,21 +327,37 @@ cache_node* fs_new_cache(fs_t* fs);
 /*Dumps the content of the cache and returns 0 if succesfull*/
 int fs_dumpcache();
 
-/*Returns 1 if the block was present and copies it to block_read, returns 0 otherwise*/
-int cache_read(int block_number,char* block_read);
+typedef enum { CACHE_READ, CACHE_WRITE, CACHE_OVERWRITE } cache_mode_t;
+
+/*Returns the block with block_number in the cache (loading it if needed) and pins it until cache_put; in CACHE_WRITE mode waits for the other pins to be released, CACHE_OVERWRITE is the same but the block is not read from disk since it will be written whole. A thread holds at most one block at a time*/
+char* cache_get(fs_t* fs, int block_number, cache_mode_t mode);
 
-/*Writes the block with block_number in the cache*/
-int cache_write(int block_number,char* block);
+/*Releases a block returned by cache_get, dirty if it was modified*/
+void cache_put(char* block, int dirty);
 
 /*thread function*/
 void *thread_cache_function(void* ptr);
 
 void cache_clean(int block_number);
 
+/*Moves the data of a block to another block number (e.g. when a delayed block is allocated)*/
+void cache_rename(int block_number, int new_number);
+
+/*Copies a whole block into the cache*/
 void writeIn_cache(fs_t* fs, int block_number,char* block);
 
+/*Copies a whole block out of the cache*/
 void readFrom_cache(fs_t* fs, int block_number,char* block);
 
 void cache_flush(fs_t*fs);
 
+/*Pins the first blocks (loading them if needed) while pins are left and returns their entries in entries; returns the number of blocks pinned*/
+int cache_pin(fs_t* fs, int* block_numbers, int count, int* entries);
+
+/*Returns the data of a pinned entry*/
+char* cache_pinned_block(int entry);
+
+/*Releases the pins and wakes up the writers waiting for them*/
+void cache_unpin(int* entries, int count);
+
 #endif
@@ -0,0 +1,257 @@
+/*
+ * Client Leases
+ *
+ * lease.c
+ *
+ * Implementation of the lease table: a small array, protected by a
+ * mutex, of the (client, file) pairs with a lease. It is scanned when a
+ * file changes, which is cheap for the number of leases it holds.
+ *
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/time.h>
+#include <sthread.h>
+#include <snfs_codec.h>
+#include "lease.h"
+
+
+typedef struct {
+	struct sockaddr_un addr;	// the client
+	socklen_t len;
+	int compact;			// the client uses the compact encoding
+	snfs_fhandle_t file;		// the file covered
+	int pending;			// reserved, the file is not known yet
+	int broken;			// a file changed while reserved
+	snfs_fhandle_t unsent;		// invalidation not delivered yet
+	int stale;			// 'unsent' is valid
+	long long expires;		// expiration time (ms), 0 if free
+} lease_t;
+
+
+static sthread_mutex_t Lease_lock;
+static lease_t Leases[LEASE_MAX];
+static int Sockfd;
+
+// statistics
+static unsigned Granted, Refused, Sent, Retained;
+
+
+static long long lease_now()
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (long long)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+
+static int lease_same_client(lease_t* l, struct sockaddr_un* addr, socklen_t len)
+{
+	return l->len == len && memcmp(&l->addr, addr, len) == 0;
+}
+
+
+// sends an invalidation to the client of a lease (must hold the lock)
+//   returns: 0 if sent, -1 otherwise
+static int lease_notify(lease_t* l, snfs_fhandle_t file)
+{
+	snfs_msg_res_t res;
+	char wire[SNFS_WIRE_MAX_SMALL];
+	void* msg = &res;
+	int len = sizeof(res) - sizeof(res.body) + sizeof(res.body.invalidate);
+
+	memset(&res, 0, sizeof(res));
+	res.type = REQ_INVALIDATE;
+	res.status = RES_OK;
+	res.body.invalidate.file = file;
+	if (l->compact) {
+		len = snfs_encode_res(&res, wire);
+		msg = wire;
+	}
+
+	// never block on a client that does not drain its socket
+	if (sendto(Sockfd, msg, len, MSG_DONTWAIT, (struct sockaddr*)&l->addr, l->len) < 0) {
+		// reported once, the retries fail the same way
+		if (!l->stale) {
+			printf("[lease] invalidation not sent: %s.\n", strerror(errno));
+		}
+		return -1;
+	}
+	Sent++;
+	return 0;
+}
+
+
+// invalidates a lease and drops it (must hold the lock); if the client
+// cannot be told, the lease is kept with the invalidation, which is
+// sent again by the next lease_begin or lease_break
+static void lease_revoke(lease_t* l, snfs_fhandle_t file)
+{
+	// two different invalidations still owed become one for all
+	if (l->stale && l->unsent != file) {
+		file = SNFS_INVALIDATE_ALL;
+	}
+	if (lease_notify(l, file) < 0) {
+		Retained += !l->stale;
+		l->stale = 1;
+		l->unsent = file;
+		return;
+	}
+	l->stale = 0;
+	l->expires = 0;
+
+	// the client drops all it caches, so its other leases go too
+	if (file == SNFS_INVALIDATE_ALL) {
+		for (int j = 0; j < LEASE_MAX; j++) {
+			lease_t* o = &Leases[j];
+			if (o != l && !o->pending && lease_same_client(o, &l->addr, l->len)) {
+				o->stale = 0;
+				o->expires = 0;
+			}
+		}
+	}
+}
+
+
+// sends the invalidations a client is still owed (must hold the lock)
+//   returns: 0 if none is left, -1 otherwise
+static int lease_flush(struct sockaddr_un* addr, socklen_t len, long long now)
+{
+	int left = 0;
+
+	for (int i = 0; i < LEASE_MAX; i++) {
+		lease_t* l = &Leases[i];
+		if (l->stale && l->expires > now && lease_same_client(l, addr, len)) {
+			lease_revoke(l, l->unsent);
+			left |= l->stale;
+		}
+	}
+	return left ? -1 : 0;
+}
+
+
+void lease_init(int sockfd)
+{
+	Lease_lock = sthread_mutex_init();
+	Sockfd = sockfd;
+	memset(Leases, 0, sizeof(Leases));
+}
+
+
+int lease_begin(struct sockaddr_un* cliaddr, socklen_t clilen, int compact)
+{
+	long long now = lease_now();
+	int id = -1;
+
+	if (clilen > sizeof(*cliaddr)) {
+		return -1;
+	}
+
+	sthread_mutex_lock(Lease_lock);
+	// a client is not given new leases until it knows of the changes
+	// to those it holds
+	if (lease_flush(cliaddr, clilen, now) < 0) {
+		Refused++;
+		sthread_mutex_unlock(Lease_lock);
+		return -1;
+	}
+	for (int i = 0; i < LEASE_MAX && id < 0; i++) {
+		if (Leases[i].expires <= now) {
+			id = i;
+		}
+	}
+	if (id < 0) {
+		Refused++;
+	} else {
+		lease_t* l = &Leases[id];
+		memcpy(&l->addr, cliaddr, clilen);
+		l->len = clilen;
+		l->compact = compact;
+		l->file = 0;
+		l->pending = 1;
+		l->broken = 0;
+		l->stale = 0;
+		l->expires = now + LEASE_TIME_MS;
+	}
+	sthread_mutex_unlock(Lease_lock);
+
+	return id;
+}
+
+
+unsigned lease_end(int id, snfs_fhandle_t file)
+{
+	unsigned time = 0;
+
+	if (id < 0) {
+		return 0;
+	}
+
+	sthread_mutex_lock(Lease_lock);
+	lease_t* l = &Leases[id];
+	if (file <= 0 || l->broken) {
+		l->expires = 0;
+	} else {
+		// a client holds a single lease per file
+		for (int i = 0; i < LEASE_MAX; i++) {
+			if (i != id && Leases[i].expires > 0 && !Leases[i].pending && !Leases[i].stale &&
+				Leases[i].file == file && lease_same_client(&Leases[i], &l->addr, l->len)) {
+				Leases[i].expires = 0;
+			}
+		}
+		l->file = file;
+		l->expires = lease_now() + LEASE_TIME_MS;
+		time = LEASE_TIME_MS;
+		Granted++;
+	}
+	l->pending = 0;
+	sthread_mutex_unlock(Lease_lock);
+
+	return time;
+}
+
+
+void lease_break(snfs_fhandle_t file)
+{
+	long long now = lease_now();
+
+	sthread_mutex_lock(Lease_lock);
+	for (int i = 0; i < LEASE_MAX; i++) {
+		lease_t* l = &Leases[i];
+		if (l->expires <= now) {
+			continue;
+		}
+		// a lookup in progress may have seen the file before the change
+		if (l->pending) {
+			l->broken = 1;
+			continue;
+		}
+		if (file == SNFS_INVALIDATE_ALL || l->file == file) {
+			lease_revoke(l, file);
+		} else if (l->stale) {
+			// an earlier invalidation is tried again
+			lease_revoke(l, l->unsent);
+		}
+	}
+	sthread_mutex_unlock(Lease_lock);
+}
+
+
+void lease_dump()
+{
+	long long now = lease_now();
+	int held = 0;
+
+	sthread_mutex_lock(Lease_lock);
+	for (int i = 0; i < LEASE_MAX; i++) {
+		if (Leases[i].expires > now && !Leases[i].pending) {
+			held++;
+		}
+	}
+	printf("===== Dump: Leases ========================================\n");
+	printf("Held: %d Granted: %u Refused: %u Invalidations sent: %u kept for retry: %u\n",
+		held, Granted, Refused, Sent, Retained);
+	sthread_mutex_unlock(Lease_lock);
+}
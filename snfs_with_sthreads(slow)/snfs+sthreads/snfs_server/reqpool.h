@@ -0,0 +1,131 @@
+/*
+ * Request Descriptor Pool
+ *
+ * reqpool.h
+ *
+ * Preallocated pool of request descriptors used by the server threads.
+ * A descriptor holds buffers for the incoming request and the outgoing
+ * response, and the client address, so serving a message does not
+ * allocate memory. Messages are variable-length: the buffers are sized
+ * when the pool is created, for the largest message the server accepts.
+ *
+ * Descriptors are recycled through a shared free list and through small
+ * per-thread caches; the shared list is only touched when a cache must
+ * be refilled or flushed, which happens in batches.
+ *
+ */
+
+#ifndef _REQPOOL_H_
+#define _REQPOOL_H_
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <snfs_proto.h>
+
+
+// descriptors are aligned to the size of a cache line
+#define REQPOOL_ALIGN 64
+
+// number of descriptors allocated each time the pool grows
+#define REQPOOL_CHUNK 16
+
+// maximum number of descriptors kept in a per-thread cache
+#define REQPOOL_CACHE_SIZE 8
+
+// maximum number of per-thread caches accounted in the occupancy
+#define REQPOOL_MAX_CACHES 32
+
+
+// request descriptor structure
+struct _req {
+	char* reqbuf;		// request buffer
+	snfs_msg_req_t* req;	// request being served (inside 'reqbuf')
+	snfs_msg_res_t* res;	// response buffer
+	int compact;		// 1 if the request used the compact encoding
+	struct sockaddr_un cliaddr;
+	int reqsz;		// size of the request in the fixed-size format
+	int rawsz;		// size of the request received
+	socklen_t clilen;
+	struct _req* next;	// free list link
+} __attribute__((aligned(REQPOOL_ALIGN)));
+typedef struct _req* req_t;
+
+
+// per-thread cache of free descriptors (owned by a single thread)
+typedef struct {
+	req_t list[REQPOOL_CACHE_SIZE];
+	int count;
+} reqpool_cache_t;
+
+
+// descriptor pool (the implementation is hidden)
+typedef struct reqpool_ reqpool_t;
+
+
+/*
+ * reqpool_new: creates a pool and preallocates its first descriptors
+ * - initial: number of descriptors to preallocate
+ * - max: maximum number of descriptors the pool may grow to
+ * - reqsz: size of the request buffer of each descriptor
+ * - ressz: size of the response buffer of each descriptor
+ *   returns: the pool or NULL if error
+ */
+reqpool_t* reqpool_new(unsigned initial, unsigned max, unsigned reqsz,
+   unsigned ressz);
+
+
+/*
+ * reqpool_cache_init: initializes an empty per-thread cache
+ * - cache: the cache of the calling thread
+ */
+void reqpool_cache_init(reqpool_t* pool, reqpool_cache_t* cache);
+
+
+/*
+ * reqpool_get: gets a free descriptor, blocking while the pool is
+ * at its maximum size and every descriptor is in use
+ * - cache: the cache of the calling thread
+ *   returns: the descriptor
+ */
+req_t reqpool_get(reqpool_t* pool, reqpool_cache_t* cache);
+
+
+/*
+ * reqpool_put: gives a descriptor back to the pool
+ * - cache: the cache of the calling thread
+ */
+void reqpool_put(reqpool_t* pool, reqpool_cache_t* cache, req_t req);
+
+
+/*
+ * reqpool_cache_flush: gives all the descriptors of a cache back to the
+ * shared free list (e.g. before the thread blocks waiting for work)
+ * - cache: the cache of the calling thread
+ */
+void reqpool_cache_flush(reqpool_t* pool, reqpool_cache_t* cache);
+
+
+/*
+ * reqpool_occupancy: gets the pool occupancy
+ * - allocated: number of descriptors allocated so far [out]
+ * - in_use: number of descriptors not free [out]
+ *   returns: the maximum number of descriptors
+ */
+unsigned reqpool_occupancy(reqpool_t* pool, unsigned* allocated,
+   unsigned* in_use);
+
+
+/*
+ * reqpool_reqsz: gets the size of the request buffer of the descriptors
+ */
+unsigned reqpool_reqsz(reqpool_t* pool);
+
+
+/*
+ * reqpool_dump: dumps the occupancy of the pool
+ */
+void reqpool_dump(reqpool_t* pool);
+
+
+#endif
@@ -14,28 +14,92 @@
 #include <string.h>
 
 #include <snfs_proto.h>
+#include <snfs_codec.h>
+#include "snfs.h"
+#include "lease.h"
 #include "block.h"
 #include "fs.h"
 
 
+#ifndef BLOCK_SIZE
+// default block size
+#define BLOCK_SIZE 512
+#endif
+
 #ifndef NUM_BLOCKS
-// default storage of 8 MB (8*1024*2 blocks * 512 bytes/block)
+// default storage of 8 MB (8*1024*2 blocks * 512 bytes/block); with
+// another block size the number of blocks keeps the same storage size
 #define NUM_BLOCKS (8*1024*2)
 #endif
 
+#ifndef NUM_INODES
+// default number of files and directories
+#define NUM_INODES 4096
+#endif
+
 #define DEFAULT_DISK_DELAY 1
 //10000
 
 static fs_t* FS;
 
+// image file where the storage is kept between runs (or NULL)
+static char* Image;
+
+// largest amount of data accepted in a read/write message
+static unsigned Max_transfer = SNFS_MAX_TRANSFER;
+
+// reads copy the data instead of pinning the cache blocks
+static int Read_copy;
+
 
 void snfs_init(int argc, char **argv)
 {
   int disk_delay = DEFAULT_DISK_DELAY;
   if (argc > 1)
     sscanf(argv[1], "%d", &disk_delay);
-  FS = fs_new(NUM_BLOCKS, disk_delay);
-  fs_format(FS);
+  Read_copy = (getenv(SNFS_READ_COPY_ENV) != NULL);
+
+  // mount the image of a previous run, if any
+  Image = getenv(SNFS_IMAGE_ENV);
+  if (Image != NULL && (FS = fs_load(Image, disk_delay)) != NULL) {
+    printf("[snfs] mounted the image '%s'.\n", Image);
+    return;
+  }
+  unsigned block_size = BLOCK_SIZE;
+  char* env = getenv(SNFS_BLOCK_SIZE_ENV);
+  if (env != NULL && (sscanf(env, "%u", &block_size) != 1 || block_size == 0))
+    block_size = BLOCK_SIZE;
+  FS = fs_new((unsigned long long)NUM_BLOCKS * BLOCK_SIZE / block_size,
+    block_size, disk_delay);
+  if (FS == NULL) {
+    printf("[snfs] cannot create the storage.\n");
+    exit(1);
+  }
+  fs_format(FS, NUM_INODES);
+}
+
+
+void snfs_finish()
+{
+  if (fs_unmount(FS, Image) == 0 && Image != NULL) {
+    printf("[snfs] stored the image '%s'.\n", Image);
+  }
+}
+
+
+void snfs_set_max_transfer(unsigned max)
+{
+  if (max > SNFS_MAX_TRANSFER)
+    max = SNFS_MAX_TRANSFER;
+  if (max < MAX_READ_DATA)
+    max = MAX_READ_DATA;
+  Max_transfer = max;
+}
+
+
+unsigned snfs_get_max_transfer()
+{
+  return Max_transfer;
 }
 
 
@@ -82,6 +146,7 @@ void snfs_lookup(snfs_msg_req_t *req, int reqsz, snfs_msg_res_t *res,
          res->status = RES_OK;
          res->body.lookup.file = fileid;
          res->body.lookup.fsize = attrs.size;
+         res->body.lookup.ftype = (attrs.type == FS_DIR) ? SNFS_DIR : SNFS_FILE;
       }
    }   
 }
@@ -96,16 +161,52 @@ void snfs_read(snfs_msg_req_t *req, int reqsz, snfs_msg_res_t *res,
    unsigned count = req->body.read.count;
    
    // prepare the response
-   *ressz = sizeof(*res) - sizeof(res->body) + sizeof(res->body.read);
+   *ressz = SNFS_READ_RES_SIZE(0);
    res->type = REQ_READ;
    res->status = RES_ERROR;
 
    // handle request
    char* data = res->body.read.data;
    int* nread = (int*)&res->body.read.nread;
-   if (count <= MAX_READ_DATA && !fs_read(FS,file,offset,count,data,nread)){
+   if (count <= Max_transfer && !fs_read(FS,file,offset,count,data,nread)){
+      res->status = RES_OK;
+      *ressz = SNFS_READ_RES_SIZE(*nread);
+   }
+}
+
+
+void snfs_read_pinned(snfs_msg_req_t *req, int reqsz, snfs_msg_res_t *res, 
+   int* ressz, snfs_read_pinned_t* pinned)
+{
+   // get input arguments
+   inodeid_t file = (inodeid_t)req->body.read.fhandle;
+   unsigned offset = req->body.read.offset;
+   unsigned count = req->body.read.count;
+
+   pinned->npieces = 0;
+   int nread;
+   if (!Read_copy && count <= Max_transfer && !fs_read_pinned(FS,file,offset,count,
+      res->body.read.data,pinned->pieces,CACHE_PIN_MAX + 1,&pinned->npieces,
+      &nread)) {
+      // the data follows the header (the part that was not pinned is
+      // in the response, but sent as one of the pieces)
+      *ressz = SNFS_READ_RES_SIZE(nread);
+      res->type = REQ_READ;
       res->status = RES_OK;
+      res->body.read.nread = nread;
+      return;
    }
+
+   // reads are copied, no block could be pinned or an error: copy
+   // the data
+   snfs_read(req,reqsz,res,ressz);
+}
+
+
+void snfs_read_unpin(snfs_read_pinned_t* pinned)
+{
+   fs_unpin(FS,pinned->pieces,pinned->npieces);
+   pinned->npieces = 0;
 }
 
 
@@ -123,8 +224,11 @@ void snfs_write(snfs_msg_req_t *req, int reqsz, snfs_msg_res_t *res,
    res->type = REQ_WRITE;
    res->status = RES_ERROR;
 
-   // handle request
-   if (count <= MAX_WRITE_DATA && !fs_write(FS,file,offset,count,data)){
+   // handle request (the data must have been received in full)
+   if (count <= Max_transfer && reqsz >= SNFS_WRITE_REQ_SIZE(count) &&
+      !fs_write(FS,file,offset,count,data)){
+      // the clients caching the old size are told first
+      lease_break(file);
       fs_file_attrs_t attrs;
       if (fs_get_attrs(FS,file,&attrs) == 0) {
          res->status = RES_OK;
@@ -134,6 +238,80 @@ void snfs_write(snfs_msg_req_t *req, int reqsz, snfs_msg_res_t *res,
 }
 
 
+void snfs_seek(snfs_msg_req_t *req, int reqsz, snfs_msg_res_t *res, 
+   int* ressz)
+{
+   // get input arguments
+   inodeid_t file = (inodeid_t)req->body.seek.fhandle;
+   unsigned offset = req->body.seek.offset;
+   fs_seek_t what = (req->body.seek.whence == SNFS_SEEK_HOLE) ?
+      FS_SEEK_HOLE : FS_SEEK_DATA;
+
+   // prepare the response
+   *ressz = sizeof(*res) - sizeof(res->body) + sizeof(res->body.seek);
+   res->type = REQ_SEEK;
+   res->status = RES_ERROR;
+
+   // handle request
+   unsigned pos;
+   if (!fs_seek(FS,file,offset,what,&pos)) {
+      res->status = RES_OK;
+      res->body.seek.offset = pos;
+   }
+}
+
+
+void snfs_truncate(snfs_msg_req_t *req, int reqsz, snfs_msg_res_t *res, 
+   int* ressz)
+{
+   // get input arguments
+   inodeid_t file = (inodeid_t)req->body.truncate.fhandle;
+   unsigned size = req->body.truncate.size;
+
+   // prepare the response
+   *ressz = sizeof(*res) - sizeof(res->body) + sizeof(res->body.truncate);
+   res->type = REQ_TRUNCATE;
+   res->status = RES_ERROR;
+
+   // handle request
+   if (!fs_truncate(FS,file,size)) {
+      // the clients caching the old size are told first
+      lease_break(file);
+      fs_file_attrs_t attrs;
+      if (fs_get_attrs(FS,file,&attrs) == 0) {
+         res->status = RES_OK;
+         res->body.truncate.fsize = attrs.size;
+      }
+   }
+}
+
+
+void snfs_fallocate(snfs_msg_req_t *req, int reqsz, snfs_msg_res_t *res, 
+   int* ressz)
+{
+   // get input arguments
+   inodeid_t file = (inodeid_t)req->body.fallocate.fhandle;
+   unsigned offset = req->body.fallocate.offset;
+   unsigned count = req->body.fallocate.count;
+
+   // prepare the response
+   *ressz = sizeof(*res) - sizeof(res->body) + sizeof(res->body.fallocate);
+   res->type = REQ_FALLOCATE;
+   res->status = RES_ERROR;
+
+   // handle request
+   if (!fs_fallocate(FS,file,offset,count)) {
+      // the clients caching the old size are told first
+      lease_break(file);
+      fs_file_attrs_t attrs;
+      if (fs_get_attrs(FS,file,&attrs) == 0) {
+         res->status = RES_OK;
+         res->body.fallocate.fsize = attrs.size;
+      }
+   }
+}
+
+
 void snfs_create(snfs_msg_req_t *req, int reqsz, snfs_msg_res_t *res, 
    int* ressz)
 {
@@ -193,9 +371,14 @@ void snfs_readdir(snfs_msg_req_t *req, int reqsz, snfs_msg_res_t *res,
    // handle request
    fs_file_name_t entries[MAX_READDIR_ENTRIES];
    int numentries;
+   if (maxentries > MAX_READDIR_ENTRIES)
+      maxentries = MAX_READDIR_ENTRIES;
    if (!fs_readdir(FS,dir,entries,maxentries,&numentries)) {
       res->status = RES_OK;
       res->body.readdir.count = numentries;
+      // only the entries listed are sent
+      *ressz = sizeof(*res) - sizeof(res->body) + sizeof(res->body.readdir) -
+         (MAX_READDIR_ENTRIES - numentries) * sizeof(snfs_dir_entry_t);
       for (int i = 0; i < numentries; i++) {
          snfs_dir_entry_t* entry = &res->body.readdir.list[i]; 
          strncpy(entry->name,entries[i].name,MAX_FILE_NAME_SIZE);
@@ -230,7 +413,10 @@ void snfs_remove(snfs_msg_req_t *req, int reqsz, snfs_msg_res_t *res, int* ressz
     // handle request
    name[MAX_FILE_NAME_SIZE-1] = '\0';
    inodeid_t fileid;
-   if (!fs_remove(FS,dir,name, &fileid)) {
+   fs_itype_t type;
+   if (!fs_remove(FS,dir,name, &fileid, &type)) {
+      // the files of a removed subtree are not known any more
+      lease_break(type == FS_DIR ? SNFS_INVALIDATE_ALL : (snfs_fhandle_t)fileid);
       res->status = RES_OK;
       res->body.remove.file = (snfs_fhandle_t)fileid;
 	}
@@ -253,7 +439,15 @@ void snfs_copy(snfs_msg_req_t *req, int reqsz, snfs_msg_res_t *res, int* ressz)
    src_name[MAX_FILE_NAME_SIZE-1] = '\0';
    dst_name[MAX_FILE_NAME_SIZE-1] = '\0';
    inodeid_t fileid;
+   fs_file_attrs_t attrs;
    if (!fs_copy(FS,src,src_name ,dst,dst_name, &fileid)){
+      // a copy over an existing file changes its contents, one over a
+      // directory may change any file of the subtree
+      if (fs_get_attrs(FS,fileid,&attrs) == 0 && attrs.type == FS_FILE) {
+         lease_break((snfs_fhandle_t)fileid);
+      } else {
+         lease_break(SNFS_INVALIDATE_ALL);
+      }
 			res->status = RES_OK;
 			res->body.copy.file = (snfs_fhandle_t)fileid;
    }
@@ -275,7 +469,9 @@ void snfs_append(snfs_msg_req_t *req, int reqsz, snfs_msg_res_t *res, int* ressz
    // handle request
    src_name[MAX_FILE_NAME_SIZE-1] = '\0';
    dst_name[MAX_FILE_NAME_SIZE-1] = '\0';
-   if (!fs_append(FS,dir2, src_name,dir1, dst_name)){
+   inodeid_t fileid;
+   if (!fs_append(FS,dir2, src_name,dir1, dst_name, &fileid)){
+      lease_break((snfs_fhandle_t)fileid);
       fs_file_attrs_t attrs;
       if (fs_get_attrs(FS,dir1,&attrs) == 0) {
          res->status = RES_OK;
@@ -323,3 +519,148 @@ void snfs_dumpcache(snfs_msg_req_t *req, int reqsz, snfs_msg_res_t *res, int* re
    }
 }	   
 		   
+
+
+void snfs_negotiate(snfs_msg_req_t *req, int reqsz, snfs_msg_res_t *res, int* ressz)
+{
+   // get input arguments
+   unsigned max = req->body.negotiate.max_transfer;
+
+   // prepare the response
+   *ressz = sizeof(*res) - sizeof(res->body) + sizeof(res->body.negotiate);
+   res->type = REQ_NEGOTIATE;
+   res->status = RES_OK;
+
+   // handle request
+   if (max < MAX_READ_DATA)
+      max = MAX_READ_DATA;
+   res->body.negotiate.max_transfer = (max < Max_transfer) ? max : Max_transfer;
+   // only the current version of the compact encoding is spoken
+   res->body.negotiate.wire_version = (req->body.negotiate.wire_version >= SNFS_WIRE_VERSION) ?
+      SNFS_WIRE_VERSION : 0;
+}
+
+
+/*
+ * Compound requests
+ */
+
+// operations allowed in a compound request
+static const snfs_handler_t Compound_ops[NUM_REQ_TYPES] = {
+   [REQ_LOOKUP] = snfs_lookup,
+   [REQ_CREATE] = snfs_create,
+   [REQ_MKDIR] = snfs_mkdir,
+   [REQ_REMOVE] = snfs_remove,
+   [REQ_COPY] = snfs_copy,
+   [REQ_APPEND] = snfs_append
+};
+
+
+// replaces a handle naming the result of an earlier operation
+static int compound_resolve(snfs_fhandle_t* fh, snfs_fhandle_t* handles, int i)
+{
+   if (!SNFS_FH_IS_RESULT(*fh))
+      return 0;
+   int op = SNFS_FH_RESULT_OP(*fh);
+   if (op >= i || handles[op] <= 0)
+      return -1;
+   *fh = handles[op];
+   return 0;
+}
+
+
+void snfs_compound(snfs_msg_req_t *req, int reqsz, snfs_msg_res_t *res, int* ressz)
+{
+   // get input arguments
+   snfs_msg_req_compound_t* ops = &req->body.compound;
+   snfs_msg_res_compound_t* results = &res->body.compound;
+
+   // prepare the response
+   *ressz = sizeof(*res) - sizeof(res->body) + sizeof(res->body.compound);
+   res->type = REQ_COMPOUND;
+   res->status = RES_ERROR;
+   if (ops->count == 0 || ops->count > SNFS_COMPOUND_MAX_OPS)
+      return;
+   results->count = ops->count;
+
+   // handle request: run each operation with its own handler
+   snfs_fhandle_t handles[SNFS_COMPOUND_MAX_OPS];
+   int failed = 0, stop = 0;
+   for (int i = 0; i < ops->count; i++) {
+      snfs_compound_op_t* op = &ops->ops[i];
+      snfs_compound_res_t* r = &results->res[i];
+      r->type = op->type;
+      r->status = RES_SKIPPED;
+      handles[i] = 0;
+
+      // the condition refers to the last operation that ran
+      if (stop || (op->cond == SNFS_COND_IF_FAILED) != failed)
+         continue;
+
+      snfs_msg_req_t sub;
+      snfs_msg_res_t subres;
+      int subsz;
+      memset(&sub, 0, sizeof(sub));
+      memset(&subres, 0, sizeof(subres));
+      sub.type = op->type;
+      memcpy(&sub.body, &op->args, sizeof(op->args));
+
+      int err = (op->type >= NUM_REQ_TYPES || Compound_ops[op->type] == NULL);
+      if (!err) {
+         switch (op->type) {
+            case REQ_CREATE:
+               err = compound_resolve(&sub.body.create.dir, handles, i);
+               break;
+            case REQ_MKDIR:
+               err = compound_resolve(&sub.body.mkdir.dir, handles, i);
+               break;
+            case REQ_REMOVE:
+               err = compound_resolve(&sub.body.remove.dir, handles, i);
+               break;
+            case REQ_COPY:
+               err = compound_resolve(&sub.body.copy.src_dir, handles, i) |
+                  compound_resolve(&sub.body.copy.dst_dir, handles, i);
+               break;
+            case REQ_APPEND:
+               err = compound_resolve(&sub.body.append.dir1, handles, i) |
+                  compound_resolve(&sub.body.append.dir2, handles, i);
+               break;
+            default:
+               break;
+         }
+      }
+      if (err) {
+         r->status = RES_ERROR;
+      } else {
+         Compound_ops[op->type](&sub, sizeof(sub), &subres, &subsz);
+         r->status = subres.status;
+         memcpy(&r->body, &subres.body, sizeof(r->body));
+      }
+
+      // keep the handle the operation produced for the next ones
+      if (r->status == RES_OK) {
+         switch (op->type) {
+            case REQ_LOOKUP:
+               handles[i] = r->body.lookup.file;
+               break;
+            case REQ_CREATE:
+               handles[i] = r->body.create.file;
+               break;
+            case REQ_MKDIR:
+               handles[i] = r->body.mkdir.newdirid;
+               break;
+            case REQ_COPY:
+               handles[i] = r->body.copy.file;
+               break;
+            default:
+               break;
+         }
+      }
+
+      // a failure stops the sequence unless the next operation handles it
+      failed = (r->status != RES_OK);
+      stop = failed && (i + 1 == ops->count ||
+         ops->ops[i + 1].cond != SNFS_COND_IF_FAILED);
+      res->status = r->status;
+   }
+}
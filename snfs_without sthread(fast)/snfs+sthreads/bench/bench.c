@@ -0,0 +1,73 @@
+/*
+ * SNFS benchmarks
+ *
+ * bench.c
+ *
+ * Helpers shared by the benchmarks.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include "bench.h"
+
+
+double bench_now()
+{
+	struct timeval t;
+	gettimeofday(&t, NULL);
+	return t.tv_sec + t.tv_usec / 1e6;
+}
+
+
+unsigned long long bench_cycles()
+{
+#if defined(__i386__) || defined(__x86_64__)
+	unsigned lo, hi;
+	__asm__ __volatile__ ("rdtsc" : "=a" (lo), "=d" (hi));
+	return ((unsigned long long)hi << 32) | lo;
+#else
+	return 0;
+#endif
+}
+
+
+static int cmp_double(const void* a, const void* b)
+{
+	double x = *(const double*)a, y = *(const double*)b;
+	return (x > y) - (x < y);
+}
+
+
+double bench_percentile(double* samples, int n, double p)
+{
+	if (n == 0)
+		return 0;
+	qsort(samples, n, sizeof(double), cmp_double);
+	int i = (int)(p / 100 * n);
+	return samples[i < n ? i : n - 1];
+}
+
+
+snfs_ctx_t* bench_connect(int flags)
+{
+	char client_sock[] = "/tmp/benchXXXXXX";
+	int fd = mkstemp(client_sock);
+	if (fd < 0) {
+		printf("[bench] Unable to create client socket.\n");
+		return NULL;
+	}
+	close(fd);
+	snfs_ctx_t* ctx = snfs_init(client_sock, SERVER_SOCK, flags);
+	if (ctx == NULL)
+		printf("[bench] Unable to initialize SNFS API.\n");
+	return ctx;
+}
+
+
+double bench_mb(double bytes, double secs)
+{
+	return (secs > 0) ? bytes / secs / (1024 * 1024) : 0;
+}
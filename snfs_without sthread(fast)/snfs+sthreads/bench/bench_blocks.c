@@ -0,0 +1,124 @@
+/*
+ * SNFS benchmarks
+ *
+ * bench_blocks.c
+ *
+ * One row of the block size matrix (see matrix.sh): small files created,
+ * read and removed per second, and the throughput of writing and
+ * reading the largest file with one call per block.
+ *
+ * usage: bench_blocks <block size of the server>
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <snfs_api.h>
+#include <snfs_proto.h>
+#include "bench.h"
+
+#define SMALL_FILES 64		// the storage holds 128 blocks of 64 KB
+#define SMALL_FILE_SIZE 1024
+#define LARGE_FILE_BLOCKS 10	// a file holds 10 blocks
+#define ROUNDS 20
+
+
+static int small_files(snfs_ctx_t* ctx, snfs_fhandle_t dir, double* created,
+   double* read, double* removed)
+{
+	char name[MAX_FILE_NAME_SIZE];
+	char data[SMALL_FILE_SIZE], back[SMALL_FILE_SIZE];
+	snfs_fhandle_t fh[SMALL_FILES];
+	unsigned fsize;
+	int nread;
+	memset(data, 's', sizeof(data));
+
+	double t = bench_now();
+	for (int i = 0; i < SMALL_FILES; i++) {
+		sprintf(name, "s%d", i);
+		if (snfs_create(ctx, dir, name, &fh[i]) != STAT_OK ||
+		   snfs_write(ctx, fh[i], 0, sizeof(data), data, &fsize) != STAT_OK)
+			return -1;
+	}
+	*created = SMALL_FILES / (bench_now() - t);
+
+	t = bench_now();
+	for (int i = 0; i < SMALL_FILES; i++) {
+		if (snfs_read(ctx, fh[i], 0, sizeof(back), back, &nread) != STAT_OK ||
+		   nread != sizeof(back))
+			return -1;
+	}
+	*read = SMALL_FILES / (bench_now() - t);
+
+	t = bench_now();
+	for (int i = 0; i < SMALL_FILES; i++) {
+		sprintf(name, "s%d", i);
+		if (snfs_remove(ctx, dir, name, &fh[i]) != STAT_OK)
+			return -1;
+	}
+	*removed = SMALL_FILES / (bench_now() - t);
+	return 0;
+}
+
+
+static int large_file(snfs_ctx_t* ctx, unsigned bs, double* wmb, double* rmb)
+{
+	unsigned total = LARGE_FILE_BLOCKS * bs;
+	char* data = (char*) malloc(total);
+	char* back = (char*) malloc(total);
+	snfs_fhandle_t fh;
+	unsigned fsize;
+	int nread, ok = 1;
+	memset(data, 'l', total);
+	if (snfs_create(ctx, ROOT_FHANDLE, "large", &fh) != STAT_OK)
+		ok = 0;
+
+	double t = bench_now();
+	for (int r = 0; ok && r < ROUNDS; r++) {
+		for (unsigned off = 0; ok && off < total; off += bs)
+			ok = (snfs_write(ctx, fh, off, bs, data + off, &fsize) == STAT_OK);
+	}
+	*wmb = bench_mb((double)total * ROUNDS, bench_now() - t);
+
+	t = bench_now();
+	for (int r = 0; ok && r < ROUNDS; r++) {
+		for (unsigned off = 0; ok && off < total; off += bs) {
+			ok = (snfs_read(ctx, fh, off, bs, back + off, &nread) == STAT_OK &&
+				nread == bs);
+		}
+	}
+	*rmb = bench_mb((double)total * ROUNDS, bench_now() - t);
+	ok = ok && !memcmp(back, data, total);
+	free(data);
+	free(back);
+	return ok ? 0 : -1;
+}
+
+
+int main(int argc, char** argv)
+{
+	unsigned bs;
+	if (argc < 2 || sscanf(argv[1], "%u", &bs) != 1 || bs == 0) {
+		printf("usage: %s <block size of the server>\n", argv[0]);
+		return 1;
+	}
+	snfs_ctx_t* ctx = bench_connect(0);
+	snfs_fhandle_t dir;
+	if (ctx == NULL || snfs_mkdir(ctx, ROOT_FHANDLE, "small", &dir) != STAT_OK)
+		return 1;
+	if (bs > snfs_max_transfer(ctx)) {
+		printf("[bench_blocks] blocks larger than a message.\n");
+		return 1;
+	}
+	double created, read, removed, wmb, rmb;
+	if (small_files(ctx, dir, &created, &read, &removed) < 0 ||
+	   large_file(ctx, bs, &wmb, &rmb) < 0) {
+		printf("[bench_blocks] the workload failed.\n");
+		return 1;
+	}
+	printf("%8u %10.0f %10.0f %10.0f %10.1f %10.1f\n", bs, created, read,
+		removed, wmb, rmb);
+	snfs_finish(ctx);
+	return 0;
+}
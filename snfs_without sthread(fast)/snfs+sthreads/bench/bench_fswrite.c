@@ -0,0 +1,98 @@
+/*
+ * SNFS benchmarks
+ *
+ * bench_fswrite.c
+ *
+ * Bytes per cycle of fs_write, in the fs layer of the server (no
+ * messages), for writes that cover whole blocks and for writes that
+ * start and end inside blocks. The cycles are those of the time stamp
+ * counter. The messages of the fs layer go to /dev/null while it is
+ * measured (the server sends them to its log).
+ *
+ * usage: bench_fswrite [block size]
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sthread.h>
+#include "fs.h"
+#include "bench.h"
+
+#define DEFAULT_BLOCK_SIZE 4096
+#define STORAGE_SIZE (8 * 1024 * 1024)
+#define NUM_INODES 64
+#define ROOT_INODE 1
+#define FILE_BLOCKS 8	// blocks written by each write (the file holds 10)
+#define ROUNDS 20000
+
+typedef struct {
+	char* name;
+	unsigned offset;	// offset of the writes from the file start
+	unsigned count;		// bytes written, from FILE_BLOCKS blocks
+} workload_t;
+
+
+int main(int argc, char** argv)
+{
+	unsigned bs = DEFAULT_BLOCK_SIZE;
+	if (argc > 1 && sscanf(argv[1], "%u", &bs) != 1) {
+		printf("usage: %s [block size]\n", argv[0]);
+		return 1;
+	}
+	// the results are printed at the end, to the standard output
+	fflush(stdout);
+	int out = dup(1);
+	if (out < 0 || freopen("/dev/null", "w", stdout) == NULL)
+		return 1;
+	sthread_init();
+	fs_t* fs = fs_new(STORAGE_SIZE / bs, bs, 0);
+	inodeid_t file;
+	if (fs == NULL || fs_format(fs, NUM_INODES) < 0 ||
+	   fs_create(fs, ROOT_INODE, "w", &file) < 0) {
+		fprintf(stderr, "[bench_fswrite] cannot create the storage.\n");
+		return 1;
+	}
+
+	workload_t work[] = {
+		{"aligned", 0, FILE_BLOCKS * bs},
+		{"unaligned", 100, FILE_BLOCKS * bs - 200},
+		{"small", bs / 2 + 100, 100},
+	};
+	char* data = (char*) malloc(FILE_BLOCKS * bs);
+	memset(data, 'w', FILE_BLOCKS * bs);
+	// the blocks are allocated before they are measured
+	if (fs_write(fs, file, 0, FILE_BLOCKS * bs, data) < 0)
+		return 1;
+
+	int nwork = sizeof(work) / sizeof(work[0]);
+	double per_cycle[nwork], mb[nwork];
+	for (int w = 0; w < nwork; w++) {
+		double t = bench_now();
+		unsigned long long c = bench_cycles();
+		for (int r = 0; r < ROUNDS; r++) {
+			if (fs_write(fs, file, work[w].offset, work[w].count, data) < 0) {
+				fprintf(stderr, "[bench_fswrite] write failed.\n");
+				return 1;
+			}
+		}
+		c = bench_cycles() - c;
+		double secs = bench_now() - t;
+		double bytes = (double)work[w].count * ROUNDS;
+		per_cycle[w] = (c > 0) ? bytes / c : 0;
+		mb[w] = bench_mb(bytes, secs);
+	}
+	free(data);
+
+	fflush(stdout);
+	dup2(out, 1);
+	printf("blocks of %u bytes, %d writes of each kind\n", bs, ROUNDS);
+	printf("%10s %8s %12s %10s\n", "write", "bytes", "bytes/cycle", "MB/s");
+	for (int w = 0; w < nwork; w++) {
+		printf("%10s %8u %12.3f %10.1f\n", work[w].name, work[w].count,
+			per_cycle[w], mb[w]);
+	}
+	return 0;
+}
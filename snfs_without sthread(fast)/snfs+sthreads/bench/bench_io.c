@@ -0,0 +1,138 @@
+/*
+ * SNFS benchmarks
+ *
+ * bench_io.c
+ *
+ * Throughput of sequential application I/O of 16 B, 512 B and 4 KB,
+ * through myfs (the page cache of the open file) and with one call to
+ * the server for each application I/O (what myfs did before it had a
+ * cache).
+ *
+ * usage: bench_io [file size in bytes]
+ *
+ * A file holds 10 blocks, so the default size needs a server formatted
+ * with blocks of 4 KB or more.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <myfs.h>
+#include <snfs_api.h>
+#include <snfs_proto.h>
+#include "bench.h"
+
+#define DEFAULT_FILE_SIZE (32 * 1024)
+#define ROUNDS 20	// times each file is written and read
+
+static unsigned Io_sizes[] = {16, 512, 4096};
+
+
+static int find_file(snfs_ctx_t* ctx, char* name, snfs_fhandle_t* fh)
+{
+	char path[MAX_PATH_NAME_SIZE];
+	unsigned fsize;
+	sprintf(path, "/%s", name);
+	if (snfs_lookup(ctx, path, fh, &fsize) == STAT_OK)
+		return 0;
+	return (snfs_create(ctx, ROOT_FHANDLE, name, fh) == STAT_OK) ? 0 : -1;
+}
+
+
+// writes and reads back 'total' bytes through myfs, 'io' bytes at a time
+static int run_cached(unsigned io, unsigned total, char* data, double* wsecs,
+   double* rsecs)
+{
+	double t = bench_now();
+	int fd = my_open("/bio_cached", O_CREATE);
+	if (fd < 0)
+		return -1;
+	for (unsigned off = 0; off < total; off += io) {
+		if (my_write(fd, data + off, io) != io)
+			return -1;
+	}
+	if (my_close(fd) < 0)
+		return -1;
+	*wsecs = bench_now() - t;
+
+	char* back = (char*) malloc(total);
+	t = bench_now();
+	fd = my_open("/bio_cached", 0);
+	for (unsigned off = 0; fd >= 0 && off < total; off += io) {
+		if (my_read(fd, back + off, io) != io)
+			break;
+	}
+	int ok = (fd >= 0 && my_close(fd) == 0 && !memcmp(back, data, total));
+	*rsecs = bench_now() - t;
+	free(back);
+	return ok ? 0 : -1;
+}
+
+
+// writes and reads back 'total' bytes with one call for each 'io' bytes
+static int run_direct(snfs_ctx_t* ctx, unsigned io, unsigned total,
+   char* data, double* wsecs, double* rsecs)
+{
+	snfs_fhandle_t fh;
+	unsigned fsize;
+	int nread;
+	if (find_file(ctx, "bio_direct", &fh) < 0)
+		return -1;
+	double t = bench_now();
+	for (unsigned off = 0; off < total; off += io) {
+		if (snfs_write(ctx, fh, off, io, data + off, &fsize) != STAT_OK)
+			return -1;
+	}
+	*wsecs = bench_now() - t;
+
+	char* back = (char*) malloc(total);
+	t = bench_now();
+	for (unsigned off = 0; off < total; off += io) {
+		if (snfs_read(ctx, fh, off, io, back + off, &nread) != STAT_OK ||
+		   nread != io)
+			break;
+	}
+	*rsecs = bench_now() - t;
+	int ok = !memcmp(back, data, total);
+	free(back);
+	return ok ? 0 : -1;
+}
+
+
+int main(int argc, char** argv)
+{
+	unsigned total = DEFAULT_FILE_SIZE;
+	if (argc > 1 && (sscanf(argv[1], "%u", &total) != 1 || total % 4096)) {
+		printf("usage: %s [file size, a multiple of 4096]\n", argv[0]);
+		return 1;
+	}
+	snfs_ctx_t* ctx = bench_connect(0);
+	if (ctx == NULL || my_init_lib() < 0)
+		return 1;
+	char* data = (char*) malloc(total);
+	for (unsigned i = 0; i < total; i++)
+		data[i] = 'a' + i % 26;
+
+	printf("file of %u bytes written and read %d times, MB/s\n", total, ROUNDS);
+	printf("%8s %12s %12s %12s %12s\n", "io size", "myfs write", "myfs read",
+		"call write", "call read");
+	for (int i = 0; i < sizeof(Io_sizes) / sizeof(Io_sizes[0]); i++) {
+		double cw = 0, cr = 0, dw = 0, dr = 0;
+		for (int r = 0; r < ROUNDS; r++) {
+			double w1, r1, w2, r2;
+			if (run_cached(Io_sizes[i], total, data, &w1, &r1) < 0 ||
+			   run_direct(ctx, Io_sizes[i], total, data, &w2, &r2) < 0) {
+				printf("[bench_io] I/O of %u bytes failed.\n", Io_sizes[i]);
+				return 1;
+			}
+			cw += w1; cr += r1; dw += w2; dr += r2;
+		}
+		printf("%8u %12.2f %12.2f %12.2f %12.2f\n", Io_sizes[i],
+			bench_mb((double)total * ROUNDS, cw), bench_mb((double)total * ROUNDS, cr),
+			bench_mb((double)total * ROUNDS, dw), bench_mb((double)total * ROUNDS, dr));
+	}
+	free(data);
+	snfs_finish(ctx);
+	return 0;
+}
@@ -0,0 +1,118 @@
+/*
+ * SNFS benchmarks
+ *
+ * bench_lat.c
+ *
+ * Latency of lookups with the server idle and while another client
+ * keeps fragmenting the storage and defragmenting it. The names looked
+ * up are not in the directory, so the client cannot cache the results
+ * and every lookup goes to the server.
+ *
+ * usage: bench_lat [lookups]
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <snfs_api.h>
+#include <snfs_proto.h>
+#include "bench.h"
+
+#define DEFAULT_LOOKUPS 2000
+#define FRAG_FILES 16		// files written and half removed before each defrag
+#define FRAG_FILE_SIZE 4096
+
+
+// fragments the storage and defragments it until killed
+static void defrag_loop()
+{
+	snfs_ctx_t* ctx = bench_connect(0);
+	if (ctx == NULL)
+		exit(1);
+	snfs_fhandle_t dir, fh;
+	unsigned fsize;
+	char name[MAX_FILE_NAME_SIZE];
+	char data[FRAG_FILE_SIZE];
+	memset(data, 'f', sizeof(data));
+	if (snfs_mkdir(ctx, ROOT_FHANDLE, "frag", &dir) != STAT_OK)
+		exit(1);
+	for (;;) {
+		for (int i = 0; i < FRAG_FILES; i++) {
+			sprintf(name, "f%d", i);
+			if (snfs_create(ctx, dir, name, &fh) == STAT_OK)
+				snfs_write(ctx, fh, 0, sizeof(data), data, &fsize);
+		}
+		for (int i = 0; i < FRAG_FILES; i += 2) {
+			sprintf(name, "f%d", i);
+			snfs_remove(ctx, dir, name, &fh);
+		}
+		snfs_defrag(ctx);
+		for (int i = 1; i < FRAG_FILES; i += 2) {
+			sprintf(name, "f%d", i);
+			snfs_remove(ctx, dir, name, &fh);
+		}
+	}
+}
+
+
+// times 'n' lookups and prints their percentiles
+static int measure(snfs_ctx_t* ctx, char* what, int n)
+{
+	double* lat = (double*) malloc(n * sizeof(double));
+	char path[MAX_PATH_NAME_SIZE];
+	snfs_fhandle_t fh;
+	unsigned fsize;
+	double start = bench_now();
+	for (int i = 0; i < n; i++) {
+		sprintf(path, "/lat/missing%d", i);
+		double t = bench_now();
+		if (snfs_lookup(ctx, path, &fh, &fsize) == STAT_BUSY) {
+			printf("[bench_lat] lookup refused as busy.\n");
+			free(lat);
+			return -1;
+		}
+		lat[i] = (bench_now() - t) * 1e6;
+	}
+	double secs = bench_now() - start;
+	double p50 = bench_percentile(lat, n, 50);
+	double p90 = bench_percentile(lat, n, 90);
+	double p99 = bench_percentile(lat, n, 99);
+	printf("%-14s %10.0f %10.0f %10.0f %10.0f %10.0f\n", what, n / secs,
+		p50, p90, p99, lat[n - 1]);
+	free(lat);
+	return 0;
+}
+
+
+int main(int argc, char** argv)
+{
+	int n = DEFAULT_LOOKUPS;
+	if (argc > 1 && (sscanf(argv[1], "%d", &n) != 1 || n < 1)) {
+		printf("usage: %s [lookups]\n", argv[0]);
+		return 1;
+	}
+	snfs_ctx_t* ctx = bench_connect(0);
+	snfs_fhandle_t dir;
+	if (ctx == NULL || snfs_mkdir(ctx, ROOT_FHANDLE, "lat", &dir) != STAT_OK)
+		return 1;
+
+	printf("%d lookups, latency in us\n", n);
+	printf("%-14s %10s %10s %10s %10s %10s\n", "", "lookups/s", "p50", "p90",
+		"p99", "max");
+	if (measure(ctx, "idle", n) < 0)
+		return 1;
+	pid_t child = fork();
+	if (child == 0) {
+		defrag_loop();
+	}
+	sleep(1);
+	int res = measure(ctx, "during defrag", n);
+	kill(child, SIGKILL);
+	waitpid(child, NULL, 0);
+	snfs_finish(ctx);
+	return (res < 0) ? 1 : 0;
+}
@@ -0,0 +1,110 @@
+/*
+ * SNFS benchmarks
+ *
+ * bench_mt.c
+ *
+ * Calls per second of a multi-threaded client, with 1 to MAX_THREADS
+ * sthreads that read 4 KB from their own file, sharing one context
+ * (one socket) or using one context each.
+ *
+ * usage: bench_mt [calls per thread]
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sthread.h>
+#include <snfs_api.h>
+#include <snfs_proto.h>
+#include "bench.h"
+
+#define DEFAULT_CALLS 2000
+#define MAX_THREADS 8
+#define IO_SIZE 4096
+
+typedef struct {
+	snfs_ctx_t* ctx;
+	snfs_fhandle_t fh;
+	int calls;
+	int failed;
+} worker_t;
+
+
+static void* worker(void* arg)
+{
+	worker_t* w = (worker_t*) arg;
+	char buf[IO_SIZE];
+	int nread;
+	for (int i = 0; i < w->calls; i++) {
+		if (snfs_read(w->ctx, w->fh, 0, IO_SIZE, buf, &nread) != STAT_OK ||
+		   nread != IO_SIZE)
+			w->failed++;
+	}
+	return NULL;
+}
+
+
+// runs 'n' threads, on the shared context or on one context each
+static double run(snfs_ctx_t* shared, snfs_ctx_t** own, snfs_fhandle_t* files,
+   int n, int calls, int* failed)
+{
+	worker_t w[MAX_THREADS];
+	sthread_t th[MAX_THREADS];
+	double t = bench_now();
+	for (int i = 0; i < n; i++) {
+		w[i].ctx = (shared != NULL) ? shared : own[i];
+		w[i].fh = files[i];
+		w[i].calls = calls;
+		w[i].failed = 0;
+		th[i] = sthread_create(worker, (void*)&w[i], 1);
+	}
+	for (int i = 0; i < n; i++) {
+		sthread_join(th[i], NULL);
+		*failed += w[i].failed;
+	}
+	return n * calls / (bench_now() - t);
+}
+
+
+int main(int argc, char** argv)
+{
+	int calls = DEFAULT_CALLS;
+	if (argc > 1 && (sscanf(argv[1], "%d", &calls) != 1 || calls < 1)) {
+		printf("usage: %s [calls per thread]\n", argv[0]);
+		return 1;
+	}
+	sthread_init();
+	snfs_ctx_t* shared = bench_connect(SNFS_CTX_THREADS);
+	snfs_ctx_t* own[MAX_THREADS];
+	snfs_fhandle_t files[MAX_THREADS];
+	if (shared == NULL)
+		return 1;
+	char name[MAX_FILE_NAME_SIZE];
+	char data[IO_SIZE];
+	unsigned fsize;
+	memset(data, 'm', sizeof(data));
+	for (int i = 0; i < MAX_THREADS; i++) {
+		sprintf(name, "mt%d", i);
+		if ((own[i] = bench_connect(0)) == NULL ||
+		   snfs_create(shared, ROOT_FHANDLE, name, &files[i]) != STAT_OK ||
+		   snfs_write(shared, files[i], 0, IO_SIZE, data, &fsize) != STAT_OK)
+			return 1;
+	}
+
+	int failed = 0;
+	printf("%d reads of %d bytes per thread, calls/s\n", calls, IO_SIZE);
+	printf("%8s %14s %14s\n", "threads", "one context", "context each");
+	for (int n = 1; n <= MAX_THREADS; n *= 2) {
+		double one = run(shared, own, files, n, calls, &failed);
+		double each = run(NULL, own, files, n, calls, &failed);
+		printf("%8d %14.0f %14.0f\n", n, one, each);
+	}
+	if (failed > 0)
+		printf("[bench_mt] %d reads failed.\n", failed);
+
+	for (int i = 0; i < MAX_THREADS; i++)
+		snfs_finish(own[i]);
+	snfs_finish(shared);
+	return (failed > 0) ? 1 : 0;
+}
@@ -0,0 +1,85 @@
+/*
+ * SNFS benchmarks
+ *
+ * bench_read.c
+ *
+ * Throughput of reads of a cached file, with 4 KB to 256 KB read at a
+ * time. Run it against a server started normally (the data is sent
+ * from the cache blocks) and against one started with SNFS_READ_COPY
+ * set (the data is copied into the response). The benchmark makes the
+ * server print its statistics, which count the reads sent each way.
+ *
+ * usage: bench_read [file size in bytes]
+ *
+ * A file holds 10 blocks, so the default size needs a server formatted
+ * with blocks of 32 KB or more.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <snfs_api.h>
+#include <snfs_proto.h>
+#include "bench.h"
+
+#define DEFAULT_FILE_SIZE (256 * 1024)
+#define ROUNDS 200	// times the file is read with each read size
+
+static unsigned Read_sizes[] = {4096, 16384, 65536, 262144};
+
+
+int main(int argc, char** argv)
+{
+	unsigned total = DEFAULT_FILE_SIZE;
+	if (argc > 1 && (sscanf(argv[1], "%u", &total) != 1 || total == 0)) {
+		printf("usage: %s [file size in bytes]\n", argv[0]);
+		return 1;
+	}
+	snfs_ctx_t* ctx = bench_connect(0);
+	snfs_fhandle_t fh;
+	unsigned fsize;
+	if (ctx == NULL || snfs_create(ctx, ROOT_FHANDLE, "bread", &fh) != STAT_OK)
+		return 1;
+	char* data = (char*) malloc(total);
+	char* back = (char*) malloc(total);
+	for (unsigned i = 0; i < total; i++)
+		data[i] = 'a' + i % 26;
+	if (snfs_write(ctx, fh, 0, total, data, &fsize) != STAT_OK) {
+		printf("[bench_read] cannot write the file.\n");
+		return 1;
+	}
+
+	printf("file of %u bytes read %d times (max transfer %u), MB/s\n", total,
+		ROUNDS, snfs_max_transfer(ctx));
+	printf("%10s %10s\n", "read size", "MB/s");
+	for (int i = 0; i < sizeof(Read_sizes) / sizeof(Read_sizes[0]); i++) {
+		unsigned rs = Read_sizes[i];
+		if (rs > total || rs > snfs_max_transfer(ctx))
+			break;
+		double t = bench_now();
+		for (int r = 0; r < ROUNDS; r++) {
+			for (unsigned off = 0; off < total; off += rs) {
+				int nread;
+				unsigned n = (total - off < rs) ? total - off : rs;
+				if (snfs_read(ctx, fh, off, n, back + off, &nread) != STAT_OK ||
+				   nread != n) {
+					printf("[bench_read] read failed.\n");
+					return 1;
+				}
+			}
+		}
+		double secs = bench_now() - t;
+		if (memcmp(back, data, total)) {
+			printf("[bench_read] the data read differs.\n");
+			return 1;
+		}
+		printf("%10u %10.1f\n", rs, bench_mb((double)total * ROUNDS, secs));
+	}
+
+	snfs_dumpcache(ctx);
+	free(data);
+	free(back);
+	snfs_finish(ctx);
+	return 0;
+}
@@ -0,0 +1,92 @@
+/*
+ * SNFS benchmarks
+ *
+ * bench_tree.c
+ *
+ * Time to copy and to remove a directory tree with one call. Build the
+ * server with -DFS_TREE_WORKERS=1 to compare with a single thread
+ * walking the tree.
+ *
+ * usage: bench_tree [directories per level]
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <snfs_api.h>
+#include <snfs_proto.h>
+#include "bench.h"
+
+#define DEFAULT_WIDTH 4
+#define DEPTH 2			// levels of directories under the root of the tree
+#define FILES_PER_DIR 8
+#define FILE_SIZE 1024
+#define ROUNDS 50
+
+static int Dirs, Files;
+
+
+// fills 'dir' with files and, above the last level, 'width' directories
+static int build(snfs_ctx_t* ctx, snfs_fhandle_t dir, int level, int width)
+{
+	char name[MAX_FILE_NAME_SIZE];
+	char data[FILE_SIZE];
+	snfs_fhandle_t fh;
+	unsigned fsize;
+	memset(data, 'd', sizeof(data));
+	for (int i = 0; i < FILES_PER_DIR; i++) {
+		sprintf(name, "f%d", i);
+		if (snfs_create(ctx, dir, name, &fh) != STAT_OK ||
+		   snfs_write(ctx, fh, 0, sizeof(data), data, &fsize) != STAT_OK)
+			return -1;
+		Files++;
+	}
+	for (int i = 0; level < DEPTH && i < width; i++) {
+		sprintf(name, "d%d", i);
+		if (snfs_mkdir(ctx, dir, name, &fh) != STAT_OK ||
+		   build(ctx, fh, level + 1, width) < 0)
+			return -1;
+		Dirs++;
+	}
+	return 0;
+}
+
+
+int main(int argc, char** argv)
+{
+	int width = DEFAULT_WIDTH;
+	if (argc > 1 && (sscanf(argv[1], "%d", &width) != 1 || width < 1)) {
+		printf("usage: %s [directories per level]\n", argv[0]);
+		return 1;
+	}
+	snfs_ctx_t* ctx = bench_connect(0);
+	snfs_fhandle_t tree, fh;
+	if (ctx == NULL || snfs_mkdir(ctx, ROOT_FHANDLE, "tree", &tree) != STAT_OK ||
+	   build(ctx, tree, 0, width) < 0) {
+		printf("[bench_tree] cannot build the tree.\n");
+		return 1;
+	}
+
+	double copy = 0, removal = 0;
+	for (int r = 0; r < ROUNDS; r++) {
+		double t = bench_now();
+		if (snfs_copy(ctx, ROOT_FHANDLE, "tree", ROOT_FHANDLE, "tcopy", &fh) != STAT_OK) {
+			printf("[bench_tree] copy failed.\n");
+			return 1;
+		}
+		copy += bench_now() - t;
+		t = bench_now();
+		if (snfs_remove(ctx, ROOT_FHANDLE, "tcopy", &fh) != STAT_OK) {
+			printf("[bench_tree] remove failed.\n");
+			return 1;
+		}
+		removal += bench_now() - t;
+	}
+	printf("tree of %d directories and %d files, %d copies and removes\n",
+		Dirs + 1, Files, ROUNDS);
+	printf("%10s %10.0f us\n%10s %10.0f us\n", "copy", copy / ROUNDS * 1e6,
+		"remove", removal / ROUNDS * 1e6);
+	snfs_finish(ctx);
+	return 0;
+}
@@ -0,0 +1,87 @@
+/*
+ * SNFS benchmarks
+ *
+ * bench_trunc.c
+ *
+ * Files rewritten per second, a call per block:
+ * - recreate: the file is removed, created again and written
+ * - truncate: the file is truncated to 0 and written in place
+ * - fallocate: the file is removed, created again, its size reserved
+ *   with one call and then written (an upload of a known size)
+ * The server's statistics, which the benchmark makes it print, show
+ * the average time of each kind of call.
+ *
+ * usage: bench_trunc <block size of the server>
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <snfs_api.h>
+#include <snfs_proto.h>
+#include "bench.h"
+
+#define FILE_BLOCKS 8	// a file holds 10 blocks
+#define ROUNDS 2000
+
+typedef enum {RECREATE, TRUNCATE, FALLOCATE} rewrite_t;
+
+
+static int rewrite(snfs_ctx_t* ctx, rewrite_t how, unsigned bs, char* data,
+   snfs_fhandle_t* fh)
+{
+	unsigned total = FILE_BLOCKS * bs, fsize;
+	snfs_fhandle_t old;
+	if (how == TRUNCATE) {
+		if (snfs_truncate(ctx, *fh, 0, &fsize) != STAT_OK)
+			return -1;
+	} else {
+		if (snfs_remove(ctx, ROOT_FHANDLE, "rewrite", &old) != STAT_OK ||
+		   snfs_create(ctx, ROOT_FHANDLE, "rewrite", fh) != STAT_OK)
+			return -1;
+		if (how == FALLOCATE &&
+		   snfs_fallocate(ctx, *fh, 0, total, &fsize) != STAT_OK)
+			return -1;
+	}
+	for (unsigned off = 0; off < total; off += bs) {
+		if (snfs_write(ctx, *fh, off, bs, data + off, &fsize) != STAT_OK)
+			return -1;
+	}
+	return 0;
+}
+
+
+int main(int argc, char** argv)
+{
+	unsigned bs;
+	if (argc < 2 || sscanf(argv[1], "%u", &bs) != 1 || bs == 0) {
+		printf("usage: %s <block size of the server>\n", argv[0]);
+		return 1;
+	}
+	char* names[] = {"recreate", "truncate", "fallocate"};
+	snfs_ctx_t* ctx = bench_connect(0);
+	snfs_fhandle_t fh;
+	if (ctx == NULL || snfs_create(ctx, ROOT_FHANDLE, "rewrite", &fh) != STAT_OK)
+		return 1;
+	char* data = (char*) malloc(FILE_BLOCKS * bs);
+	memset(data, 't', FILE_BLOCKS * bs);
+
+	printf("file of %u blocks of %u bytes rewritten %d times\n", FILE_BLOCKS,
+		bs, ROUNDS);
+	printf("%10s %10s\n", "rewrite", "files/s");
+	for (rewrite_t how = RECREATE; how <= FALLOCATE; how++) {
+		double t = bench_now();
+		for (int r = 0; r < ROUNDS; r++) {
+			if (rewrite(ctx, how, bs, data, &fh) < 0) {
+				printf("[bench_trunc] %s failed.\n", names[how]);
+				return 1;
+			}
+		}
+		printf("%10s %10.0f\n", names[how], ROUNDS / (bench_now() - t));
+	}
+	snfs_dumpcache(ctx);
+	free(data);
+	snfs_finish(ctx);
+	return 0;
+}
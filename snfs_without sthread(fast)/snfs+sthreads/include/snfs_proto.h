@@ -15,6 +15,8 @@
 #ifndef _SNFS_PROTO_H_
 #define _SNFS_PROTO_H_
 
+#include <stddef.h>
+
 
 /*
  * SNFS Protocol Types and Macros
@@ -28,14 +30,22 @@
 #define MAX_PATH_NAME_SIZE 200
 
 
-// maximum size of data read in one single message
+// size of data read in one single message before the transfer size
+// is negotiated (every server supports it)
 #define MAX_READ_DATA (1024)
 
 
-// maximum amount of data written sent in one single message
+// amount of data written in one single message before the transfer
+// size is negotiated (every server supports it)
 #define MAX_WRITE_DATA (1024)
 
 
+// largest transfer size that may be negotiated; read and write messages
+// are variable-length, so the actual limit is also bounded by the size
+// of a datagram the sockets of both sides accept
+#define SNFS_MAX_TRANSFER (256*1024)
+
+
 // maximum amount of directory entries sent in one single message
 #define MAX_READDIR_ENTRIES 64
 
@@ -76,15 +86,28 @@ typedef enum {
    REQ_APPEND = 10,
    REQ_DEFRAG = 11,
    REQ_DISKUSAGE = 12,
-   REQ_DUMPCACHE = 13   
+   REQ_DUMPCACHE = 13,
+   REQ_NEGOTIATE = 14,
+   REQ_COMPOUND = 15,
+   REQ_INVALIDATE = 16,
+   REQ_SEEK = 17,
+   REQ_TRUNCATE = 18,
+   REQ_FALLOCATE = 19
 } snfs_msg_type_t;
 
-typedef int snfs_req_serial_num_t;
+// number of message codes (must follow the last code above)
+#define NUM_REQ_TYPES 20
+
+// serial number of a request, echoed in its response so a client with
+// several requests in flight matches the responses (0 is never used)
+typedef unsigned snfs_req_serial_num_t;
 
 typedef enum {
    RES_OK = 0,
    RES_ERROR = -1,
-   RES_UNKNOWN = -2
+   RES_UNKNOWN = -2,
+   RES_SKIPPED = -3,
+   RES_BUSY = -4        // the server is overloaded, the request was not served
 } snfs_msg_res_status_t;
 
 
@@ -117,9 +140,13 @@ typedef struct {
 } snfs_msg_req_lookup_t;
 
 
+// the server grants a lease of 'lease' milliseconds on the result; a
+// client may cache it meanwhile (see SNFS Invalidate)
 typedef struct {
    snfs_fhandle_t file;
    unsigned fsize;
+   snfs_dir_entry_type_t ftype;
+   unsigned lease;
 } snfs_msg_res_lookup_t;
 
 
@@ -137,9 +164,10 @@ typedef struct {
 } snfs_msg_req_read_t;
 
 
+// the response carries only the 'nread' bytes of data read
 typedef struct {
-   char data[MAX_READ_DATA];
    unsigned nread;
+   char data[0];
 } snfs_msg_res_read_t;
 
 
@@ -150,11 +178,12 @@ typedef struct {
  */
 
 
+// the request carries only the 'count' bytes of data to write
 typedef struct {
    snfs_fhandle_t fhandle;
    unsigned offset;
    unsigned count;
-   char data[MAX_WRITE_DATA];
+   char data[0];
 } snfs_msg_req_write_t;
 
 
@@ -163,6 +192,80 @@ typedef struct {
 } snfs_msg_res_write_t;
 
 
+/*
+ * SNFS Seek
+ *   - request message: snfs_msg_req_seek_t
+ *   - response message: snfs_msg_res_seek_t
+ *
+ * Finds the first offset from 'offset' on holding data of the file or
+ * in a hole of it (the blocks never written, which are read as zeros,
+ * and the end of the file). The request fails if 'offset' is not below
+ * the size of the file or if there is no data after it.
+ */
+
+
+typedef enum {
+   SNFS_SEEK_DATA = 0,
+   SNFS_SEEK_HOLE = 1
+} snfs_seek_whence_t;
+
+
+typedef struct {
+   snfs_fhandle_t fhandle;
+   unsigned offset;
+   snfs_seek_whence_t whence;
+} snfs_msg_req_seek_t;
+
+
+typedef struct {
+   unsigned offset;
+} snfs_msg_res_seek_t;
+
+
+/*
+ * SNFS Truncate
+ *   - request message: snfs_msg_req_truncate_t
+ *   - response message: snfs_msg_res_truncate_t
+ *
+ * Changes the size of a file: its blocks past a smaller size are freed,
+ * a larger size ends the file in a hole.
+ */
+
+
+typedef struct {
+   snfs_fhandle_t fhandle;
+   unsigned size;
+} snfs_msg_req_truncate_t;
+
+
+typedef struct {
+   unsigned fsize;
+} snfs_msg_res_truncate_t;
+
+
+/*
+ * SNFS Fallocate
+ *   - request message: snfs_msg_req_fallocate_t
+ *   - response message: snfs_msg_res_fallocate_t
+ *
+ * Reserves the blocks of the 'count' bytes from 'offset' of a file, so
+ * writing them later allocates nothing; the file grows to the end of
+ * the range if needed, which reads as zeros where it was not written.
+ */
+
+
+typedef struct {
+   snfs_fhandle_t fhandle;
+   unsigned offset;
+   unsigned count;
+} snfs_msg_req_fallocate_t;
+
+
+typedef struct {
+   unsigned fsize;
+} snfs_msg_res_fallocate_t;
+
+
 /*
  * SNFS Create
  *   - request message: snfs_msg_req_create_t
@@ -272,6 +375,132 @@ typedef struct {
    unsigned fsize;
 } snfs_msg_res_append_t;
 
+/*
+ * SNFS Negotiate
+ *   - request message: snfs_msg_req_negotiate_t
+ *   - response message: snfs_msg_res_negotiate_t
+ *
+ * The client proposes the largest amount of data it wants to transfer
+ * in a single read or write message and the server answers with the
+ * size both will use (never below MAX_READ_DATA/MAX_WRITE_DATA).
+ * Likewise for the version of the compact message encoding (see
+ * snfs_codec.h); version 0 keeps the fixed-size message format. This
+ * request is always sent in the fixed-size format.
+ */
+
+
+typedef struct {
+   unsigned max_transfer;
+   unsigned wire_version;
+} snfs_msg_req_negotiate_t;
+
+
+typedef struct {
+   unsigned max_transfer;
+   unsigned wire_version;
+} snfs_msg_res_negotiate_t;
+
+
+/*
+ * SNFS Compound
+ *   - request message: snfs_msg_req_compound_t
+ *   - response message: snfs_msg_res_compound_t
+ *
+ * A sequence of up to SNFS_COMPOUND_MAX_OPS lookup, create, mkdir,
+ * remove, copy and append operations run by the server one after the
+ * other (not atomically) in a single round trip. A directory handle
+ * argument may name the handle produced by an earlier operation of
+ * the sequence (SNFS_FH_RESULT). The sequence stops at the first
+ * operation that fails, unless the next one runs only on failure
+ * (SNFS_COND_IF_FAILED); operations not run are answered with
+ * RES_SKIPPED. The response status is the one of the last operation
+ * run.
+ */
+
+
+// maximum number of operations in a compound request
+#define SNFS_COMPOUND_MAX_OPS 8
+
+// handle argument naming the handle produced by operation 'i'
+#define SNFS_FH_RESULT(i) (-(i) - 1)
+
+// true if handle 'fh' names the handle produced by another operation
+#define SNFS_FH_IS_RESULT(fh) ((fh) < 0)
+
+// operation 'i' of a SNFS_FH_RESULT handle
+#define SNFS_FH_RESULT_OP(fh) (-(fh) - 1)
+
+
+// when an operation of a compound request runs
+typedef enum {
+   SNFS_COND_ALWAYS = 0,     // if the previous operation succeeded
+   SNFS_COND_IF_FAILED = 1   // only if the previous operation failed
+} snfs_compound_cond_t;
+
+
+typedef struct {
+   snfs_msg_type_t type;
+   snfs_compound_cond_t cond;
+   union {
+      snfs_msg_req_lookup_t lookup;
+      snfs_msg_req_create_t create;
+      snfs_msg_req_mkdir_t mkdir;
+      snfs_msg_req_remove_t remove;
+      snfs_msg_req_copy_t copy;
+      snfs_msg_req_append_t append;
+   } args;
+} snfs_compound_op_t;
+
+
+typedef struct {
+   snfs_msg_type_t type;
+   snfs_msg_res_status_t status;
+   union {
+      snfs_msg_res_lookup_t lookup;
+      snfs_msg_res_create_t create;
+      snfs_msg_res_mkdir_t mkdir;
+      snfs_msg_res_remove_t remove;
+      snfs_msg_res_copy_t copy;
+      snfs_msg_res_append_t append;
+   } body;
+} snfs_compound_res_t;
+
+
+typedef struct {
+   unsigned count;
+   snfs_compound_op_t ops[SNFS_COMPOUND_MAX_OPS];
+} snfs_msg_req_compound_t;
+
+
+typedef struct {
+   unsigned count;
+   snfs_compound_res_t res[SNFS_COMPOUND_MAX_OPS];
+} snfs_msg_res_compound_t;
+
+
+/*
+ * SNFS Invalidate
+ *   - response message: snfs_msg_res_invalidate_t
+ *
+ * Sent by the server, unrequested (serial number 0), to the clients
+ * holding a lease on a lookup result that changed: the cached results
+ * for 'file' (for every file if SNFS_INVALIDATE_ALL) must be dropped.
+ * It is sent before the response of the request that caused it, so a
+ * client never sees the response first. Clients that do not drain
+ * their socket may miss it; the lease bounds how long they may use a
+ * stale result.
+ */
+
+
+// 'file' of an invalidation of every cached result
+#define SNFS_INVALIDATE_ALL 0
+
+
+typedef struct {
+   snfs_fhandle_t file;
+} snfs_msg_res_invalidate_t;
+
+
 /*
  * SNFS FileSystem
  *   - request message: snfs_msg_req_append_t
@@ -290,7 +519,8 @@ typedef struct {
  * SNFS Messages
  *
  * Messages have a common field ('type') indicating the type of
- * service that the request/response refers to; the union contains
+ * service that the request/response refers to and the serial number
+ * ('serial') the client gave the request; the union contains
  * all the possible message formats both referring to requests and
  * responses. Response messages have also the 'status' field
  * indicating if the service succeeded.
@@ -301,11 +531,15 @@ typedef struct {
 
 typedef struct {
   snfs_msg_type_t type;
+  snfs_req_serial_num_t serial;
   union {
     snfs_msg_req_ping_t ping;
     snfs_msg_req_lookup_t lookup;
     snfs_msg_req_read_t read;
     snfs_msg_req_write_t write;
+    snfs_msg_req_seek_t seek;
+    snfs_msg_req_truncate_t truncate;
+    snfs_msg_req_fallocate_t fallocate;
     snfs_msg_req_create_t create;
     snfs_msg_req_mkdir_t mkdir;
     snfs_msg_req_readdir_t readdir;
@@ -313,18 +547,23 @@ typedef struct {
 	snfs_msg_req_copy_t copy;
 	snfs_msg_req_append_t append;
 	snfs_msg_req_filesystem_t filesystem;
-	
+	snfs_msg_req_negotiate_t negotiate;
+	snfs_msg_req_compound_t compound;
   } body;
 } snfs_msg_req_t;
 
 typedef struct {
    snfs_msg_type_t type;
+   snfs_req_serial_num_t serial;
    snfs_msg_res_status_t status;
    union {
       snfs_msg_res_ping_t ping;
       snfs_msg_res_lookup_t lookup;
       snfs_msg_res_read_t read;
       snfs_msg_res_write_t write;
+      snfs_msg_res_seek_t seek;
+      snfs_msg_res_truncate_t truncate;
+      snfs_msg_res_fallocate_t fallocate;
       snfs_msg_res_create_t create;
       snfs_msg_res_mkdir_t mkdir;
       snfs_msg_res_readdir_t readdir;
@@ -332,8 +571,20 @@ typedef struct {
 	  snfs_msg_res_copy_t copy;
 	  snfs_msg_res_append_t append;
 	  snfs_msg_res_filesystem_t filesystem;
+	  snfs_msg_res_negotiate_t negotiate;
+	  snfs_msg_res_compound_t compound;
+	  snfs_msg_res_invalidate_t invalidate;
    } body;
 } snfs_msg_res_t;
 
 
+// size of a read response carrying 'count' bytes of data
+#define SNFS_READ_RES_SIZE(count) \
+   (offsetof(snfs_msg_res_t, body) + sizeof(snfs_msg_res_read_t) + (count))
+
+// size of a write request carrying 'count' bytes of data
+#define SNFS_WRITE_REQ_SIZE(count) \
+   (offsetof(snfs_msg_req_t, body) + sizeof(snfs_msg_req_write_t) + (count))
+
+
 #endif
@@ -1,86 +1,392 @@
-/* 
- * File System Interface
- * 
- * myfs.c
- *
- * Implementation of the SNFS programming interface simulating the 
- * standard Unix I/O interface. This interface uses the SNFS API to
- * invoke the SNFS services in a remote server.
- * 
- */
-
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include <myfs.h>
-#include <snfs_api.h>
-#include <snfs_proto.h>
-#include <unistd.h>
-#include "queue.h"
-
-
-#ifndef SERVER_SOCK
+/* 
+ * File System Interface
+ * 
+ * myfs.c
+ *
+ * Implementation of the SNFS programming interface simulating the 
+ * standard Unix I/O interface. This interface uses the SNFS API to
+ * invoke the SNFS services in a remote server.
+ * 
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <myfs.h>
+#include <snfs_api.h>
+#include <snfs_proto.h>
+#include <unistd.h>
+#include <sthread.h>
+#include "fdtable.h"
+
+
+#ifndef SERVER_SOCK
 #define SERVER_SOCK "/tmp/server.socket"
-#endif
-
-#define MAX_OPEN_FILES 10	// how many files can be open at the same time
-
-
-static queue_t *Open_files_list;	// Open files list
-static int Lib_initted = 0;	// Flag to test if library was initiated
-static int Open_files = 0;	// How many files are currently open
-
-
+#endif
+
+#define MIN_OPEN_FILES 16	// initial size of the open files table
+#define MAX_OPEN_FILES 65536	// how many files can be open at the same time
+
+#define MYFS_CACHE_PAGES 8	// pages cached for each open file
+#define MYFS_READAHEAD 4	// pages read ahead of a sequential read
+#define MYFS_FLUSH_PAGES 4	// dirty pages that start a write back
+
+#define MIN(a,b) ((a)<=(b)?(a):(b))
+
+
+static fdtable_t *Open_files;	// Open files table (indexed by descriptor)
+static sthread_mutex_t Open_files_lock;	// NULL if used by a single thread
+static snfs_ctx_t *Ctx;		// context of the SNFS API
+static int Lib_initted = 0;	// Flag to test if library was initiated
+static unsigned Page_size;	// size of a cached page (the transfer size)
+
+
+// page of the cache of an open file: holds every byte of the file in
+// [off, off+len) ('len' is below the page size only in the last page
+// of the file), of which [dlo, dhi) was not written back yet
+struct _file_page {
+	int valid;
+	unsigned off;
+	unsigned len;
+	unsigned dlo, dhi;	// dirty range (empty if dlo == dhi)
+	unsigned used;		// tick of the last use
+	char* data;
+};
+
+// page cache statistics (not locked, approximate with several threads)
+static unsigned Pc_reads, Pc_hits, Pc_fetched, Pc_writes, Pc_written;
+
+
 int mkstemp(char *template);
+char *strtok_r(char *str, const char *delim, char **saveptr);
+
+int myparse(char *pathname);
+
+
+/*
+ * Compound requests: the lookups a call needs and the operation itself
+ * are sent together, so most calls take a single round trip
+ */
+
+// adds an operation to a compound request, returns its index
+static int compound_add(snfs_msg_req_compound_t* c, snfs_msg_type_t type,
+   snfs_compound_cond_t cond)
+{
+	snfs_compound_op_t* op = &c->ops[c->count];
+	memset(op, 0, sizeof(*op));
+	op->type = type;
+	op->cond = cond;
+	return c->count++;
+}
+
+// handle of directory 'path': the root handle or the result of a lookup
+// added to the compound request
+static snfs_fhandle_t compound_dir(snfs_msg_req_compound_t* c, char* path)
+{
+	if (strcmp(path, "/") == 0)
+		return (snfs_fhandle_t) ROOT_FHANDLE;
+	int i = compound_add(c, REQ_LOOKUP, SNFS_COND_ALWAYS);
+	strcpy(c->ops[i].args.lookup.pname, path);
+	return SNFS_FH_RESULT(i);
+}
+
+
+/*
+ * Page cache: each open file caches up to MYFS_CACHE_PAGES pages of the
+ * size of a read/write message. Reads fetch the missing pages with
+ * their messages in flight together, plus MYFS_READAHEAD more when the
+ * reads are sequential; writes go to the pages and are written back in
+ * file order when MYFS_FLUSH_PAGES pages are dirty, when a dirty page
+ * is replaced and when the file is closed.
+ */
+
+static int cache_alloc(fd_t fdesc)
+{
+	if (fdesc->pages != NULL)
+		return 0;
+	struct _file_page* pages = (struct _file_page*) malloc(MYFS_CACHE_PAGES * sizeof(*pages));
+	char* data = (char*) malloc(MYFS_CACHE_PAGES * Page_size);
+	if (pages == NULL || data == NULL) {
+		printf("[myfs] Out of memory for the file cache.\n");
+		free(pages);
+		free(data);
+		return -1;
+	}
+	for (int i = 0; i < MYFS_CACHE_PAGES; i++) {
+		pages[i].valid = 0;
+		pages[i].data = data + i * Page_size;
+	}
+	fdesc->pages = pages;
+	return 0;
+}
+
+static void cache_free(fd_t fdesc)
+{
+	if (fdesc->pages != NULL) {
+		free(fdesc->pages[0].data);
+		free(fdesc->pages);
+		fdesc->pages = NULL;
+	}
+}
+
+static struct _file_page* cache_find(fd_t fdesc, unsigned off)
+{
+	for (int i = 0; i < MYFS_CACHE_PAGES; i++)
+		if (fdesc->pages[i].valid && fdesc->pages[i].off == off)
+			return &fdesc->pages[i];
+	return NULL;
+}
+
+static int cache_dirty(fd_t fdesc)
+{
+	int count = 0;
+	for (int i = 0; i < MYFS_CACHE_PAGES; i++)
+		if (fdesc->pages[i].valid && fdesc->pages[i].dlo < fdesc->pages[i].dhi)
+			count++;
+	return count;
+}
+
+// writes back the dirty pages, in file order so the file grows
+// sequentially
+static int cache_flush(fd_t fdesc)
+{
+	if (fdesc->pages == NULL)
+		return 0;
+	for (;;) {
+		struct _file_page* p = NULL;
+		for (int i = 0; i < MYFS_CACHE_PAGES; i++) {
+			struct _file_page* q = &fdesc->pages[i];
+			if (q->valid && q->dlo < q->dhi && (p == NULL || q->off < p->off))
+				p = q;
+		}
+		if (p == NULL)
+			return 0;
+		// a busy server is waited for, the page is not given up
+		unsigned fsize;
+		snfs_call_status_t st;
+		do {
+			st = snfs_write(Ctx, fdesc->fileId, p->off + p->dlo, p->dhi - p->dlo,
+			   p->data + p->dlo, &fsize);
+		} while (st == STAT_BUSY);
+		if (st != STAT_OK) {
+			printf("[myfs] Error writing back to file.\n");
+			return -1;
+		}
+		Pc_written++;
+		p->dlo = p->dhi = 0;
+		fdesc->ssize = fsize;
+	}
+}
+
+// writes back the dirty pages and forgets every page, when the server
+// changes the size of the file
+static int cache_drop(fd_t fdesc)
+{
+	if (cache_flush(fdesc) < 0)
+		return -1;
+	for (int i = 0; fdesc->pages != NULL && i < MYFS_CACHE_PAGES; i++)
+		fdesc->pages[i].valid = 0;
+	return 0;
+}
+
+// frees the least recently used page, writing back the dirty pages
+// first if it is dirty
+static struct _file_page* cache_victim(fd_t fdesc)
+{
+	struct _file_page* v = NULL;
+	for (int i = 0; i < MYFS_CACHE_PAGES; i++) {
+		struct _file_page* q = &fdesc->pages[i];
+		if (!q->valid) {
+			v = q;
+			break;
+		}
+		if (v == NULL || q->used < v->used)
+			v = q;
+	}
+	if (v->valid && v->dlo < v->dhi && cache_flush(fdesc) < 0)
+		return NULL;
+	v->valid = 0;
+	return v;
+}
+
+// reads the pages not cached among the 'num' pages from 'off'; the
+// data past the size the server last confirmed (a hole left by writes
+// not written back yet) is not read but zeroed
+static int cache_fetch(fd_t fdesc, unsigned off, unsigned num)
+{
+	snfs_call_t* calls[MYFS_CACHE_PAGES];
+	struct _file_page* fetched[MYFS_CACHE_PAGES];
+	unsigned want[MYFS_CACHE_PAGES];
+	int n = 0, ret = 0;
+
+	for (; num > 0 && off < fdesc->size; num--, off += Page_size) {
+		if (cache_find(fdesc, off) != NULL)
+			continue;
+		struct _file_page* p = cache_victim(fdesc);
+		if (p == NULL) {
+			ret = -1;
+			break;
+		}
+		// the page is taken now so the next victims are other pages
+		p->valid = 1;
+		p->off = off;
+		p->len = MIN(Page_size, fdesc->size - off);
+		p->dlo = p->dhi = 0;
+		p->used = ++fdesc->tick;
+		want[n] = fdesc->ssize > off ? MIN(p->len, fdesc->ssize - off) : 0;
+		memset(p->data + want[n], 0, p->len - want[n]);
+		if (want[n] == 0)
+			continue;
+		calls[n] = snfs_read_async(Ctx, fdesc->fileId, off, want[n], p->data, NULL, NULL);
+		if (calls[n] == NULL) {
+			p->valid = 0;
+			ret = -1;
+			break;
+		}
+		fetched[n++] = p;
+	}
+	for (int i = 0; i < n; i++) {
+		unsigned nread;
+		snfs_call_status_t st = snfs_wait(calls[i], &nread);
+		// a page refused by a busy server is read again (snfs_read
+		// waits for the server)
+		if (st == STAT_BUSY) {
+			int got;
+			st = snfs_read(Ctx, fdesc->fileId, fetched[i]->off, want[i],
+				fetched[i]->data, &got);
+			nread = got;
+		}
+		if (st != STAT_OK || nread != want[i]) {
+			fetched[i]->valid = 0;
+			ret = -1;
+		}
+	}
+	Pc_fetched += n;
+	return ret;
+}
+
+// gets the page at 'off' to read from it, reading it and the next
+// 'ahead' pages if it is not cached
+static struct _file_page* cache_get(fd_t fdesc, unsigned off, unsigned ahead)
+{
+	struct _file_page* p = cache_find(fdesc, off);
+	if (p == NULL) {
+		if (cache_fetch(fdesc, off, 1 + MIN(ahead, MYFS_CACHE_PAGES - 1)) < 0)
+			return NULL;
+		if ((p = cache_find(fdesc, off)) == NULL)
+			return NULL;
+	} else
+		Pc_hits++;
+	p->used = ++fdesc->tick;
+	return p;
+}
+
+// gets the page at 'off' to write [start, end) of it; the page is only
+// read if the write does not replace all the data it has
+static struct _file_page* cache_get_for_write(fd_t fdesc, unsigned off,
+   unsigned start, unsigned end)
+{
+	struct _file_page* p = cache_find(fdesc, off);
+	if (p == NULL) {
+		unsigned len = fdesc->size > off ? MIN(Page_size, fdesc->size - off) : 0;
+		// a page beyond the end of the file has nothing to read
+		if (len > 0 && (start > 0 || end < len))
+			return cache_get(fdesc, off, 0);
+		if ((p = cache_victim(fdesc)) == NULL)
+			return NULL;
+		p->valid = 1;
+		p->off = off;
+		p->len = len;
+		p->dlo = p->dhi = 0;
+	}
+	p->used = ++fdesc->tick;
+	return p;
+}
+
+
+
+/*
+ * Open files: with several threads, the table is locked to find a
+ * descriptor and the descriptor is locked before the table is released,
+ * so my_close (which removes it with the table locked) waits for the
+ * calls using it
+ */
 
-int myparse(char *pathname);
-
-int my_init_lib(){
-	char CLIENT_SOCK[]="/tmp/clientXXXXXX";
-	if(mkstemp(CLIENT_SOCK)<0){
-		printf("[my_init_lib] Unable to create client socket.\n");
-		return -1;
-	}
-	if(snfs_init(CLIENT_SOCK,SERVER_SOCK)<0){
-		printf("[my_init_lib] Unable to initialize SNFS API.\n");
-		return -1;
-	}
-	Open_files_list=queue_create();
-	Lib_initted=1;
-	return 0;
-}
-
-int my_open(char* name,int flags){
-	if(!Lib_initted){
-		printf("[my_open] Library is not initialized.\n");
-		return -1;
-	}
-	if(Open_files>=MAX_OPEN_FILES){
-		printf("[my_open] All slots filled.\n");
-		return -1;
+static fd_t fd_get(int fd)
+{
+	if (Open_files_lock != NULL)
+		sthread_mutex_lock(Open_files_lock);
+	fd_t fdesc = fdtable_get(Open_files, fd);
+	if (fdesc != NULL && fdesc->lock != NULL)
+		sthread_mutex_lock(fdesc->lock);
+	if (Open_files_lock != NULL)
+		sthread_mutex_unlock(Open_files_lock);
+	return fdesc;
+}
+
+static void fd_put(fd_t fdesc)
+{
+	if (fdesc->lock != NULL)
+		sthread_mutex_unlock(fdesc->lock);
+}
+
+
+static int init_lib(int flags){
+	char CLIENT_SOCK[]="/tmp/clientXXXXXX";
+	if(mkstemp(CLIENT_SOCK)<0){
+		printf("[my_init_lib] Unable to create client socket.\n");
+		return -1;
+	}
+	if((Ctx=snfs_init(CLIENT_SOCK,SERVER_SOCK,flags))==NULL){
+		printf("[my_init_lib] Unable to initialize SNFS API.\n");
+		return -1;
+	}
+	Open_files=fdtable_create(MIN_OPEN_FILES,MAX_OPEN_FILES);
+	if(Open_files==NULL){
+		printf("[my_init_lib] Unable to create the open files table.\n");
+		return -1;
+	}
+	Open_files_lock=(flags & SNFS_CTX_THREADS) ? sthread_mutex_init() : NULL;
+	Page_size=snfs_max_transfer(Ctx);
+	Lib_initted=1;
+	return 0;
+}
+
+int my_init_lib(){
+	return init_lib(0);
+}
+
+int my_init_lib_threads(){
+	return init_lib(SNFS_CTX_THREADS);
+}
+
+int my_open(char* name,int flags){
+	if(!Lib_initted){
+		printf("[my_open] Library is not initialized.\n");
+		return -1;
 	}
 	if ( myparse(name) != 0 ) {
-		printf("[my_open] Malformed pathname.\n");
-		return -1;
+		printf("[my_open] Malformed pathname.\n");
+		return -1;
 	}
-	snfs_fhandle_t dir, file_fh;
+	snfs_fhandle_t dir, file_fh;
 	unsigned fsize = 0;
 	char newfilename[MAX_FILE_NAME_SIZE];
 	char newdirname[MAX_PATH_NAME_SIZE];
 	char fulldirname[MAX_PATH_NAME_SIZE];
-	char *token;
+	char *token, *save;
 	char *search="/";
 	int i=0;
 	memset(&newfilename,0,MAX_FILE_NAME_SIZE);
 	memset(&newdirname,0,MAX_PATH_NAME_SIZE);
 	memset(&fulldirname,0,MAX_PATH_NAME_SIZE);
 	strcpy(fulldirname,name);
-	token = strtok(fulldirname, search);
+	token = strtok_r(fulldirname, search, &save);
 
 	while(token != NULL) {
 		i++;
 		strcpy(newfilename,token);
-		token = strtok(NULL, search);
+		token = strtok_r(NULL, search, &save);
 	} 
 	if ( i > 1){
 		strncpy(newdirname, name, strlen(name)-(strlen(newfilename)+1));
@@ -91,206 +397,498 @@ int my_open(char* name,int flags){
 		newfilename[strlen(newfilename)]='\0';
 		strcpy(newdirname, name);   
 	}
-	if(newfilename == NULL) {
-		printf("[my_open] Error looking for directory in server.\n");
-		return -1;
+	if(newfilename == NULL) {
+		printf("[my_open] Error looking for directory in server.\n");
+		return -1;
 	}
-	snfs_call_status_t status = snfs_lookup(name,&file_fh,&fsize);
-	if (status != STAT_OK) {
-		snfs_lookup(newdirname,&dir,&fsize);        
-   	if (i==1)  //Create a file in Root directory
+	if(flags == O_CREATE) {
+		// lookup the file and create it if it does not exist
+		snfs_msg_req_compound_t ops;
+		snfs_compound_res_t res[SNFS_COMPOUND_MAX_OPS];
+		ops.count = 0;
+		if (i==1)  //Create a file in Root directory
 			dir = ( snfs_fhandle_t)  1;
-	}
-	if(flags == O_CREATE && status != STAT_OK) {
-		if (snfs_create(dir,newfilename,&file_fh) != STAT_OK) {
-			printf("[my_open] Error creating a file in server.\n");
-			return -1;
-		}
+		else
+			dir = compound_dir(&ops, newdirname);
+		int look = compound_add(&ops, REQ_LOOKUP, SNFS_COND_ALWAYS);
+		strcpy(ops.ops[look].args.lookup.pname, name);
+		int create = compound_add(&ops, REQ_CREATE, SNFS_COND_IF_FAILED);
+		ops.ops[create].args.create.dir = dir;
+		strcpy(ops.ops[create].args.create.name, newfilename);
+		if (snfs_compound(Ctx, &ops, res) != STAT_OK) {
+			printf("[my_open] Error creating a file in server.\n");
+			return -1;
+		}
+		if (res[look].status == RES_OK) {
+			file_fh = res[look].body.lookup.file;
+			fsize = res[look].body.lookup.fsize;
+		} else
+			file_fh = res[create].body.create.file;
 	}
 	else
-		if (status != STAT_OK) {
-			printf("[my_open] Error opening up file. %d \n",file_fh);
-			return -1;
-		}
-	fd_t fdesc = (fd_t) malloc(sizeof(struct _file_desc));
-	fdesc->fileId = file_fh;
-	fdesc->size = fsize;
-	fdesc->write_offset = 0;
-	fdesc->read_offset = 0;
-	queue_enqueue(Open_files_list, fdesc);
-	Open_files++;
-	return file_fh;
-}
-
-int my_read(int fileId, char* buffer, unsigned numBytes)
-{
-	if (!Lib_initted) {
-		printf("[my_read] Library is not initialized.\n");
-		return -1;
-	}
-	
-	fd_t fdesc = queue_node_get(Open_files_list, fileId);
-	if(fdesc == NULL) {
-		printf("[my_read] File isn't in use. Open it first.\n");
-		return -1;
-	}
-	
-	// EoF ?
-	if(fdesc->read_offset == fdesc->size)
-		return 0;
-	
-	int nread;
-	unsigned rBytes;
-	int counter = 0;
-	
-	// If bytes to be read are greater than file size
-	if(fdesc->size < ((unsigned)fdesc->read_offset) + numBytes)
-		numBytes = fdesc->size - (unsigned)(fdesc->read_offset);
-	
-	//if data must be read using blocks
-	if(numBytes > MAX_READ_DATA)
-		rBytes = MAX_READ_DATA;
-	else
-		rBytes = numBytes;
-	
-	while(numBytes) {
-		if(rBytes > numBytes)
-			rBytes = numBytes;
-		
-		if (snfs_read(fileId,(unsigned)fdesc->read_offset,rBytes,&buffer[counter],&nread) != STAT_OK) {
-			printf("[my_read] Error reading from file.\n");
-			return -1;
-		}
-		fdesc->read_offset += nread;
-		numBytes -= (unsigned)nread;
-		counter += nread;
-	}
-	
-	return counter;
-}
-
-int my_write(int fileId, char* buffer, unsigned numBytes)
-{
-	if (!Lib_initted) {
-		printf("[my_write] Library is not initialized.\n");
-		return -1;
-	}
-	
-	fd_t fdesc = queue_node_get(Open_files_list, fileId);
-	if(fdesc == NULL) {
-		printf("[my_write] File isn't in use. Open it first.\n");
-		return -1;
-	}
-	
-	unsigned fsize;
-	unsigned wBytes;
-	int counter = 0;
-	
-	if(numBytes > MAX_WRITE_DATA)
-		wBytes = MAX_WRITE_DATA;
-	else
-		wBytes = numBytes;
-	
-	while(numBytes) {
-		if(wBytes > numBytes)
-			wBytes = numBytes;
-		
-		if (snfs_write(fileId,(unsigned)fdesc->write_offset,wBytes,&buffer[counter],&fsize) != STAT_OK) {
-			printf("[my_write] Error writing to file.\n");
-			return -1;
-		}
-		fdesc->size = fsize;
-		fdesc->write_offset += (int)wBytes;
-		numBytes -= (unsigned)wBytes;
-		counter += (int)wBytes;
-	}
-	
-	return counter;
-}
-
-int my_close(int fileId)
-{
-	if (!Lib_initted) {
-		printf("[my_close] Library is not initialized.\n");
-		return -1;
-	}
-	
-	fd_t temp = queue_node_remove(Open_files_list, fileId);
-	if(temp == NULL) {
-		printf("[my_close] File isn't in use. Open it first.\n");
-		return -1;
-	}
-	
-	free(temp);
-	Open_files--;
-	
-	return 0;
-}
-
-
-int my_listdir(char* path, char **filenames, int* numFiles)
-{
-	if (!Lib_initted) {
-		printf("[my_listdir] Library is not initialized.\n");
-		return -1;
-	}
-	
+		if (snfs_lookup(Ctx, name,&file_fh,&fsize) != STAT_OK) {
+			printf("[my_open] Error opening up file. %d \n",file_fh);
+			return -1;
+		}
+	fd_t fdesc = (fd_t) malloc(sizeof(struct _file_desc));
+	fdesc->fileId = file_fh;
+	fdesc->size = fsize;
+	fdesc->ssize = fsize;
+	fdesc->write_offset = 0;
+	fdesc->read_offset = 0;
+	fdesc->pages = NULL;
+	fdesc->next_read = 0;
+	fdesc->tick = 0;
+	fdesc->lock = (Open_files_lock != NULL) ? sthread_mutex_init() : NULL;
+	// descriptors are not the file handle, a file may be open many times
+	if (Open_files_lock != NULL)
+		sthread_mutex_lock(Open_files_lock);
+	int fd = fdtable_alloc(Open_files, fdesc);
+	if (Open_files_lock != NULL)
+		sthread_mutex_unlock(Open_files_lock);
+	if(fd < 0) {
+		if (fdesc->lock != NULL)
+			sthread_mutex_free(fdesc->lock);
+		printf("[my_open] All slots filled.\n");
+		free(fdesc);
+		return -1;
+	}
+	return fd;
+}
+
+// total size of the buffers of an iovec
+static unsigned iov_size(const struct iovec* iov, int iovcnt)
+{
+	unsigned total = 0;
+	for (int i = 0; i < iovcnt; i++)
+		total += iov[i].iov_len;
+	return total;
+}
+
+// reads into the buffers of 'iov' from offset 'pos' of an open file
+// (locked); the pages missing for the whole range are read together
+static int file_readv(fd_t fdesc, unsigned pos, const struct iovec* iov,
+   int iovcnt)
+{
+	// EoF ?
+	if(pos >= fdesc->size)
+		return 0;
+	
+	// If bytes to be read are greater than file size
+	unsigned numBytes = iov_size(iov, iovcnt);
+	if(fdesc->size < pos + numBytes)
+		numBytes = fdesc->size - pos;
+	
+	if (cache_alloc(fdesc) < 0)
+		return -1;
+	
+	// read ahead only when the reads are sequential
+	unsigned ahead = (pos == fdesc->next_read) ? MYFS_READAHEAD : 0;
+	unsigned nread = 0, seg = 0, segoff = 0;
+	
+	while (nread < numBytes) {
+		unsigned off = pos - pos % Page_size;
+		unsigned pages = (pos + numBytes - nread - 1 - off) / Page_size;
+		struct _file_page* p = cache_get(fdesc, off, pages + ahead);
+		if (p == NULL) {
+			printf("[my_read] Error reading from file.\n");
+			return -1;
+		}
+		// copy up to the end of the page or of the current buffer
+		while (segoff == iov[seg].iov_len) {
+			seg++;
+			segoff = 0;
+		}
+		unsigned n = MIN(p->off + p->len - pos, numBytes - nread);
+		n = MIN(n, iov[seg].iov_len - segoff);
+		memcpy((char*)iov[seg].iov_base + segoff, p->data + (pos - off), n);
+		Pc_reads++;
+		nread += n;
+		segoff += n;
+		pos += n;
+	}
+	fdesc->next_read = pos;
+	
+	return (int)nread;
+}
+
+// writes the buffers of 'iov' at offset 'pos' of an open file (locked)
+static int file_writev(fd_t fdesc, unsigned pos, const struct iovec* iov,
+   int iovcnt)
+{
+	unsigned numBytes = iov_size(iov, iovcnt);
+	if(numBytes == 0)
+		return 0;
+	
+	if (cache_alloc(fdesc) < 0)
+		return -1;
+	
+	// a write beyond the end of the file leaves a hole before its data
+	unsigned written = 0, seg = 0, segoff = 0;
+	
+	while (written < numBytes) {
+		while (segoff == iov[seg].iov_len) {
+			seg++;
+			segoff = 0;
+		}
+		unsigned off = pos - pos % Page_size;
+		unsigned start = pos - off;
+		unsigned n = MIN(Page_size - start, iov[seg].iov_len - segoff);
+		struct _file_page* p = cache_get_for_write(fdesc, off, start, start + n);
+		if (p == NULL) {
+			printf("[my_write] Error writing to file.\n");
+			return -1;
+		}
+		// the hole between the end of the file and 'pos' reads as zeros
+		if (start > p->len)
+			memset(p->data + p->len, 0, start - p->len);
+		memcpy(p->data + start, (char*)iov[seg].iov_base + segoff, n);
+		// the page has all the data up to 'pos', so the dirty range
+		// may grow over clean bytes (or zeros of a hole) but never over
+		// a gap
+		if (p->dlo == p->dhi) {
+			p->dlo = start;
+			p->dhi = start + n;
+		} else {
+			p->dlo = MIN(p->dlo, start);
+			p->dhi = p->dhi > start + n ? p->dhi : start + n;
+		}
+		if (start + n > p->len)
+			p->len = start + n;
+		Pc_writes++;
+		written += n;
+		segoff += n;
+		pos += n;
+		if (pos > fdesc->size)
+			fdesc->size = pos;
+	}
+	
+	if (cache_dirty(fdesc) >= MYFS_FLUSH_PAGES && cache_flush(fdesc) < 0) {
+		printf("[my_write] Error writing to file.\n");
+		return -1;
+	}
+	
+	return (int)numBytes;
+}
+
+int my_read(int fd, char* buffer, unsigned numBytes)
+{
+	if (!Lib_initted) {
+		printf("[my_read] Library is not initialized.\n");
+		return -1;
+	}
+	
+	fd_t fdesc = fd_get(fd);
+	if(fdesc == NULL) {
+		printf("[my_read] File isn't in use. Open it first.\n");
+		return -1;
+	}
+	
+	struct iovec iov = { buffer, numBytes };
+	int ret = file_readv(fdesc, (unsigned)fdesc->read_offset, &iov, 1);
+	if (ret > 0)
+		fdesc->read_offset += ret;
+	fd_put(fdesc);
+	return ret;
+}
+
+int my_write(int fd, char* buffer, unsigned numBytes)
+{
+	if (!Lib_initted) {
+		printf("[my_write] Library is not initialized.\n");
+		return -1;
+	}
+	
+	fd_t fdesc = fd_get(fd);
+	if(fdesc == NULL) {
+		printf("[my_write] File isn't in use. Open it first.\n");
+		return -1;
+	}
+	
+	struct iovec iov = { buffer, numBytes };
+	int ret = file_writev(fdesc, (unsigned)fdesc->write_offset, &iov, 1);
+	if (ret > 0)
+		fdesc->write_offset += ret;
+	fd_put(fdesc);
+	return ret;
+}
+
+int my_pread(int fd, char* buffer, unsigned numBytes, unsigned offset)
+{
+	struct iovec iov = { buffer, numBytes };
+	return my_preadv(fd, &iov, 1, offset);
+}
+
+int my_pwrite(int fd, char* buffer, unsigned numBytes, unsigned offset)
+{
+	struct iovec iov = { buffer, numBytes };
+	return my_pwritev(fd, &iov, 1, offset);
+}
+
+int my_readv(int fd, const struct iovec* iov, int iovcnt)
+{
+	if (!Lib_initted) {
+		printf("[my_readv] Library is not initialized.\n");
+		return -1;
+	}
+	
+	fd_t fdesc = fd_get(fd);
+	if(fdesc == NULL) {
+		printf("[my_readv] File isn't in use. Open it first.\n");
+		return -1;
+	}
+	
+	int ret = (iovcnt < 0) ? -1 : file_readv(fdesc, (unsigned)fdesc->read_offset, iov, iovcnt);
+	if (ret > 0)
+		fdesc->read_offset += ret;
+	fd_put(fdesc);
+	return ret;
+}
+
+int my_writev(int fd, const struct iovec* iov, int iovcnt)
+{
+	if (!Lib_initted) {
+		printf("[my_writev] Library is not initialized.\n");
+		return -1;
+	}
+	
+	fd_t fdesc = fd_get(fd);
+	if(fdesc == NULL) {
+		printf("[my_writev] File isn't in use. Open it first.\n");
+		return -1;
+	}
+	
+	int ret = (iovcnt < 0) ? -1 : file_writev(fdesc, (unsigned)fdesc->write_offset, iov, iovcnt);
+	if (ret > 0)
+		fdesc->write_offset += ret;
+	fd_put(fdesc);
+	return ret;
+}
+
+int my_preadv(int fd, const struct iovec* iov, int iovcnt, unsigned offset)
+{
+	if (!Lib_initted) {
+		printf("[my_pread] Library is not initialized.\n");
+		return -1;
+	}
+	
+	fd_t fdesc = fd_get(fd);
+	if(fdesc == NULL) {
+		printf("[my_pread] File isn't in use. Open it first.\n");
+		return -1;
+	}
+	
+	int ret = (iovcnt < 0) ? -1 : file_readv(fdesc, offset, iov, iovcnt);
+	fd_put(fdesc);
+	return ret;
+}
+
+int my_pwritev(int fd, const struct iovec* iov, int iovcnt, unsigned offset)
+{
+	if (!Lib_initted) {
+		printf("[my_pwrite] Library is not initialized.\n");
+		return -1;
+	}
+	
+	fd_t fdesc = fd_get(fd);
+	if(fdesc == NULL) {
+		printf("[my_pwrite] File isn't in use. Open it first.\n");
+		return -1;
+	}
+	
+	int ret = (iovcnt < 0) ? -1 : file_writev(fdesc, offset, iov, iovcnt);
+	fd_put(fdesc);
+	return ret;
+}
+
+int my_lseek(int fd, int offset, int whence)
+{
+	if (!Lib_initted) {
+		printf("[my_lseek] Library is not initialized.\n");
+		return -1;
+	}
+	
+	fd_t fdesc = fd_get(fd);
+	if(fdesc == NULL) {
+		printf("[my_lseek] File isn't in use. Open it first.\n");
+		return -1;
+	}
+	
+	long long pos = -1;
+	if (whence == SEEK_SET)
+		pos = offset;
+	else if (whence == SEEK_CUR)
+		pos = (long long)fdesc->read_offset + offset;
+	else if (whence == SEEK_END)
+		pos = (long long)fdesc->size + offset;
+	else if ((whence == SEEK_DATA || whence == SEEK_HOLE) && offset >= 0) {
+		// the server knows the holes once it has all the data
+		unsigned found;
+		if (cache_flush(fdesc) == 0 && snfs_seek(Ctx, fdesc->fileId, offset,
+		   (whence == SEEK_DATA) ? SNFS_SEEK_DATA : SNFS_SEEK_HOLE, &found) == STAT_OK)
+			pos = found;
+	}
+	
+	if (pos < 0 || pos > 0x7fffffff) {
+		printf("[my_lseek] Invalid offset.\n");
+		pos = -1;
+	} else {
+		// both offsets move, as if there was a single one
+		fdesc->read_offset = (int)pos;
+		fdesc->write_offset = (int)pos;
+	}
+	fd_put(fdesc);
+	return (int)pos;
+}
+
+int my_ftruncate(int fd, unsigned size)
+{
+	if (!Lib_initted) {
+		printf("[my_ftruncate] Library is not initialized.\n");
+		return -1;
+	}
+	
+	fd_t fdesc = fd_get(fd);
+	if(fdesc == NULL) {
+		printf("[my_ftruncate] File isn't in use. Open it first.\n");
+		return -1;
+	}
+	
+	unsigned fsize;
+	int ret = -1;
+	if (cache_drop(fdesc) == 0 &&
+	   snfs_truncate(Ctx, fdesc->fileId, size, &fsize) == STAT_OK) {
+		fdesc->size = fsize;
+		fdesc->ssize = fsize;
+		ret = 0;
+	} else
+		printf("[my_ftruncate] Error truncating the file.\n");
+	fd_put(fdesc);
+	return ret;
+}
+
+int my_fallocate(int fd, unsigned offset, unsigned len)
+{
+	if (!Lib_initted) {
+		printf("[my_fallocate] Library is not initialized.\n");
+		return -1;
+	}
+	
+	fd_t fdesc = fd_get(fd);
+	if(fdesc == NULL) {
+		printf("[my_fallocate] File isn't in use. Open it first.\n");
+		return -1;
+	}
+	
+	unsigned fsize;
+	int ret = -1;
+	if (cache_drop(fdesc) == 0 &&
+	   snfs_fallocate(Ctx, fdesc->fileId, offset, len, &fsize) == STAT_OK) {
+		fdesc->size = fsize;
+		fdesc->ssize = fsize;
+		ret = 0;
+	} else
+		printf("[my_fallocate] Error reserving space.\n");
+	fd_put(fdesc);
+	return ret;
+}
+
+int my_close(int fd)
+{
+	if (!Lib_initted) {
+		printf("[my_close] Library is not initialized.\n");
+		return -1;
+	}
+	
+	if (Open_files_lock != NULL)
+		sthread_mutex_lock(Open_files_lock);
+	fd_t temp = fdtable_release(Open_files, fd);
+	if (temp != NULL && temp->lock != NULL)
+		sthread_mutex_lock(temp->lock);
+	if (Open_files_lock != NULL)
+		sthread_mutex_unlock(Open_files_lock);
+	if(temp == NULL) {
+		printf("[my_close] File isn't in use. Open it first.\n");
+		return -1;
+	}
+	
+	// the data is on the server before the file can be opened again
+	int ret = cache_flush(temp);
+	if (ret < 0)
+		printf("[my_close] Error writing back to file.\n");
+	cache_free(temp);
+	if (temp->lock != NULL) {
+		sthread_mutex_unlock(temp->lock);
+		sthread_mutex_free(temp->lock);
+	}
+	free(temp);
+	
+	return ret;
+}
+
+
+int my_listdir(char* path, char **filenames, int* numFiles)
+{
+	if (!Lib_initted) {
+		printf("[my_listdir] Library is not initialized.\n");
+		return -1;
+	}
+	
 	snfs_fhandle_t dir;
 	unsigned fsize;	
 	
 	if ( myparse(path) != 0 ) {
-		printf("[my_listdir] Error looking for folder in server.\n");
+		printf("[my_listdir] Error looking for folder in server.\n");
 		return -1;
 	}   
      		
 	if ((strlen(path)==1) && (path[0]== '/') ) 
 		dir = ( snfs_fhandle_t)  1;
 	else
-		if(snfs_lookup(path, &dir, &fsize) != STAT_OK) {
-	     printf("[my_listdir] Error looking for folder in server.\n");
-	     return -1;
+		if(snfs_lookup(Ctx, path, &dir, &fsize) != STAT_OK) {
+	     printf("[my_listdir] Error looking for folder in server.\n");
+	     return -1;
 	   }
 	
-	
-	snfs_dir_entry_t list[MAX_READDIR_ENTRIES];
-	unsigned nFiles;
-	char* fnames;
-	
-	if (snfs_readdir(dir, MAX_READDIR_ENTRIES, list, &nFiles) != STAT_OK) {
-		printf("[my_listdir] Error reading directory in server.\n");
-		return -1;
-	}
-	
-	*numFiles = (int)nFiles;
-	
-	*filenames = fnames = (char*) malloc(sizeof(char)*((MAX_FILE_NAME_SIZE+1)*(*numFiles)));
-	for (int i = 0; i < *numFiles; i++) {
-		strcpy(fnames, list[i].name);
-		fnames += strlen(fnames)+1;
-	}
-	
-	return 0;
-}
-
-int my_mkdir(char* dirname){
-	if (!Lib_initted) {
-		printf("[my_mkdir] Library is not initialized.\n");
-		return -1;
+	
+	snfs_dir_entry_t list[MAX_READDIR_ENTRIES];
+	unsigned nFiles;
+	char* fnames;
+	
+	if (snfs_readdir(Ctx, dir, MAX_READDIR_ENTRIES, list, &nFiles) != STAT_OK) {
+		printf("[my_listdir] Error reading directory in server.\n");
+		return -1;
+	}
+	
+	*numFiles = (int)nFiles;
+	
+	*filenames = fnames = (char*) malloc(sizeof(char)*((MAX_FILE_NAME_SIZE+1)*(*numFiles)));
+	for (int i = 0; i < *numFiles; i++) {
+		strcpy(fnames, list[i].name);
+		fnames += strlen(fnames)+1;
+	}
+	
+	return 0;
+}
+
+int my_mkdir(char* dirname){
+	if (!Lib_initted) {
+		printf("[my_mkdir] Library is not initialized.\n");
+		return -1;
 	}
 
 	if ( myparse(dirname) != 0 ) {
-		printf("[my_mkdir] Malformed pathname.\n");
-		return -1;
+		printf("[my_mkdir] Malformed pathname.\n");
+		return -1;
 	}
 	
-	
-	
-	snfs_fhandle_t dir, newdir;
-	unsigned fsize;
+	
+	
+	snfs_fhandle_t dir;
 	char newfilename[MAX_FILE_NAME_SIZE];
 	char newdirname[MAX_PATH_NAME_SIZE];
 	char fulldirname[MAX_PATH_NAME_SIZE];
-	char *token;
+	char *token, *save;
 	char *search="/";
 	int i=0;
 	
@@ -298,20 +896,14 @@ int my_mkdir(char* dirname){
 	memset(&newdirname,0,MAX_PATH_NAME_SIZE);
 	memset(&fulldirname,0,MAX_PATH_NAME_SIZE);
 	
-	if(snfs_lookup(dirname, &dir, &fsize) == STAT_OK) {
-		printf("[my_mkdir] Error creating a  subdirectory that already exists.\n");
-		return -1;
-	}
-	
-
 	strcpy(fulldirname,dirname);
-	token = strtok(fulldirname, search);
+	token = strtok_r(fulldirname, search, &save);
 
 
 	while(token != NULL) {
 		i++;
 		strcpy(newfilename,token);
-		token = strtok(NULL, search);
+		token = strtok_r(NULL, search, &save);
 	} 
 	if ( i > 1){
 		strncpy(newdirname, dirname, strlen(dirname)-(strlen(newfilename)+1));
@@ -322,43 +914,52 @@ int my_mkdir(char* dirname){
 		newfilename[strlen(newfilename)]='\0';//CORRECCAO
 		strcpy(newdirname, dirname);   
 	}    
-	
+	
 
-	if(newdirname == NULL) {
-		printf("[my_mkdir] Error looking for directory in server.\n");
-		return -1;
+	if(newdirname == NULL) {
+		printf("[my_mkdir] Error looking for directory in server.\n");
+		return -1;
 	}
 	
 	
+	// lookup the parent directory and create the new one in it (the
+	// server refuses a name that already exists)
+	snfs_msg_req_compound_t ops;
+	snfs_compound_res_t res[SNFS_COMPOUND_MAX_OPS];
+	ops.count = 0;
 	if (i==1)  //Create a directory in Root
 		dir = ( snfs_fhandle_t)  1;
 	else   //Create a directory elsewhere
-		if(snfs_lookup(newdirname, &dir, &fsize) != STAT_OK) {
-			printf("[my_mkdir] Error creating a  subdirectory which has a wrong pathname.\n");
-			return -1;
-		}
-
-
-	if(snfs_mkdir(dir, newfilename, &newdir) != STAT_OK) {
-		printf("[my_mkdir] Error creating new directory in server.\n");
-		return -1;
-	}
-	
-	return 0;
+		dir = compound_dir(&ops, newdirname);
+	int mk = compound_add(&ops, REQ_MKDIR, SNFS_COND_ALWAYS);
+	ops.ops[mk].args.mkdir.dir = dir;
+	strcpy(ops.ops[mk].args.mkdir.file, newfilename);
+
+	if(snfs_compound(Ctx, &ops, res) != STAT_OK) {
+		if (mk > 0 && res[0].status != RES_OK)
+			printf("[my_mkdir] Error creating a  subdirectory which has a wrong pathname.\n");
+		else
+			printf("[my_mkdir] Error creating new directory in server.\n");
+		return -1;
+	}
+	
+	return 0;
 }
 
 int myparse(char* pathname) {
-
-	char line[MAX_PATH_NAME_SIZE]; 
-	char *token;
-	char *search = "/";
+
+	char line[MAX_PATH_NAME_SIZE]; 
+	char *token, *save;
+	char *search = "/";
 	int i=0;
-
-	strcpy(line,pathname); 
+
+	strcpy(line,pathname); 
+
 	if(strlen(line) >= MAX_PATH_NAME_SIZE || (strlen(line) < 1) ) {
 		return -1; 
-	}
-	if (strchr(line, ' ') != NULL || strstr( (const char *) line, "//") != NULL || line[0] != '/' ) {
+	}
+
+	if (strchr(line, ' ') != NULL || strstr( (const char *) line, "//") != NULL || line[0] != '/' ) {
 		return -1; 
 	}
 
@@ -366,17 +967,18 @@ int myparse(char* pathname) {
 	if ((i=strlen(pathname)) && line[i]=='/') {
 		return -1; 
 	}
-	   	i=0;
-	token = strtok(line, search);
-
-	while(token != NULL) {
-		if ( strlen(token) > MAX_FILE_NAME_SIZE -1) { 
+	   
+	i=0;
+	token = strtok_r(line, search, &save);
+
+	while(token != NULL) {
+		if ( strlen(token) > MAX_FILE_NAME_SIZE -1) { 
 			return -1; 
-		}
-		i++;
-
-		token = strtok(NULL, search);
-	}
+		}
+		i++;
+
+		token = strtok_r(NULL, search, &save);
+	}
 
 	return 0;
 }
@@ -400,94 +1002,94 @@ void removeLastName(char* path,char* file,char* newpath){
 int my_remove(char* name){
 	char dirPathName[MAX_PATH_NAME_SIZE];
 	char fileName[MAX_FILE_NAME_SIZE];
-	snfs_fhandle_t file;
-	snfs_fhandle_t dir;
-	unsigned fileSize;
-	unsigned dirSize;
-	if(snfs_lookup(name,&file,&fileSize)!=STAT_OK){
-		printf("[my_remove] Error no file/directory found with that pathname.\n");
-		return -1;
-	}
+	snfs_msg_req_compound_t ops;
+	snfs_compound_res_t res[SNFS_COMPOUND_MAX_OPS];
+	ops.count = 0;
+	
+	int look = compound_add(&ops, REQ_LOOKUP, SNFS_COND_ALWAYS);
+	strcpy(ops.ops[look].args.lookup.pname, name);
 	removeLastName(name,fileName,dirPathName);
-	snfs_lookup(dirPathName,&dir,&dirSize);
-	if(strcmp(dirPathName,"/")==0)
-		dir=1;
+	snfs_fhandle_t dir = compound_dir(&ops, dirPathName);
+	int rm = compound_add(&ops, REQ_REMOVE, SNFS_COND_ALWAYS);
+	ops.ops[rm].args.remove.dir = dir;
+	strcpy(ops.ops[rm].args.remove.name, fileName);
 	
-	if(snfs_remove(dir,fileName,&file)!=STAT_OK){
-		printf("[my_remove] Error removing file/directory.\n");
+	if(snfs_compound(Ctx, &ops, res)!=STAT_OK){
+		if (res[look].status != RES_OK)
+			printf("[my_remove] Error no file/directory found with that pathname.\n");
+		else
+			printf("[my_remove] Error removing file/directory.\n");
 		return -1;
 	}
 	return 0;
 }
 
 int my_copy(char* name1,char* name2){
-	snfs_fhandle_t file1;
-	unsigned file1size;
 	char fileName1[MAX_FILE_NAME_SIZE];
 	char dirPathName1[MAX_PATH_NAME_SIZE];
-	snfs_fhandle_t dir1;
-	unsigned dirSize1;
-	snfs_fhandle_t file2;
 	char fileName2[MAX_FILE_NAME_SIZE];
 	char dirPathName2[MAX_PATH_NAME_SIZE];
-	snfs_fhandle_t dir2;
-	unsigned dirSize2;
-	if(snfs_lookup(name1,&file1,&file1size)!=STAT_OK){
-		printf("[my_copy] Error no file/directory found with that pathname.\n");
-		return -1;
-	}
+	snfs_msg_req_compound_t ops;
+	snfs_compound_res_t res[SNFS_COMPOUND_MAX_OPS];
+	ops.count = 0;
+	
+	int look = compound_add(&ops, REQ_LOOKUP, SNFS_COND_ALWAYS);
+	strcpy(ops.ops[look].args.lookup.pname, name1);
 	removeLastName(name1,fileName1,dirPathName1);
 	removeLastName(name2,fileName2,dirPathName2);
-	snfs_lookup(dirPathName1,&dir1,&dirSize1);
-	snfs_lookup(dirPathName2,&dir2,&dirSize2);
-	if(strcmp(dirPathName1,"/")==0)
-		dir1=1;
-	if(strcmp(dirPathName2,"/")==0)
-		dir2=1;	
+	snfs_fhandle_t dir1 = compound_dir(&ops, dirPathName1);
+	snfs_fhandle_t dir2 = compound_dir(&ops, dirPathName2);
+	int cp = compound_add(&ops, REQ_COPY, SNFS_COND_ALWAYS);
+	ops.ops[cp].args.copy.src_dir = dir1;
+	strcpy(ops.ops[cp].args.copy.src_name, fileName1);
+	ops.ops[cp].args.copy.dst_dir = dir2;
+	strcpy(ops.ops[cp].args.copy.dst_name, fileName2);
 	
-	if(snfs_copy(dir1,fileName1,dir2,fileName2,&file2)!=STAT_OK){
-		printf("[my_copy] Error copying file/directory.\n");
-		return -1;
+	if(snfs_compound(Ctx, &ops, res)!=STAT_OK){
+		if (res[look].status != RES_OK)
+			printf("[my_copy] Error no file/directory found with that pathname.\n");
+		else
+			printf("[my_copy] Error copying file/directory.\n");
+		return -1;
 	}
 	return 0;
 }
 
 int my_append(char* name1,char* name2){
-	snfs_fhandle_t file1;
-	unsigned file1size;
 	char fileName1[MAX_FILE_NAME_SIZE];
 	char dirPathName1[MAX_PATH_NAME_SIZE];
-	snfs_fhandle_t dir1;
-	unsigned dirSize1;
-	snfs_fhandle_t file2;
-	unsigned file2size;
 	char fileName2[MAX_FILE_NAME_SIZE];
 	char dirPathName2[MAX_PATH_NAME_SIZE];
-	snfs_fhandle_t dir2;
-	unsigned dirSize2;
-	if(snfs_lookup(name1,&file1,&file1size)!=STAT_OK || snfs_lookup(name2,&file2,&file2size)!=STAT_OK){
-		printf("[my_append] Error no file/directory found with that pathname.\n");
-		return -1;
-	}
+	snfs_msg_req_compound_t ops;
+	snfs_compound_res_t res[SNFS_COMPOUND_MAX_OPS];
+	ops.count = 0;
 	
+	int look1 = compound_add(&ops, REQ_LOOKUP, SNFS_COND_ALWAYS);
+	strcpy(ops.ops[look1].args.lookup.pname, name1);
+	int look2 = compound_add(&ops, REQ_LOOKUP, SNFS_COND_ALWAYS);
+	strcpy(ops.ops[look2].args.lookup.pname, name2);
 	removeLastName(name1,fileName1,dirPathName1);
 	removeLastName(name2,fileName2,dirPathName2);
-	snfs_lookup(dirPathName1,&dir1,&dirSize1);
-	snfs_lookup(dirPathName2,&dir2,&dirSize2);
-	if(strcmp(dirPathName1,"/")==0)
-		dir1=1;
-	if(strcmp(dirPathName2,"/")==0)
-		dir2=1;	
+	snfs_fhandle_t dir1 = compound_dir(&ops, dirPathName1);
+	snfs_fhandle_t dir2 = compound_dir(&ops, dirPathName2);
+	int app = compound_add(&ops, REQ_APPEND, SNFS_COND_ALWAYS);
+	ops.ops[app].args.append.dir1 = dir1;
+	strcpy(ops.ops[app].args.append.name1, fileName1);
+	ops.ops[app].args.append.dir2 = dir2;
+	strcpy(ops.ops[app].args.append.name2, fileName2);
 	
-	if(snfs_append(dir1,fileName1,dir2,fileName2,&file1size)!=STAT_OK){
-		printf("[my_append] Error appending files.\n");
+	if(snfs_compound(Ctx, &ops, res)!=STAT_OK){
+		if (res[look1].status != RES_OK || res[look2].status != RES_OK)
+			printf("[my_append] Error no file/directory found with that pathname.\n");
+		else
+			printf("[my_append] Error appending files.\n");
 		return -1;
 	}
 	return 0;
 }
 
 int my_defrag(){
-	if(snfs_defrag()!=STAT_OK){
+	if(snfs_defrag(Ctx)!=STAT_OK){
 		printf("[my_defrag] Error defragging\n");
 		return -1;
 	}
@@ -495,14 +1097,18 @@ int my_defrag(){
 }
 
 int my_diskusage(){
-	if(snfs_diskusage()!=STAT_OK){
+	if(snfs_diskusage(Ctx)!=STAT_OK){
 		printf("[my_diskusage] Error defragging\n");
 		return -1;
 	}
 	return 0;
 }
 int my_dumpcache(){
-	if(snfs_dumpcache()!=STAT_OK){
+	printf("===== Dump: File Page Cache ===============================\n");
+	printf("Page reads: %u Hits: %u Fetched: %u Page writes: %u Written back: %u\n",
+		Pc_reads, Pc_hits, Pc_fetched, Pc_writes, Pc_written);
+	snfs_lookup_cache_dump(Ctx);
+	if(snfs_dumpcache(Ctx)!=STAT_OK){
 		printf("[my_dumpcache] Error defragging\n");
 		return -1;
 	}
@@ -11,85 +11,558 @@
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/un.h>
+#include <sys/time.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
 #include <strings.h>
+#include <sthread.h>
 
 #include <snfs_api.h>
 #include <snfs_proto.h>
+#include <snfs_codec.h>
 
 
 /*
- * Internal private global variables
+ * Remote calls in flight
+ *
+ * Every request gets a serial number and the call slot of that number
+ * (slot 'serial % SNFS_MAX_CALLS'), so up to SNFS_MAX_CALLS requests
+ * may be in flight. Responses arrive in any order: whoever waits for
+ * a call (or polls) receives them and hands each one to its call by
+ * its serial number. When several threads share a context, one of the
+ * waiting threads receives for all of them while the others wait in
+ * the context monitor.
  */
 
-// the client socket file descriptor
-static int Cli_sock;
+typedef enum {CALL_FREE = 0, CALL_PENDING = 1, CALL_DONE = 2} call_state_t;
+
+// a call the server answers with RES_BUSY (the queue of its class is
+// full) is made again, up to SNFS_BUSY_RETRIES times, after a pause
+// that starts at SNFS_BUSY_WAIT_US and doubles each time (about 1 s
+// in all)
+#define SNFS_BUSY_RETRIES 10
+#define SNFS_BUSY_WAIT_US 1000
+
+int usleep(unsigned int usec);
+
+struct snfs_call_ {
+   snfs_ctx_t* ctx;
+   snfs_req_serial_num_t serial;
+   call_state_t state;
+   snfs_msg_type_t type;
+   snfs_msg_res_t* res;       // where the response is placed
+   int ressz;                 // size of 'res'
+   int status;                // size of the response received or -1
+   char* data;                // where the data of a read is received
+   unsigned count;            // size of 'data'
+   snfs_callback_t callback;  // completion callback (if any)
+   void* arg;
+   snfs_msg_res_t own;        // response of an asynchronous call
+};
+
 
-// the client socket address
-static struct sockaddr_un Cli_addr;
+/*
+ * Lookup cache
+ *
+ * Results of snfs_lookup, kept while the lease the server granted on
+ * them lasts. The server sends an invalidation when a cached file
+ * changes; pending invalidations are handled before the cache is used.
+ * The cache is direct-mapped by a hash of the pathname.
+ */
 
-// the server socket address
-static struct sockaddr_un Serv_addr;
+#define LCACHE_SIZE 256
+
+typedef struct {
+   char path[MAX_PATH_NAME_SIZE];
+   snfs_fhandle_t file;
+   unsigned fsize;
+   snfs_dir_entry_type_t ftype;
+   long long expires;         // end of the lease (ms), 0 if free
+} lcache_entry_t;
+
+
+/*
+ * Client context: the socket, what was negotiated with the server, the
+ * calls in flight and the lookup cache. Everything but the socket is
+ * protected by the monitor of contexts shared by several threads.
+ */
+
+struct snfs_ctx_ {
+   int sock;                          // the client socket file descriptor
+   struct sockaddr_un cli_addr;       // the client socket address
+   struct sockaddr_un serv_addr;      // the server socket address
+   unsigned max_transfer;             // data in a single read/write message
+   unsigned wire_version;             // compact encoding in use (0 if none)
+   sthread_mon_t mon;                 // NULL if used by a single thread
+   int receiving;                     // 1 while a thread receives for all
+   snfs_call_t calls[SNFS_MAX_CALLS];
+   snfs_req_serial_num_t next_serial; // serial number of the next request
+   lcache_entry_t lcache[LCACHE_SIZE];
+   unsigned lcache_gen;               // number of invalidations received (a
+                                      // lookup result that crossed one is
+                                      // not cached)
+   unsigned lcache_hits, lcache_misses, lcache_invals;
+};
 
 
 /*
  * Internal private auxiliary functions
  */
 
+static void ctx_enter(snfs_ctx_t* ctx)
+{
+   if (ctx->mon != NULL) {
+      sthread_monitor_enter(ctx->mon);
+   }
+}
+
+
+static void ctx_exit(snfs_ctx_t* ctx)
+{
+   if (ctx->mon != NULL) {
+      sthread_monitor_exit(ctx->mon);
+   }
+}
+
+
 /*
- * Makes a remote call, sending 'req' to the server (defined in the global variable Serv_addr)
- * and waiting for the response.
+ * Gets a free call slot and gives it a new serial number, or returns
+ * NULL if every slot is in use (inside the context monitor).
 */
 
-static int remote_call(snfs_msg_req_t *req, int reqsz, snfs_msg_res_t *res, 
-   int ressz)
+static snfs_call_t* call_alloc(snfs_ctx_t* ctx)
 {
-   int status;
-   
-   
-   status = sendto(Cli_sock, (void*)req, reqsz, 0, 
-      (struct sockaddr *)&Serv_addr, sizeof(Serv_addr));
-   if (status < 0) {
-     //printf("DEBUG: serv_addr: %s\n", Serv_addr.sun_path);
-      printf("[snfs_api] sendto error: %s.\n", strerror(errno));
-      return -1;
+   for (int i = 0; i < SNFS_MAX_CALLS; i++) {
+      snfs_req_serial_num_t serial = ctx->next_serial++;
+      if (serial == 0) {
+         serial = ctx->next_serial++;
+      }
+      snfs_call_t* call = &ctx->calls[serial % SNFS_MAX_CALLS];
+      if (call->state == CALL_FREE) {
+         memset(call, 0, offsetof(snfs_call_t, own));
+         call->ctx = ctx;
+         call->serial = serial;
+         return call;
+      }
    }
-  
-   // waits for an answer
-   status = recvfrom(Cli_sock, res, ressz, 0, NULL, NULL);
+   return NULL;
+}
+
+
+static long long lcache_now()
+{
+   struct timeval tv;
+   gettimeofday(&tv, NULL);
+   return (long long)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+
+static lcache_entry_t* lcache_slot(snfs_ctx_t* ctx, char* path)
+{
+   unsigned h = 5381;
+   for (char* c = path; *c != '\0'; c++) {
+      h = h * 33 + (unsigned char)*c;
+   }
+   return &ctx->lcache[h % LCACHE_SIZE];
+}
+
+
+static void lcache_invalidate(snfs_ctx_t* ctx, snfs_fhandle_t file)
+{
+   ctx->lcache_gen++;
+   ctx->lcache_invals++;
+   for (int i = 0; i < LCACHE_SIZE; i++) {
+      if (file == SNFS_INVALIDATE_ALL || ctx->lcache[i].file == file) {
+         ctx->lcache[i].expires = 0;
+      }
+   }
+}
+
+
+/*
+ * Receives a message the server sent without a request (serial number
+ * 0), namely an invalidation of the lookup cache.
+*/
+
+static void recv_unrequested(snfs_ctx_t* ctx)
+{
+   char wire[SNFS_WIRE_MAX_SMALL];
+   snfs_msg_res_t dec;
+   snfs_msg_res_t* res = (snfs_msg_res_t*)wire;
+   char* data;
+
+   int status = recv(ctx->sock, wire, sizeof(wire), 0);
+   if (ctx->wire_version > 0) {
+      status = (status < 0 || snfs_decode_res(wire, status, &dec, &data) < 0) ?
+         -1 : sizeof(dec);
+      res = &dec;
+   }
+   if (status < (int)(sizeof(*res) - sizeof(res->body) + sizeof(res->body.invalidate)) ||
+      res->type != REQ_INVALIDATE) {
+      printf("[snfs_api] unexpected message.\n");
+      return;
+   }
+   ctx_enter(ctx);
+   lcache_invalidate(ctx, res->body.invalidate.file);
+   ctx_exit(ctx);
+}
+
+
+/*
+ * Gets the outcome of a completed call: the status and, for reads and
+ * writes, the number of bytes read or the size of the file.
+*/
+
+static snfs_call_status_t call_result(snfs_call_t* call, unsigned* result)
+{
+   snfs_msg_res_t* res = call->res;
+
+   *result = 0;
+   if (call->status < (int)(sizeof(*res) - sizeof(res->body))) {
+      return STAT_ERROR;
+   }
+   if (res->status == RES_BUSY) {
+      return STAT_BUSY;
+   }
+   if (res->status != RES_OK) {
+      return STAT_ERROR;
+   }
+   if (call->type == REQ_READ) {
+      if (res->body.read.nread > call->count ||
+         call->status < (int)SNFS_READ_RES_SIZE(res->body.read.nread)) {
+         return STAT_ERROR;
+      }
+      *result = res->body.read.nread;
+   } else if (call->type == REQ_WRITE) {
+      *result = res->body.write.fsize;
+   }
+   return STAT_OK;
+}
+
+
+/*
+ * Receives one response and completes its call, running its callback.
+ * Without 'block' it returns at once if no response has arrived. If
+ * another thread is receiving, it waits for that thread instead (or
+ * returns at once without 'block'). Called inside the context monitor,
+ * which is released while receiving and running the callback.
+ * Returns 1 if a call was completed, 0 if not, or -1 on error.
+*/
+
+static int call_recv(snfs_ctx_t* ctx, int block)
+{
+   char wire[SNFS_WIRE_MAX_SMALL];
+   snfs_req_serial_num_t serial = 0;
+   snfs_call_t* call = NULL;
+   struct iovec iov[2];
+   struct msghdr msg;
+   int status, ret = -1;
+
+   if (ctx->receiving) {
+      if (block) {
+         sthread_monitor_wait(ctx->mon);
+      }
+      return 0;
+   }
+   ctx->receiving = 1;
+   ctx_exit(ctx);
+
+   // peek the header to find the call the response belongs to (the
+   // unrequested messages of the server are handled on the way)
+   for (;;) {
+      status = recv(ctx->sock, wire, SNFS_WIRE_READ_HDR, MSG_PEEK | (block ? 0 : MSG_DONTWAIT));
+      if (status < 0) {
+         if (!block && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            ret = 0;
+         } else {
+            printf("[snfs_api] recvfrom error: %s.\n", strerror(errno));
+         }
+         ctx_enter(ctx);
+         goto done;
+      }
+      if (status == 0) {
+		printf("[snfs_api] server is closed.\n");
+		ctx_enter(ctx);
+		goto done;
+      }
+      if (ctx->wire_version > 0) {
+         snfs_decode_serial(wire, status, &serial);
+      } else if (status >= offsetof(snfs_msg_res_t, status)) {
+         memcpy(&serial, wire + offsetof(snfs_msg_res_t, serial), sizeof(serial));
+      }
+      if (serial != 0) {
+         break;
+      }
+      recv_unrequested(ctx);
+   }
+
+   ctx_enter(ctx);
+   call = &ctx->calls[serial % SNFS_MAX_CALLS];
+   if (call->state != CALL_PENDING || call->serial != serial) {
+      // drop the datagram
+      recv(ctx->sock, wire, 1, 0);
+      printf("[snfs_api] unexpected response.\n");
+      ret = 0;
+      goto done;
+   }
+   ctx_exit(ctx);
+
+   // the data of a read is received right where the caller wants it
+   // (the call is only changed by its owner once it is done)
+   memset(&msg, 0, sizeof(msg));
+   msg.msg_iov = iov;
+   msg.msg_iovlen = 1;
+   iov[0].iov_base = (ctx->wire_version > 0) ? wire : (char*)call->res;
+   iov[0].iov_len = (ctx->wire_version > 0) ? sizeof(wire) : call->ressz;
+   if (call->data != NULL) {
+      iov[0].iov_len = (ctx->wire_version > 0) ? SNFS_WIRE_READ_HDR : SNFS_READ_RES_SIZE(0);
+      iov[1].iov_base = call->data;
+      iov[1].iov_len = call->count;
+      msg.msg_iovlen = 2;
+   }
+   status = recvmsg(ctx->sock, &msg, 0);
    if (status < 0) {
       printf("[snfs_api] recvfrom error: %s.\n", strerror(errno));
-      return -1;
    }
-   if (status == 0) {
-		printf("[snfs_api] server is closed.\n");
-		return -1;
+
+   if (status >= 0 && ctx->wire_version > 0) {
+      snfs_msg_res_t dec;
+      char* data;
+      if (snfs_decode_res(wire, status, &dec, &data) < 0) {
+         printf("[snfs_api] malformed response.\n");
+         status = -1;
+      } else if (data != NULL) {
+         memcpy(call->res, &dec, SNFS_READ_RES_SIZE(0));
+         status = SNFS_READ_RES_SIZE(dec.body.read.nread);
+      } else {
+         memcpy(call->res, &dec, (call->ressz < sizeof(dec)) ? call->ressz : sizeof(dec));
+         status = sizeof(dec);
+      }
+   }
+
+   ctx_enter(ctx);
+   call->status = status;
+   call->state = CALL_DONE;
+   ret = 1;
+
+done:
+   // let the threads waiting for their calls see them (or receive)
+   ctx->receiving = 0;
+   if (ctx->mon != NULL) {
+      sthread_monitor_signalall(ctx->mon);
+   }
+
+   // a call with a callback is finished by it
+   if (ret == 1 && call->callback != NULL) {
+      unsigned result;
+      snfs_call_status_t stat = call_result(call, &result);
+      snfs_callback_t callback = call->callback;
+      void* arg = call->arg;
+      call->state = CALL_FREE;
+      ctx_exit(ctx);
+      callback(stat, result, arg);
+      ctx_enter(ctx);
    }
+   return ret;
+}
+
+
+/*
+ * Sends 'req' to the server (defined in the context) as a new call,
+ * without waiting for the response, which is placed in 'res' (in the
+ * call itself if NULL). Blocks while every call slot is in use.
+ *
+ * Messages are built in the fixed-size format and, if the server agreed
+ * on it, sent in the compact encoding. The data of a write ('wdata') is
+ * sent from where it is and the data of a read is received at 'rdata'.
+*/
+
+static snfs_call_t* call_start(snfs_ctx_t* ctx, snfs_msg_req_t* req, int reqsz,
+   char* wdata, unsigned wcount, snfs_msg_res_t* res, int ressz, char* rdata,
+   unsigned rcount, snfs_callback_t callback, void* arg)
+{
+   char wire[SNFS_WIRE_MAX_SMALL];
+   struct iovec iov[2];
+   struct msghdr msg;
+   snfs_call_t* call;
+
+   // wait for calls in flight to complete if there is no free slot
+   ctx_enter(ctx);
+   while ((call = call_alloc(ctx)) == NULL) {
+      if (call_recv(ctx, 1) < 0) {
+         ctx_exit(ctx);
+         return NULL;
+      }
+   }
+   call->type = req->type;
+   call->res = (res != NULL) ? res : &call->own;
+   call->ressz = (res != NULL) ? ressz : sizeof(call->own);
+   call->data = rdata;
+   call->count = rcount;
+   call->callback = callback;
+   call->arg = arg;
+   // pending before it is sent, another thread may get the response
+   call->state = CALL_PENDING;
+   req->serial = call->serial;
+   ctx_exit(ctx);
+
+   memset(&msg, 0, sizeof(msg));
+   msg.msg_name = &ctx->serv_addr;
+   msg.msg_namelen = sizeof(ctx->serv_addr);
+   msg.msg_iov = iov;
+   msg.msg_iovlen = (wdata != NULL) ? 2 : 1;
+   iov[0].iov_base = req;
+   iov[0].iov_len = reqsz;
+   if (ctx->wire_version > 0) {
+      iov[0].iov_base = wire;
+      iov[0].iov_len = snfs_encode_req(req, wire);
+   }
+   iov[1].iov_base = wdata;
+   iov[1].iov_len = wcount;
+
+   if (sendmsg(ctx->sock, &msg, 0) < 0) {
+      printf("[snfs_api] sendto error: %s.\n", strerror(errno));
+      ctx_enter(ctx);
+      call->state = CALL_FREE;
+      ctx_exit(ctx);
+      return NULL;
+   }
+   return call;
+}
+
+
+/*
+ * Waits for a call to complete and frees its slot.
+ * Returns the size of the response received or -1 on error.
+*/
 
+static int call_finish(snfs_call_t* call)
+{
+   snfs_ctx_t* ctx = call->ctx;
+   int status = -1;
+
+   ctx_enter(ctx);
+   while (call->state == CALL_PENDING) {
+      if (call_recv(ctx, 1) < 0) {
+         break;
+      }
+   }
+   if (call->state == CALL_DONE) {
+      status = call->status;
+   }
+   call->state = CALL_FREE;
+   ctx_exit(ctx);
    return status;
 }
 
 
+/*
+ * Waits before a call refused with RES_BUSY is made again (the
+ * 'attempt'-th time).
+*/
+
+static void busy_backoff(int attempt)
+{
+   usleep(SNFS_BUSY_WAIT_US << attempt);
+}
+
+
+/*
+ * Makes a remote call, sending 'req' to the server and waiting for the
+ * response (the size returned is the one of the response in the
+ * fixed-size format). A call refused with RES_BUSY is made again.
+*/
+
+static int remote_call(snfs_ctx_t* ctx, snfs_msg_req_t *req, int reqsz,
+   snfs_msg_res_t *res, int ressz)
+{
+   for (int attempt = 0; ; attempt++) {
+      snfs_call_t* call = call_start(ctx, req, reqsz, NULL, 0, res, ressz, NULL, 0, NULL, NULL);
+      if (call == NULL) {
+         return -1;
+      }
+      int status = call_finish(call);
+      if (status < (int)(sizeof(*res) - sizeof(res->body)) ||
+         res->status != RES_BUSY || attempt == SNFS_BUSY_RETRIES) {
+         return status;
+      }
+      busy_backoff(attempt);
+   }
+}
+
+
+/*
+ * Negotiates with the server the largest amount of data transferred
+ * in a single read/write message and the message encoding; servers
+ * that do not support it keep the default transfer size.
+*/
+
+static int negotiate_transfer(snfs_ctx_t* ctx)
+{
+   snfs_msg_req_t req;
+   snfs_msg_res_t res;
+   unsigned max = SNFS_MAX_TRANSFER;
+
+   // the messages must fit in a single datagram of the client socket
+   int bufsz = SNFS_WRITE_REQ_SIZE(SNFS_MAX_TRANSFER) + 1024;
+   socklen_t optlen = sizeof(bufsz);
+   setsockopt(ctx->sock, SOL_SOCKET, SO_SNDBUF, &bufsz, sizeof(bufsz));
+   setsockopt(ctx->sock, SOL_SOCKET, SO_RCVBUF, &bufsz, sizeof(bufsz));
+   if (getsockopt(ctx->sock, SOL_SOCKET, SO_SNDBUF, &bufsz, &optlen) == 0 &&
+      bufsz - (int)SNFS_WRITE_REQ_SIZE(0) - 1024 < (int)max) {
+      max = bufsz - SNFS_WRITE_REQ_SIZE(0) - 1024;
+   }
+
+   memset(&req,0,sizeof(req));
+   memset(&res,0,sizeof(res));
+   req.type = REQ_NEGOTIATE;
+   req.body.negotiate.max_transfer = max;
+   req.body.negotiate.wire_version = SNFS_WIRE_VERSION;
+
+   int status = remote_call(ctx, &req, offsetof(snfs_msg_req_t, body) + sizeof(req.body.negotiate),
+      &res, sizeof(res));
+   if (status >= 0 && res.status == RES_OK &&
+      res.body.negotiate.max_transfer >= MAX_READ_DATA &&
+      res.body.negotiate.max_transfer <= max) {
+      ctx->max_transfer = res.body.negotiate.max_transfer;
+      ctx->wire_version = res.body.negotiate.wire_version;
+   }
+   return 0;
+}
+
+
 /*
  * SNFS API implementation (see snfs_api.h)
  */
 
-int snfs_init(char* cli_name, char* server_name)
+snfs_ctx_t* snfs_init(char* cli_name, char* server_name, int flags)
 {
    if (cli_name == NULL || server_name == NULL) {
       printf("[snfs_api] invalid client/server address names.\n");
-      return -1;
+      return NULL;
+   }
+
+   snfs_ctx_t* ctx = (snfs_ctx_t*) calloc(1, sizeof(snfs_ctx_t));
+   if (ctx == NULL) {
+      printf("[snfs_api] out of memory.\n");
+      return NULL;
+   }
+   ctx->max_transfer = MAX_READ_DATA;
+   ctx->next_serial = 1;
+   if (flags & SNFS_CTX_THREADS) {
+      ctx->mon = sthread_monitor_init();
    }
 
    // creates socket datagram domain unix
-   if ((Cli_sock = socket(AF_UNIX, SOCK_DGRAM, 0)) < 0){
+   if ((ctx->sock = socket(AF_UNIX, SOCK_DGRAM, 0)) < 0){
       printf("[snfs_api] socket error: %s.\n", strerror(errno));
-      return -1;
+      snfs_finish(ctx);
+      return NULL;
    }
 
    // reuse client address if it exists
@@ -98,27 +571,36 @@ int snfs_init(char* cli_name, char* server_name)
    }
 
    // client structure address cleaning
-   bzero(&Cli_addr, sizeof(Cli_addr));
-   Cli_addr.sun_family = AF_UNIX;
-   strcpy(Cli_addr.sun_path, cli_name);
+   bzero(&ctx->cli_addr, sizeof(ctx->cli_addr));
+   ctx->cli_addr.sun_family = AF_UNIX;
+   strcpy(ctx->cli_addr.sun_path, cli_name);
 
    // binds socket to address
-   if (bind(Cli_sock, (struct sockaddr *) &Cli_addr, sizeof(Cli_addr)) < 0){
+   if (bind(ctx->sock, (struct sockaddr *) &ctx->cli_addr, sizeof(ctx->cli_addr)) < 0){
       printf("[snfs_api] bind error: %s.\n", strerror(errno));
-      return -1;
+      snfs_finish(ctx);
+      return NULL;
    }
 
    // server structure address cleaning
-   bzero(&Serv_addr, sizeof(Serv_addr));
-   Serv_addr.sun_family = AF_UNIX;
+   bzero(&ctx->serv_addr, sizeof(ctx->serv_addr));
+   ctx->serv_addr.sun_family = AF_UNIX;
 
-     //printf("DEBUG: serv_addr initialized to: %s\n", Serv_addr.sun_path);
-   strcpy(Serv_addr.sun_path, server_name);
-   return 0;
+     //printf("DEBUG: serv_addr initialized to: %s\n", ctx->serv_addr.sun_path);
+   strcpy(ctx->serv_addr.sun_path, server_name);
+
+   negotiate_transfer(ctx);
+   return ctx;
 }
 
 
-snfs_call_status_t snfs_ping(char* inmsg, int insize, char* outmsg, int outsize)
+unsigned snfs_max_transfer(snfs_ctx_t* ctx)
+{
+   return ctx->max_transfer;
+}
+
+
+snfs_call_status_t snfs_ping(snfs_ctx_t* ctx, char* inmsg, int insize, char* outmsg, int outsize)
 {
    snfs_msg_req_t req;
    snfs_msg_res_t res;
@@ -130,7 +612,7 @@ snfs_call_status_t snfs_ping(char* inmsg, int insize, char* outmsg, int outsize)
    req.type = REQ_PING;
    strncpy(req.body.ping.msg,inmsg,insize);
 
-   int status = remote_call(&req, sizeof(req.type) + sizeof(req.body.ping), 
+   int status = remote_call(ctx, &req, offsetof(snfs_msg_req_t, body) + sizeof(req.body.ping), 
       &res, sizeof(res));
 
    // format response
@@ -143,15 +625,32 @@ snfs_call_status_t snfs_ping(char* inmsg, int insize, char* outmsg, int outsize)
 
 
 /* 
-   snfs_call_status_t snfs_lookup(char* pathname, ...) */
+   snfs_call_status_t snfs_lookup(snfs_ctx_t* ctx, char* pathname, ...) */
 
-snfs_call_status_t snfs_lookup(char* pathname, 
+snfs_call_status_t snfs_lookup(snfs_ctx_t* ctx, char* pathname, 
    snfs_fhandle_t* file, unsigned* fsize)
 {
 
 	snfs_msg_req_t req;
 	snfs_msg_res_t res;
 	
+	// a cached result is used while its lease lasts (and nothing in
+	// the socket invalidated it)
+	int polled = snfs_poll(ctx, 0);
+	ctx_enter(ctx);
+	lcache_entry_t* entry = lcache_slot(ctx, pathname);
+	if (polled >= 0 && entry->expires > lcache_now() &&
+		strcmp(entry->path, pathname) == 0) {
+		ctx->lcache_hits++;
+		*file = entry->file;
+		*fsize = entry->fsize;
+		ctx_exit(ctx);
+		return STAT_OK;
+	}
+	ctx->lcache_misses++;
+	unsigned gen = ctx->lcache_gen;
+	ctx_exit(ctx);
+	
 	memset(&req,0,sizeof(req));
 	memset(&res,0,sizeof(res));
 	
@@ -159,7 +658,8 @@ snfs_call_status_t snfs_lookup(char* pathname,
 	req.type = REQ_LOOKUP;
 	strcpy(req.body.lookup.pname, pathname);
 	
-	int status = remote_call(&req, sizeof(req.type) + sizeof(req.body.lookup), 
+	long long sent = lcache_now();
+	int status = remote_call(ctx, &req, offsetof(snfs_msg_req_t, body) + sizeof(req.body.lookup), 
 					       &res, sizeof(res));
 	
 	// format response
@@ -168,71 +668,301 @@ snfs_call_status_t snfs_lookup(char* pathname,
 		return STAT_ERROR;
 	}
 	
+	// the lease is counted from the time the request was sent
+	ctx_enter(ctx);
+	if (res.body.lookup.lease > 0 && gen == ctx->lcache_gen &&
+		strlen(pathname) < MAX_PATH_NAME_SIZE) {
+		strcpy(entry->path, pathname);
+		entry->file = res.body.lookup.file;
+		entry->fsize = res.body.lookup.fsize;
+		entry->ftype = res.body.lookup.ftype;
+		entry->expires = sent + res.body.lookup.lease;
+	}
+	ctx_exit(ctx);
+	
 	*file = res.body.lookup.file;
 	*fsize = res.body.lookup.fsize;
 	return STAT_OK;
 }
 
 
-snfs_call_status_t snfs_read(snfs_fhandle_t fhandle, unsigned offset,
-   unsigned count, char* buffer, int* nread)
+snfs_call_t* snfs_read_async(snfs_ctx_t* ctx, snfs_fhandle_t fhandle, unsigned offset,
+   unsigned count, char* buffer, snfs_callback_t callback, void* arg)
 {
 	snfs_msg_req_t req;
-	snfs_msg_res_t res;
+	
+	if (count > ctx->max_transfer) {
+		printf("[snfs_api] read above the transfer size.\n");
+		return NULL;
+	}
 	
 	memset(&req,0,sizeof(req));
-	memset(&res,0,sizeof(res));
 	
 	// format request
 	req.type = REQ_READ;
 	req.body.read.fhandle = fhandle;
 	req.body.read.offset = offset;
 	req.body.read.count = count;
-	 
-	int status = remote_call(&req, sizeof(req.type) + sizeof(req.body.read), 
-				  &res, sizeof(res));
 	
+	return call_start(ctx, &req, offsetof(snfs_msg_req_t, body) + sizeof(req.body.read),
+		NULL, 0, NULL, 0, buffer, count, callback, arg);
+}
+
+
+snfs_call_t* snfs_write_async(snfs_ctx_t* ctx, snfs_fhandle_t fhandle, unsigned offset,
+   unsigned count, char* buffer, snfs_callback_t callback, void* arg)
+{
+	snfs_msg_req_t req;
+	
+	if (count > ctx->max_transfer) {
+		printf("[snfs_api] write above the transfer size.\n");
+		return NULL;
+	}
+	
+	memset(&req,0,sizeof(req));
+	
+	// format request (the data is sent from 'buffer')
+	req.type = REQ_WRITE;
+	req.body.write.fhandle = fhandle;
+	req.body.write.offset = offset;
+	req.body.write.count = count;
+	
+	return call_start(ctx, &req, SNFS_WRITE_REQ_SIZE(0), buffer, count,
+		NULL, 0, NULL, 0, callback, arg);
+}
+
+
+snfs_call_status_t snfs_wait(snfs_call_t* call, unsigned* result)
+{
+	snfs_call_status_t stat = STAT_ERROR;
+	
+	*result = 0;
+	if (call_finish(call) >= 0) {
+		stat = call_result(call, result);
+	}
+	return stat;
+}
+
+
+int snfs_poll(snfs_ctx_t* ctx, int block)
+{
+	int done = 0, status;
+	
+	ctx_enter(ctx);
+	// only wait if there is a call to wait for
+	if (block) {
+		block = 0;
+		for (int i = 0; i < SNFS_MAX_CALLS; i++) {
+			if (ctx->calls[i].state == CALL_PENDING) {
+				block = 1;
+				break;
+			}
+		}
+	}
+	while ((status = call_recv(ctx, block)) > 0) {
+		done++;
+		block = 0;
+	}
+	ctx_exit(ctx);
+	return (status < 0) ? -1 : done;
+}
+
+
+snfs_call_status_t snfs_read(snfs_ctx_t* ctx, snfs_fhandle_t fhandle, unsigned offset,
+   unsigned count, char* buffer, int* nread)
+{
+	snfs_call_t* calls[SNFS_MAX_CALLS];
+	unsigned at[SNFS_MAX_CALLS];
+	snfs_call_status_t stat = STAT_OK;
+	unsigned issued = 0, done = 0, eof = 0;
+	int head = 0, tail = 0;
+	
+	// larger reads are split in messages of the negotiated size, which
+	// are all in flight at once (up to SNFS_PIPELINE_DEPTH of them)
+	do {
+		while (issued < count && tail - head < SNFS_PIPELINE_DEPTH) {
+			unsigned chunk = (count - issued < ctx->max_transfer) ? count - issued : ctx->max_transfer;
+			at[tail % SNFS_MAX_CALLS] = issued;
+			calls[tail % SNFS_MAX_CALLS] = snfs_read_async(ctx, fhandle, offset + issued,
+				chunk, buffer + issued, NULL, NULL);
+			if (calls[tail % SNFS_MAX_CALLS] == NULL) {
+				stat = STAT_ERROR;
+				count = issued;
+				break;
+			}
+			tail++;
+			issued += chunk;
+		}
+		if (head == tail) {
+			break;
+		}
+		
+		// chunks complete in order of offset as far as the caller sees;
+		// a chunk refused as busy is read again
+		snfs_call_t* call = calls[head % SNFS_MAX_CALLS];
+		unsigned chunk = call->count, pos = at[head % SNFS_MAX_CALLS], got;
+		head++;
+		snfs_call_status_t st = snfs_wait(call, &got);
+		for (int attempt = 0; st == STAT_BUSY && attempt < SNFS_BUSY_RETRIES; attempt++) {
+			busy_backoff(attempt);
+			call = snfs_read_async(ctx, fhandle, offset + pos, chunk, buffer + pos, NULL, NULL);
+			st = (call != NULL) ? snfs_wait(call, &got) : STAT_ERROR;
+		}
+		if (st != STAT_OK) {
+			stat = st;
+		} else if (!eof) {
+			done += got;
+			// a short read is the end of the file
+			eof = (got < chunk);
+		}
+		if (eof || stat != STAT_OK) {
+			count = issued;
+		}
+	} while (head < tail || issued < count);
+	
+	*nread = done;
+	return stat;
+}
+
+
+snfs_call_status_t snfs_write(snfs_ctx_t* ctx, snfs_fhandle_t fhandle, unsigned offset, 
+   unsigned count, char* buffer, unsigned int* fsize)
+{
+	snfs_call_t* calls[SNFS_MAX_CALLS];
+	unsigned at[SNFS_MAX_CALLS];
+	snfs_call_status_t stat = STAT_OK;
+	unsigned issued = 0, size = 0;
+	int head = 0, tail = 0;
+	
+	// larger writes are split in messages of the negotiated size, which
+	// are all in flight at once (up to SNFS_PIPELINE_DEPTH of them); a
+	// chunk arriving before the ones preceding it leaves a hole that
+	// they fill
+	do {
+		while (issued < count && tail - head < SNFS_PIPELINE_DEPTH && stat == STAT_OK) {
+			unsigned chunk = (count - issued < ctx->max_transfer) ? count - issued : ctx->max_transfer;
+			at[tail % SNFS_MAX_CALLS] = issued;
+			calls[tail % SNFS_MAX_CALLS] = snfs_write_async(ctx, fhandle, offset + issued,
+				chunk, buffer + issued, NULL, NULL);
+			if (calls[tail % SNFS_MAX_CALLS] == NULL) {
+				stat = STAT_ERROR;
+				break;
+			}
+			tail++;
+			issued += chunk;
+		}
+		if (head == tail) {
+			break;
+		}
+		
+		// the size after the write is the one after its last chunk; a
+		// chunk refused as busy is written again
+		snfs_call_t* call = calls[head % SNFS_MAX_CALLS];
+		unsigned pos = at[head % SNFS_MAX_CALLS], got;
+		unsigned chunk = (count - pos < ctx->max_transfer) ? count - pos : ctx->max_transfer;
+		head++;
+		snfs_call_status_t st = snfs_wait(call, &got);
+		for (int attempt = 0; st == STAT_BUSY && attempt < SNFS_BUSY_RETRIES; attempt++) {
+			busy_backoff(attempt);
+			call = snfs_write_async(ctx, fhandle, offset + pos, chunk, buffer + pos, NULL, NULL);
+			st = (call != NULL) ? snfs_wait(call, &got) : STAT_ERROR;
+		}
+		if (st != STAT_OK) {
+			stat = st;
+		} else if (got > size) {
+			size = got;
+		}
+	} while (head < tail || (issued < count && stat == STAT_OK));
+	
+	*fsize = size;
+	return stat;
+}
+
+
+snfs_call_status_t snfs_seek(snfs_ctx_t* ctx, snfs_fhandle_t fhandle, unsigned offset,
+   snfs_seek_whence_t whence, unsigned* pos)
+{
+	snfs_msg_req_t req;
+	snfs_msg_res_t res;
+	
+	memset(&req,0,sizeof(req));
+	memset(&res,0,sizeof(res));
+
+	// format request
+	req.type = REQ_SEEK;
+	req.body.seek.fhandle = fhandle;
+	req.body.seek.offset = offset;
+	req.body.seek.whence = whence;
+	
+	int status = remote_call(ctx, &req, offsetof(snfs_msg_req_t, body) + sizeof(req.body.seek), 
+					       &res, sizeof(res));
+
 	// format response
 	if (status < 0 || res.status != RES_OK) {
 		return STAT_ERROR;
 	}
 	
-	memcpy(buffer, res.body.read.data, count);
-	*nread = res.body.read.nread;
+	*pos = res.body.seek.offset;
 	return STAT_OK;
 }
 
 
-snfs_call_status_t snfs_write(snfs_fhandle_t fhandle, unsigned offset, 
-   unsigned count, char* buffer, unsigned int* fsize)
+snfs_call_status_t snfs_truncate(snfs_ctx_t* ctx, snfs_fhandle_t fhandle, unsigned size,
+   unsigned* fsize)
 {
 	snfs_msg_req_t req;
 	snfs_msg_res_t res;
 	
 	memset(&req,0,sizeof(req));
 	memset(&res,0,sizeof(res));
-	
+
 	// format request
-	req.type = REQ_WRITE;
-	req.body.write.fhandle = fhandle;
-	req.body.write.offset = offset;
-	req.body.write.count = count;
-	memcpy(req.body.write.data, buffer, count);
+	req.type = REQ_TRUNCATE;
+	req.body.truncate.fhandle = fhandle;
+	req.body.truncate.size = size;
 	
-	int status = remote_call(&req, sizeof(req.type) + sizeof(req.body.write), 
-				  &res, sizeof(res));
+	int status = remote_call(ctx, &req, offsetof(snfs_msg_req_t, body) + sizeof(req.body.truncate), 
+					       &res, sizeof(res));
+
+	// format response
+	if (status < 0 || res.status != RES_OK) {
+		return STAT_ERROR;
+	}
+	
+	*fsize = res.body.truncate.fsize;
+	return STAT_OK;
+}
+
+
+snfs_call_status_t snfs_fallocate(snfs_ctx_t* ctx, snfs_fhandle_t fhandle, unsigned offset,
+   unsigned count, unsigned* fsize)
+{
+	snfs_msg_req_t req;
+	snfs_msg_res_t res;
 	
+	memset(&req,0,sizeof(req));
+	memset(&res,0,sizeof(res));
+
+	// format request
+	req.type = REQ_FALLOCATE;
+	req.body.fallocate.fhandle = fhandle;
+	req.body.fallocate.offset = offset;
+	req.body.fallocate.count = count;
+	
+	int status = remote_call(ctx, &req, offsetof(snfs_msg_req_t, body) + sizeof(req.body.fallocate), 
+					       &res, sizeof(res));
+
 	// format response
 	if (status < 0 || res.status != RES_OK) {
 		return STAT_ERROR;
 	}
 	
-	*fsize = res.body.write.fsize;
+	*fsize = res.body.fallocate.fsize;
 	return STAT_OK;
 }
 
 
-snfs_call_status_t snfs_create(snfs_fhandle_t dir, char* name, 
+snfs_call_status_t snfs_create(snfs_ctx_t* ctx, snfs_fhandle_t dir, char* name, 
    snfs_fhandle_t* file)
 {
 	snfs_msg_req_t req;
@@ -246,7 +976,7 @@ snfs_call_status_t snfs_create(snfs_fhandle_t dir, char* name,
 	req.body.create.dir = (snfs_fhandle_t)dir;
 	strcpy(req.body.create.name, name);
 	
-	int status = remote_call(&req, sizeof(req.type) + sizeof(req.body.create), 
+	int status = remote_call(ctx, &req, offsetof(snfs_msg_req_t, body) + sizeof(req.body.create), 
 					       &res, sizeof(res));
 
 	// format response
@@ -259,7 +989,7 @@ snfs_call_status_t snfs_create(snfs_fhandle_t dir, char* name,
 }
 
 
-snfs_call_status_t snfs_mkdir(snfs_fhandle_t dir, char* name, 
+snfs_call_status_t snfs_mkdir(snfs_ctx_t* ctx, snfs_fhandle_t dir, char* name, 
    snfs_fhandle_t* file)
 {
 	snfs_msg_req_t req;
@@ -273,7 +1003,7 @@ snfs_call_status_t snfs_mkdir(snfs_fhandle_t dir, char* name,
 	req.body.mkdir.dir = dir;
 	strcpy(req.body.mkdir.file, name);
 	
-	int status = remote_call(&req, sizeof(req.type) + sizeof(req.body.mkdir), 
+	int status = remote_call(ctx, &req, offsetof(snfs_msg_req_t, body) + sizeof(req.body.mkdir), 
 				  &res, sizeof(res));
 
 	// format response
@@ -286,7 +1016,7 @@ snfs_call_status_t snfs_mkdir(snfs_fhandle_t dir, char* name,
 }
 
 
-snfs_call_status_t snfs_readdir(snfs_fhandle_t dir, unsigned cmax, 
+snfs_call_status_t snfs_readdir(snfs_ctx_t* ctx, snfs_fhandle_t dir, unsigned cmax, 
    snfs_dir_entry_t* list, unsigned* count)
 {
 	snfs_msg_req_t req;
@@ -300,7 +1030,7 @@ snfs_call_status_t snfs_readdir(snfs_fhandle_t dir, unsigned cmax,
 	req.body.readdir.dir = dir;
 	req.body.readdir.cmax = cmax;
 	
-	int status = remote_call(&req, sizeof(req.type) + sizeof(req.body.readdir), 
+	int status = remote_call(ctx, &req, offsetof(snfs_msg_req_t, body) + sizeof(req.body.readdir), 
 				  &res, sizeof(res));
 
 	// format response
@@ -313,7 +1043,7 @@ snfs_call_status_t snfs_readdir(snfs_fhandle_t dir, unsigned cmax,
 	return STAT_OK;
 }
 
-snfs_call_status_t snfs_remove(snfs_fhandle_t dir, char* name, snfs_fhandle_t* file)  
+snfs_call_status_t snfs_remove(snfs_ctx_t* ctx, snfs_fhandle_t dir, char* name, snfs_fhandle_t* file)  
 {   
 	snfs_msg_req_t req;
 	snfs_msg_res_t res;
@@ -326,7 +1056,7 @@ snfs_call_status_t snfs_remove(snfs_fhandle_t dir, char* name, snfs_fhandle_t* f
 	req.body.remove.dir = (snfs_fhandle_t)dir;
 	strcpy(req.body.remove.name, name);
 	
-	int status = remote_call(&req, sizeof(req.type) + sizeof(req.body.remove), 
+	int status = remote_call(ctx, &req, offsetof(snfs_msg_req_t, body) + sizeof(req.body.remove), 
 					       &res, sizeof(res));
 
 	// format response
@@ -338,7 +1068,7 @@ snfs_call_status_t snfs_remove(snfs_fhandle_t dir, char* name, snfs_fhandle_t* f
 	return STAT_OK;
 }
 
-snfs_call_status_t snfs_copy(snfs_fhandle_t src_dir, char* src_name, snfs_fhandle_t dst_dir, char* dst_name, snfs_fhandle_t* file)  
+snfs_call_status_t snfs_copy(snfs_ctx_t* ctx, snfs_fhandle_t src_dir, char* src_name, snfs_fhandle_t dst_dir, char* dst_name, snfs_fhandle_t* file)  
 {   
 	snfs_msg_req_t req;
 	snfs_msg_res_t res;
@@ -353,7 +1083,7 @@ snfs_call_status_t snfs_copy(snfs_fhandle_t src_dir, char* src_name, snfs_fhandl
 	req.body.copy.dst_dir = (snfs_fhandle_t)dst_dir;
 	strcpy(req.body.copy.dst_name, dst_name);
 	
-	int status = remote_call(&req, sizeof(req.type) + sizeof(req.body.copy), 
+	int status = remote_call(ctx, &req, offsetof(snfs_msg_req_t, body) + sizeof(req.body.copy), 
 					       &res, sizeof(res));
 
 	// format response
@@ -365,7 +1095,7 @@ snfs_call_status_t snfs_copy(snfs_fhandle_t src_dir, char* src_name, snfs_fhandl
 	return STAT_OK;
 }
 
-snfs_call_status_t snfs_append(snfs_fhandle_t dir1, char* name1, snfs_fhandle_t dir2, char* name2, unsigned int* fsize)  
+snfs_call_status_t snfs_append(snfs_ctx_t* ctx, snfs_fhandle_t dir1, char* name1, snfs_fhandle_t dir2, char* name2, unsigned int* fsize)  
 {   
 	snfs_msg_req_t req;
 	snfs_msg_res_t res;
@@ -380,7 +1110,7 @@ snfs_call_status_t snfs_append(snfs_fhandle_t dir1, char* name1, snfs_fhandle_t
 	req.body.append.dir2 = (snfs_fhandle_t)dir2;
 	strcpy(req.body.append.name2, name2);
 	
-	int status = remote_call(&req, sizeof(req.type) + sizeof(req.body.copy), 
+	int status = remote_call(ctx, &req, offsetof(snfs_msg_req_t, body) + sizeof(req.body.copy), 
 					       &res, sizeof(res));
 
 	// format response
@@ -392,7 +1122,41 @@ snfs_call_status_t snfs_append(snfs_fhandle_t dir1, char* name1, snfs_fhandle_t
 	return STAT_OK;
 }
 
-snfs_call_status_t snfs_defrag()  
+snfs_call_status_t snfs_compound(snfs_ctx_t* ctx, snfs_msg_req_compound_t* ops,
+   snfs_compound_res_t* results)
+{
+	snfs_msg_req_t req;
+	snfs_msg_res_t res;
+	
+	if (ops->count == 0 || ops->count > SNFS_COMPOUND_MAX_OPS) {
+		return STAT_ERROR;
+	}
+	
+	memset(&req,0,sizeof(req));
+	memset(&res,0,sizeof(res));
+	
+	// format request
+	req.type = REQ_COMPOUND;
+	memcpy(&req.body.compound, ops, sizeof(*ops));
+	
+	int status = remote_call(ctx, &req, offsetof(snfs_msg_req_t, body) + sizeof(req.body.compound), 
+					       &res, sizeof(res));
+	
+	// format response (the results are valid even if an operation failed)
+	if (status < 0 || res.body.compound.count != ops->count) {
+		for (int i = 0; i < ops->count; i++) {
+			results[i].type = ops->ops[i].type;
+			results[i].status = RES_SKIPPED;
+		}
+		return STAT_ERROR;
+	}
+	
+	memcpy(results, res.body.compound.res, sizeof(*results) * ops->count);
+	return (res.status == RES_OK) ? STAT_OK : STAT_ERROR;
+}
+
+
+snfs_call_status_t snfs_defrag(snfs_ctx_t* ctx)  
 {   
 	snfs_msg_req_t req;
 	snfs_msg_res_t res;
@@ -404,7 +1168,7 @@ snfs_call_status_t snfs_defrag()
 	req.type = REQ_DEFRAG;
 	
 	
-	int status = remote_call(&req, sizeof(req.type) + sizeof(req.body.filesystem), 
+	int status = remote_call(ctx, &req, offsetof(snfs_msg_req_t, body) + sizeof(req.body.filesystem), 
 					       &res, sizeof(res));
 
 	// format response
@@ -416,7 +1180,7 @@ snfs_call_status_t snfs_defrag()
 }
 
 
-snfs_call_status_t snfs_diskusage()  
+snfs_call_status_t snfs_diskusage(snfs_ctx_t* ctx)  
 {   
 	snfs_msg_req_t req;
 	snfs_msg_res_t res;
@@ -428,7 +1192,7 @@ snfs_call_status_t snfs_diskusage()
 	req.type = REQ_DISKUSAGE;
 	
 	
-	int status = remote_call(&req, sizeof(req.type) + sizeof(req.body.filesystem), 
+	int status = remote_call(ctx, &req, offsetof(snfs_msg_req_t, body) + sizeof(req.body.filesystem), 
 					       &res, sizeof(res));
 
 	// format response
@@ -440,7 +1204,7 @@ snfs_call_status_t snfs_diskusage()
 }
 
 
-snfs_call_status_t snfs_dumpcache()  
+snfs_call_status_t snfs_dumpcache(snfs_ctx_t* ctx)  
 {   
 	snfs_msg_req_t req;
 	snfs_msg_res_t res;
@@ -452,7 +1216,7 @@ snfs_call_status_t snfs_dumpcache()
 	req.type = REQ_DUMPCACHE;
 	
 	
-	int status = remote_call(&req, sizeof(req.type) + sizeof(req.body.filesystem), 
+	int status = remote_call(ctx, &req, offsetof(snfs_msg_req_t, body) + sizeof(req.body.filesystem), 
 					       &res, sizeof(res));
 
 	// format response
@@ -464,8 +1228,24 @@ snfs_call_status_t snfs_dumpcache()
 }
 
 
-void snfs_finish()
+void snfs_lookup_cache_dump(snfs_ctx_t* ctx)
+{
+	ctx_enter(ctx);
+	unsigned lookups = ctx->lcache_hits + ctx->lcache_misses;
+	printf("===== Dump: Lookup Cache ==================================\n");
+	printf("Lookups: %u Hits: %u (%u%%) Round trips saved: %u Invalidations: %u\n",
+		lookups, ctx->lcache_hits, lookups ? ctx->lcache_hits * 100 / lookups : 0,
+		ctx->lcache_hits, ctx->lcache_invals);
+	ctx_exit(ctx);
+}
+
+
+void snfs_finish(snfs_ctx_t* ctx)
 {
-	close(Cli_sock);
-	unlink(Cli_addr.sun_path);
+	close(ctx->sock);
+	unlink(ctx->cli_addr.sun_path);
+	if (ctx->mon != NULL) {
+		sthread_monitor_free(ctx->mon);
+	}
+	free(ctx);
 }
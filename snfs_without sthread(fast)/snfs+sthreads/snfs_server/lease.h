@@ -0,0 +1,74 @@
+/*
+ * Client Leases
+ *
+ * lease.h
+ *
+ * Leases the server grants to clients on the lookup results they
+ * cache. While a lease lasts, a change to the file it covers makes the
+ * server send the client an invalidation (see SNFS Invalidate in
+ * snfs_proto.h); the lease is then dropped. An invalidation that
+ * cannot be sent keeps the lease, and is sent again before the client
+ * is granted any other lease.
+ *
+ */
+
+#ifndef _LEASE_H_
+#define _LEASE_H_
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <snfs_proto.h>
+
+
+// duration of a lease (milliseconds)
+#define LEASE_TIME_MS 5000
+
+// maximum number of leases held at the same time
+#define LEASE_MAX 256
+
+
+/*
+ * lease_init: initializes the lease table
+ * - sockfd: socket used to send the invalidations
+ */
+void lease_init(int sockfd);
+
+
+/*
+ * lease_begin: reserves a lease for a client before a lookup, so a
+ * change that happens during the lookup is noticed (the lease is then
+ * not granted)
+ * - cliaddr, clilen: the client address
+ * - compact: 1 if the client uses the compact message encoding
+ *   returns: the lease id or -1 if the table is full or the client
+ *     still has to be told of a change
+ */
+int lease_begin(struct sockaddr_un* cliaddr, socklen_t clilen, int compact);
+
+
+/*
+ * lease_end: grants a reserved lease on the file found by the lookup
+ * - id: the lease id (may be -1)
+ * - file: the file found, or 0 if the lookup failed (the reservation
+ *   is cancelled)
+ *   returns: the duration of the lease in milliseconds (0 if none)
+ */
+unsigned lease_end(int id, snfs_fhandle_t file);
+
+
+/*
+ * lease_break: notifies the clients holding a lease on a file that
+ * changed and drops their leases
+ * - file: the file or SNFS_INVALIDATE_ALL (every lease of every client)
+ */
+void lease_break(snfs_fhandle_t file);
+
+
+/*
+ * lease_dump: dumps the lease statistics
+ */
+void lease_dump();
+
+
+#endif
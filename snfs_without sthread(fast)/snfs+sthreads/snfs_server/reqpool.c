@@ -0,0 +1,219 @@
+/*
+ * Request Descriptor Pool
+ *
+ * reqpool.c
+ *
+ * Implementation of the request descriptor pool. Descriptors (and their
+ * message buffers) are allocated in chunks of REQPOOL_CHUNK, never freed, and recycled
+ * through a shared free list protected by a monitor. Each server
+ * thread keeps a private cache so the common get/put pair does not
+ * touch shared state at all.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <sthread.h>
+#include "reqpool.h"
+
+
+#define MIN(a,b) ((a)<=(b)?(a):(b))
+
+// internal implementation of 'reqpool_t'
+struct reqpool_ {
+	sthread_mon_t mon;
+	req_t free;		// shared free list
+	unsigned nfree;		// descriptors in the shared free list
+	unsigned allocated;	// descriptors allocated so far
+	unsigned max;		// maximum number of descriptors
+	unsigned reqsz;		// size of the request buffers
+	unsigned ressz;		// size of the response buffers
+	reqpool_cache_t* caches[REQPOOL_MAX_CACHES];	// registered caches
+	int ncaches;
+};
+
+
+/*
+ * Internal functions (must be called inside the pool monitor)
+ */
+
+static int reqpool_grow(reqpool_t* pool)
+{
+	unsigned num = MIN(REQPOOL_CHUNK, pool->max - pool->allocated);
+	if (num == 0) {
+		return -1;
+	}
+
+	char* chunk = (char*) malloc(num * sizeof(struct _req) + REQPOOL_ALIGN);
+	char* bufs = (char*) malloc(num * (pool->reqsz + pool->ressz));
+	if (chunk == NULL || bufs == NULL) {
+		printf("[reqpool] out of memory.\n");
+		free(chunk);
+		free(bufs);
+		return -1;
+	}
+
+	// align the first descriptor to a cache line
+	uintptr_t addr = (uintptr_t)chunk;
+	req_t reqs = (req_t)((addr + REQPOOL_ALIGN - 1) & ~(uintptr_t)(REQPOOL_ALIGN - 1));
+
+	for (int i = 0; i < num; i++) {
+		reqs[i].reqbuf = bufs;
+		reqs[i].req = (snfs_msg_req_t*) bufs;
+		reqs[i].res = (snfs_msg_res_t*) (bufs + pool->reqsz);
+		bufs += pool->reqsz + pool->ressz;
+		reqs[i].next = pool->free;
+		pool->free = &reqs[i];
+	}
+	pool->nfree += num;
+	pool->allocated += num;
+	return 0;
+}
+
+
+static void reqpool_release(reqpool_t* pool, reqpool_cache_t* cache, int num)
+{
+	for (int i = 0; i < num && cache->count > 0; i++) {
+		req_t req = cache->list[--cache->count];
+		req->next = pool->free;
+		pool->free = req;
+		pool->nfree++;
+	}
+	sthread_monitor_signalall(pool->mon);
+}
+
+
+/*
+ * Request descriptor pool interface functions
+ */
+
+reqpool_t* reqpool_new(unsigned initial, unsigned max, unsigned reqsz,
+   unsigned ressz)
+{
+	if (max == 0 || initial > max) {
+		printf("[reqpool] invalid pool size.\n");
+		return NULL;
+	}
+	if (reqsz < sizeof(snfs_msg_req_t) || ressz < sizeof(snfs_msg_res_t)) {
+		printf("[reqpool] invalid message buffer size.\n");
+		return NULL;
+	}
+
+	reqpool_t* pool = (reqpool_t*) malloc(sizeof(reqpool_t));
+	pool->mon = sthread_monitor_init();
+	pool->free = NULL;
+	pool->nfree = 0;
+	pool->ncaches = 0;
+	pool->allocated = 0;
+	pool->max = max;
+	// keep the buffers of consecutive descriptors aligned
+	pool->reqsz = (reqsz + REQPOOL_ALIGN - 1) & ~(REQPOOL_ALIGN - 1);
+	pool->ressz = (ressz + REQPOOL_ALIGN - 1) & ~(REQPOOL_ALIGN - 1);
+
+	while (pool->allocated < initial) {
+		if (reqpool_grow(pool) < 0) {
+			break;
+		}
+	}
+	return pool;
+}
+
+
+void reqpool_cache_init(reqpool_t* pool, reqpool_cache_t* cache)
+{
+	cache->count = 0;
+
+	// caches are registered only to report the pool occupancy
+	sthread_monitor_enter(pool->mon);
+	if (pool->ncaches < REQPOOL_MAX_CACHES) {
+		pool->caches[pool->ncaches++] = cache;
+	}
+	sthread_monitor_exit(pool->mon);
+}
+
+
+req_t reqpool_get(reqpool_t* pool, reqpool_cache_t* cache)
+{
+	// fast path: the thread's own cache
+	if (cache->count > 0) {
+		return cache->list[--cache->count];
+	}
+
+	sthread_monitor_enter(pool->mon);
+	while (pool->free == NULL) {
+		if (reqpool_grow(pool) < 0) {
+			// the pool is full, wait for descriptors to be released
+			sthread_monitor_wait(pool->mon);
+		}
+	}
+
+	// refill half of the cache in a single visit to the free list
+	req_t req = pool->free;
+	pool->free = req->next;
+	pool->nfree--;
+	while (pool->free != NULL && cache->count < REQPOOL_CACHE_SIZE / 2) {
+		cache->list[cache->count++] = pool->free;
+		pool->free = pool->free->next;
+		pool->nfree--;
+	}
+	sthread_monitor_exit(pool->mon);
+
+	return req;
+}
+
+
+void reqpool_put(reqpool_t* pool, reqpool_cache_t* cache, req_t req)
+{
+	// a full cache gives back half of its descriptors first
+	if (cache->count == REQPOOL_CACHE_SIZE) {
+		sthread_monitor_enter(pool->mon);
+		reqpool_release(pool, cache, REQPOOL_CACHE_SIZE / 2);
+		sthread_monitor_exit(pool->mon);
+	}
+	cache->list[cache->count++] = req;
+}
+
+
+void reqpool_cache_flush(reqpool_t* pool, reqpool_cache_t* cache)
+{
+	if (cache->count == 0) {
+		return;
+	}
+	sthread_monitor_enter(pool->mon);
+	reqpool_release(pool, cache, cache->count);
+	sthread_monitor_exit(pool->mon);
+}
+
+
+unsigned reqpool_occupancy(reqpool_t* pool, unsigned* allocated,
+   unsigned* in_use)
+{
+	sthread_monitor_enter(pool->mon);
+	// the cache counters belong to other threads, the sum is a snapshot
+	unsigned cached = 0;
+	for (int i = 0; i < pool->ncaches; i++) {
+		cached += pool->caches[i]->count;
+	}
+	*allocated = pool->allocated;
+	*in_use = pool->allocated - pool->nfree - MIN(cached, pool->allocated - pool->nfree);
+	sthread_monitor_exit(pool->mon);
+	return pool->max;
+}
+
+
+unsigned reqpool_reqsz(reqpool_t* pool)
+{
+	return pool->reqsz;
+}
+
+
+void reqpool_dump(reqpool_t* pool)
+{
+	unsigned allocated, in_use;
+	unsigned max = reqpool_occupancy(pool, &allocated, &in_use);
+
+	printf("===== Dump: Request Descriptor Pool =======================\n");
+	printf("Max: %u Allocated: %u In use: %u Free: %u Buffers: %u+%u bytes\n",
+		max, allocated, in_use, allocated - in_use, pool->reqsz, pool->ressz);
+}
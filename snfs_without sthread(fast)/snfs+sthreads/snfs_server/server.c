@@ -14,12 +14,14 @@
 #include <sys/un.h>
 #include <sys/time.h>
 #include <sys/select.h>
+#include <sys/uio.h>
 #include <stdio.h>
 #include <string.h>
 #include <strings.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <signal.h>
 #include <sthread.h>
 #ifdef USE_PTHREADS
 #include <pthread.h>
@@ -27,85 +29,304 @@
 
 // SNFS includes
 #include <snfs_proto.h>
+#include <snfs_codec.h>
 #include "snfs.h"
+#include "reqpool.h"
+#include "lease.h"
 
 
 #ifndef SERVER_SOCK
 #define SERVER_SOCK "/tmp/server.socket"
 #endif
 
-// request descriptor structure
-struct _req {
-	snfs_msg_req_t req;
-	struct sockaddr_un cliaddr;
-	int reqsz;
-	socklen_t clilen;
-};
-typedef struct _req* req_t;
+// initial and maximum number of request descriptors
+#ifndef REQPOOL_INITIAL
+#define REQPOOL_INITIAL 32
+#endif
+#ifndef REQPOOL_MAX
+#define REQPOOL_MAX 128
+#endif
+
+// requests are received after this headroom, where compactly encoded
+// requests are decoded (a write is decoded right before its data)
+#define REQ_HEADROOM ((sizeof(snfs_msg_req_t) + 63) & ~63)
 
 
 /*
  * SNFS Services
  *
- * all services are registered in a global table which is
- * used during request resolution to find the handler that
- * serves the request
+ * all services are registered in a global table indexed by the
+ * message type, which is used during request resolution to find
+ * the handler that serves the request and its properties
  *
  * service handlers are implemented in snfs.c
  */
 
-#define NUM_REQ_HANDLERS 13
-#define NUM_TC 5		// max number of active threads
-#define RING_SIZE 10
+#define RING_SIZE 10	// requests buffered per service class
+#define PARK_MAX 16	// requests parked per service class once its ring is full
+
+
+/*
+ * Worker pools
+ *
+ * requests are queued by service class (see snfs.h) and each class
+ * has its own pool of consumer threads; the size of each pool is
+ * given in the command line:
+ *
+ *   server [disk_delay] [latency_workers] [bulk_workers] [maint_workers]
+ *
+ * a worker serves the queue of its own class and, when idle, helps
+ * the more latency sensitive classes; latency workers never run bulk
+ * or maintenance requests. Between the queues a worker may serve,
+ * the choice is weighted round robin using Class_weight.
+ *
+ * the receiving thread never waits for a class: when the ring of a
+ * class is full its requests are parked (up to PARK_MAX) and moved to
+ * the ring as it drains; past that they are answered with RES_BUSY,
+ * so a burst of bulk requests does not stop latency requests (a
+ * RES_BUSY answer the receiving thread cannot send at once is sent by
+ * a worker, see srv_reject_busy)
+ */
+
+static int Class_workers[SNFS_NUM_CLASSES] = {3, 2, 1};
+static const int Class_weight[SNFS_NUM_CLASSES] = {4, 2, 1};
+static const char* Class_name[SNFS_NUM_CLASSES] = {"latency", "bulk", "maintenance"};
+
+// request queue of a service class
+typedef struct {
+	req_t ring[RING_SIZE];
+	int head;	// next request to consume
+	int count;	// buffer requests not yet consumed
+	int credit;	// round robin credit left
+	req_t parked;	// requests waiting for room in the ring (FIFO)
+	req_t parked_tail;
+	int nparked;
+} req_queue_t;
 
 
 static sthread_mon_t mon = NULL;
-static int available_reqs; // buffer requests not yet consumed 
-req_t ring[RING_SIZE];
+static req_queue_t Queue[SNFS_NUM_CLASSES];
+static req_t Busy_replies;	// RES_BUSY answers left for the workers (FIFO)
+static req_t Busy_tail;
+static reqpool_t* Pool;    // request descriptors
 int sockfd;
 
-struct {
-  snfs_msg_type_t type;
-  snfs_handler_t handler;
-} Service[NUM_REQ_HANDLERS] = {
-  {REQ_PING, snfs_ping},
-  {REQ_LOOKUP, snfs_lookup},
-  {REQ_READ, snfs_read},
-  {REQ_WRITE, snfs_write},
-  {REQ_CREATE, snfs_create},
-  {REQ_MKDIR, snfs_mkdir},
-  {REQ_READDIR, snfs_readdir},
-  {REQ_REMOVE, snfs_remove},
-  {REQ_COPY, snfs_copy},
-  {REQ_APPEND, snfs_append},
-  {REQ_DEFRAG, snfs_defrag},
-  {REQ_DISKUSAGE, snfs_diskusage},
-  {REQ_DUMPCACHE, snfs_dumpcache}
+static const snfs_service_t Service[NUM_REQ_TYPES] = {
+  [REQ_PING] = {"ping", snfs_ping, SNFS_OP_READONLY,
+     SNFS_REQ_SIZE(ping), SNFS_CLASS_LATENCY},
+  [REQ_LOOKUP] = {"lookup", snfs_lookup, SNFS_OP_READONLY,
+     SNFS_REQ_SIZE(lookup), SNFS_CLASS_LATENCY},
+  [REQ_READ] = {"read", snfs_read, SNFS_OP_READONLY,
+     SNFS_REQ_SIZE(read), SNFS_CLASS_LATENCY},
+  [REQ_WRITE] = {"write", snfs_write, SNFS_OP_MUTATING,
+     SNFS_REQ_SIZE(write), SNFS_CLASS_BULK},
+  [REQ_SEEK] = {"seek", snfs_seek, SNFS_OP_READONLY,
+     SNFS_REQ_SIZE(seek), SNFS_CLASS_LATENCY},
+  [REQ_TRUNCATE] = {"truncate", snfs_truncate, SNFS_OP_MUTATING,
+     SNFS_REQ_SIZE(truncate), SNFS_CLASS_BULK},
+  [REQ_FALLOCATE] = {"fallocate", snfs_fallocate, SNFS_OP_MUTATING,
+     SNFS_REQ_SIZE(fallocate), SNFS_CLASS_BULK},
+  [REQ_CREATE] = {"create", snfs_create, SNFS_OP_MUTATING,
+     SNFS_REQ_SIZE(create), SNFS_CLASS_LATENCY},
+  [REQ_MKDIR] = {"mkdir", snfs_mkdir, SNFS_OP_MUTATING,
+     SNFS_REQ_SIZE(mkdir), SNFS_CLASS_LATENCY},
+  [REQ_READDIR] = {"readdir", snfs_readdir, SNFS_OP_READONLY,
+     SNFS_REQ_SIZE(readdir), SNFS_CLASS_LATENCY},
+  [REQ_COPY] = {"copy", snfs_copy, SNFS_OP_MUTATING,
+     SNFS_REQ_SIZE(copy), SNFS_CLASS_BULK},
+  [REQ_REMOVE] = {"remove", snfs_remove, SNFS_OP_MUTATING,
+     SNFS_REQ_SIZE(remove), SNFS_CLASS_BULK},
+  [REQ_APPEND] = {"append", snfs_append, SNFS_OP_MUTATING,
+     SNFS_REQ_SIZE(append), SNFS_CLASS_BULK},
+  [REQ_DEFRAG] = {"defrag", snfs_defrag, SNFS_OP_MUTATING,
+     SNFS_REQ_SIZE(filesystem), SNFS_CLASS_MAINTENANCE},
+  [REQ_DISKUSAGE] = {"diskusage", snfs_diskusage, SNFS_OP_READONLY,
+     SNFS_REQ_SIZE(filesystem), SNFS_CLASS_MAINTENANCE},
+  [REQ_DUMPCACHE] = {"dumpcache", snfs_dumpcache, SNFS_OP_READONLY,
+     SNFS_REQ_SIZE(filesystem), SNFS_CLASS_MAINTENANCE},
+  [REQ_NEGOTIATE] = {"negotiate", snfs_negotiate, SNFS_OP_READONLY,
+     SNFS_REQ_SIZE(negotiate), SNFS_CLASS_LATENCY},
+  [REQ_COMPOUND] = {"compound", snfs_compound, SNFS_OP_MUTATING,
+     SNFS_REQ_SIZE(compound), SNFS_CLASS_LATENCY}	// see request_class
 };
 
+
+/*
+ * Per operation statistics, indexed by message type
+ *
+ * counters are updated by several consumer threads with atomic
+ * increments; the dump is only a snapshot
+ */
+
+static struct {
+  unsigned count;     // requests served
+  unsigned errors;    // requests answered with an error status
+  unsigned long usecs; // total service time (microseconds)
+  unsigned long bytes_in;  // request bytes received
+  unsigned long bytes_out; // response bytes sent
+} Service_stats[NUM_REQ_TYPES];
+
+// read responses sent from pinned cache blocks / copied into the response
+static unsigned Reads_zero_copy;
+static unsigned Reads_copied;
+
+
+static void service_stats_update(snfs_msg_type_t type,
+   snfs_msg_res_status_t status, struct timeval* start, int bytes_in,
+   int bytes_out)
+{
+	struct timeval end;
+	gettimeofday(&end, NULL);
+	unsigned long usecs = (end.tv_sec - start->tv_sec) * 1000000 +
+		(end.tv_usec - start->tv_usec);
+
+	__sync_fetch_and_add(&Service_stats[type].count, 1);
+	__sync_fetch_and_add(&Service_stats[type].usecs, usecs);
+	__sync_fetch_and_add(&Service_stats[type].bytes_in, bytes_in);
+	__sync_fetch_and_add(&Service_stats[type].bytes_out, bytes_out);
+	if (status != RES_OK)
+		__sync_fetch_and_add(&Service_stats[type].errors, 1);
+}
+
+
+static void service_stats_dump()
+{
+	printf("===== Dump: Service Statistics ============================\n");
+	for (int i = 0; i < NUM_REQ_TYPES; i++) {
+		if (Service[i].handler == NULL || Service_stats[i].count == 0)
+			continue;
+		printf("%-10s count: %u errors: %u avg: %lu us in: %lu B out: %lu B\n",
+			Service[i].name, Service_stats[i].count, Service_stats[i].errors,
+			Service_stats[i].usecs / Service_stats[i].count,
+			Service_stats[i].bytes_in, Service_stats[i].bytes_out);
+	}
+	printf("read data sent from the cache: %u copied: %u\n",
+		Reads_zero_copy, Reads_copied);
+}
+
 /*
  * Buffer management functions
  */
 
-req_t get_req() {
-	static short int pos = 0;
+/* must be called inside the monitor */
+req_t get_req(snfs_class_t cls) {
+	req_queue_t* q = &Queue[cls];
+	
+	req_t temp = q->ring[q->head];
+	q->head = (q->head + 1) % RING_SIZE;
+	q->count--;
 	
-	req_t temp = ring[pos];
-	pos = (pos + 1) % RING_SIZE;
+	// the oldest parked request takes the slot released
+	if (q->parked != NULL) {
+		req_t req = q->parked;
+		q->parked = req->next;
+		q->nparked--;
+		q->ring[(q->head + q->count) % RING_SIZE] = req;
+		q->count++;
+	}
 	
 	return temp;
 }
 
-void put_req(req_t req) {
-	static short int pos = 0;
-	
-	ring[pos] = req;
-	pos = (pos + 1) % RING_SIZE;
+/*
+ * put_req: queues a request, parking it if the ring of its class is full
+ *   returns: 0 if queued, -1 if the class has no room at all
+ * must be called inside the monitor
+ */
+int put_req(snfs_class_t cls, req_t req) {
+	req_queue_t* q = &Queue[cls];
 	
-	return;
+	if (q->count < RING_SIZE) {
+		q->ring[(q->head + q->count) % RING_SIZE] = req;
+		q->count++;
+		return 0;
+	}
+	if (q->nparked == PARK_MAX)
+		return -1;
+	req->next = NULL;
+	if (q->parked == NULL)
+		q->parked = req;
+	else
+		q->parked_tail->next = req;
+	q->parked_tail = req;
+	q->nparked++;
+	return 0;
+}
+
+/*
+ * pick_queue: chooses the queue a worker of class 'home' serves next,
+ * with weighted round robin among the non-empty queues it may serve
+ * (its own and the ones of more latency sensitive classes)
+ *   returns: the class of the queue, or -1 if there is nothing to do
+ * must be called inside the monitor
+ */
+int pick_queue(snfs_class_t home) {
+	for (int pass = 0; pass < 2; pass++) {
+		int best = -1;
+		for (int c = 0; c <= home; c++) {
+			if (Queue[c].count > 0 && Queue[c].credit > 0 &&
+			    (best < 0 || Queue[c].credit > Queue[best].credit))
+				best = c;
+		}
+		if (best >= 0) {
+			Queue[best].credit--;
+			return best;
+		}
+		
+		// every candidate used its share, start a new round
+		int pending = 0;
+		for (int c = 0; c <= home; c++) {
+			if (Queue[c].count > 0) {
+				Queue[c].credit = Class_weight[c];
+				pending = 1;
+			}
+		}
+		if (!pending)
+			return -1;
+	}
+	return -1;
+}
+
+/*
+ * find_service: gets the service descriptor of a message type
+ *   returns: the descriptor or NULL if the type is unknown
+ */
+const snfs_service_t* find_service(snfs_msg_type_t type) {
+	if (type < 0 || type >= NUM_REQ_TYPES || Service[type].handler == NULL)
+		return NULL;
+	return &Service[type];
 }
 
-int my_recvfrom(snfs_msg_req_t* req, struct sockaddr_un* cliaddr, socklen_t* clilen) {
+/*
+ * request_class: gets the service class of a request; a compound is
+ * served in the class of its most expensive operation (the operations
+ * of myfs' copy, remove and append are sent in compounds)
+ */
+snfs_class_t request_class(req_t req_d, const snfs_service_t* service) {
+	// unknown requests are answered by the latency workers
+	if (service == NULL)
+		return SNFS_CLASS_LATENCY;
+	snfs_class_t cls = service->sclass;
+	snfs_msg_req_t* req = req_d->req;
+	if (req->type == REQ_COMPOUND && req_d->reqsz >= service->reqsz) {
+		for (unsigned i = 0; i < req->body.compound.count &&
+		     i < SNFS_COMPOUND_MAX_OPS; i++) {
+			const snfs_service_t* op = find_service(req->body.compound.ops[i].type);
+			if (op != NULL && op->sclass > cls)
+				cls = op->sclass;
+		}
+	}
+	return cls;
+}
+
+// set when the server is asked to terminate (SIGINT or SIGTERM)
+static volatile sig_atomic_t Shutdown = 0;
+
+void srv_shutdown_handler(int sig) {
+	Shutdown = 1;
+}
+
+int my_recvfrom(snfs_msg_req_t* req, int size, struct sockaddr_un* cliaddr, socklen_t* clilen) {
 	int reqsz;
 	
 	*clilen = sizeof(*cliaddr);
@@ -113,9 +334,9 @@ int my_recvfrom(snfs_msg_req_t* req, struct sockaddr_un* cliaddr, socklen_t* cli
 	do {
 		sthread_yield();
 		errno = 0;
-		reqsz = recvfrom(sockfd, (void*)req, sizeof(*req), MSG_DONTWAIT,
+		reqsz = recvfrom(sockfd, (void*)req, size, MSG_DONTWAIT,
 							(struct sockaddr *)cliaddr, clilen);
-	} while(errno == EAGAIN);
+	} while((errno == EAGAIN || errno == EINTR) && !Shutdown);
 	
 	return reqsz;
 }
@@ -147,15 +368,34 @@ void srv_init_socket(struct sockaddr_un* servaddr)
 		printf("[snfs_srv] unbind error: %s.\n", strerror(errno));
 		exit(-1);
 	}
+
+	// the largest messages (a write request or a read response) must
+	// fit in a single datagram; if the socket buffers cannot grow that
+	// much, the transfer size offered to the clients is reduced
+	int bufsz = SNFS_WRITE_REQ_SIZE(SNFS_MAX_TRANSFER) + 1024;
+	socklen_t optlen = sizeof(bufsz);
+	setsockopt(sockfd, SOL_SOCKET, SO_SNDBUF, &bufsz, sizeof(bufsz));
+	setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &bufsz, sizeof(bufsz));
+	if (getsockopt(sockfd, SOL_SOCKET, SO_SNDBUF, &bufsz, &optlen) < 0) {
+		bufsz = 0;
+	}
+	int max = bufsz - SNFS_WRITE_REQ_SIZE(0) - 1024;
+	snfs_set_max_transfer(max > 0 ? (unsigned)max : 0);
 	
-	printf("Server is running...\n");
+	printf("Server is running (max transfer %u bytes)...\n", snfs_get_max_transfer());
 }
 
 
-int srv_recv_request(snfs_msg_req_t* req, struct sockaddr_un* cliaddr, socklen_t* clilen)
+int srv_recv_request(snfs_msg_req_t* req, int size, struct sockaddr_un* cliaddr, socklen_t* clilen)
 {
-	int status = my_recvfrom(req, cliaddr, clilen);
+	int status = my_recvfrom(req, size, cliaddr, clilen);
 	
+	if (Shutdown) {
+		// the file system is unmounted once the requests running end
+		printf("Server is terminating...\n");
+		snfs_finish();
+		exit(0);
+	}
 	if (status == 0) {
 		printf("[snfs_srv] request error.\n");
 		return 0;
@@ -169,7 +409,29 @@ int srv_recv_request(snfs_msg_req_t* req, struct sockaddr_un* cliaddr, socklen_t
 }
 
 
-void srv_send_response(snfs_msg_res_t* res, int ressz, struct sockaddr_un* cliaddr, socklen_t clilen)
+/*
+ * srv_encode_response: encodes a response in the compact format
+ * - wire: buffer of SNFS_WIRE_MAX_SMALL bytes for the encoded response
+ * - ressz: size of the response in the fixed-size format [in/out]
+ *   returns: the start of the encoded response; the data of a read is
+ *   not moved, its header is placed right before it
+ */
+char* srv_encode_response(snfs_msg_res_t* res, int* ressz, char* wire)
+{
+	int len = snfs_encode_res(res, wire);
+	if (res->type == REQ_READ && res->status == RES_OK) {
+		// the header overwrites the fixed-size one
+		char* hdr = res->body.read.data - len;
+		*ressz = len + res->body.read.nread;
+		memcpy(hdr, wire, len);
+		return hdr;
+	}
+	*ressz = len;
+	return wire;
+}
+
+
+void srv_send_response(void* res, int ressz, struct sockaddr_un* cliaddr, socklen_t clilen)
 {
 	int status = sendto(sockfd, res, ressz, 0, (struct sockaddr *)cliaddr, clilen);
 	if (status < 0) {
@@ -180,52 +442,213 @@ void srv_send_response(snfs_msg_res_t* res, int ressz, struct sockaddr_un* cliad
 	}
 }
 
+/*
+ * srv_send_response_pinned: sends a read response whose data is in
+ * pinned cache blocks, gathering the header and the blocks in a
+ * single message
+ * - hdr: the response header (in the format of the request)
+ */
+void srv_send_response_pinned(char* hdr, int hdrsz, snfs_read_pinned_t* pinned,
+   struct sockaddr_un* cliaddr, socklen_t clilen)
+{
+	struct iovec iov[CACHE_PIN_MAX + 2];
+	struct msghdr msg;
+	int ressz = hdrsz;
+
+	iov[0].iov_base = hdr;
+	iov[0].iov_len = hdrsz;
+	for (int i = 0; i < pinned->npieces; i++) {
+		iov[i+1].iov_base = pinned->pieces[i].data;
+		iov[i+1].iov_len = pinned->pieces[i].len;
+		ressz += pinned->pieces[i].len;
+	}
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_name = cliaddr;
+	msg.msg_namelen = clilen;
+	msg.msg_iov = iov;
+	msg.msg_iovlen = pinned->npieces + 1;
+
+	int status = sendmsg(sockfd, &msg, 0);
+	if (status < 0) {
+		printf("[snfs_srv] sendmsg error: %s.\n", strerror(errno));
+	}
+	if (status != ressz) {
+		printf("[snfs_srv] message size mismatch.\n");
+	}
+}
+
+/*
+ * srv_send_busy: answers a request with RES_BUSY
+ * - flags: the flags of sendto
+ *   returns: the result of sendto
+ */
+static int srv_send_busy(req_t req_d, int flags)
+{
+	snfs_msg_res_t* res = req_d->res;
+	char wire[SNFS_WIRE_MAX_SMALL];
+	char* out = (char*)res;
+	int ressz = sizeof(*res) - sizeof(res->body);
+
+	memset(res, 0, sizeof(*res));
+	res->type = req_d->req->type;
+	res->status = RES_BUSY;
+	res->serial = req_d->req->serial;
+	if (req_d->compact) {
+		out = srv_encode_response(res, &ressz, wire);
+	}
+	return sendto(sockfd, out, ressz, flags, (struct sockaddr *)&(req_d->cliaddr),
+		req_d->clilen);
+}
+
+/*
+ * srv_reject_busy: answers a request that could not be queued with
+ * RES_BUSY, from the receiving thread; if the client is not receiving,
+ * the answer is left to the workers, which may wait for the client
+ * (the receiving thread never does, the client waits for the answer)
+ *   returns: 0 if the descriptor may be given back, 1 if the workers
+ *   own it
+ */
+int srv_reject_busy(req_t req_d)
+{
+	if (srv_send_busy(req_d, MSG_DONTWAIT) >= 0 ||
+	   (errno != EAGAIN && errno != EWOULDBLOCK)) {
+		return 0;
+	}
+	sthread_monitor_enter(mon);
+	req_d->next = NULL;
+	if (Busy_replies == NULL)
+		Busy_replies = req_d;
+	else
+		Busy_tail->next = req_d;
+	Busy_tail = req_d;
+	sthread_monitor_signalall(mon);
+	sthread_monitor_exit(mon);
+	return 1;
+}
+
 /*
 * SNFS request handler thread
 */
 
-void* thread_consumer() {
+void* thread_consumer(void* arg) {
+	snfs_class_t home = (snfs_class_t)(long)arg;
 	req_t req_d;
-	int ressz, req_i;
-	snfs_msg_res_t res;
+	int ressz, cls;
+	snfs_msg_type_t type;
+	snfs_msg_res_status_t status;
+	const snfs_service_t* service;
+	struct timeval start;
+	snfs_msg_res_t* res;
+	char* out;
+	char wire[SNFS_WIRE_MAX_SMALL];
+	reqpool_cache_t cache;
+	snfs_read_pinned_t pinned;
+	
+	reqpool_cache_init(Pool, &cache);
 	
 	while(1) {
 		sthread_monitor_enter(mon);
 		// get request from queue
-		while (!available_reqs) sthread_monitor_wait(mon);
+		while (Busy_replies == NULL && (cls = pick_queue(home)) < 0) {
+			// an idle thread must not keep descriptors to itself
+			reqpool_cache_flush(Pool, &cache);
+			sthread_monitor_wait(mon);
+		}
+		
+		// the RES_BUSY answers the receiving thread could not send
+		// go first, their clients are waiting
+		if (Busy_replies != NULL) {
+			req_d = Busy_replies;
+			Busy_replies = req_d->next;
+			sthread_monitor_exit(mon);
+			if (srv_send_busy(req_d, 0) < 0) {
+				printf("[snfs_srv] sendto error: %s.\n", strerror(errno));
+			}
+			reqpool_put(Pool, &cache, req_d);
+			continue;
+		}
 		
-		req_d = get_req();
-		available_reqs--;
-		sthread_monitor_signal(mon); 
+		req_d = get_req(cls);
+		sthread_monitor_signalall(mon); 
 		sthread_monitor_exit(mon); 
 
 		
 		// clean response
-		memset(&res,0,sizeof(res));
+		res = req_d->res;
+		memset(res,0,sizeof(*res));
+		pinned.npieces = 0;
 		
 		// find request handler
-		req_i = -1;
-		for (int i = 0; i < NUM_REQ_HANDLERS; i++) {
-			if (req_d->req.type == Service[i].type) {
-				req_i = i;
-				break;
-			}
-		}
+		type = req_d->req->type;
+		service = find_service(type);
 
       		// serve the request
-		if (req_i == -1) {
-			res.status = RES_UNKNOWN;
-			ressz = sizeof(res) - sizeof(res.body);
+		if (service == NULL) {
+			res->status = RES_UNKNOWN;
+			ressz = sizeof(*res) - sizeof(res->body);
 			printf("[snfs_srv] unknown request.\n");
+		} else if (req_d->reqsz < service->reqsz) {
+			res->type = type;
+			res->status = RES_ERROR;
+			ressz = sizeof(*res) - sizeof(res->body);
+			printf("[snfs_srv] malformed '%s' request.\n", service->name);
+		} else if (type == REQ_LOOKUP) {
+			// the client may cache the result under a lease
+			gettimeofday(&start, NULL);
+			int lease = lease_begin(&req_d->cliaddr, req_d->clilen, req_d->compact);
+			service->handler(req_d->req,req_d->reqsz,res,&ressz);
+			res->body.lookup.lease = lease_end(lease,
+				(res->status == RES_OK) ? res->body.lookup.file : 0);
+		} else if (type == REQ_READ) {
+			// the data is sent from the cache blocks when possible
+			gettimeofday(&start, NULL);
+			snfs_read_pinned(req_d->req,req_d->reqsz,res,&ressz,&pinned);
+			if (res->status == RES_OK && res->body.read.nread > 0) {
+				if (pinned.npieces > 0)
+					__sync_fetch_and_add(&Reads_zero_copy, 1);
+				else
+					__sync_fetch_and_add(&Reads_copied, 1);
+			}
 		} else {
-			Service[req_i].handler(&(req_d->req),req_d->reqsz,&res,&ressz);
+			gettimeofday(&start, NULL);
+			service->handler(req_d->req,req_d->reqsz,res,&ressz);
+		}
+
+		// answer in the format of the request, with its serial number
+		res->serial = req_d->req->serial;
+		status = res->status;
+		out = (char*)res;
+		if (pinned.npieces > 0) {
+			// only the header is encoded, the data stays in the cache
+			int hdrsz = SNFS_READ_RES_SIZE(0);
+			if (req_d->compact) {
+				hdrsz = snfs_encode_res(res, wire);
+				out = wire;
+			}
+			ressz = hdrsz + res->body.read.nread;
+		} else if (req_d->compact) {
+			out = srv_encode_response(res, &ressz, wire);
+		}
+		if (service != NULL && req_d->reqsz >= service->reqsz) {
+			service_stats_update(type, status, &start, req_d->rawsz, ressz);
+			if (type == REQ_DUMPCACHE) {
+				reqpool_dump(Pool);
+				service_stats_dump();
+				lease_dump();
+			}
 		}
 
       		// send response to client
-		srv_send_response(&res,ressz,&(req_d->cliaddr),req_d->clilen);
+		if (pinned.npieces > 0) {
+			srv_send_response_pinned(out,ressz - res->body.read.nread,&pinned,
+				&(req_d->cliaddr),req_d->clilen);
+			snfs_read_unpin(&pinned);
+		} else {
+			srv_send_response(out,ressz,&(req_d->cliaddr),req_d->clilen);
+		}
 		
-		// free stuff
-		free(req_d); req_d = NULL;
+		// give the descriptor back to the pool
+		reqpool_put(Pool, &cache, req_d); req_d = NULL;
 		
 		// force request processing
 		sthread_yield();
@@ -240,27 +663,62 @@ void* thread_consumer() {
 void* thread_producer() 
 {
 	req_t req_d;
+	const snfs_service_t* service;
+	snfs_class_t cls;
+	reqpool_cache_t cache;
+	
+	reqpool_cache_init(Pool, &cache);
 	
 	while(1) 
 	{
-		// wait for a free buffer slot
-		sthread_monitor_enter(mon);
-		while (available_reqs == RING_SIZE) sthread_monitor_wait(mon);
-		sthread_monitor_exit(mon); 
-
-		// create and clean request
-		req_d = (req_t) malloc(sizeof(struct _req));
-		memset(req_d,0,sizeof(struct _req));
+		// get a request descriptor from the pool
+		req_d = reqpool_get(Pool, &cache);
 
-		if ((req_d->reqsz = srv_recv_request(&(req_d->req),&(req_d->cliaddr),&(req_d->clilen))) == 0) 
+		char* raw = req_d->reqbuf + REQ_HEADROOM;
+		if ((req_d->rawsz = srv_recv_request((snfs_msg_req_t*)raw,reqpool_reqsz(Pool) - REQ_HEADROOM,&(req_d->cliaddr),&(req_d->clilen))) == 0) {
+			reqpool_put(Pool, &cache, req_d);
 			continue;
+		}
+		
+		req_d->compact = SNFS_WIRE_IS_COMPACT(raw);
+		if (req_d->compact) {
+			// decode into the headroom; the data of a write stays in place
+			// and the decoded header is moved right before it
+			char* data;
+			req_d->req = (snfs_msg_req_t*)req_d->reqbuf;
+			req_d->reqsz = snfs_decode_req(raw, req_d->rawsz, req_d->req, &data);
+			if (req_d->reqsz < 0) {
+				printf("[snfs_srv] malformed compact request.\n");
+				req_d->req->type = REQ_NULL;
+				req_d->reqsz = 0;
+			} else if (data != NULL) {
+				char* hdr = data - SNFS_WRITE_REQ_SIZE(0);
+				memmove(hdr, req_d->req, SNFS_WRITE_REQ_SIZE(0));
+				req_d->req = (snfs_msg_req_t*)hdr;
+			}
+		} else {
+			req_d->req = (snfs_msg_req_t*)raw;
+			req_d->reqsz = req_d->rawsz;
+			
+			// clean the part of the fixed-size header that was not received
+			if (req_d->reqsz < sizeof(*req_d->req)) {
+				memset(raw + req_d->reqsz, 0, sizeof(*req_d->req) - req_d->reqsz);
+			}
+		}
+		
+		service = find_service(req_d->req->type);
+		cls = request_class(req_d, service);
 		
 		sthread_monitor_enter(mon); 
-		// send to buffer
-		put_req(req_d);
-		available_reqs++;
+		// queue the request without waiting for its class
+		int queued = put_req(cls, req_d);
 		sthread_monitor_signalall(mon);
 		sthread_monitor_exit(mon);
+		if (queued < 0) {
+			printf("[snfs_srv] %s requests are overloaded.\n", Class_name[cls]);
+			if (srv_reject_busy(req_d) == 0)
+				reqpool_put(Pool, &cache, req_d);
+		}
 		sthread_yield();
 	}
 }
@@ -274,33 +732,64 @@ void* thread_producer()
 
 int main(int argc, char **argv)
 {
-	sthread_t threads[NUM_TC];
+	sthread_t* threads;
 	sthread_t prodthr;
-	int i;
-	available_reqs = 0;
+	int i, c, num_threads = 0;
+	
+	// get the size of the worker pools
+	for (c = 0; c < SNFS_NUM_CLASSES && c + 2 < argc; c++) {
+		if (sscanf(argv[c + 2], "%d", &Class_workers[c]) != 1 || Class_workers[c] < 1) {
+			printf("Invalid number of %s workers. Terminating...\n", Class_name[c]);
+			exit(-1);
+		}
+	}
+	for (c = 0; c < SNFS_NUM_CLASSES; c++) {
+		num_threads += Class_workers[c];
+		Queue[c].head = Queue[c].count = 0;
+		Queue[c].parked = Queue[c].parked_tail = NULL;
+		Queue[c].nparked = 0;
+		Queue[c].credit = Class_weight[c];
+	}
 	
 	// initialize sthread lib	
 	sthread_init();
 
 	//initialize filesystem
 	snfs_init(argc, argv);
+	signal(SIGINT, srv_shutdown_handler);
+	signal(SIGTERM, srv_shutdown_handler);
 	
    	// initialize SNFS layer
        struct sockaddr_un servaddr;
                 	
 	// initialize communications
 	srv_init_socket(&servaddr);
+	lease_init(sockfd);
 			
 	// initialize  monitor
         mon = sthread_monitor_init();
+	
+	// initialize request descriptor pool
+	// (with buffers for the largest read/write messages)
+	Pool = reqpool_new(REQPOOL_INITIAL, REQPOOL_MAX,
+		REQ_HEADROOM + SNFS_WRITE_REQ_SIZE(snfs_get_max_transfer()),
+		SNFS_READ_RES_SIZE(snfs_get_max_transfer()));
+	if (Pool == NULL) {
+		printf("Error while creating the request pool. Terminating...\n");
+		exit(-1);
+	}
         
-	// create thread_consumer threads
-	for(i = 0; i < NUM_TC; i++) {
-		threads[i] = sthread_create(thread_consumer, (void*) NULL, 1);
-		if (threads[i] == NULL) {
-			printf("Error while creating threads. Terminating...\n");
-			exit(-1);
+	// create thread_consumer threads, one pool per service class
+	threads = (sthread_t*) malloc(num_threads * sizeof(sthread_t));
+	for(i = 0, c = 0; c < SNFS_NUM_CLASSES; c++) {
+		for(int j = 0; j < Class_workers[c]; j++, i++) {
+			threads[i] = sthread_create(thread_consumer, (void*)(long)c, 1);
+			if (threads[i] == NULL) {
+				printf("Error while creating threads. Terminating...\n");
+				exit(-1);
+			}
 		}
+		printf("Started %d %s workers.\n", Class_workers[c], Class_name[c]);
 	}
 	
 	// create producer thread
@@ -308,7 +797,7 @@ int main(int argc, char **argv)
 	
 	
 	sthread_join(prodthr, (void**)NULL);
-	for(i = 0; i < NUM_TC; i++)
+	for(i = 0; i < num_threads; i++)
 		sthread_join(threads[i], (void **)NULL);
 
 	return 0;
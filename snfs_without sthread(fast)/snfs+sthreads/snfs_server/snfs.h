@@ -13,6 +13,7 @@
 #define _SNFS_HANDLERS_H_
 
 #include <snfs_proto.h>
+#include "fs.h"
 
 
 /*
@@ -27,12 +28,88 @@ typedef void (*snfs_handler_t)(snfs_msg_req_t *req, int reqsz,
 
 
 /*
- * snfs_init: performs internal SNFS initialization; currently
- * argc and argv are not being used.
+ * service classes: requests of different classes are scheduled
+ * independently, so long operations do not delay short ones
+ */
+typedef enum {
+   SNFS_CLASS_LATENCY = 0,     // short operations a client waits for
+   SNFS_CLASS_BULK = 1,        // operations that move or create data
+   SNFS_CLASS_MAINTENANCE = 2  // whole file system operations
+} snfs_class_t;
+
+#define SNFS_NUM_CLASSES 3
+
+
+// operation flags
+#define SNFS_OP_READONLY 0x1   // does not modify the file system
+#define SNFS_OP_MUTATING 0x2   // modifies the file system
+
+
+/*
+ * the snfs service descriptor, one per message type
+ * - name: name of the operation (statistics and debug)
+ * - handler: the handler serving the request
+ * - flags: operation flags (SNFS_OP_*)
+ * - reqsz: minimum size of a well formed request
+ * - sclass: the service class of the operation
+ */
+typedef struct {
+   const char* name;
+   snfs_handler_t handler;
+   int flags;
+   int reqsz;
+   snfs_class_t sclass;
+} snfs_service_t;
+
+
+// size of a request carrying the body 'field'
+#define SNFS_REQ_SIZE(field) \
+   (offsetof(snfs_msg_req_t, body) + sizeof(((snfs_msg_req_t*)0)->body.field))
+
+
+// environment variable naming the image file of the storage
+#define SNFS_IMAGE_ENV "SNFS_IMAGE"
+
+// environment variable with the block size of a new storage
+#define SNFS_BLOCK_SIZE_ENV "SNFS_BLOCK_SIZE"
+
+// environment variable that, if set, makes reads copy the data into the
+// response instead of sending it from the cache (to compare the two)
+#define SNFS_READ_COPY_ENV "SNFS_READ_COPY"
+
+
+/*
+ * snfs_init: performs internal SNFS initialization; argv[1] is the
+ * disk delay. If SNFS_IMAGE_ENV names an image file stored by a
+ * previous run, the file system in it is mounted; otherwise a new one
+ * is formatted, with the block size in SNFS_BLOCK_SIZE_ENV (if set).
+ * Reads are copied if SNFS_READ_COPY_ENV is set.
  */
 void snfs_init(int argc, char **argv);
 
 
+/*
+ * snfs_finish: unmounts the file system, storing it in the image file
+ * (if SNFS_IMAGE_ENV is set); no request may be served afterwards
+ */
+void snfs_finish();
+
+
+/*
+ * snfs_set_max_transfer: sets the largest amount of data the server
+ * accepts in a read/write message (bounded by SNFS_MAX_TRANSFER and
+ * by the datagram size the server socket supports)
+ */
+void snfs_set_max_transfer(unsigned max);
+
+
+/*
+ * snfs_get_max_transfer: gets the largest amount of data the server
+ * accepts in a read/write message
+ */
+unsigned snfs_get_max_transfer();
+
+
 /*
  * SNFS Handlers
  *
@@ -53,10 +130,48 @@ void snfs_read(snfs_msg_req_t *req, int reqsz, snfs_msg_res_t *res,
    int* ressz);
 
 
+// the cache blocks holding the data of a read response (and the rest
+// of the data, copied into the response)
+typedef struct {
+   fs_pinned_t pieces[CACHE_PIN_MAX + 1];
+   int npieces;      // 0 if the data was copied into the response
+} snfs_read_pinned_t;
+
+
+/*
+ * snfs_read_pinned: serves a read like snfs_read, but leaves the data
+ * in pinned cache blocks when possible; the data is sent from there
+ * and released with snfs_read_unpin. The data past the blocks that
+ * can be pinned is copied into the response; if none can be pinned,
+ * all of it is copied as usual.
+ * - pinned: the blocks holding the data [out]
+ */
+void snfs_read_pinned(snfs_msg_req_t *req, int reqsz, snfs_msg_res_t *res, 
+   int* ressz, snfs_read_pinned_t* pinned);
+
+
+/*
+ * snfs_read_unpin: releases the blocks of a response by snfs_read_pinned
+ */
+void snfs_read_unpin(snfs_read_pinned_t* pinned);
+
+
 void snfs_write(snfs_msg_req_t *req, int reqsz, snfs_msg_res_t *res, 
    int* ressz);
 
 
+void snfs_seek(snfs_msg_req_t *req, int reqsz, snfs_msg_res_t *res, 
+   int* ressz);
+
+
+void snfs_truncate(snfs_msg_req_t *req, int reqsz, snfs_msg_res_t *res, 
+   int* ressz);
+
+
+void snfs_fallocate(snfs_msg_req_t *req, int reqsz, snfs_msg_res_t *res, 
+   int* ressz);
+
+
 void snfs_create(snfs_msg_req_t *req, int reqsz, snfs_msg_res_t *res, 
    int* ressz);
 
@@ -86,5 +201,11 @@ void snfs_diskusage(snfs_msg_req_t *req, int reqsz, snfs_msg_res_t *res,
 		   
 void snfs_dumpcache(snfs_msg_req_t *req, int reqsz, snfs_msg_res_t *res, 
 	       int* ressz);		   
+
+void snfs_negotiate(snfs_msg_req_t *req, int reqsz, snfs_msg_res_t *res, 
+	       int* ressz);
+
+void snfs_compound(snfs_msg_req_t *req, int reqsz, snfs_msg_res_t *res, 
+	       int* ressz);
 		   
 #endif